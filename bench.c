@@ -0,0 +1,599 @@
+// Microbenchmarks for the dsk99 disk image routines.
+//
+// Built by "make bench". The tool itself is compiled in with its entry point
+// renamed, so every routine is measured exactly as dsk99 runs it. Results are
+// written to stdout as JSON, one object per operation, geometry and
+// occupancy.
+//
+// "bench -a {archive}" instead times whole operations over a directory of
+// images, such as one written by "dsk99 generate". "bench -z {archive}"
+// runs each batch operation twice and fails if the second run makes any
+// heap allocation, as batch work is meant to allocate nothing per image
+// once buffers and scratch space are warmed up.
+#define main dsk99_main
+#include "dsk99.c"
+#undef main
+#include <ftw.h>
+
+
+/*
+ ****************************************************************************
+ *                               Constants
+ ****************************************************************************
+ */
+#define BENCH_ROUNDS      7         // Timed rounds, the median is reported
+#define BENCH_ROUND_NS    20000000  // Minimum length of a round
+
+enum
+{
+  bench_empty = 0,   // Freshly formatted disk
+  bench_half,        // About half of the sectors used
+  bench_full,        // No room for another file
+  bench_occupancy_count
+};
+
+enum
+{
+  needs_room  = 0x1,   // Only measured when a file can be added
+  needs_files = 0x2    // Only measured when the disk holds files
+};
+
+
+/*
+ ****************************************************************************
+ *                               Structures
+ ****************************************************************************
+ */
+// One measured operation
+struct bench_case
+{
+  char *name;                 // Operation name in the report
+  void (*run)(int count);     // Run the operation count times
+  int needs;                  // needs_* conditions for measuring
+};
+
+
+/*
+ ****************************************************************************
+ *                                Globals
+ ****************************************************************************
+ */
+char bench_host_file[64];                  // Host file added by add_file
+char bench_last_name[FILE_NAME_LEN + 1];   // Last file on the disk
+struct fib_block *bench_fib;               // Largest file on the disk
+volatile int bench_sink;                   // Keeps results alive
+int bench_first = 1;                       // No comma before the first row
+uint64_t bench_allocations;                // Heap allocations so far
+
+
+/*===========================================================================
+ *                        malloc / calloc / realloc
+ *===========================================================================
+ * Desription: Count heap allocations, including those of the C library,
+ *             then hand them to the C library allocator
+ *
+ * Parameters: As the C library functions
+ *
+ * Return:     As the C library functions
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void *ptr, size_t size);
+
+void* malloc(size_t size)
+{
+  __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+  return(__libc_malloc(size));
+}
+
+void* calloc(size_t count, size_t size)
+{
+  __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+  return(__libc_calloc(count, size));
+}
+
+void* realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+  return(__libc_realloc(ptr, size));
+}
+
+
+/*===========================================================================
+ *                              fill_disk
+ *===========================================================================
+ * Desription: Format a disk and fill it to the given occupancy with files
+ *             of a few different sizes
+ *
+ * Parameters: layout    - geometry_* layout
+ *             occupancy - bench_* occupancy
+ *
+ * Return:     None
+ */
+void fill_disk(int layout, int occupancy)
+{
+  static unsigned char data[64 * SECTOR_SIZE];
+  int sectors = geometries[layout].sectors;
+  int target = occupancy == bench_empty ? 0 :
+               occupancy == bench_half  ? sectors / 2 : sectors;
+  int largest = 0;
+  int i;
+
+  release_disk();
+  create_disk(layout);
+  for(i = 0; i < (int)sizeof(data); i++)
+    data[i] = (unsigned char)(i * 7 + (i >> 8));
+
+  bench_fib = NULL;
+  make_name(bench_last_name, "", FILE_NAME_LEN);
+  for(i = 0; sectors - free_sector_count() < target; i++)
+  {
+    char name[FILE_NAME_LEN + 1];
+    char label[16];
+    int size = ((i % 5) * 3 + 2) * sectors / 360 * SECTOR_SIZE - i % 200;
+    struct fib_block *fib;
+
+    if(size > (int)sizeof(data)) size = sizeof(data);
+    if(size > (free_sector_count() - 2) * SECTOR_SIZE)
+      size = (free_sector_count() - 2) * SECTOR_SIZE;
+    if(size <= 0) break;
+    snprintf(label, sizeof(label), "FILE%04d", i);
+    make_name(name, label, FILE_NAME_LEN);
+    name[FILE_NAME_LEN] = 0;
+    fib = add_file_data(label, name, data, size);
+    if(fib == NULL) break;
+    if(size > largest)
+    {
+      largest = size;
+      bench_fib = fib;
+    }
+    strcpy(bench_last_name, name);
+  }
+}
+
+
+/*===========================================================================
+ *                         Measured operations
+ *===========================================================================
+ * Desription: Each runs one operation count times on the current disk
+ *             and leaves the disk as it found it
+ *
+ * Parameters: count - Number of repetitions
+ *
+ * Return:     None
+ */
+void bench_allocate(int count)
+{
+  int i;
+  for(i = 0; i < count; i++)
+  {
+    struct disk_sector *sector = allocate();
+    if(sector != NULL) mark_sector(sector_of(sector), 0);
+  }
+}
+
+void bench_free_sector_count(int count)
+{
+  int i;
+  for(i = 0; i < count; i++)
+    bench_sink += free_sector_count();
+}
+
+void bench_find_fib(int count)
+{
+  int i;
+  for(i = 0; i < count; i++)
+    bench_sink += (find_fib(bench_last_name) != NULL);
+}
+
+void bench_find_fib_missing(int count)
+{
+  int i;
+  for(i = 0; i < count; i++)
+    bench_sink += (find_fib("ZZZZZZZZZZ") != NULL);
+}
+
+void bench_add_remove(int count)
+{
+  int i;
+  for(i = 0; i < count; i++)
+  {
+    if(add_file(bench_host_file, "BENCHFILE "))
+      remove_file("BENCHFILE ");
+  }
+}
+
+void bench_extract(int count)
+{
+  int i;
+  for(i = 0; i < count; i++)
+    extract_file(bench_fib, "/dev/null");
+}
+
+void bench_list(int count)
+{
+  int i;
+  int saved;
+
+  // The listing goes to /dev/null, the report stays on stdout
+  fflush(stdout);
+  saved = dup(1);
+  if(freopen("/dev/null", "w", stdout) == NULL) return;
+  for(i = 0; i < count; i++)
+    list_disk();
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+  clearerr(stdout);
+}
+
+void bench_make_name(int count)
+{
+  char name[FILE_NAME_LEN];
+  int i;
+  for(i = 0; i < count; i++)
+  {
+    make_name(name, "records1.dat", FILE_NAME_LEN);
+    bench_sink += name[i % FILE_NAME_LEN];
+  }
+}
+
+void bench_clusters(int count)
+{
+  struct cluster_span spans[MAX_CLUSTERS];
+  struct fib_block fib;
+  int i;
+
+  for(i = 0; i < MAX_CLUSTERS; i++)
+  {
+    spans[i].first = 2 + i * 4;
+    spans[i].count = 1 + i % 3;
+  }
+  memset(&fib, 0, sizeof(fib));
+  for(i = 0; i < count; i++)
+  {
+    fib_set_spans(&fib, spans, MAX_CLUSTERS);
+    bench_sink += fib_spans(&fib, spans);
+  }
+}
+
+struct bench_case bench_cases[] =
+{
+  {"allocate+free",         bench_allocate,          0},
+  {"free_sector_count",     bench_free_sector_count, 0},
+  {"find_fib",              bench_find_fib,          0},
+  {"find_fib_missing",      bench_find_fib_missing,  0},
+  {"add_file+remove_file",  bench_add_remove,        needs_room},
+  {"extract_file",          bench_extract,           needs_files},
+  {"list_disk",             bench_list,              0},
+  {"make_name",             bench_make_name,         0},
+  {"cluster_encode_decode", bench_clusters,          0},
+  {NULL,                    NULL,                    0}
+};
+
+
+/*===========================================================================
+ *                              measure
+ *===========================================================================
+ * Desription: Time one operation. The repetition count is doubled until a
+ *             round takes BENCH_ROUND_NS, then BENCH_ROUNDS rounds are
+ *             timed and the median and fastest are reported.
+ *
+ * Parameters: test      - Operation to measure
+ *             layout    - geometry_* layout
+ *             occupancy - bench_* occupancy
+ *
+ * Return:     None
+ */
+void measure(struct bench_case *test, int layout, int occupancy)
+{
+  static char *occupancy_names[bench_occupancy_count] =
+  {
+    "empty", "half", "full"
+  };
+  double round_ns[BENCH_ROUNDS];
+  uint64_t start;
+  int count = 1;
+  int i;
+
+  // Warm up and calibrate
+  for(;;)
+  {
+    start = clock_ns(CLOCK_MONOTONIC);
+    test->run(count);
+    if(clock_ns(CLOCK_MONOTONIC) - start >= BENCH_ROUND_NS / 4 ||
+       count >= (1 << 24))
+      break;
+    count *= 2;
+  }
+  count *= 4;
+
+  for(i = 0; i < BENCH_ROUNDS; i++)
+  {
+    start = clock_ns(CLOCK_MONOTONIC);
+    test->run(count);
+    round_ns[i] = (double)(clock_ns(CLOCK_MONOTONIC) - start) / count;
+  }
+  qsort(round_ns, BENCH_ROUNDS, sizeof(double), compare_doubles);
+
+  printf("%s  {\"op\": \"%s\", \"geometry\": \"%s\", \"occupancy\": \"%s\", "
+         "\"free_sectors\": %d, \"iterations\": %d, \"ns_per_op\": %.1f, "
+         "\"min_ns\": %.1f, \"max_ns\": %.1f}", bench_first ? "" : ",\n",
+         test->name, geometries[layout].name, occupancy_names[occupancy],
+         free_sector_count(), count, round_ns[BENCH_ROUNDS / 2],
+         round_ns[0], round_ns[BENCH_ROUNDS - 1]);
+  bench_first = 0;
+}
+
+
+/*===========================================================================
+ *                             bulk_add
+ *===========================================================================
+ * Desription: Add every file of an image to a newly formatted image of the
+ *             same geometry, keeping the file attributes
+ *
+ * Parameters: source - Image to take the files from
+ *             target - Image to write
+ *
+ * Return:     Was the image written?
+ */
+int bulk_add(char *source, char *target)
+{
+  static unsigned char data[2880 * SECTOR_SIZE];
+  static struct fib_block fibs[MAX_FILE_COUNT];
+  static unsigned char *contents[MAX_FILE_COUNT];
+  uint16_t index[MAX_FILE_COUNT];
+  int layout = geometry_sssd;
+  int count = 0;
+  int used = 0;
+  int ok;
+  int i;
+
+  release_disk();
+  if(!load_disk(source)) return(0);
+  for(i = 0; i < geometry_count; i++)
+  {
+    if(geometries[i].sectors * SECTOR_SIZE == disk_size) layout = i;
+  }
+
+  // Take a copy of each file, whole sectors
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct cluster_span spans[MAX_CLUSTERS];
+    struct fib_block *fib = fib_at(index[i]);
+    int span_count;
+    int j;
+
+    if(fib == NULL || (span_count = fib_spans(fib, spans)) < 0) continue;
+    fibs[count] = *fib;
+    contents[count] = &data[used];
+    for(j = 0; j < span_count; j++)
+    {
+      memcpy(&data[used], get_sector(spans[j].first),
+             spans[j].count * SECTOR_SIZE);
+      used += spans[j].count * SECTOR_SIZE;
+    }
+    count++;
+  }
+  release_disk();
+
+  create_disk(layout);
+  for(i = 0; i < count; i++)
+  {
+    struct fib_block *fib;
+    fib = add_file_data(fibs[i].name, fibs[i].name, contents[i],
+                        fib_physrec_count(&fibs[i]) * SECTOR_SIZE);
+    if(fib == NULL) continue;
+    fib->flags = fibs[i].flags;
+    fib->reclen = fibs[i].reclen;
+    fib->recsperphysrec = fibs[i].recsperphysrec;
+    fib->eof = fibs[i].eof;
+    memcpy(fib->fixrecs, fibs[i].fixrecs, sizeof(fib->fixrecs));
+  }
+  ok = save_disk_as(target, format_v9t9);
+  release_disk();
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                            remove_entry
+ *===========================================================================
+ * Desription: Delete one entry of a work directory tree, for nftw
+ *
+ * Parameters: path - Entry to delete
+ *             info, flag, ftw - Unused
+ *
+ * Return:     Status of the deletion
+ */
+int remove_entry(const char *path, const struct stat *info, int flag,
+                 struct FTW *ftw)
+{
+  return(remove(path));
+}
+
+
+/*===========================================================================
+ *                            bench_archive
+ *===========================================================================
+ * Desription: Time listing, extraction, bulk adding and conversion of all
+ *             images in a directory and report images/s, MB/s of image
+ *             data and heap allocations for each
+ *
+ *             When checking, each batch phase is run twice and only the
+ *             second run is reported. Its allocations must be zero: the
+ *             first run has left an image buffer for each geometry in the
+ *             pool and a scratch arena big enough for any image.
+ *
+ * Parameters: directory - Directory holding .dsk images
+ *             work      - Scratch directory for outputs, removed afterwards
+ *             check     - Fail if a batch phase allocates once warmed up
+ *
+ * Return:     Exit status
+ */
+int bench_archive(char *directory, char *work, int check)
+{
+  static char *phases[4] = {"list", "extract", "bulk_add", "convert"};
+  struct dirent **entries;
+  char **paths;
+  char **args;
+  char out[1024];
+  double image_mb = 0;
+  int images = 0;
+  int failed = 0;
+  int count;
+  int saved;
+  int phase;
+  int pass;
+  int i;
+
+  count = scandir(directory, &entries, NULL, alphasort);
+  if(count < 0 || mkdir(work, 0777) != 0)
+  {
+    printf("Cannot use \"%s\" and \"%s\"\n", directory, work);
+    return(1);
+  }
+
+  paths = calloc(count + 1, sizeof(char*));
+  args = calloc(count + 6, sizeof(char*));
+  for(i = 0; i < count; i++)
+  {
+    char *name = entries[i]->d_name;
+    struct stat info;
+    int length = strlen(name);
+    if(length > 4 && strcmp(&name[length - 4], ".dsk") == 0)
+    {
+      paths[images] = malloc(strlen(directory) + length + 2);
+      sprintf(paths[images], "%s/%s", directory, name);
+      if(stat(paths[images], &info) == 0) image_mb += info.st_size / 1e6;
+      images++;
+    }
+    free(entries[i]);
+  }
+  free(entries);
+
+  printf("[\n");
+  for(phase = 0; phase < 4; phase++)
+  {
+    uint64_t allocations = 0;
+    uint64_t start = 0;
+    double seconds;
+
+    snprintf(out, sizeof(out), "%s/%s", work, phases[phase]);
+    mkdir(out, 0777);
+
+    // Operation output is not part of the report
+    fflush(stdout);
+    saved = dup(1);
+    if(freopen("/dev/null", "w", stdout) == NULL) return(1);
+    for(pass = 0; pass < (check && phase != 2 ? 2 : 1); pass++)
+    {
+      allocations = bench_allocations;
+      start = clock_ns(CLOCK_MONOTONIC);
+      if(phase == 2)
+      {
+        for(i = 0; i < images; i++)
+        {
+          char target[1100];
+          snprintf(target, sizeof(target), "%s/%d.dsk", out, i);
+          bulk_add(paths[i], target);
+        }
+      }
+      else
+      {
+        // batch -o {out} (-l | -X | -C dkz) {image} ...
+        int n = 0;
+        args[n++] = "batch";
+        args[n++] = "-o";
+        args[n++] = out;
+        args[n++] = phase == 0 ? "-l" : phase == 1 ? "-X" : "-C";
+        if(phase == 3) args[n++] = "dkz";
+        memcpy(&args[n], paths, images * sizeof(char*));
+        batch_command(n + images, args);
+      }
+      allocations = bench_allocations - allocations;
+    }
+    seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    clearerr(stdout);
+
+    printf("%s  {\"phase\": \"%s\", \"images\": %d, \"seconds\": %.3f, "
+           "\"images_per_s\": %.1f, \"mb_per_s\": %.2f, "
+           "\"allocations\": %llu}",
+           phase ? ",\n" : "", phases[phase], images, seconds,
+           images / seconds, image_mb / seconds,
+           (unsigned long long)allocations);
+    fflush(stdout);
+    if(check && phase != 2 && allocations != 0) failed = 1;
+  }
+  printf("\n]\n");
+  if(failed) printf("Batch phases allocated memory once warmed up\n");
+
+  nftw(work, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  for(i = 0; i < images; i++)
+    free(paths[i]);
+  free(paths);
+  free(args);
+  return(failed);
+}
+
+
+/*===========================================================================
+ *                                  main
+ *===========================================================================
+ * Desription: Entry point for the benchmarks. An optional argument selects
+ *             the operations whose names match a glob, "-a {archive}
+ *             [{work directory}]" runs the archive benchmark instead and
+ *             "-z" in place of "-a" checks it allocates nothing per image.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Argument list
+ *
+ * Return:     Exit status
+ */
+int main(int argc, char **argv)
+{
+  static unsigned char data[4 * SECTOR_SIZE];
+  struct bench_case *test;
+  int layout;
+  int occupancy;
+  int fd;
+
+  if(argc > 2 && (strcmp(argv[1], "-a") == 0 || strcmp(argv[1], "-z") == 0))
+    return(bench_archive(argv[2], argc > 3 ? argv[3] : "bench-work",
+                         argv[1][1] == 'z'));
+
+  // Host file for add_file, four sectors long
+  strcpy(bench_host_file, "/tmp/dsk99-bench-XXXXXX");
+  fd = mkstemp(bench_host_file);
+  if(fd < 0 || write(fd, data, sizeof(data)) != sizeof(data))
+  {
+    printf("Cannot create \"%s\"\n", bench_host_file);
+    return(1);
+  }
+  close(fd);
+
+  printf("[\n");
+  for(layout = 0; layout < geometry_count; layout++)
+  {
+    for(occupancy = 0; occupancy < bench_occupancy_count; occupancy++)
+    {
+      fill_disk(layout, occupancy);
+      for(test = bench_cases; test->name != NULL; test++)
+      {
+        if(argc > 1 && fnmatch(argv[1], test->name, 0) != 0) continue;
+        if((test->needs & needs_room) && occupancy == bench_full) continue;
+        if((test->needs & needs_files) && bench_fib == NULL) continue;
+        measure(test, layout, occupancy);
+        fflush(stdout);
+      }
+    }
+  }
+  printf("\n]\n");
+
+  unlink(bench_host_file);
+  return(0);
+}
@@ -1,10 +1,30 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <pthread.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdarg.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <unistd.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /*
@@ -19,6 +39,46 @@
 #define FILE_NAME_LEN    10
 #define MAX_FILE_COUNT  128
 #define SECTOR_SIZE     256
+#define MAX_CLUSTERS     76
+
+#define CONTAINER_MAGIC         "DKZ1"
+#define CONTAINER_HEADER_SIZE   16
+#define CONTAINER_BLOCK_SECTORS 16
+#define CONTAINER_BLOCK_SIZE    (CONTAINER_BLOCK_SECTORS * SECTOR_SIZE)
+#define LZ_HASH_BITS            12
+
+#define DELTA_MAGIC             "DKD1"
+#define DELTA_HEADER_SIZE       40
+#define DELTA_SUMMARY_SIZE      12
+
+#define PC99_FM_TRACK           3253        // Bytes per single density track
+#define PC99_MFM_TRACK          6872        // Bytes per double density track
+#define PC99_CYLINDERS          40
+
+#define TRACE_MAGIC             "DKT1"
+#define TRACE_RING_SIZE         65536       // Records kept per thread
+
+#define TIFILES_HEADER_SIZE     128         // Header of a FIAD host file
+
+#define PACK_MAGIC              "DKP1"
+#define PACK_ENTRY_SIZE         64          // Name index entry of a pack
+#define PACK_NAME_LEN           56          // Image name in an index entry
+#define PACK_BATCH              256         // Images added per append
+#define PACK_BATCH_BYTES        (64 << 20)  // Image bytes added per append
+#define PACK_RETRIES            8           // Opens of a pack being replaced
+#define CONVERT_READERS         2           // Threads reading inputs
+#define POOL_BUFFERS            4           // Spare image buffers per thread
+#define ARENA_MIN_SIZE          (64 << 10)  // Smallest scratch arena block
+
+// Byte order is fixed at compile time so field accessors reduce to a plain
+// load, plus a byte swap on little-endian hosts.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN 1
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_BIG_ENDIAN 0
+#else
+#error "Unable to determine host byte order"
+#endif
 
 enum
 {
@@ -35,6 +95,68 @@ enum
   file_del = 0x4,  // Existing file to delete
   file_ext = 0x8   // Existing file to extract
 };
+
+enum
+{
+  op_add = 1,      // Add a host file
+  op_extract,      // Extract matching files
+  op_remove,       // Remove matching files
+  op_attr,         // Set attributes of matching files
+  op_name,         // Set disk name
+  op_protect,      // Set protect flag
+  op_unprotect,    // Clear protect flag
+  op_list,         // List disk contents
+  op_copy          // Save a copy of the image
+};
+
+enum
+{
+  phase_parse = 0,  // Reading arguments, command files and manifests
+  phase_load,       // Reading disk images
+  phase_lookup,     // Finding files by name
+  phase_allocate,   // Allocating sectors
+  phase_extract,    // Copying files out of images
+  phase_save,       // Writing disk images
+  phase_list,       // Listing disk contents
+  phase_count
+};
+
+enum
+{
+  trace_allocate = 0,   // Sector allocation, argument is the sector
+  trace_find_fib,       // File lookup, argument is the FIB sector found
+  trace_extract_span,   // Extraction of one cluster, argument is the sector
+  trace_save_write,     // Write of a run of sectors, argument is the count
+  trace_compress_block, // Compression of a block, argument is the block
+  trace_event_count
+};
+
+enum
+{
+  geometry_sssd = 0,  // Single sided, single density, 360 sectors
+  geometry_dssd,      // Double sided, single density, 720 sectors
+  geometry_dsdd,      // Double sided, double density, 1440 sectors
+  geometry_dshd,      // Double sided, high density, 2880 sectors
+  geometry_count
+};
+
+enum
+{
+  policy_first_fit = 0,  // Lowest free sectors, as the TI controller does
+  policy_next_fit,       // Free sectors after the last allocation
+  policy_best_fit,       // Smallest free run the file fits in
+  policy_worst_fit,      // Largest free run
+  policy_count
+};
+
+enum
+{
+  format_v9t9 = 0,  // Raw V9T9 sector dump
+  format_dkz  = 1,  // Compressed block container
+  format_pc99 = 2,  // PC99 track dump with address marks and CRCs
+  format_fiad = 3,  // Directory of TIFILES host files, convert only
+  format_dkp  = 4   // V9T9 image inside an indexed pack
+};
      
 
 /*
@@ -43,10 +165,13 @@ enum
  ****************************************************************************
  */
 
+// On-disk structures are declared as byte arrays so they have no padding and
+// no alignment requirement; multi-byte fields are read through the accessors
+// below and may be overlaid directly on any sector of the image buffer.
 struct vib_block
 {
   char name[10];	// Disk volume name (10 characters, pad with spaces)
-  short physrecs;	// Total number of physrecs on disk (usually 360)
+  unsigned char physrecs[2];	// Total number of physrecs on disk (usually 360)
   char secspertrack;	// Sectors per track (usually 9 (FM SD)
   char id[3];		// 'DSK'
   char protection;	// 'P' if disk is protected, ' ' otherwise.
@@ -54,7 +179,7 @@ struct vib_block
   char heads;		// Sides (1 or 2)
   char density;		// Density: 1 (FM SD), 2 (MFM DD), or 3 (MFM HD)
   char reserved[36];
-  char abm[200];	// Allocation bitmap: there is one bit per AU.
+  unsigned char abm[200];	// Allocation bitmap: there is one bit per AU.
 };
 
 struct fib_block
@@ -63,17 +188,58 @@ struct fib_block
   char  reserved[2];
   unsigned char  flags;      // File status flags
   unsigned char  recsperphysrec;  // Logical records per physrec
-  short physrec_count;    // File length in physrecs
+  unsigned char  physrec_count[2];  // File length in physrecs (big-endian)
   unsigned char  eof;     // EOF offset in last physrec for variable length
   unsigned char  reclen;  // Logical record size in bytes ([1,255] 0->256)
-  short fixrecs;          // File length in logical records
+  unsigned char  fixrecs[2];  // File length in logical records (little-endian)
   char  reserved2[8];
-  char  cluster[76][3];   // Data cluster table
+  unsigned char  cluster[MAX_CLUSTERS][3];  // Data cluster table
 };
 
 struct disk_sector
 {
-  short data[128];
+  unsigned char data[SECTOR_SIZE];
+};
+
+// Decoded entry of the FIB cluster table
+struct cluster_span
+{
+  int first;  // First sector in the span
+  int count;  // Number of contiguous sectors in the span
+};
+
+_Static_assert(sizeof(struct vib_block) == SECTOR_SIZE,
+               "VIB layout must fill exactly one sector");
+_Static_assert(sizeof(struct fib_block) == SECTOR_SIZE,
+               "FIB layout must fill exactly one sector");
+_Static_assert(sizeof(struct disk_sector) == SECTOR_SIZE,
+               "Sector layout must be exactly one sector");
+_Static_assert(MAX_FILE_COUNT * 2 == SECTOR_SIZE,
+               "FDR index must fill exactly one sector");
+
+// Layout of a PC99 track
+struct track_format
+{
+  int track_size;              // Bytes per track
+  int sectors;                 // Sectors per track
+  int marks;                   // 0xA1 bytes before an address mark (MFM)
+  unsigned char fill;          // Gap byte
+  int gap1;                    // Gap before the first sector
+  int sync;                    // Zero bytes before an address mark
+  int gap2;                    // Gap between ID and data fields
+  int gap3;                    // Gap after the data field
+  const unsigned char *order;  // Sector interleave
+};
+
+// Layout of a newly formatted disk
+struct geometry
+{
+  char *name;         // Name used on the command line
+  int sectors;        // Total number of sectors
+  int secspertrack;   // Sectors per track
+  int cylinders;      // Tracks per side
+  int heads;          // Sides
+  int density;        // Density code in the VIB
 };
 
 // This is an internal representation of the disk
@@ -84,6 +250,8 @@ struct file_arg
   int  add;
   int  remove;
   int  extract;
+  int  replace;
+  int  basic;
   int  program;
   int  fixed;
   int  variable;
@@ -99,15 +267,178 @@ struct top_args
   char disk_name[DISK_NAME_LEN+1];       // Name of disk
   char image_path[256];                  // Path to disk image
   int  file_count;                       // Number of file commands
+  int  file_capacity;                    // Allocated file commands
+  int *file_slots;                       // Hash of file names to commands
+  int  slot_count;                       // Size of the name hash
   int  unprotect;                        // Clear protection flag?
   int  protect;                          // Set protection flag?
   int  create_new;                       // Create new disk image
   int  use_existing;                     // Use existing disk image
   int  list_contents;                    // List image contents
   int  verbose;                          // Use verbose output
+  int  quiet;                            // Hold back failed add messages
   int  extract_all;                      // Extract all files from image
   int  show_help;                        // Display help
-  struct file_arg file[MAX_FILE_COUNT];  // List of file operations
+  char copy_path[256];                   // Path for converted copy of image
+  char script_path[256];                 // Command file to run
+  struct file_arg *file;                 // List of file operations
+};
+
+// Operation read from a command file
+struct script_op
+{
+  int type;               // Operation, op_add etc.
+  int next;               // Next operation on the same image, -1 if last
+  struct file_arg file;   // Names, glob pattern and file flags
+};
+
+// Disk image named in a command file
+struct script_image
+{
+  char path[256];         // Path to disk image
+  int create;             // Create a new image?
+  int first_op;           // First operation on this image, -1 if none
+  int last_op;            // Last operation on this image
+};
+
+// Read-only view of a whole disk image, mapped when it is a sector dump
+struct image_view
+{
+  unsigned char *data;       // Image contents
+  int size;                  // Image size in bytes
+  size_t map_size;           // Size of the mapping, 0 if data is allocated
+};
+
+// Top level command run instead of the option driven disk operations
+struct command
+{
+  char *name;                         // Name given as the first argument
+  int (*run)(int argc, char **argv);  // Handler, returns the exit status
+};
+
+// Counters reported by --stats. The counters are always kept, timing is
+// only taken when a report was asked for. Each thread counts for itself
+// and adds its counts to the totals when it is done.
+struct run_stats
+{
+  uint64_t wall_ns[phase_count];     // Elapsed time in each phase
+  uint64_t cpu_ns[phase_count];      // CPU time in each phase
+  uint64_t calls[phase_count];       // Times each phase was entered
+  uint64_t sectors_read;             // Image sectors read from storage
+  uint64_t sectors_written;          // Image sectors written to storage
+  uint64_t allocator_probes;         // Allocation bitmap bits examined
+  uint64_t fib_lookups;              // FIBs compared by name
+  double *image_ms;                  // Time spent on each batch image
+  int image_count;                   // Number of batch images
+  int image_capacity;                // Allocated batch image entries
+};
+
+// Start of a timed phase
+struct phase_timer
+{
+  int phase;       // Phase being timed
+  uint64_t wall;   // Elapsed time at start
+  uint64_t cpu;    // CPU time at start
+};
+
+// One tracepoint hit, written to the trace file as is
+struct trace_record
+{
+  uint64_t time_ns;    // Monotonic clock
+  uint32_t arg;        // Event argument
+  uint16_t thread;     // Thread number
+  uint8_t event;       // trace_* event
+  uint8_t kind;        // 'B' begin, 'E' end or 'I' instant
+};
+
+// Records of one thread. Only the owning thread writes to a ring.
+struct trace_ring
+{
+  struct trace_ring *next;                     // Next ring of all threads
+  uint64_t head;                               // Records written so far
+  int thread;                                  // Thread number
+  struct trace_record record[TRACE_RING_SIZE]; // Most recent records
+};
+
+_Static_assert(sizeof(struct trace_record) == 16,
+               "Trace record must be 16 bytes");
+
+// One step of an allocation workload
+struct sim_op
+{
+  char type;                        // 'a' add, 'r' remove, 'z' resize
+  char name[FILE_NAME_LEN + 1];     // File name in V9T9 format
+  int sectors;                      // New size for add and resize
+};
+
+// State of an image measured during a simulation
+struct sim_sample
+{
+  int files;           // Files on the disk
+  int free_sectors;    // Free sectors
+  int largest_run;     // Longest run of free sectors
+  double fragments;    // Mean clusters per file
+  int max_clusters;    // Most clusters used by one file
+};
+
+// Compressed container the current image was loaded from. Blocks are
+// decompressed into the disk buffer the first time one of their sectors
+// is accessed.
+struct container
+{
+  unsigned char *file;       // Container file contents, NULL if none
+  size_t file_size;          // Size of the contents
+  int mapped;                // Set if the contents are mapped, not allocated
+  int block_count;           // Number of compressed blocks
+  unsigned char *pending;    // Set for blocks not yet decompressed
+};
+
+// Pack of images mapped by a thread. Sector 0 is the header: magic,
+// image count, first sector of the tables and sectors of garbage. The
+// tables are the offset table, first sector and sector count of each
+// image by number, then the name index of PACK_ENTRY_SIZE entries sorted
+// by name, each a name and an image number.
+struct pack_map
+{
+  char path[1024];           // Pack file, empty if none is mapped
+  unsigned char *data;       // Whole pack, mapped shared
+  size_t size;               // Size mapped
+  int count;                 // Images in the pack when mapped
+  uint32_t table;            // First sector of the tables when mapped
+  unsigned char *offsets;    // Offset table
+  unsigned char *names;      // Name index
+};
+
+// Image buffers a thread is done with, kept for its next image of the same
+// size. Sizes follow from the geometries, so in effect the pool is keyed by
+// geometry.
+struct buffer_pool
+{
+  void *buffer[POOL_BUFFERS];  // Spare buffers, oldest first
+  int size[POOL_BUFFERS];      // Size of each spare buffer
+  int count;                   // Number of spare buffers
+};
+
+// Overflow chunk of a scratch arena, its space follows the header
+struct arena_chunk
+{
+  struct arena_chunk *next;    // Chunk allocated before this one
+  size_t size;                 // Bytes of space in the chunk
+};
+
+// Scratch memory for the transient state of the current image, such as
+// file contents and output buffers. Space is handed out from one block and
+// taken back all at once when the image is released. Whatever does not fit
+// goes in overflow chunks, and the block is grown to the peak use at the
+// next reset, so later images need no allocation at all.
+struct arena
+{
+  unsigned char *base;         // Block reused from image to image
+  size_t size;                 // Size of the block
+  size_t used;                 // Bytes of the block handed out
+  struct arena_chunk *chunks;  // Overflow chunks, newest first
+  size_t overflow;             // Bytes handed out from overflow chunks
+  size_t peak;                 // Most bytes in use since the last reset
 };
 
 
@@ -117,9 +448,34 @@ struct top_args
  ****************************************************************************
  */
 
+// The image being worked on belongs to the thread working on it
 struct top_args all_args;
-void* disk_buffer;
-int disk_size;
+__thread void* disk_buffer;
+__thread int disk_size;
+__thread int disk_format;
+__thread struct container image_container;
+__thread struct pack_map pack_map;
+__thread struct buffer_pool image_pool;
+__thread struct arena scratch;
+__thread int scratch_registered;   // Is scratch_key set for this thread?
+pthread_key_t scratch_key;         // Frees a thread's pool and arena
+pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+__thread struct run_stats stats;
+struct run_stats stats_total;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+int stats_report;        // 0 no report, 1 text, 2 JSON
+
+char *policy_names[policy_count] = {"first", "next", "best", "worst"};
+int allocation_policy;   // policy_* used when allocating file data
+__thread int next_fit_sector;  // Where the next fit search starts
+
+struct geometry geometries[geometry_count] =
+{
+  {"SSSD",  360,  9, 40, 1, 1},
+  {"DSSD",  720,  9, 40, 2, 1},
+  {"DSDD", 1440, 18, 40, 2, 2},
+  {"DSHD", 2880, 36, 40, 2, 3}
+};
 
 
 /*
@@ -130,1228 +486,11301 @@ int disk_size;
 
 
 /*===========================================================================
- *                                swap
+ *                          load_be16 / load_le16
  *===========================================================================
- * Desription: Swap bytes if this is a little-endian system
+ * Desription: Read an unaligned 16-bit value stored in disk byte order
  *
- * Parameters: val - Value to swap
+ * Parameters: p - Pointer to the first byte of the value
  *
- * Return:     Swapped value
+ * Return:     Value in host byte order
  */
-short swap(short val)
+static inline int load_be16(const unsigned char *p)
+{
+  uint16_t val;
+  memcpy(&val, p, sizeof(val));
+#if !HOST_BIG_ENDIAN
+  val = __builtin_bswap16(val);
+#endif
+  return(val);
+}
+
+static inline int load_le16(const unsigned char *p)
 {
-  char test[]={0,1};
-  if(*((short*)&test[0]) == 1) return(val);
-  return(((val<<8)&0xFF00) | (val >> 8));
+  uint16_t val;
+  memcpy(&val, p, sizeof(val));
+#if HOST_BIG_ENDIAN
+  val = __builtin_bswap16(val);
+#endif
+  return(val);
 }
 
 
 /*===========================================================================
- *                             cluster_first
+ *                         store_be16 / store_le16
  *===========================================================================
- * Desription: Extract first cluster from FIB cluster span record
+ * Desription: Write an unaligned 16-bit value in disk byte order
  *
- * Parameters: cluster - FIB cluster record
+ * Parameters: p   - Pointer to the first byte of the value
+ *             val - Value in host byte order
  *
- * Return:     First cluster number in span
+ * Return:     None
  */
-int cluster_first(unsigned char* cluster)
+static inline void store_be16(unsigned char *p, int val)
 {
-  // first: ABC
-  // count: DEF
-  // cluster: BC FA DE
-  return(((int)(cluster[1] & 0xF) << 8) | cluster[0]);
+  uint16_t v = val;
+#if !HOST_BIG_ENDIAN
+  v = __builtin_bswap16(v);
+#endif
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void store_le16(unsigned char *p, int val)
+{
+  uint16_t v = val;
+#if HOST_BIG_ENDIAN
+  v = __builtin_bswap16(v);
+#endif
+  memcpy(p, &v, sizeof(v));
 }
 
 
 /*===========================================================================
- *                             cluster_count
+ *                         load_le32 / store_le32
  *===========================================================================
- * Desription: Extract cluster count from FIB cluster span record
+ * Desription: Read or write an unaligned little-endian 32-bit value
  *
- * Parameters: cluster - FIB cluster record
+ * Parameters: p   - Pointer to the first byte of the value
+ *             val - Value in host byte order
  *
- * Return:     First cluster number in span
+ * Return:     Value in host byte order
  */
-int cluster_count(unsigned char* cluster)
+static inline uint32_t load_le32(const unsigned char *p)
 {
-  // first: ABC
-  // count: DEF
-  // cluster: BC FA DE
-  return((((int)cluster[2]) << 4) | (cluster[1] >> 4));
+  uint32_t val;
+  memcpy(&val, p, sizeof(val));
+#if HOST_BIG_ENDIAN
+  val = __builtin_bswap32(val);
+#endif
+  return(val);
+}
+
+static inline void store_le32(unsigned char *p, uint32_t val)
+{
+#if HOST_BIG_ENDIAN
+  val = __builtin_bswap32(val);
+#endif
+  memcpy(p, &val, sizeof(val));
 }
 
 
 /*===========================================================================
- *                              make_cluster
+ *                              hash_bytes
  *===========================================================================
- * Desription: Make cluster record
+ * Desription: Compute a 64-bit content hash
  *
- * Parameters: cluster - Pointer to cluster record
- *             first   - First sector in cluster
- *             count   - Sector count in cluster
+ * Parameters: data - Data to hash
+ *             size - Size of data
+ *             seed - Starting value, allows hashing in pieces
  *
- * Return:     First cluster number in span
+ * Return:     Hash value
  */
-void make_cluster(unsigned char* cluster, int first, int count)
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed)
 {
-  // first: ABC
-  // count: DEF
-  // cluster: BC FA DE
-  cluster[0] = first & 0xFF;
-  cluster[1] = ((first >> 8) & 0x0F) | ((count << 4) & 0xF0);
-  cluster[2] = (count >> 4) & 0xFF;
+  const unsigned char *p = data;
+  uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ull);
+  uint64_t word;
+
+  for(; size >= 8; size -= 8, p += 8)
+  {
+    memcpy(&word, p, sizeof(word));
+    h ^= word * 0xC2B2AE3D27D4EB4Full;
+    h = ((h << 31) | (h >> 33)) * 0x9E3779B97F4A7C15ull;
+  }
+  word = 0;
+  memcpy(&word, p, size);
+  h ^= word * 0xC2B2AE3D27D4EB4Full;
+
+  // Final avalanche
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  h ^= h >> 33;
+  return(h);
 }
 
 
 /*===========================================================================
- *                               make_name
+ *                              clock_ns
  *===========================================================================
- * Desription: Convert a C string to a V9T9 name
+ * Desription: Read a clock in nanoseconds
  *
- * Parameters: dst  - Pointer to V9T9 name
- *             src  - Pointer to source name
- *             size - Maximum size of the V9T9 name 
+ * Parameters: clock - Clock to read
  *
- * Return:     First cluster number in span
+ * Return:     Clock value
  */
-void make_name(char* dst, char* src, int size)
+uint64_t clock_ns(clockid_t clock)
 {
-  int i;
-  for(i = 0; i < size; i++)
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return((uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+
+
+/*===========================================================================
+ *                       phase_start / phase_stop
+ *===========================================================================
+ * Desription: Time a phase of the run for the statistics report
+ *
+ * Parameters: timer - Timer for this phase
+ *             phase - Phase being timed
+ *
+ * Return:     None
+ */
+void phase_start(struct phase_timer *timer, int phase)
+{
+  timer->phase = phase;
+  stats.calls[phase]++;
+  if(!stats_report) return;
+  timer->wall = clock_ns(CLOCK_MONOTONIC);
+  timer->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void phase_stop(struct phase_timer *timer)
+{
+  if(!stats_report) return;
+  stats.wall_ns[timer->phase] += clock_ns(CLOCK_MONOTONIC) - timer->wall;
+  stats.cpu_ns[timer->phase] += clock_ns(CLOCK_THREAD_CPUTIME_ID) -
+                                timer->cpu;
+}
+
+
+/*===========================================================================
+ *                           stats_image_done
+ *===========================================================================
+ * Desription: Record the time spent on one image of a batch
+ *
+ * Parameters: ms - Elapsed milliseconds
+ *
+ * Return:     None
+ */
+void stats_image_done(double ms)
+{
+  struct run_stats *t = &stats_total;
+  if(!stats_report) return;
+  pthread_mutex_lock(&stats_lock);
+  if(t->image_count == t->image_capacity)
   {
-    // Convert name to upper case
-    // Replace dots and spaces with underscores
-    char t = *src++;
-    if(t == 0) break; 
-    if(t >= 'a' && t <= 'z') t = t-'a'+'A';
-    if(t == '.' || t == ' ') t = '_';
-    *dst++ = t;
+    t->image_capacity = t->image_capacity ? 2 * t->image_capacity : 1024;
+    t->image_ms = realloc(t->image_ms, t->image_capacity * sizeof(double));
   }
-  // Pad name with spaces
-  for(;i < size; i++) *dst++ = ' ';
+  t->image_ms[t->image_count++] = ms;
+  pthread_mutex_unlock(&stats_lock);
 }
 
 
 /*===========================================================================
- *                              show_help
+ *                              stats_merge
  *===========================================================================
- * Desription: Display help text to the user
+ * Desription: Add the counts of the calling thread to the totals
  *
  * Parameters: None
  *
  * Return:     None
  */
-void show_help()
+void stats_merge()
 {
-  printf("dsk99 - TI 99/4A Floppy Disk Management Tool\n");
-  printf("\n");
-  printf("Usage:\n");
-  printf("\n");
-  printf("dsk99 {options} {disk image} [-n {disk name}]\n");
-  printf("      [{options} {filename} ... [-o {output name}]]\n");
-  printf("\n");
-  printf("Disk Options\n");
-  printf("  -c : Create new disk image\n");
-  printf("  -e : Use existing disk image\n");
-  printf("  -U : Clear protect flag\n");
-  printf("  -W : Set protect flag\n");
-  printf("  -n : Set disk name\n");
-  printf("  -l : List disk contents\n");
-  printf("  -X : Extract all files\n");
-  printf("\n");
-  printf("File Options\n");
-  printf("  -p : File is a program\n");
-  printf("  -d : File contains ASCII data\n");
-  printf("  -i : File contains binary data\n");
-  printf("  -u : File is not write-protected\n");
-  printf("  -w : File is write-protected\n");
-  printf("  -f{record size} : File contains fixed records of indicated size\n");
-  printf("  -v{record size} : File contains variable records of maximum indicated size\n");
-  printf("  -a : Add file to image\n");
-  printf("  -r : Remove file from image\n");
-  printf("  -x : Extract file from image\n");
-  printf("  -o : Specify output name\n");
-  printf("\n");
-  printf("Global Options\n");
-  printf("  -V : Verbose output\n");
-  printf("\n");
-  printf("Examples\n");
-  printf("  List the contents of a disk image\n");
-  printf("    dsk99 -l disk.v9t9\n");
-  printf("\n");
-  printf("  Extract all files from a disk image\n");
-  printf("    dsk99 -X disk.v9t9\n");
-  printf("\n");
-  printf("  Add all files in the current directory to a new disk image as programs\n");
-  printf("    dsk99 -c disk.v9t9 -ap *\n");
-  printf("\n");
-  printf("  Add a local file \"records1.dat\" as a \"dis/fix 80\" file named \"fixrec\"\n");
-  printf("    dsk99 -c disk.v9t9 -adf80 records1.dat -o fixrec\n");
-  printf("\n");
-  printf("  Change the existing file \"fixrec\" filetype to \"dis/fix 40\"\n");
-  printf("    dsk99 -e disk.v9t9 -df40 records1.dat -o fixrec\n");
-  printf("\n");
-  printf("  Extract a disk image file named \"fixrec\" to a local file named \"records1.dat\"\n");
-  printf("    dsk99 -e disk.v9t9 -x fixrec -o records1.dat\n");
+  int i;
+  pthread_mutex_lock(&stats_lock);
+  for(i = 0; i < phase_count; i++)
+  {
+    stats_total.wall_ns[i] += stats.wall_ns[i];
+    stats_total.cpu_ns[i]  += stats.cpu_ns[i];
+    stats_total.calls[i]   += stats.calls[i];
+  }
+  stats_total.sectors_read     += stats.sectors_read;
+  stats_total.sectors_written  += stats.sectors_written;
+  stats_total.allocator_probes += stats.allocator_probes;
+  stats_total.fib_lookups      += stats.fib_lookups;
+  pthread_mutex_unlock(&stats_lock);
+  memset(&stats, 0, sizeof(stats));
 }
 
 
 /*===========================================================================
- *                             parse_arguments
+ *                            compare_doubles
  *===========================================================================
- * Desription: Parse the command line arguments
+ * Desription: Order doubles for qsort
  *
- * Parameters: argc - Number of arguments
- *             argv - Array of arguments
+ * Parameters: a, b - Values to compare
  *
- * Return:     Were the arguments parsed correcctly?
+ * Return:     Sort order
  */
-#if 0
-int parse_arguments(int argc, char **argv)
+int compare_doubles(const void *a, const void *b)
 {
-  enum
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return((x > y) - (x < y));
+}
+
+
+/*===========================================================================
+ *                             report_stats
+ *===========================================================================
+ * Desription: Print the statistics report to stderr
+ *
+ * Parameters: total_ns - Elapsed time of the whole run
+ *
+ * Return:     None
+ */
+void report_stats(uint64_t total_ns)
+{
+  static char *phase_names[phase_count] =
   {
-    cNONE = 0,
-    cFILENAME,
-    cOUTNAME,
-    cDISKPATH,
-    cDISKNAME
+    "parse", "load", "lookup", "allocate", "extract", "save", "list"
   };
+  unsigned long long io[4] = {0, 0, 0, 0};
+  double pct[4] = {0, 0, 0, 0};
+  struct rusage usage;
+  char line[128];
+  FILE *file;
+  int i;
 
-  struct optionset
+  // Bytes and read/write syscalls as counted by the kernel
+  file = fopen("/proc/self/io", "r");
+  if(file != NULL)
+  {
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+      sscanf(line, "rchar: %llu", &io[0]);
+      sscanf(line, "wchar: %llu", &io[1]);
+      sscanf(line, "syscr: %llu", &io[2]);
+      sscanf(line, "syscw: %llu", &io[3]);
+    }
+    fclose(file);
+  }
+  getrusage(RUSAGE_SELF, &usage);
+  stats_merge();
+
+  // Per-image percentiles
+  if(stats_total.image_count > 0)
+  {
+    static double points[4] = {0.50, 0.90, 0.99, 1.00};
+    qsort(stats_total.image_ms, stats_total.image_count, sizeof(double),
+          compare_doubles);
+    for(i = 0; i < 4; i++)
+      pct[i] = stats_total.image_ms[(int)(points[i] * (stats_total.image_count - 1))];
+  }
+
+  if(stats_report == 2)
+  {
+    fprintf(stderr, "{\"wall_ms\": %.3f, \"phases\": {", total_ns / 1e6);
+    for(i = 0; i < phase_count; i++)
+    {
+      fprintf(stderr, "%s\"%s\": {\"calls\": %llu, \"wall_ms\": %.3f, "
+              "\"cpu_ms\": %.3f}", i ? ", " : "", phase_names[i],
+              (unsigned long long)stats_total.calls[i], stats_total.wall_ns[i] / 1e6,
+              stats_total.cpu_ns[i] / 1e6);
+    }
+    fprintf(stderr, "}, \"sectors_read\": %llu, \"sectors_written\": %llu, "
+            "\"bytes_read\": %llu, \"bytes_written\": %llu, "
+            "\"read_syscalls\": %llu, \"write_syscalls\": %llu, "
+            "\"allocator_probes\": %llu, \"fib_lookups\": %llu, "
+            "\"peak_rss_kb\": %ld, \"images\": %d, \"image_ms\": "
+            "{\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}\n",
+            (unsigned long long)stats_total.sectors_read,
+            (unsigned long long)stats_total.sectors_written,
+            io[0], io[1], io[2], io[3],
+            (unsigned long long)stats_total.allocator_probes,
+            (unsigned long long)stats_total.fib_lookups, usage.ru_maxrss,
+            stats_total.image_count, pct[0], pct[1], pct[2], pct[3]);
+    return;
+  }
+
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Phase       Calls     Wall ms     CPU ms\n");
+  fprintf(stderr, "--------  -------  ----------  ----------\n");
+  for(i = 0; i < phase_count; i++)
+  {
+    fprintf(stderr, "%-8s  %7llu  %10.3f  %10.3f\n", phase_names[i],
+            (unsigned long long)stats_total.calls[i], stats_total.wall_ns[i] / 1e6,
+            stats_total.cpu_ns[i] / 1e6);
+  }
+  fprintf(stderr, "total              %10.3f  %10.3f\n", total_ns / 1e6,
+          (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+          (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Sectors read/written  : %llu / %llu\n",
+          (unsigned long long)stats_total.sectors_read,
+          (unsigned long long)stats_total.sectors_written);
+  fprintf(stderr, "Bytes read/written    : %llu / %llu\n", io[0], io[1]);
+  fprintf(stderr, "Read/write syscalls   : %llu / %llu\n", io[2], io[3]);
+  fprintf(stderr, "Allocator probes      : %llu\n",
+          (unsigned long long)stats_total.allocator_probes);
+  fprintf(stderr, "FIB lookups           : %llu\n",
+          (unsigned long long)stats_total.fib_lookups);
+  fprintf(stderr, "Peak memory           : %ld KB\n", usage.ru_maxrss);
+  if(stats_total.image_count > 0)
+  {
+    fprintf(stderr, "Images                : %d\n", stats_total.image_count);
+    fprintf(stderr, "Per image ms          : p50 %.3f  p90 %.3f  "
+            "p99 %.3f  max %.3f\n", pct[0], pct[1], pct[2], pct[3]);
+  }
+}
+
+
+#ifdef DSK99_TRACE
+struct trace_ring *trace_rings;             // Rings of all traced threads
+int trace_threads;                          // Threads traced so far
+__thread struct trace_ring *trace_local;    // Ring of this thread
+
+/*===========================================================================
+ *                             trace_event
+ *===========================================================================
+ * Desription: Record a tracepoint hit in the ring of the calling thread
+ *
+ * Parameters: event - trace_* event
+ *             kind  - 'B' begin, 'E' end or 'I' instant
+ *             arg   - Event argument
+ *
+ * Return:     None
+ */
+void trace_event(int event, int kind, uint32_t arg)
+{
+  struct trace_ring *ring = trace_local;
+  struct trace_record *record;
+
+  // First event of this thread, publish a new ring
+  if(ring == NULL)
+  {
+    ring = calloc(1, sizeof(struct trace_ring));
+    if(ring == NULL) return;
+    ring->thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    trace_local = ring;
+  }
+
+  record = &ring->record[ring->head & (TRACE_RING_SIZE - 1)];
+  record->time_ns = clock_ns(CLOCK_MONOTONIC);
+  record->arg = arg;
+  record->thread = ring->thread;
+  record->event = event;
+  record->kind = kind;
+  ring->head++;
+}
+
+
+/*===========================================================================
+ *                             trace_dump
+ *===========================================================================
+ * Desription: Write the records of every thread to the trace file, named
+ *             by DSK99_TRACE_FILE or "dsk99.trace"
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void trace_dump()
+{
+  struct trace_ring *ring;
+  unsigned char header[16];
+  uint32_t count = 0;
+  char *filename = getenv("DSK99_TRACE_FILE");
+  FILE *file;
+
+  // Runs that hit no tracepoint leave any earlier trace alone
+  if(filename == NULL) filename = "dsk99.trace";
+  ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+  if(ring == NULL) return;
+  for(; ring != NULL; ring = ring->next)
+    count += ring->head < TRACE_RING_SIZE ? ring->head : TRACE_RING_SIZE;
+
+  file = fopen(filename, "wb");
+  if(file == NULL)
+  {
+    printf("Cannot write trace file \"%s\"\n", filename);
+    return;
+  }
+  memcpy(&header[0], TRACE_MAGIC, 4);
+  store_le32(&header[4], sizeof(struct trace_record));
+  store_le32(&header[8], count);
+  store_le32(&header[12], 0);
+  fwrite(header, sizeof(header), 1, file);
+
+  // Oldest surviving record first in each ring
+  for(ring = trace_rings; ring != NULL; ring = ring->next)
+  {
+    uint64_t i = ring->head < TRACE_RING_SIZE ? 0
+                                              : ring->head - TRACE_RING_SIZE;
+    for(; i < ring->head; i++)
+      fwrite(&ring->record[i & (TRACE_RING_SIZE - 1)],
+             sizeof(struct trace_record), 1, file);
+  }
+  fclose(file);
+}
+
+#define TRACE_BEGIN(event, arg)   trace_event(event, 'B', arg)
+#define TRACE_END(event, arg)     trace_event(event, 'E', arg)
+#define TRACE_INSTANT(event, arg) trace_event(event, 'I', arg)
+#define TRACE_DUMP()              trace_dump()
+#else
+#define TRACE_BEGIN(event, arg)   ((void)0)
+#define TRACE_END(event, arg)     ((void)0)
+#define TRACE_INSTANT(event, arg) ((void)0)
+#define TRACE_DUMP()              ((void)0)
+#endif
+
+
+/*===========================================================================
+ *                             lz_put_length
+ *===========================================================================
+ * Desription: Write the extension bytes of an LZ literal or match length
+ *
+ * Parameters: dst    - Output buffer
+ *             op     - Current output position
+ *             cap    - Output buffer capacity
+ *             length - Length beyond the 15 held in the token
+ *
+ * Return:     New output position, -1 if the output is full
+ */
+int lz_put_length(unsigned char *dst, int op, int cap, int length)
+{
+  while(length >= 255)
+  {
+    if(op >= cap) return(-1);
+    dst[op++] = 255;
+    length -= 255;
+  }
+  if(op >= cap) return(-1);
+  dst[op++] = length;
+  return(op);
+}
+
+
+/*===========================================================================
+ *                              lz_compress
+ *===========================================================================
+ * Desription: Compress a block with a small self-contained LZ77 coder
+ *
+ *             The output is a list of sequences: a token holding literal
+ *             and match lengths, the literals, then a 16-bit match offset.
+ *             The last sequence holds only literals.
+ *
+ * Parameters: src - Data to compress
+ *             len - Size of data
+ *             dst - Output buffer
+ *             cap - Output buffer capacity
+ *
+ * Return:     Compressed size, 0 if the data did not fit in the output
+ */
+int lz_compress(const unsigned char *src, int len, unsigned char *dst,
+                int cap)
+{
+  int table[1 << LZ_HASH_BITS];
+  int ip = 0;
+  int op = 0;
+  int anchor = 0;
+
+  memset(table, 0xFF, sizeof(table));
+  while(ip + 4 <= len)
+  {
+    uint32_t seq;
+    int hash;
+    int ref;
+    memcpy(&seq, &src[ip], sizeof(seq));
+    hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    ref = table[hash];
+    table[hash] = ip;
+
+    if(ref >= 0 && ip - ref <= 0xFFFF &&
+       memcmp(&src[ref], &src[ip], 4) == 0)
+    {
+      int literals = ip - anchor;
+      int match = 4;
+      unsigned char *token;
+      while(ip + match < len && src[ref + match] == src[ip + match])
+        match++;
+
+      // Token, literals, offset, then match length extension
+      if(op >= cap) return(0);
+      token = &dst[op++];
+      *token = ((literals < 15 ? literals : 15) << 4) |
+               (match - 4 < 15 ? match - 4 : 15);
+      if(literals >= 15 && (op = lz_put_length(dst, op, cap, literals - 15)) < 0)
+        return(0);
+      if(op + literals + 2 > cap) return(0);
+      memcpy(&dst[op], &src[anchor], literals);
+      op += literals;
+      dst[op++] = (ip - ref) & 0xFF;
+      dst[op++] = (ip - ref) >> 8;
+      if(match - 4 >= 15 && (op = lz_put_length(dst, op, cap, match - 19)) < 0)
+        return(0);
+
+      ip += match;
+      anchor = ip;
+    }
+    else
+    {
+      ip++;
+    }
+  }
+
+  // Trailing literals
+  {
+    int literals = len - anchor;
+    if(op >= cap) return(0);
+    dst[op++] = (literals < 15 ? literals : 15) << 4;
+    if(literals >= 15 && (op = lz_put_length(dst, op, cap, literals - 15)) < 0)
+      return(0);
+    if(op + literals > cap) return(0);
+    memcpy(&dst[op], &src[anchor], literals);
+    op += literals;
+  }
+  return(op);
+}
+
+
+/*===========================================================================
+ *                             lz_decompress
+ *===========================================================================
+ * Desription: Decompress a block written by lz_compress
+ *
+ * Parameters: src  - Compressed data
+ *             slen - Size of compressed data
+ *             dst  - Output buffer
+ *             dlen - Expected decompressed size
+ *
+ * Return:     Was the block decompressed correctly?
+ */
+int lz_decompress(const unsigned char *src, int slen, unsigned char *dst,
+                  int dlen)
+{
+  int ip = 0;
+  int op = 0;
+
+  while(ip < slen)
+  {
+    int token = src[ip++];
+    int literals = token >> 4;
+    int match = (token & 0xF) + 4;
+    int offset;
+    int b;
+
+    if(literals == 15)
+    {
+      do
+      {
+        if(ip >= slen) return(0);
+        b = src[ip++];
+        literals += b;
+      } while(b == 255);
+    }
+    if(ip + literals > slen || op + literals > dlen) return(0);
+    memcpy(&dst[op], &src[ip], literals);
+    ip += literals;
+    op += literals;
+    if(ip >= slen) break;
+
+    // Match copy, which may overlap its own output
+    if(ip + 2 > slen) return(0);
+    offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    if(match == 19)
+    {
+      do
+      {
+        if(ip >= slen) return(0);
+        b = src[ip++];
+        match += b;
+      } while(b == 255);
+    }
+    if(offset == 0 || offset > op || op + match > dlen) return(0);
+    for(b = 0; b < match; b++, op++)
+      dst[op] = dst[op - offset];
+  }
+  return(op == dlen);
+}
+
+
+/*===========================================================================
+ *                         container_load_block
+ *===========================================================================
+ * Desription: Decompress one block of the current container image
+ *
+ * Parameters: block - Block number to decompress
+ *
+ * Return:     None
+ */
+void container_load_block(int block)
+{
+  struct container *c = &image_container;
+  unsigned char *entry = &c->file[CONTAINER_HEADER_SIZE + block * 8];
+  uint32_t offset = load_le32(&entry[0]);
+  uint32_t size = load_le32(&entry[4]);
+  unsigned char *dst = (unsigned char*)disk_buffer +
+                       block * CONTAINER_BLOCK_SIZE;
+  int raw = disk_size - block * CONTAINER_BLOCK_SIZE;
+  if(raw > CONTAINER_BLOCK_SIZE) raw = CONTAINER_BLOCK_SIZE;
+
+  // Blank blocks have no data, stored blocks have their raw size
+  c->pending[block] = 0;
+  stats.sectors_read += raw / SECTOR_SIZE;
+  if(size == 0) return;
+  if(size == raw)
+  {
+    memcpy(dst, &c->file[offset], raw);
+    return;
+  }
+  if(!lz_decompress(&c->file[offset], size, dst, raw))
+  {
+    printf("Compressed block %d is corrupt\n", block);
+    memset(dst, 0, raw);
+  }
+}
+
+
+/*===========================================================================
+ *                              get_sector
+ *===========================================================================
+ * Desription: Get a sector of the current image, decompressing it first
+ *             if it comes from a compressed container
+ *
+ * Parameters: secno - Sector number
+ *
+ * Return:     Pointer to the sector
+ */
+struct disk_sector* get_sector(int secno)
+{
+  struct disk_sector *sector = disk_buffer;
+  int block = secno / CONTAINER_BLOCK_SECTORS;
+  if(image_container.pending != NULL && image_container.pending[block])
+    container_load_block(block);
+  return(&sector[secno]);
+}
+
+
+/*===========================================================================
+ *                            VIB/FIB accessors
+ *===========================================================================
+ * Desription: Read and write the multi-byte fields of the VIB and FIB
+ *
+ * Parameters: vib/fib - Block to access
+ *             val     - New field value
+ *
+ * Return:     Field value in host byte order
+ */
+static inline int vib_physrecs(struct vib_block *vib)
+{
+  return(load_be16(vib->physrecs));
+}
+
+static inline void vib_set_physrecs(struct vib_block *vib, int val)
+{
+  store_be16(vib->physrecs, val);
+}
+
+static inline int fib_physrec_count(struct fib_block *fib)
+{
+  return(load_be16(fib->physrec_count));
+}
+
+static inline void fib_set_physrec_count(struct fib_block *fib, int val)
+{
+  store_be16(fib->physrec_count, val);
+}
+
+// Level 3 record count is the one field stored in reverse byte order
+static inline int fib_fixrecs(struct fib_block *fib)
+{
+  return(load_le16(fib->fixrecs));
+}
+
+static inline void fib_set_fixrecs(struct fib_block *fib, int val)
+{
+  store_le16(fib->fixrecs, val);
+}
+
+
+/*===========================================================================
+ *                     fib_timestamp / fib_set_timestamp
+ *===========================================================================
+ * Desription: Read or write the update time kept in the reserved FIB
+ *             bytes 24-27, packed as hour:5 minute:6 second/2:5 then
+ *             year:7 month:4 day:5 like later TI disk controllers do
+ *
+ * Parameters: fib  - File information block
+ *             when - Host time to store
+ *
+ * Return:     Packed timestamp, 0 if none is stored
+ */
+uint32_t fib_timestamp(struct fib_block *fib)
+{
+  unsigned char *p = (unsigned char*)&fib->reserved2[4];
+  return(((uint32_t)load_be16(&p[2]) << 16) | load_be16(&p[0]));
+}
+
+uint32_t pack_timestamp(time_t when)
+{
+  struct tm local;
+  localtime_r(&when, &local);
+  return(((uint32_t)(((local.tm_year % 100) << 9) |
+                     ((local.tm_mon + 1) << 5) | local.tm_mday) << 16) |
+         ((local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2)));
+}
+
+void fib_set_timestamp(struct fib_block *fib, time_t when)
+{
+  unsigned char *p = (unsigned char*)&fib->reserved2[4];
+  uint32_t packed = pack_timestamp(when);
+  store_be16(&p[0], packed & 0xFFFF);
+  store_be16(&p[2], packed >> 16);
+}
+
+
+/*===========================================================================
+ *                             fib_file_size
+ *===========================================================================
+ * Desription: Determine the size in bytes of a file from its FIB
+ *
+ * Parameters: fib - File information block
+ *
+ * Return:     File size in bytes
+ */
+int fib_file_size(struct fib_block *fib)
+{
+  int physrecs = fib_physrec_count(fib);
+  if(physrecs == 0) return(0);
+
+  // An EOF offset of zero means the last physrec is completely used
+  if(fib->eof == 0) return(physrecs * SECTOR_SIZE);
+  return((physrecs - 1) * SECTOR_SIZE + fib->eof);
+}
+
+
+/*===========================================================================
+ *                             fdr_index_get
+ *===========================================================================
+ * Desription: Read one entry of the FDR index sector
+ *
+ * Parameters: slot - Index entry to read
+ *
+ * Return:     Sector number of the FIB, 0 if the entry is empty
+ */
+static inline int fdr_index_get(int slot)
+{
+  struct disk_sector *sector = disk_buffer;
+  return(load_be16(&sector[BLOCK_FIB_INDEX].data[slot * 2]));
+}
+
+
+/*===========================================================================
+ *                             fdr_index_set
+ *===========================================================================
+ * Desription: Write one entry of the FDR index sector
+ *
+ * Parameters: slot   - Index entry to write
+ *             secno  - Sector number of the FIB, 0 to clear the entry
+ *
+ * Return:     None
+ */
+static inline void fdr_index_set(int slot, int secno)
+{
+  struct disk_sector *sector = disk_buffer;
+  store_be16(&sector[BLOCK_FIB_INDEX].data[slot * 2], secno);
+}
+
+
+/*===========================================================================
+ *                            fdr_index_decode
+ *===========================================================================
+ * Desription: Decode the whole FDR index sector into native integers
+ *
+ * Parameters: index - Array of MAX_FILE_COUNT entries to fill
+ *
+ * Return:     Number of non-empty entries
+ */
+int fdr_index_decode(uint16_t *index)
+{
+  struct disk_sector *sector = disk_buffer;
+  int i;
+  int used = 0;
+
+  memcpy(index, sector[BLOCK_FIB_INDEX].data, SECTOR_SIZE);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+#if !HOST_BIG_ENDIAN
+    index[i] = __builtin_bswap16(index[i]);
+#endif
+    used += (index[i] != 0);
+  }
+  return(used);
+}
+
+
+/*===========================================================================
+ *                                fib_at
+ *===========================================================================
+ * Desription: Overlay a FIB on a sector of the disk image
+ *
+ * Parameters: secno - Sector number holding the FIB
+ *
+ * Return:     Pointer to the FIB, NULL if the sector is outside the image
+ */
+struct fib_block* fib_at(int secno)
+{
+  if(secno <= BLOCK_FIB_INDEX ||
+     secno >= disk_size / (int)sizeof(struct disk_sector))
+    return(NULL);
+  return((struct fib_block*)get_sector(secno));
+}
+
+
+/*===========================================================================
+ *                              sector_of
+ *===========================================================================
+ * Desription: Find the sector number of a block in the disk image
+ *
+ * Parameters: block - Pointer into the disk image
+ *
+ * Return:     Sector number holding the block
+ */
+int sector_of(void *block)
+{
+  return(((intptr_t)block - (intptr_t)disk_buffer) /
+         (int)sizeof(struct disk_sector));
+}
+
+
+/*===========================================================================
+ *                             cluster_first
+ *===========================================================================
+ * Desription: Extract first cluster from FIB cluster span record
+ *
+ * Parameters: cluster - FIB cluster record
+ *
+ * Return:     First cluster number in span
+ */
+int cluster_first(unsigned char* cluster)
+{
+  // first: ABC
+  // count: DEF
+  // cluster: BC FA DE
+  return(((int)(cluster[1] & 0xF) << 8) | cluster[0]);
+}
+
+
+/*===========================================================================
+ *                             cluster_count
+ *===========================================================================
+ * Desription: Extract cluster count from FIB cluster span record
+ *
+ * Parameters: cluster - FIB cluster record
+ *
+ * Return:     Highest file sector offset held by the span
+ */
+int cluster_count(unsigned char* cluster)
+{
+  // first: ABC
+  // count: DEF
+  // cluster: BC FA DE
+  return((((int)cluster[2]) << 4) | (cluster[1] >> 4));
+}
+
+
+/*===========================================================================
+ *                              make_cluster
+ *===========================================================================
+ * Desription: Make cluster record
+ *
+ * Parameters: cluster - Pointer to cluster record
+ *             first   - First sector in cluster
+ *             count   - Sector count in cluster
+ *
+ * Return:     First cluster number in span
+ */
+void make_cluster(unsigned char* cluster, int first, int count)
+{
+  // first: ABC
+  // count: DEF
+  // cluster: BC FA DE
+  cluster[0] = first & 0xFF;
+  cluster[1] = ((first >> 8) & 0x0F) | ((count << 4) & 0xF0);
+  cluster[2] = (count >> 4) & 0xFF;
+}
+
+
+/*===========================================================================
+ *                               fib_spans
+ *===========================================================================
+ * Desription: Decode the cluster table of a FIB into sector spans
+ *
+ *             Each table entry holds the first sector of a span and the
+ *             highest file sector offset stored in it, so span lengths are
+ *             the differences between consecutive offsets.
+ *
+ * Parameters: fib   - File information block
+ *             spans - Array of MAX_CLUSTERS entries to fill
+ *
+ * Return:     Number of spans, -1 if the table is inconsistent
+ */
+int fib_spans(struct fib_block *fib, struct cluster_span *spans)
+{
+  int i;
+  int last = -1;
+  int sectors = disk_size / (int)sizeof(struct disk_sector);
+
+  for(i = 0; i < MAX_CLUSTERS; i++)
+  {
+    int first  = cluster_first(fib->cluster[i]);
+    int offset = cluster_count(fib->cluster[i]);
+    if(first == 0) break;
+
+    spans[i].first = first;
+    spans[i].count = offset - last;
+    if(spans[i].count <= 0 || first + spans[i].count > sectors)
+      return(-1);
+    last = offset;
+  }
+  return(i);
+}
+
+
+/*===========================================================================
+ *                             fib_set_spans
+ *===========================================================================
+ * Desription: Encode sector spans into the cluster table of a FIB
+ *
+ * Parameters: fib   - File information block
+ *             spans - Spans to store
+ *             count - Number of spans, at most MAX_CLUSTERS
+ *
+ * Return:     None
+ */
+void fib_set_spans(struct fib_block *fib, struct cluster_span *spans,
+                   int count)
+{
+  int i;
+  int offset = -1;
+
+  memset(fib->cluster, 0, sizeof(fib->cluster));
+  for(i = 0; i < count; i++)
+  {
+    offset += spans[i].count;
+    make_cluster(fib->cluster[i], spans[i].first, offset);
+  }
+}
+
+
+/*===========================================================================
+ *                               make_name
+ *===========================================================================
+ * Desription: Convert a C string to a V9T9 name
+ *
+ * Parameters: dst  - Pointer to V9T9 name
+ *             src  - Pointer to source name
+ *             size - Maximum size of the V9T9 name 
+ *
+ * Return:     First cluster number in span
+ */
+void make_name(char* dst, char* src, int size)
+{
+  int i;
+  for(i = 0; i < size; i++)
+  {
+    // Convert name to upper case
+    // Replace dots and spaces with underscores
+    char t = *src++;
+    if(t == 0) break; 
+    if(t >= 'a' && t <= 'z') t = t-'a'+'A';
+    if(t == '.' || t == ' ') t = '_';
+    *dst++ = t;
+  }
+  // Pad name with spaces
+  for(;i < size; i++) *dst++ = ' ';
+}
+
+
+/*===========================================================================
+ *                              show_help
+ *===========================================================================
+ * Desription: Display help text to the user
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void show_help()
+{
+  printf("dsk99 - TI 99/4A Floppy Disk Management Tool\n");
+  printf("\n");
+  printf("Usage:\n");
+  printf("\n");
+  printf("dsk99 {options} {disk image} [-n {disk name}]\n");
+  printf("      [{options} {filename} ... [-o {output name}]]\n");
+  printf("dsk99 {command} {arguments}\n");
+  printf("\n");
+  printf("Commands\n");
+  printf("  diff {old image} {new image} {delta} : Write sector delta between images\n");
+  printf("  patch {image} {delta} [{output}]     : Apply sector delta to an image\n");
+  printf("  sync [-t] [-w] {image} {directory}   : Update image to match a directory\n");
+  printf("       -t keeps file times in the FIB, -w keeps watching for changes\n");
+  printf("  build {manifest} {image}             : Build an image from a manifest\n");
+  printf("  batch [-j {journal}] [-o {dir}] (-l | -X [-b] | -C {ext}) {image} ...\n");
+  printf("       List, extract or convert many images, resuming from the journal\n");
+  printf("  trace [-j] {trace file}             : Summarize a trace from \"make trace\"\n");
+  printf("       -j writes Chrome trace event JSON instead\n");
+  printf("  generate [-s {seed}] [-n {images}] {directory}\n");
+  printf("       Write a synthetic archive of images for benchmarking\n");
+  printf("  simulate [-g {geometry}] [-s {seed}] [-n {ops}] [-r {workload}]\n");
+  printf("           [-p {policy},...] [-o {series.csv}]\n");
+  printf("       Compare allocation policies over an add/remove/resize workload\n");
+  printf("  convert [-j {workers}] [-o {dir}] {dsk|dkz|pc99|fiad} {input} ...\n");
+  printf("       Convert many images or FIAD directories on all processors\n");
+  printf("  append {image} {file} {host file}   : Append records to a data file\n");
+  printf("  update {image} {file}#{record} {host file}\n");
+  printf("       Replace one record of a fixed record file\n");
+  printf("  grep [-i] [-E] [-b] [-j {workers}] {pattern} {image} ...\n");
+  printf("       Search records and program text inside many images\n");
+  printf("  copy {image}:{file} ... {image}[:{file}]\n");
+  printf("       Copy files between images, keeping their type and records\n");
+  printf("  repack [-g {geometry}] [-j {workers}] [-o {dir}] [-m {mapping}]\n");
+  printf("         [-r] {image} ...\n");
+  printf("       Pack the files of many images into as few large images as possible\n");
+  printf("  pack {pack} {image} ...  : Add images to an indexed pack\n");
+  printf("  pack -l {pack}            : List the images of a pack\n");
+  printf("  compact {pack}            : Drop replaced images from a pack\n");
+  printf("  recover [-r] [-j {workers}] {image} ...\n");
+  printf("       Find deleted files whose FIB and data remain, -r restores them\n");
+  printf("\n");
+  printf("Disk Options\n");
+  printf("  -c : Create new disk image\n");
+  printf("  -e : Use existing disk image\n");
+  printf("  -U : Clear protect flag\n");
+  printf("  -W : Set protect flag\n");
+  printf("  -n : Set disk name\n");
+  printf("  -l : List disk contents\n");
+  printf("  -X : Extract all files\n");
+  printf("  -C : Save a copy of the disk image (\".dkz\" compressed, \".pc99\" tracks)\n");
+  printf("\n");
+  printf("File Options\n");
+  printf("  -p : File is a program\n");
+  printf("  -d : File contains ASCII data\n");
+  printf("  -i : File contains binary data\n");
+  printf("  -u : File is not write-protected\n");
+  printf("  -w : File is write-protected\n");
+  printf("  -f{record size} : File contains fixed records of indicated size\n");
+  printf("  -v{record size} : File contains variable records of maximum indicated size\n");
+  printf("  -a : Add file to image\n");
+  printf("  -r : Remove file from image\n");
+  printf("  -R : Replace file contents in place, writing only what changed\n");
+  printf("  -x : Extract file from image, or records with {name}#{first}[-{last}]\n");
+  printf("  -b : With -x, list a BASIC program as source text\n");
+  printf("  -o : Specify output name\n");
+  printf("\n");
+  printf("Global Options\n");
+  printf("  -V : Verbose output\n");
+  printf("  -s {command file} : Run the operations in a command file\n");
+  printf("  --stats[=json] : Report time, I/O and memory use on stderr\n");
+  printf("  --alloc={first|next|best|worst} : Allocation policy for file data\n");
+  printf("\n");
+  printf("Examples\n");
+  printf("  List the contents of a disk image\n");
+  printf("    dsk99 -l disk.v9t9\n");
+  printf("\n");
+  printf("  Extract all files from a disk image\n");
+  printf("    dsk99 -X disk.v9t9\n");
+  printf("\n");
+  printf("  Add all files in the current directory to a new disk image as programs\n");
+  printf("    dsk99 -c disk.v9t9 -ap *\n");
+  printf("\n");
+  printf("  Add a local file \"records1.dat\" as a \"dis/fix 80\" file named \"fixrec\"\n");
+  printf("    dsk99 -c disk.v9t9 -adf80 records1.dat -o fixrec\n");
+  printf("\n");
+  printf("  Change the existing file \"fixrec\" filetype to \"dis/fix 40\"\n");
+  printf("    dsk99 -e disk.v9t9 -df40 records1.dat -o fixrec\n");
+  printf("\n");
+  printf("  Extract a disk image file named \"fixrec\" to a local file named \"records1.dat\"\n");
+  printf("    dsk99 -e disk.v9t9 -x fixrec -o records1.dat\n");
+  printf("\n");
+  printf("  Extract records 100 to 109 of the fixed record file \"fixrec\"\n");
+  printf("    dsk99 -e disk.v9t9 -x fixrec#100-109 -o some.dat\n");
+  printf("\n");
+  printf("  Convert a disk image to the compressed format and back\n");
+  printf("    dsk99 -e disk.v9t9 -C disk.dkz\n");
+  printf("    dsk99 -e disk.dkz -C disk.v9t9\n");
+}
+
+
+/*===========================================================================
+ *                              file_arg_for
+ *===========================================================================
+ * Desription: Find the file operation for a host file name, adding a new
+ *             one if the name has not been seen
+ *
+ * Parameters: name - Host file name
+ *
+ * Return:     Index of the file operation
+ */
+int file_arg_for(char *name)
+{
+  int i;
+  int slot;
+
+  // Keep the name hash at most half full
+  if(2 * (all_args.file_count + 1) > all_args.slot_count)
+  {
+    free(all_args.file_slots);
+    all_args.slot_count = all_args.slot_count ? 2 * all_args.slot_count : 256;
+    all_args.file_slots = malloc(all_args.slot_count * sizeof(int));
+    memset(all_args.file_slots, 0xFF, all_args.slot_count * sizeof(int));
+    for(i = 0; i < all_args.file_count; i++)
+    {
+      char *key = all_args.file[i].file_name;
+      slot = hash_bytes(key, strlen(key), 0) & (all_args.slot_count - 1);
+      while(all_args.file_slots[slot] >= 0)
+        slot = (slot + 1) & (all_args.slot_count - 1);
+      all_args.file_slots[slot] = i;
+    }
+  }
+
+  slot = hash_bytes(name, strlen(name), 0) & (all_args.slot_count - 1);
+  while((i = all_args.file_slots[slot]) >= 0)
+  {
+    if(strcmp(all_args.file[i].file_name, name) == 0) return(i);
+    slot = (slot + 1) & (all_args.slot_count - 1);
+  }
+
+  // Add a new operation
+  if(all_args.file_count == all_args.file_capacity)
+  {
+    all_args.file_capacity = all_args.file_capacity ?
+                             2 * all_args.file_capacity : 64;
+    all_args.file = realloc(all_args.file,
+                            all_args.file_capacity * sizeof(struct file_arg));
+  }
+  i = all_args.file_count++;
+  memset(&all_args.file[i], 0, sizeof(struct file_arg));
+  strncpy(all_args.file[i].file_name, name,
+          sizeof(all_args.file[i].file_name) - 1);
+  all_args.file_slots[slot] = i;
+  return(i);
+}
+
+
+/*===========================================================================
+ *                             parse_arguments
+ *===========================================================================
+ * Desription: Parse the command line arguments
+ *
+ * Parameters: argc - Number of arguments
+ *             argv - Array of arguments
+ *
+ * Return:     Were the arguments parsed correcctly?
+ */
+#if 0
+int parse_arguments(int argc, char **argv)
+{
+  enum
+  {
+    cNONE = 0,
+    cFILENAME,
+    cOUTNAME,
+    cDISKPATH,
+    cDISKNAME
+  };
+
+  struct optionset
+  {
+    char *set;     // Set of all valid flags in this option
+    int   expect;  // Type of parameter we expect to get next
+  };  
+
+  // valid sets of flags for options
+  struct optionset valid_set[] =
+  {
+    {"Vh",                  cNONE},
+    {"oV",                  cOUTNAME},
+    {"rV",                  cFILENAME},
+    {"xV",                  cFILENAME},
+    {"nV",                  cDISKNAME},
+    {"cWUlV",               cDISKPATH},
+    {"eWUlXV",              cDISKPATH},
+    {"pdifwuvV0123456789",  cFILENAME},
+    {"apdifwuvV0123456789", cFILENAME},
+    {NULL,    cNONE}
+  };
+
+  int i;
+  int expect = cNONE;
+  struct file_arg curr_file;
+  int last_file = -1;
+  int last_arg = 0;
+
+  // Display help if no arguments given
+  if(argc == 1)
+  {
+    show_help();
+    return(0);
+  }
+
+  for(i = 1; i < argc; i++)
+  {
+    char *arg = argv[i];
+    if(arg[0] == '-')
+    {
+      // This is an option
+      
+      // Find the set to use
+      struct optionset *set = valid_set;
+      while(set->set != NULL)
+      {
+        // If all option flags are contained in this set, use it
+        if(strspn(&arg[1], set->set) == strlen(arg)-1) break;
+
+        // Check next set
+        set++;
+      }
+
+      // Check for option validity
+      if(set->set == NULL ||
+         (last_arg != 0 && 
+          expect != cNONE && 
+          set->expect != cNONE && 
+          set->expect != expect))
+      {
+        printf("Invalid option \"%s\"\n", arg);
+        if(all_args.verbose)
+        {
+          if(set->set == NULL)      printf("This option does not exist\n");
+          if(set->expect != expect) printf("This option can't be used with other options it's with\n");
+        }
+        return(0);
+      }
+
+      if(last_arg == 0)
+      {
+        memset(&curr_file, 0, sizeof(struct file_arg));
+        last_arg = 1;
+      }
+
+      // Process flags
+      char *op = &arg[1];
+      while(*op)
+      {
+        switch(*op)
+        {
+          case 'a':  curr_file.add          = 1; break;
+          case 'c':  all_args.create_new    = 1; break;
+          case 'd':  curr_file.ascii        = 1; break;
+          case 'e':  all_args.use_existing  = 1; break;
+          case 'f':  curr_file.fixed        = 1; break;
+          case 'h':  all_args.show_help     = 1; break;
+          case 'i':  curr_file.binary       = 1; break;
+          case 'l':  all_args.list_contents = 1; break;
+          case 'n':  break;
+          case 'o':  break;
+          case 'p':  curr_file.program      = 1; break;
+          case 'r':  curr_file.remove       = 1; break;
+          case 'u':  curr_file.unprotect    = 1; break;
+          case 'U':  all_args.unprotect     = 1; break;
+          case 'v':  curr_file.variable     = 1; break;
+          case 'V':  all_args.verbose++;         break;
+          case 'W':  all_args.protect       = 1; break;
+          case 'w':  curr_file.protect      = 1; break;
+          case 'x':  curr_file.extract      = 1; break;
+          case 'X':  all_args.extract_all   = 1; break;
+
+          default:   printf("Unknown option \"%c\"\n", *op); return(0);
+        }
+
+        op++;
+        // Process record length
+        if((*(op-1) == 'f' || *(op-1) == 'v') && set->expect == cFILENAME)
+        {
+          if(*op < '0' || *op > '9' ||
+             (curr_file.record_size = strtol(op, &op, 10)) == 0)
+          {
+            printf("Unknown option \"%s\"\n", (op-1)); return(0);
+          }
+          if(curr_file.record_size > 254)
+          {
+            printf("Invalid record length %d\n", curr_file.record_size);
+            return(0);
+          }
+
+          struct file_arg *file = &all_args.file[all_args.file_count];
+          file->ascii = curr_file.ascii;
+          file->binary = curr_file.binary;
+          file->fixed = curr_file.fixed;
+          file->variable = curr_file.variable;
+          file->record_size = curr_file.record_size;
+        }
+      }
+      expect = set->expect;
+    }
+    else
+    {
+      // This is a name
+      int i;
+      if(expect == cNONE)
+      {
+        printf("Invalid argument \"%s\"\n", arg);
+        return(0);
+      }
+      last_arg = 0;
+      switch(expect)
+      {
+        case cFILENAME:
+          for(i = 0; i < all_args.file_count; i++)
+          {
+            if(strcmp(all_args.file[i].file_name, arg) == 0) break;
+          }          
+          if(i >= MAX_FILE_COUNT)
+          {
+            printf("Disk full, cannot add \"%s\"\n", arg);
+            return(0);
+          }
+          if(i == all_args.file_count)
+            all_args.file_count++;
+          if(curr_file.add != 0 || curr_file.extract != 0) last_file = i;
+//          memcpy(&all_args.file[i], &curr_file, sizeof(struct file_arg));
+          strcpy(all_args.file[i].file_name, arg);
+          break;
+          
+        case cOUTNAME:
+          if(last_file == -1)
+          {
+            printf("No file to use for output name \"%s\"\n", arg);
+            return(0);
+          }
+          strcpy(all_args.file[i].output_name, arg);
+          last_file = -1;
+          break;
+
+        case cDISKPATH:
+          strcpy(all_args.image_path, arg);
+          expect = cNONE;
+          break;
+
+        case cDISKNAME:
+          strncpy(all_args.disk_name, arg, DISK_NAME_LEN);
+          expect = cNONE;
+          break;
+
+        default:
+          printf("Internal error, unknown name type %d for \"%s\"\n", 
+                 expect, arg);
+          return(0);
+      }
+    }
+  }
+  return(1);
+}
+#endif
+int parse_arguments(int argc, char **argv)
+{
+  enum
+  {
+    cNONE = 0,
+    cFILENAME,
+    cOUTNAME,
+    cDISKPATH,
+    cDISKNAME,
+    cCOPYPATH,
+    cSCRIPT
+  };
+
+  struct optionset
   {
     char *set;     // Set of all valid flags in this option
     int   expect;  // Type of parameter we expect to get next
   };  
 
-  // valid sets of flags for options
-  struct optionset valid_set[] =
+  // valid sets of flags for options
+  struct optionset valid_set[] =
+  {
+    {"Vh",                  cNONE},
+    {"oV",                  cOUTNAME},
+    {"rV",                  cFILENAME},
+    {"xbV",                 cFILENAME},
+    {"nV",                  cDISKNAME},
+    {"CV",                  cCOPYPATH},
+    {"sV",                  cSCRIPT},
+    {"cWUlV",               cDISKPATH},
+    {"eWUlXV",              cDISKPATH},
+    {"pdifwuvV0123456789",  cFILENAME},
+    {"apdifwuvV0123456789", cFILENAME},
+    {"RpdifwuvV0123456789", cFILENAME},
+    {NULL,    cNONE}
+  };
+
+  int i;
+  int expect = cNONE;
+  struct file_arg curr_file;
+  int last_file = -1;
+
+  // Display help if no arguments given
+  if(argc == 1)
+  {
+    show_help();
+    return(0);
+  }
+
+  memset(&curr_file, 0, sizeof(struct file_arg));
+  for(i = 1; i < argc; i++)
+  {
+    char *arg = argv[i];
+    if(arg[0] == '-')
+    {
+      // This is an option
+      
+      // Find the set to use
+      struct optionset *set = valid_set;
+      while(set->set != NULL)
+      {
+        // If all option flags are contained in this set, use it
+        if(strspn(&arg[1], set->set) == strlen(arg)-1) break;
+
+        // Check next set
+        set++;
+      }
+
+      // Check for option validity
+      if(expect != cFILENAME ||
+         set->expect != cOUTNAME)
+      {
+        if((set->set == NULL)
+           ||
+           (expect != cNONE && 
+            set->expect != cNONE && 
+            set->expect != expect))
+        {
+          printf("Invalid option \"%s\"\n", arg);
+          if(all_args.verbose)
+          {
+            if(set->set == NULL)      printf("This option does not exist\n");
+            if(set->expect != expect) printf("This option can't be used with other options it's with\n");
+          }
+          return(0);
+        }
+      }
+
+      // Process flags
+      char *op = &arg[1];
+      while(*op)
+      {
+        // Handle mutually exclusive options
+        if(strchr("arxR", *op))
+        {
+          curr_file.add       = 0;
+          curr_file.remove    = 0;
+          curr_file.extract   = 0;
+          curr_file.replace   = 0;
+        }
+        if(strchr("di", *op))
+        {
+          curr_file.ascii     = 0;
+          curr_file.binary    = 0;
+        }
+        if(strchr("fpv", *op))
+        {
+          curr_file.fixed     = 0;
+          curr_file.program   = 0;
+          curr_file.variable  = 0;
+        }
+        if(strchr("uw", *op))
+        {
+          curr_file.unprotect = 0;
+          curr_file.protect   = 0;
+        }
+
+        switch(*op)
+        {
+          case 'a':  curr_file.add          = 1; break;
+          case 'b':  curr_file.basic        = 1; break;
+          case 'c':  all_args.create_new    = 1; break;
+          case 'C':  break;
+          case 'd':  curr_file.ascii        = 1; break;
+          case 'e':  all_args.use_existing  = 1; break;
+          case 'f':  curr_file.fixed        = 1; break;
+          case 'h':  all_args.show_help     = 1; break;
+          case 'i':  curr_file.binary       = 1; break;
+          case 'l':  all_args.list_contents = 1; break;
+          case 'n':  break;
+          case 'o':  break;
+          case 'p':  curr_file.program      = 1; break;
+          case 'r':  curr_file.remove       = 1; break;
+          case 'R':  curr_file.replace      = 1; break;
+          case 's':  break;
+          case 'u':  curr_file.unprotect    = 1; break;
+          case 'U':  all_args.unprotect     = 1; break;
+          case 'v':  curr_file.variable     = 1; break;
+          case 'V':  all_args.verbose++;         break;
+          case 'W':  all_args.protect       = 1; break;
+          case 'w':  curr_file.protect      = 1; break;
+          case 'x':  curr_file.extract      = 1; break;
+          case 'X':  all_args.extract_all   = 1; break;
+
+          default:   printf("Unknown option \"%c\"\n", *op); return(0);
+        }
+
+        op++;
+        // Process record length
+        if(set->expect == cFILENAME)
+        {
+          if((*(op-1) == 'f' || *(op-1) == 'v') && set->expect == cFILENAME)
+          {
+            if(*op < '0' || *op > '9' ||
+               (curr_file.record_size = strtol(op, &op, 10)) == 0)
+            {
+              printf("Unknown option \"%s\"\n", (op-1)); return(0);
+            }
+            if(curr_file.record_size > 254)
+            {
+              printf("Invalid record length %d\n", curr_file.record_size);
+              return(0);
+            }
+          }
+        }
+      }
+      expect = set->expect;
+    }
+    else
+    {
+      // This is a name
+      int i;
+      if(expect == cNONE)
+      {
+        printf("Invalid argument \"%s\"\n", arg);
+        return(0);
+      }
+
+      switch(expect)
+      {
+        case cFILENAME:
+          i = file_arg_for(arg);
+          if(curr_file.add != 0 || curr_file.extract != 0 ||
+             curr_file.replace != 0)
+            last_file = i;
+          memcpy(&all_args.file[i], &curr_file, sizeof(struct file_arg));
+          strncpy(all_args.file[i].file_name, arg,
+                  sizeof(all_args.file[i].file_name) - 1);
+          break;
+          
+        case cOUTNAME:
+          if(last_file == -1)
+          {
+            printf("No file to use for output name \"%s\"\n", arg);
+            return(0);
+          }
+          strncpy(all_args.file[last_file].output_name, arg,
+                  sizeof(all_args.file[last_file].output_name) - 1);
+          last_file = -1;
+          expect = cNONE;
+          memset(&curr_file, 0, sizeof(struct file_arg));
+          break;
+
+        case cDISKPATH:
+          strcpy(all_args.image_path, arg);
+          expect = cNONE;
+          memset(&curr_file, 0, sizeof(struct file_arg));
+          break;
+
+        case cDISKNAME:
+          strncpy(all_args.disk_name, arg, DISK_NAME_LEN);
+          expect = cNONE;
+          memset(&curr_file, 0, sizeof(struct file_arg));
+          break;
+
+        case cCOPYPATH:
+          strncpy(all_args.copy_path, arg, sizeof(all_args.copy_path) - 1);
+          expect = cNONE;
+          memset(&curr_file, 0, sizeof(struct file_arg));
+          break;
+
+        case cSCRIPT:
+          strncpy(all_args.script_path, arg,
+                  sizeof(all_args.script_path) - 1);
+          expect = cNONE;
+          memset(&curr_file, 0, sizeof(struct file_arg));
+          break;
+
+        default:
+          printf("Internal error, unknown name type %d for \"%s\"\n", 
+                 expect, arg);
+          return(0);
+      }
+    }
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                              list_disk
+ *===========================================================================
+ * Desription: List the contents of the disk
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void list_disk()
+{
+  int i;
+  struct vib_block *vib = disk_buffer;
+  uint16_t index[MAX_FILE_COUNT];
+  struct phase_timer timer;
+
+  phase_start(&timer, phase_list);
+  // Dump header
+  printf("Disk Name : %.*s\n", DISK_NAME_LEN, vib->name);
+  printf("Disk Size : %d\n",vib_physrecs(vib) * 256);
+  printf("Protected?: %s\n",(vib->protection == 'P' ? "Yes": "No"));
+  printf("Cylinders : %d\n",vib->cylinders);
+  printf("Heads     : %d\n",vib->heads);
+  printf("Density   : %s\n",(vib->density == 1 ? "FM SD":
+                            (vib->density == 2 ? "MFM DD":
+                            (vib->density == 3 ? "MFM HD": 
+                                                 "Unknown"))));
+
+  printf("\n");
+  printf("Name        Type         WP  Size   Sectors\n");
+  printf("----------  -----------  --  -----  ------\n");
+  // List files
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct fib_block* fib = fib_at(index[i]);
+    if(fib != NULL)
+    {
+      struct cluster_span spans[MAX_CLUSTERS];
+      int span_count = fib_spans(fib, spans);
+      int i;
+
+      // File type
+      printf("%.*s  ", FILE_NAME_LEN, fib->name);
+      if(fib->flags & fib_program)
+      {
+        printf("program      ");
+      }
+      else
+      {
+        if(fib->flags & fib_binary) printf("int/");
+          else printf("dis/");
+        if(fib->flags & fib_var) printf("var");
+          else printf("fix");
+        printf(" %-3d  ", fib->reclen);
+      }
+      
+      // Write protect
+      if(fib->flags & fib_wp) printf("wp  ");
+        else                  printf("    ");
+        
+      // File size
+      printf("%5d  ", fib_file_size(fib));
+
+      // Sector usage
+      for(i=0; i<span_count; i++)
+      {
+        if(spans[i].count > 1)
+        {
+          printf("%d-%d  ", spans[i].first,
+                 spans[i].first + spans[i].count - 1);
+        }
+        else
+        {
+          printf("%d  ", spans[i].first);
+        }
+      }
+      if(span_count < 0) printf("(bad cluster table)");
+      printf("\n");
+    }
+  }
+  phase_stop(&timer);
+}
+
+
+/*
+0: Program/data file indicator 0 = Data file 1 = Program file
+
+1: Binary/ASCII data 0 = ASCII data (DISPLAY file) 1 = Binary data (INTERNAL 
+or program file)
+
+2: Reserved for future data type expansion
+
+3: Protect flag 0 = Not protected 1 = Protected
+
+4-6: Reserved for future expansion
+
+7: FIXED/VARIABLE flag 0 = Fixed length records 1 = Variable length records
+
+Byte 13 contains the number of logical records per AU.
+
+Bytes 14-15 contain the number of logical records allocated on Level 2
+(256 byte records}.
+
+Byte 16 contains the EOF offset within the highest physical AU for variable
+length record files and program files.
+
+Byte 17 contains the logical record size in bytes. In case of variable length
+records, this entry will indicate the maximum allowable record size.
+
+Bytes 18-19 contain the number of records allocated on Level 3, For variable
+length records, this entry is replaced with the number of Level 2 records
+actually used. (NOTE: The bytes in this entry are in reverse order.)
+
+Bytes 20-27 have been reserved for future expansion. They will be fixed to 0
+in this implementation of disk peripheral software.
+
+Bytes 23-255 contain three byte blocks indicating the clusters that have been
+allocated for the file. The first 12 bits in each entry indicate the address of
+the first AU in the cluster . The second 12 bits indicate the highest logical
+record offset in the cluster of contiguous records. This indication has been 
+chosen, rather than the number of data-records in the chain, since it reduces
+the amount of computation required for relative record file access.
+*/
+
+
+/*
+Allocation units
+
+The allocation bitmap in the VIB has room for 1600 bits. Disks of up to 1600
+sectors map one bit to each sector. Larger disks, such as DSHD with 2880
+sectors, map each bit to an AU of several sectors: bit n covers sectors
+n * AU to n * AU + AU - 1. Sectors 0 and 1 (VIB and FDR index) are in the
+first AU, so nothing else is ever allocated from it.
+
+Cluster entries still hold sector numbers, but every FIB and every cluster
+starts on an AU boundary and a file owns the whole AU its last sector is in.
+No two files share an AU. Growing a file first uses the rest of its last
+AU, and an AU is released when its first sector is, which happens only
+when all of its sectors that belong to the file are released.
+*/
+
+
+/*===========================================================================
+ *                            sectors_per_au
+ *===========================================================================
+ * Desription: Number of sectors in an allocation unit. The bitmap has
+ *             room for 1600 AUs, larger disks use AUs of several sectors.
+ *
+ * Parameters: None
+ *
+ * Return:     Sectors per AU
+ */
+int sectors_per_au()
+{
+  int sectors = disk_size / (int)sizeof(struct disk_sector);
+  return(sectors > 1600 ? (sectors + 1599) / 1600 : 1);
+}
+
+
+/*===========================================================================
+ *                              sector_free
+ *===========================================================================
+ * Desription: Check the allocation bitmap for a sector
+ *
+ * Parameters: sector - Sector number
+ *
+ * Return:     Is the AU holding the sector free?
+ */
+int sector_free(int sector)
+{
+  struct vib_block *vib = disk_buffer;
+  int au = sector / sectors_per_au();
+  return((vib->abm[au/8] & (1 << (au % 8))) == 0);
+}
+
+
+/*===========================================================================
+ *                             scratch_free
+ *===========================================================================
+ * Desription: Free the image buffer pool and scratch arena of the calling
+ *             thread, run when a thread that used them exits
+ *
+ * Parameters: unused - Value of scratch_key
+ *
+ * Return:     None
+ */
+void scratch_free(void *unused)
+{
+  struct buffer_pool *pool = &image_pool;
+  struct arena *a = &scratch;
+
+  while(pool->count > 0)
+    free(pool->buffer[--pool->count]);
+  while(a->chunks != NULL)
+  {
+    struct arena_chunk *chunk = a->chunks;
+    a->chunks = chunk->next;
+    free(chunk);
+  }
+  free(a->base);
+  memset(a, 0, sizeof(struct arena));
+}
+
+
+/*===========================================================================
+ *                           scratch_register
+ *===========================================================================
+ * Desription: Arrange for the pool and arena of the calling thread to be
+ *             freed when it exits, done once per thread before either
+ *             holds memory
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void scratch_key_create()
+{
+  pthread_key_create(&scratch_key, scratch_free);
+}
+
+void scratch_register()
+{
+  if(scratch_registered) return;
+  pthread_once(&scratch_once, scratch_key_create);
+  pthread_setspecific(scratch_key, &scratch);
+  scratch_registered = 1;
+}
+
+
+/*===========================================================================
+ *                             image_buffer
+ *===========================================================================
+ * Desription: Get a buffer for a disk image, reusing a spare buffer of the
+ *             same size when the thread has one
+ *
+ * Parameters: size - Size of the image
+ *             zero - Should the buffer be zero-filled?
+ *
+ * Return:     Image buffer, NULL if out of memory
+ */
+void* image_buffer(int size, int zero)
+{
+  struct buffer_pool *pool = &image_pool;
+  void *buffer;
+  int i;
+
+  for(i = pool->count - 1; i >= 0; i--)
+  {
+    if(pool->size[i] != size) continue;
+    buffer = pool->buffer[i];
+    pool->count--;
+    memmove(&pool->buffer[i], &pool->buffer[i + 1],
+            (pool->count - i) * sizeof(void*));
+    memmove(&pool->size[i], &pool->size[i + 1],
+            (pool->count - i) * sizeof(int));
+    if(zero) memset(buffer, 0, size);
+    return(buffer);
+  }
+  return(zero ? calloc(1, size) : malloc(size));
+}
+
+
+/*===========================================================================
+ *                           image_buffer_put
+ *===========================================================================
+ * Desription: Keep an image buffer for reuse, the oldest spare buffer is
+ *             freed if the pool is full
+ *
+ * Parameters: buffer - Image buffer, may be NULL
+ *             size   - Size of the buffer
+ *
+ * Return:     None
+ */
+void image_buffer_put(void *buffer, int size)
+{
+  struct buffer_pool *pool = &image_pool;
+
+  if(buffer == NULL) return;
+  scratch_register();
+  if(pool->count == POOL_BUFFERS)
+  {
+    free(pool->buffer[0]);
+    pool->count--;
+    memmove(&pool->buffer[0], &pool->buffer[1], pool->count * sizeof(void*));
+    memmove(&pool->size[0], &pool->size[1], pool->count * sizeof(int));
+  }
+  pool->buffer[pool->count] = buffer;
+  pool->size[pool->count] = size;
+  pool->count++;
+}
+
+
+/*===========================================================================
+ *                             arena_reset
+ *===========================================================================
+ * Desription: Take back all scratch space of the thread, growing the block
+ *             if the space used since the last reset did not fit in it
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void arena_reset()
+{
+  struct arena *a = &scratch;
+
+  while(a->chunks != NULL)
+  {
+    struct arena_chunk *chunk = a->chunks;
+    a->chunks = chunk->next;
+    free(chunk);
+  }
+  if(a->peak > a->size)
+  {
+    size_t size = a->size ? 2 * a->size : ARENA_MIN_SIZE;
+    while(size < a->peak) size *= 2;
+    free(a->base);
+    a->base = malloc(size);
+    a->size = a->base != NULL ? size : 0;
+  }
+  a->used = 0;
+  a->overflow = 0;
+  a->peak = 0;
+}
+
+
+/*===========================================================================
+ *                             arena_alloc
+ *===========================================================================
+ * Desription: Take scratch space for the current image. The space lasts
+ *             until the image is released or the arena is rewound.
+ *
+ * Parameters: size - Bytes needed
+ *
+ * Return:     Scratch space, 16 byte aligned, NULL if out of memory
+ */
+void* arena_alloc(size_t size)
+{
+  struct arena *a = &scratch;
+  struct arena_chunk *chunk;
+  void *p;
+
+  scratch_register();
+  size = size ? (size + 15) & ~(size_t)15 : 16;
+  if(a->chunks == NULL && a->used + size <= a->size)
+  {
+    // Space in the block
+    p = &a->base[a->used];
+    a->used += size;
+  }
+  else
+  {
+    // Once the block is full everything goes in overflow chunks, so space
+    // is always taken back newest first
+    size_t header = (sizeof(struct arena_chunk) + 15) & ~(size_t)15;
+    chunk = malloc(header + size);
+    if(chunk == NULL) return(NULL);
+    chunk->next = a->chunks;
+    chunk->size = size;
+    a->chunks = chunk;
+    a->overflow += size;
+    p = (unsigned char*)chunk + header;
+  }
+  if(a->used + a->overflow > a->peak) a->peak = a->used + a->overflow;
+  return(p);
+}
+
+
+/*===========================================================================
+ *                       arena_mark / arena_rewind
+ *===========================================================================
+ * Desription: Note how much scratch space is in use, then take back all
+ *             space handed out since. Rewinding to an empty arena resets
+ *             it.
+ *
+ * Parameters: mark - Value returned by arena_mark
+ *
+ * Return:     arena_mark: Mark for arena_rewind
+ */
+size_t arena_mark()
+{
+  return(scratch.used + scratch.overflow);
+}
+
+void arena_rewind(size_t mark)
+{
+  struct arena *a = &scratch;
+
+  if(mark == 0)
+  {
+    arena_reset();
+    return;
+  }
+  while(a->chunks != NULL &&
+        a->used + a->overflow - a->chunks->size >= mark)
+  {
+    struct arena_chunk *chunk = a->chunks;
+    a->chunks = chunk->next;
+    a->overflow -= chunk->size;
+    free(chunk);
+  }
+  if(a->chunks == NULL && mark < a->used) a->used = mark;
+}
+
+
+/*===========================================================================
+ *                             mark_sector
+ *===========================================================================
+ * Desription: Set sector usage in the allocation bitmap
+ *
+ * Parameters: sector - Sector number to mark
+ *             used   - Is this sector used?
+ *
+ * Return:     None
+ */
+void mark_sector(int sector, int used)
+{
+  struct vib_block *vib = disk_buffer;
+  int au = sector / sectors_per_au();
+  if(used)
+  {
+    vib->abm[au/8] |= 1 <<(au%8);
+  }
+  else if(sector % sectors_per_au() == 0)
+  {
+    // An AU is freed with its first sector. A file owns whole AUs and its
+    // sectors are released as whole spans or as its tail, so the rest of
+    // the AU is released along with the first sector, whatever the order
+    vib->abm[au/8] &= ~(1 <<(au%8));
+  }
+}
+
+
+/*===========================================================================
+ *                             create_disk
+ *===========================================================================
+ * Desription: Create a new disk image in memory
+ *
+ * Parameters: layout - geometry_* layout of the disk
+ *
+ * Return:     None
+ */
+void create_disk(int layout)
+{
+  int i;
+  struct vib_block *vib;
+  struct geometry *g = &geometries[layout];
+
+  // Any image still in memory goes back to the pool
+  image_buffer_put(disk_buffer, disk_size);
+  disk_size = g->sectors * SECTOR_SIZE;
+  disk_buffer = image_buffer(disk_size, 1);
+
+  // Format disk
+  vib = (struct vib_block*)disk_buffer;
+  make_name(vib->name, "", DISK_NAME_LEN);
+  vib_set_physrecs(vib, g->sectors);
+  vib->secspertrack = g->secspertrack;
+  memcpy(vib->id, "DSK", 3);
+  vib->cylinders    = g->cylinders;
+  vib->heads        = g->heads;
+  vib->density      = g->density;
+
+  // Set allocation bitmap
+  memset(&vib->abm[0], 0xFF, sizeof(vib->abm));
+  for(i = 2; i < disk_size / sizeof(struct disk_sector); i++)
+  {
+    mark_sector(i, 0);
+  }
+}
+
+
+/*===========================================================================
+ *                             sector_is_zero
+ *===========================================================================
+ * Desription: Check whether every byte of a sector is zero
+ *
+ * Parameters: data - Sector contents
+ *
+ * Return:     Is the sector blank?
+ */
+int sector_is_zero(const void *data)
+{
+  int i;
+#ifdef __SSE2__
+  const __m128i *p = data;
+  __m128i acc = _mm_loadu_si128(&p[0]);
+  for(i = 1; i < SECTOR_SIZE / 16; i++)
+    acc = _mm_or_si128(acc, _mm_loadu_si128(&p[i]));
+  return(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) ==
+         0xFFFF);
+#else
+  const unsigned char *p = data;
+  uint64_t acc = 0;
+  for(i = 0; i < SECTOR_SIZE; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, &p[i], sizeof(word));
+    acc |= word;
+  }
+  return(acc == 0);
+#endif
+}
+
+
+/*===========================================================================
+ *                             sector_equal
+ *===========================================================================
+ * Desription: Compare two sectors
+ *
+ * Parameters: a, b - Sector contents
+ *
+ * Return:     Do the sectors hold the same bytes?
+ */
+int sector_equal(const void *a, const void *b)
+{
+  int i;
+#ifdef __SSE2__
+  const __m128i *pa = a;
+  const __m128i *pb = b;
+  __m128i acc = _mm_xor_si128(_mm_loadu_si128(&pa[0]),
+                              _mm_loadu_si128(&pb[0]));
+  for(i = 1; i < SECTOR_SIZE / 16; i++)
+    acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128(&pa[i]),
+                                          _mm_loadu_si128(&pb[i])));
+  return(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) ==
+         0xFFFF);
+#else
+  const unsigned char *pa = a;
+  const unsigned char *pb = b;
+  uint64_t acc = 0;
+  for(i = 0; i < SECTOR_SIZE; i += 8)
+  {
+    uint64_t wa, wb;
+    memcpy(&wa, &pa[i], sizeof(wa));
+    memcpy(&wb, &pb[i], sizeof(wb));
+    acc |= wa ^ wb;
+  }
+  return(acc == 0);
+#endif
+}
+
+
+/*===========================================================================
+ *                           container_release
+ *===========================================================================
+ * Desription: Drop the mapping of the container the image came from,
+ *             decompressing any blocks still pending first
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void container_release()
+{
+  struct container *c = &image_container;
+  int i;
+
+  if(c->file == NULL) return;
+  for(i = 0; i < c->block_count; i++)
+  {
+    if(c->pending[i]) container_load_block(i);
+  }
+  if(c->mapped) munmap(c->file, c->file_size);
+  else          free(c->file);
+  memset(c, 0, sizeof(struct container));
+}
+
+
+/*===========================================================================
+ *                             release_disk
+ *===========================================================================
+ * Desription: Release the disk image in memory and any container mapping.
+ *             The image buffer goes back to the pool and the scratch
+ *             arena is reset, ready for the next image.
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void release_disk()
+{
+  struct container *c = &image_container;
+  if(c->file != NULL)
+  {
+    if(c->mapped) munmap(c->file, c->file_size);
+    else          free(c->file);
+    memset(c, 0, sizeof(struct container));
+  }
+  image_buffer_put(disk_buffer, disk_size);
+  arena_reset();
+  disk_buffer = NULL;
+  disk_size = 0;
+}
+
+
+/*===========================================================================
+ *                           attach_container
+ *===========================================================================
+ * Desription: Use container file contents as the current image
+ *
+ *             Only the block holding the VIB and FDR index is
+ *             decompressed here, other blocks are decompressed by
+ *             get_sector() the first time they are used.
+ *
+ * Parameters: file     - Container file contents, owned by the image from
+ *                        now on
+ *             size     - Size of the container file
+ *             mapped   - Are the contents mapped rather than allocated?
+ *             filename - Name of the container file
+ *
+ * Return:     Was the container opened correctly?
+ */
+int attach_container(unsigned char *file, off_t size, int mapped,
+                     char *filename)
+{
+  struct container *c = &image_container;
+  int block_sectors;
+  int i;
+
+  // Check the header and block index
+  c->file = file;
+  c->file_size = size;
+  c->mapped = mapped;
+  c->block_count = 0;
+  if(size >= CONTAINER_HEADER_SIZE)
+  {
+    disk_size = load_le32(&file[4]);
+    block_sectors = file[8] | (file[9] << 8);
+    c->block_count = load_le32(&file[12]);
+  }
+  if(size < CONTAINER_HEADER_SIZE ||
+     disk_size < 2 * SECTOR_SIZE || disk_size % SECTOR_SIZE != 0 ||
+     block_sectors != CONTAINER_BLOCK_SECTORS ||
+     c->block_count != (disk_size + CONTAINER_BLOCK_SIZE - 1) /
+                       CONTAINER_BLOCK_SIZE ||
+     CONTAINER_HEADER_SIZE + (off_t)c->block_count * 8 > size)
+  {
+    printf("%s is not a valid compressed disk image\n", filename);
+    release_disk();
+    return(0);
+  }
+  for(i = 0; i < c->block_count; i++)
+  {
+    unsigned char *entry = &file[CONTAINER_HEADER_SIZE + i * 8];
+    if((off_t)load_le32(&entry[0]) + load_le32(&entry[4]) > size ||
+       load_le32(&entry[4]) > CONTAINER_BLOCK_SIZE)
+    {
+      printf("%s is not a valid compressed disk image\n", filename);
+      release_disk();
+      return(0);
+    }
+  }
+
+  c->pending = arena_alloc(c->block_count);
+  memset(c->pending, 1, c->block_count);
+  disk_buffer = image_buffer(disk_size, 1);
+  disk_format = format_dkz;
+
+  // Confirm this is a valid image
+  struct vib_block *vib = (struct vib_block*)get_sector(BLOCK_VIB);
+  if(vib->id[0] != 'D' ||
+     vib->id[1] != 'S' ||
+     vib->id[2] != 'K')
+  {
+    printf("%s is not a V9T9 disk image\n", filename);
+    return(0);
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                            load_container
+ *===========================================================================
+ * Desription: Open a compressed container image file
+ *
+ * Parameters: fd       - Open container file
+ *             size     - Size of the container file
+ *             filename - Name of the container file
+ *
+ * Return:     Was the container opened correctly?
+ */
+int load_container(int fd, off_t size, char *filename)
+{
+  unsigned char *file;
+
+  file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(file == MAP_FAILED)
+  {
+    printf("Cannot read disk image \"%s\"\n", filename);
+    return(0);
+  }
+  return(attach_container(file, size, 1, filename));
+}
+
+
+// Work shared by the container compression threads. Each block is
+// compressed into its own slot of the output, at the offset it would have
+// uncompressed, and its size goes in the block index.
+struct compress_job
+{
+  unsigned char *data;       // Image being compressed
+  int size;                  // Size of the image
+  int next_block;            // Next block to be claimed by a thread
+  int block_count;           // Number of blocks in the image
+  unsigned char *output;     // Container being written
+  pthread_mutex_t lock;
+};
+
+
+/*===========================================================================
+ *                            compress_blocks
+ *===========================================================================
+ * Desription: Thread body compressing container blocks until none remain
+ *
+ * Parameters: arg - Shared compression job
+ *
+ * Return:     None
+ */
+void* compress_blocks(void *arg)
+{
+  struct compress_job *job = arg;
+  unsigned char *data = job->data;
+
+  for(;;)
+  {
+    unsigned char *slot;
+    int block;
+    int raw;
+    int secno;
+    int blank = 1;
+    int size = 0;
+
+    pthread_mutex_lock(&job->lock);
+    block = job->next_block++;
+    pthread_mutex_unlock(&job->lock);
+    if(block >= job->block_count) break;
+
+    raw = job->size - block * CONTAINER_BLOCK_SIZE;
+    if(raw > CONTAINER_BLOCK_SIZE) raw = CONTAINER_BLOCK_SIZE;
+    for(secno = 0; blank && secno < raw / SECTOR_SIZE; secno++)
+      blank = sector_is_zero(&data[block * CONTAINER_BLOCK_SIZE +
+                                   secno * SECTOR_SIZE]);
+
+    // Blank blocks take no space, incompressible blocks are stored
+    slot = &job->output[CONTAINER_HEADER_SIZE + job->block_count * 8 +
+                        block * CONTAINER_BLOCK_SIZE];
+    if(!blank)
+    {
+      TRACE_BEGIN(trace_compress_block, block);
+      size = lz_compress(&data[block * CONTAINER_BLOCK_SIZE], raw, slot,
+                         raw - 1);
+      if(size == 0)
+      {
+        memcpy(slot, &data[block * CONTAINER_BLOCK_SIZE], raw);
+        size = raw;
+      }
+      TRACE_END(trace_compress_block, size);
+    }
+    store_le32(&job->output[CONTAINER_HEADER_SIZE + block * 8 + 4], size);
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                           write_host_file
+ *===========================================================================
+ * Desription: Write a whole host file from memory
+ *
+ * Parameters: filename - File to write
+ *             data     - File contents
+ *             size     - Size of file contents
+ *
+ * Return:     Was the file written?
+ */
+int write_host_file(char *filename, unsigned char *data, size_t size)
+{
+  size_t done = 0;
+  int ok = 1;
+  int fd;
+
+  // Written straight from memory, no stdio buffer
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0) return(0);
+  while(ok && done < size)
+  {
+    ssize_t wrote = write(fd, &data[done], size - done);
+    if(wrote > 0) done += wrote;
+    else if(wrote < 0 && errno == EINTR) continue;
+    else ok = 0;
+  }
+  if(close(fd) != 0) ok = 0;
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                           container_bound
+ *===========================================================================
+ * Desription: Most bytes the container of the disk image in memory can
+ *             take, the header and block index plus every block stored
+ *
+ * Parameters: None
+ *
+ * Return:     Size of buffer needed by encode_container
+ */
+size_t container_bound()
+{
+  int block_count = (disk_size + CONTAINER_BLOCK_SIZE - 1) /
+                    CONTAINER_BLOCK_SIZE;
+  return(CONTAINER_HEADER_SIZE + (size_t)block_count * 8 + disk_size);
+}
+
+
+/*===========================================================================
+ *                           encode_container
+ *===========================================================================
+ * Desription: Compress the disk image in memory into a container
+ *
+ * Parameters: out     - Receives the container, container_bound() bytes
+ *             threads - Most threads to compress blocks on
+ *
+ * Return:     Size of the container
+ */
+size_t encode_container(unsigned char *out, int threads)
+{
+  struct compress_job job;
+  pthread_t pool[16];
+  int thread_count;
+  unsigned char *index = &out[CONTAINER_HEADER_SIZE];
+  size_t offset;
+  int i;
+
+  // Compress blocks on the threads allowed
+  memset(&job, 0, sizeof(job));
+  job.data = disk_buffer;
+  job.size = disk_size;
+  job.block_count = (disk_size + CONTAINER_BLOCK_SIZE - 1) /
+                    CONTAINER_BLOCK_SIZE;
+  job.output = out;
+  pthread_mutex_init(&job.lock, NULL);
+  thread_count = threads - 1;
+  if(thread_count > 16) thread_count = 16;
+  if(thread_count > job.block_count / 8) thread_count = job.block_count / 8;
+  for(i = 0; i < thread_count; i++)
+  {
+    if(pthread_create(&pool[i], NULL, compress_blocks, &job) != 0) break;
+  }
+  thread_count = i;
+  compress_blocks(&job);
+  for(i = 0; i < thread_count; i++)
+    pthread_join(pool[i], NULL);
+  pthread_mutex_destroy(&job.lock);
+
+  // Header, block index, then the blocks moved down from their slots
+  memcpy(&out[0], CONTAINER_MAGIC, 4);
+  store_le32(&out[4], disk_size);
+  store_le16(&out[8], CONTAINER_BLOCK_SECTORS);
+  store_le16(&out[10], 0);
+  store_le32(&out[12], job.block_count);
+  offset = CONTAINER_HEADER_SIZE + job.block_count * 8;
+  for(i = 0; i < job.block_count; i++)
+  {
+    uint32_t size = load_le32(&index[i * 8 + 4]);
+    store_le32(&index[i * 8], size ? offset : 0);
+    memmove(&out[offset], &out[CONTAINER_HEADER_SIZE + job.block_count * 8 +
+                               (size_t)i * CONTAINER_BLOCK_SIZE], size);
+    offset += size;
+  }
+  return(offset);
+}
+
+
+/*===========================================================================
+ *                            save_container
+ *===========================================================================
+ * Desription: Save the disk image in memory as a compressed container
+ *
+ * Parameters: filename - File used to store disk image
+ *
+ * Return:     Was disk image stored correctly?
+ */
+int save_container(char *filename)
+{
+  size_t mark = arena_mark();
+  unsigned char *data;
+  size_t size;
+  int ok;
+
+  // Compress blocks on all available processors
+  data = arena_alloc(container_bound());
+  size = encode_container(data, sysconf(_SC_NPROCESSORS_ONLN));
+  TRACE_BEGIN(trace_save_write, 0);
+  ok = write_host_file(filename, data, size);
+  TRACE_END(trace_save_write, disk_size / SECTOR_SIZE);
+  if(!ok)
+    printf("Cannot save disk file \"%s\"\n", filename);
+  stats.sectors_written += disk_size / SECTOR_SIZE;
+  arena_rewind(mark);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                            write_sectors
+ *===========================================================================
+ * Desription: Write a V9T9 sector dump
+ *
+ *             Runs of blank sectors are skipped so they become holes in
+ *             the output file. Outputs that cannot hold holes (pipes,
+ *             devices) are written in full.
+ *
+ * Parameters: filename - File used to store disk image
+ *             data     - Sectors to write
+ *             size     - Size of the image
+ *
+ * Return:     Was disk image stored correctly?
+ */
+int write_sectors(char *filename, unsigned char *data, int size)
+{
+  int fd;
+  struct stat info;
+  int sectors = size / SECTOR_SIZE;
+  int secno = 0;
+  int ok = 1;
+
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+  {
+    printf("Cannot save disk file \"%s\"\n", filename);
+    return(0);
+  }
+
+  if(fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+  {
+    // Holes are not possible, write the whole image
+    TRACE_BEGIN(trace_save_write, 0);
+    ok = (write(fd, data, size) == size);
+    TRACE_END(trace_save_write, sectors);
+    stats.sectors_written += sectors;
+  }
+  else
+  {
+    while(ok && secno < sectors)
+    {
+      int first;
+
+      // Skip blank sectors, then write the following run of data sectors
+      while(secno < sectors && sector_is_zero(&data[secno * SECTOR_SIZE]))
+        secno++;
+      first = secno;
+      while(secno < sectors && !sector_is_zero(&data[secno * SECTOR_SIZE]))
+        secno++;
+      if(secno > first)
+      {
+        ssize_t length = (ssize_t)(secno - first) * SECTOR_SIZE;
+        stats.sectors_written += secno - first;
+        TRACE_BEGIN(trace_save_write, first);
+        ok = (pwrite(fd, &data[first * SECTOR_SIZE], length,
+                     (off_t)first * SECTOR_SIZE) == length);
+        TRACE_END(trace_save_write, secno - first);
+      }
+    }
+
+    // Bytes after the last whole sector, then extend the file over any
+    // trailing hole
+    if(ok && size % SECTOR_SIZE)
+    {
+      ssize_t tail = size % SECTOR_SIZE;
+      ok = (pwrite(fd, &data[sectors * SECTOR_SIZE], tail,
+                   (off_t)sectors * SECTOR_SIZE) == tail);
+    }
+    if(ok) ok = (ftruncate(fd, size) == 0);
+  }
+
+  if(close(fd) != 0) ok = 0;
+  if(!ok)
+  {
+    printf("Cannot save disk file \"%s\"\n", filename);
+    return(0);
+  }
+
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             save_v9t9
+ *===========================================================================
+ * Desription: Save the disk image in memory as a V9T9 sector dump
+ *
+ * Parameters: filename - File used to store disk image
+ *
+ * Return:     Was disk image stored correctly?
+ */
+int save_v9t9(char *filename)
+{
+  return(write_sectors(filename, disk_buffer, disk_size));
+}
+
+
+// CRC-CCITT (polynomial 0x1021) of a byte shifted into the high end of the
+// CRC. The entry for x = i ^ (i >> 4) reduces to three shifts, so the
+// compiler builds the whole table.
+#define CRC_X(i)   ((i) ^ ((i) >> 4))
+#define CRC_E(i)   ((uint16_t)((CRC_X(i) << 12) ^ (CRC_X(i) << 5) ^ CRC_X(i)))
+#define CRC_4(i)   CRC_E(i), CRC_E(i + 1), CRC_E(i + 2), CRC_E(i + 3)
+#define CRC_16(i)  CRC_4(i), CRC_4(i + 4), CRC_4(i + 8), CRC_4(i + 12)
+#define CRC_64(i)  CRC_16(i), CRC_16(i + 16), CRC_16(i + 32), CRC_16(i + 48)
+static const uint16_t crc_table[256] =
+{
+  CRC_64(0), CRC_64(64), CRC_64(128), CRC_64(192)
+};
+
+static const unsigned char fm_order[9] = {0, 7, 5, 3, 1, 8, 6, 4, 2};
+static const unsigned char mfm_order[18] =
+{
+  0, 11, 4, 15, 8, 1, 12, 5, 16, 9, 2, 13, 6, 17, 10, 3, 14, 7
+};
+
+static const struct track_format track_formats[2] =
+{
+  {PC99_FM_TRACK,   9, 0, 0xFF, 16,  6, 11, 45, fm_order},
+  {PC99_MFM_TRACK, 18, 3, 0x4E, 40, 12, 22, 24, mfm_order}
+};
+
+
+/*===========================================================================
+ *                              crc_update
+ *===========================================================================
+ * Desription: Add a byte to a CRC-CCITT
+ *
+ * Parameters: crc  - CRC so far
+ *             byte - Next byte
+ *
+ * Return:     Updated CRC
+ */
+static inline uint16_t crc_update(uint16_t crc, unsigned char byte)
+{
+  return((uint16_t)(crc << 8) ^ crc_table[(crc >> 8) ^ byte]);
+}
+
+
+/*===========================================================================
+ *                            pc99_sector
+ *===========================================================================
+ * Desription: Map a physical sector to its place in the sector dump. Side
+ *             1 is numbered from the last cylinder back to the first.
+ *
+ * Parameters: tf       - Track layout
+ *             cylinder - Cylinder of the sector
+ *             head     - Side of the sector
+ *             sector   - Sector number on the track
+ *
+ * Return:     Logical sector number
+ */
+int pc99_sector(const struct track_format *tf, int cylinder, int head,
+                int sector)
+{
+  if(head == 0) return(cylinder * tf->sectors + sector);
+  return((2 * PC99_CYLINDERS - 1 - cylinder) * tf->sectors + sector);
+}
+
+
+/*===========================================================================
+ *                           pc99_read_track
+ *===========================================================================
+ * Desription: Decode one track in a single pass, checking the CRC of each
+ *             ID and data field and copying the data into the disk buffer
+ *
+ * Parameters: tf       - Track layout
+ *             track    - Track contents
+ *             cylinder - Cylinder of the track
+ *             head     - Side of the track
+ *
+ * Return:     Number of different sectors read, -1 if a CRC is wrong
+ */
+int pc99_read_track(const struct track_format *tf, const unsigned char *track,
+                    int cylinder, int head)
+{
+  unsigned char *data = disk_buffer;
+  uint16_t preset = 0xFFFF;
+  uint64_t seen = 0;
+  int sector = -1;
+  int found = 0;
+  int i;
+
+  // MFM CRCs start with the 0xA1 sync marks
+  for(i = 0; i < tf->marks; i++) preset = crc_update(preset, 0xA1);
+
+  for(i = 1; i < tf->track_size; i++)
+  {
+    unsigned char mark = track[i];
+    unsigned char prior = track[i - 1];
+    uint16_t crc;
+    int j;
+
+    if(prior != (tf->marks ? 0xA1 : 0x00)) continue;
+    if(mark == 0xFE && i + 7 <= tf->track_size)
+    {
+      // ID field: cylinder, head, sector, size code, CRC
+      crc = crc_update(preset, mark);
+      for(j = 1; j <= 4; j++) crc = crc_update(crc, track[i + j]);
+      if(crc != load_be16(&track[i + 5])) return(-1);
+      sector = (track[i + 3] < tf->sectors && track[i + 1] == cylinder &&
+                track[i + 2] == head) ? track[i + 3] : -1;
+      i += 6;
+    }
+    else if((mark == 0xFB || mark == 0xF8) && sector >= 0 &&
+            i + 259 <= tf->track_size)
+    {
+      // Data field follows the ID field it belongs to
+      unsigned char *out = &data[pc99_sector(tf, cylinder, head, sector) *
+                                 SECTOR_SIZE];
+      crc = crc_update(preset, mark);
+      for(j = 0; j < SECTOR_SIZE; j++)
+      {
+        out[j] = track[i + 1 + j];
+        crc = crc_update(crc, out[j]);
+      }
+      if(crc != load_be16(&track[i + 1 + SECTOR_SIZE])) return(-1);
+      if(!(seen & (1ull << sector))) found++;
+      seen |= 1ull << sector;
+      sector = -1;
+      i += SECTOR_SIZE + 2;
+    }
+  }
+  return(found);
+}
+
+
+/*===========================================================================
+ *                           pc99_write_track
+ *===========================================================================
+ * Desription: Encode one track of the disk buffer in a single pass
+ *
+ * Parameters: tf       - Track layout
+ *             track    - Receives the track contents
+ *             cylinder - Cylinder of the track
+ *             head     - Side of the track
+ *
+ * Return:     None
+ */
+void pc99_write_track(const struct track_format *tf, unsigned char *track,
+                      int cylinder, int head)
+{
+  unsigned char *data = disk_buffer;
+  uint16_t preset = 0xFFFF;
+  int pos = 0;
+  int slot;
+  int i;
+
+  for(i = 0; i < tf->marks; i++) preset = crc_update(preset, 0xA1);
+  memset(track, tf->fill, tf->track_size);
+  pos = tf->gap1;
+
+  for(slot = 0; slot < tf->sectors; slot++)
+  {
+    int sector = tf->order[slot];
+    unsigned char *in = &data[pc99_sector(tf, cylinder, head, sector) *
+                              SECTOR_SIZE];
+    uint16_t crc;
+
+    // ID field
+    memset(&track[pos], 0x00, tf->sync);
+    pos += tf->sync;
+    memset(&track[pos], 0xA1, tf->marks);
+    pos += tf->marks;
+    track[pos++] = 0xFE;
+    track[pos++] = cylinder;
+    track[pos++] = head;
+    track[pos++] = sector;
+    track[pos++] = 1;
+    crc = preset;
+    for(i = pos - 5; i < pos; i++) crc = crc_update(crc, track[i]);
+    store_be16(&track[pos], crc);
+    pos += 2 + tf->gap2;
+
+    // Data field
+    memset(&track[pos], 0x00, tf->sync);
+    pos += tf->sync;
+    memset(&track[pos], 0xA1, tf->marks);
+    pos += tf->marks;
+    track[pos++] = 0xFB;
+    crc = crc_update(preset, 0xFB);
+    for(i = 0; i < SECTOR_SIZE; i++)
+    {
+      track[pos++] = in[i];
+      crc = crc_update(crc, in[i]);
+    }
+    store_be16(&track[pos], crc);
+    pos += 2 + tf->gap3;
+  }
+}
+
+
+/*===========================================================================
+ *                            pc99_layout
+ *===========================================================================
+ * Desription: Find the track layout of a PC99 image from its size
+ *
+ * Parameters: size  - Size of the image file
+ *             heads - Receives the number of sides
+ *
+ * Return:     Track layout, NULL if the size does not fit PC99
+ */
+const struct track_format* pc99_layout(off_t size, int *heads)
+{
+  int i;
+  for(i = 0; i < 2; i++)
+  {
+    const struct track_format *tf = &track_formats[i];
+    if(size == (off_t)tf->track_size * PC99_CYLINDERS ||
+       size == (off_t)tf->track_size * PC99_CYLINDERS * 2)
+    {
+      *heads = size / ((off_t)tf->track_size * PC99_CYLINDERS);
+      return(tf);
+    }
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                             decode_pc99
+ *===========================================================================
+ * Desription: Decode a PC99 track image held in memory into a new disk
+ *             buffer, one track at a time. Tracks are stored side 0
+ *             cylinders 0-39, then side 1.
+ *
+ * Parameters: file     - Image contents
+ *             tf       - Track layout
+ *             heads    - Number of sides
+ *             filename - Image name used in messages
+ *
+ * Return:     Was the image decoded?
+ */
+int decode_pc99(const unsigned char *file, const struct track_format *tf,
+                int heads, char *filename)
+{
+  int head;
+  int cylinder;
+
+  disk_size = heads * PC99_CYLINDERS * tf->sectors * SECTOR_SIZE;
+  disk_buffer = image_buffer(disk_size, 1);
+  if(disk_buffer == NULL) return(0);
+
+  for(head = 0; head < heads; head++)
+  {
+    for(cylinder = 0; cylinder < PC99_CYLINDERS; cylinder++)
+    {
+      const unsigned char *track = &file[((size_t)head * PC99_CYLINDERS +
+                                          cylinder) * tf->track_size];
+      int found = pc99_read_track(tf, track, cylinder, head);
+      if(found < 0)
+      {
+        printf("%s: CRC error on side %d track %d\n", filename, head,
+               cylinder);
+        return(0);
+      }
+      if(found != tf->sectors)
+      {
+        printf("%s: %d sectors missing on side %d track %d\n", filename,
+               tf->sectors - found, head, cylinder);
+        return(0);
+      }
+      stats.sectors_read += found;
+    }
+  }
+  disk_format = format_pc99;
+  return(1);
+}
+
+
+/*===========================================================================
+ *                              load_pc99
+ *===========================================================================
+ * Desription: Read a PC99 track image file
+ *
+ * Parameters: fd       - Open image file
+ *             size     - Size of the image file
+ *             tf       - Track layout
+ *             heads    - Number of sides
+ *             filename - Image name used in messages
+ *
+ * Return:     Was the image read?
+ */
+int load_pc99(int fd, off_t size, const struct track_format *tf, int heads,
+              char *filename)
+{
+  unsigned char *file;
+  int ok;
+
+  file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(file == MAP_FAILED)
+  {
+    printf("Cannot read disk image \"%s\"\n", filename);
+    return(0);
+  }
+  madvise(file, size, MADV_SEQUENTIAL);
+  ok = decode_pc99(file, tf, heads, filename);
+  munmap(file, size);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                             encode_pc99
+ *===========================================================================
+ * Desription: Encode the disk buffer as a PC99 track image. 9 sectors per
+ *             track are written single density, 18 double density.
+ *
+ * Parameters: out - Receives the image contents, NULL to only find the
+ *                   size of the image
+ *
+ * Return:     Size of the image, 0 if the disk does not fit PC99
+ */
+size_t encode_pc99(unsigned char *out)
+{
+  const struct track_format *tf;
+  int sectors = disk_size / SECTOR_SIZE;
+  int heads;
+  int head;
+  int cylinder;
+
+  if(sectors == 360 || sectors == 720)  tf = &track_formats[0];
+  else if(sectors == 1440)              tf = &track_formats[1];
+  else return(0);
+  heads = sectors / (tf->sectors * PC99_CYLINDERS);
+
+  for(head = 0; out != NULL && head < heads; head++)
+  {
+    for(cylinder = 0; cylinder < PC99_CYLINDERS; cylinder++)
+    {
+      pc99_write_track(tf, &out[((size_t)head * PC99_CYLINDERS +
+                                 cylinder) * tf->track_size],
+                       cylinder, head);
+    }
+  }
+  return((size_t)heads * PC99_CYLINDERS * tf->track_size);
+}
+
+
+/*===========================================================================
+ *                              save_pc99
+ *===========================================================================
+ * Desription: Save the disk buffer as a PC99 track image
+ *
+ * Parameters: filename - File to write
+ *
+ * Return:     Was the image written?
+ */
+int save_pc99(char *filename)
+{
+  size_t mark = arena_mark();
+  size_t size = encode_pc99(NULL);
+  unsigned char *data;
+  int ok;
+
+  if(size == 0)
+  {
+    printf("Cannot save \"%s\", PC99 images hold SSSD, DSSD or DSDD disks\n",
+           filename);
+    return(0);
+  }
+  data = arena_alloc(size);
+  encode_pc99(data);
+  TRACE_BEGIN(trace_save_write, 0);
+  ok = write_host_file(filename, data, size);
+  TRACE_END(trace_save_write, disk_size / SECTOR_SIZE);
+  if(!ok) printf("Cannot save disk file \"%s\"\n", filename);
+  stats.sectors_written += disk_size / SECTOR_SIZE;
+  arena_rewind(mark);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                          pack_table_sectors
+ *===========================================================================
+ * Desription: Sectors taken by the tables of a pack
+ *
+ * Parameters: count - Number of images in the pack
+ *
+ * Return:     Sectors of the offset table, or of both tables
+ */
+static inline size_t pack_offset_sectors(int count)
+{
+  return(((size_t)count * 8 + SECTOR_SIZE - 1) / SECTOR_SIZE);
+}
+
+static inline size_t pack_table_sectors(int count)
+{
+  return(pack_offset_sectors(count) +
+         ((size_t)count * PACK_ENTRY_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE);
+}
+
+
+/*===========================================================================
+ *                              pack_split
+ *===========================================================================
+ * Desription: Split the address of an image inside a pack, such as
+ *             "archive.dkp:GAMES1", into the pack file and image name
+ *
+ * Parameters: address - Image address or ordinary file name
+ *             pack    - Receives the pack file name
+ *             size    - Size of pack
+ *
+ * Return:     Image name within address, NULL if address is not in a pack
+ */
+char* pack_split(char *address, char *pack, int size)
+{
+  char *p;
+  for(p = address; (p = strchr(p, ':')) != NULL; p++)
+  {
+    if(p - address >= 4 && strncasecmp(p - 4, ".dkp", 4) == 0 &&
+       p - address < size)
+    {
+      memcpy(pack, address, p - address);
+      pack[p - address] = 0;
+      return(p + 1);
+    }
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                              pack_open
+ *===========================================================================
+ * Desription: Map a pack for this thread, reusing the mapping while the
+ *             pack's header still matches it
+ *
+ *             The pack is mapped shared, so an update made through
+ *             pack_append() shows in the header and the pack is mapped
+ *             again on the next use.
+ *
+ * Parameters: path - Pack file
+ *
+ * Return:     Is the pack mapped?
+ */
+int pack_open(char *path)
+{
+  struct pack_map *m = &pack_map;
+  struct stat info;
+  int fd;
+
+  if(m->data != NULL && strcmp(m->path, path) == 0 &&
+     load_le32(&m->data[4]) == (uint32_t)m->count &&
+     load_le32(&m->data[8]) == (uint32_t)m->table)
+    return(1);
+
+  if(m->data != NULL) munmap(m->data, m->size);
+  memset(m, 0, sizeof(struct pack_map));
+  fd = open(path, O_RDONLY);
+  if(fd < 0 || fstat(fd, &info) != 0 || info.st_size < SECTOR_SIZE)
+  {
+    if(fd >= 0) close(fd);
+    return(0);
+  }
+  m->data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m->data == MAP_FAILED)
+  {
+    m->data = NULL;
+    return(0);
+  }
+  m->size = info.st_size;
+  m->count = load_le32(&m->data[4]);
+  m->table = load_le32(&m->data[8]);
+  if(memcmp(m->data, PACK_MAGIC, 4) != 0 ||
+     ((size_t)m->table + pack_table_sectors(m->count)) * SECTOR_SIZE >
+     m->size)
+  {
+    munmap(m->data, m->size);
+    memset(m, 0, sizeof(struct pack_map));
+    return(0);
+  }
+  snprintf(m->path, sizeof(m->path), "%s", path);
+  m->offsets = &m->data[(size_t)m->table * SECTOR_SIZE];
+  m->names = m->offsets + pack_offset_sectors(m->count) * SECTOR_SIZE;
+  return(1);
+}
+
+
+/*===========================================================================
+ *                              pack_find
+ *===========================================================================
+ * Desription: Look up an image in the mapped pack
+ *
+ * Parameters: name - Image name
+ *
+ * Return:     Image number, -1 if the pack has no such image
+ */
+int pack_find(char *name)
+{
+  struct pack_map *m = &pack_map;
+  int low = 0;
+  int high = m->count;
+
+  // Binary search of the name index
+  while(low < high)
+  {
+    int mid = (low + high) / 2;
+    int order = strncmp((char*)&m->names[mid * PACK_ENTRY_SIZE], name,
+                        PACK_NAME_LEN);
+    if(order == 0) return(load_le32(&m->names[mid * PACK_ENTRY_SIZE +
+                                              PACK_NAME_LEN]));
+    if(order < 0) low = mid + 1;
+    else          high = mid;
+  }
+  return(-1);
+}
+
+
+/*===========================================================================
+ *                              pack_image
+ *===========================================================================
+ * Desription: Find the sectors of an image inside a pack
+ *
+ * Parameters: address - Image address, {pack}:{image}
+ *             size    - Receives the size of the image
+ *
+ * Return:     Image sectors within this thread's mapping of the pack,
+ *             NULL if the pack or the image cannot be found
+ */
+unsigned char* pack_image(char *address, int *size)
+{
+  struct pack_map *m = &pack_map;
+  char pack[1024];
+  char *name = pack_split(address, pack, sizeof(pack));
+  unsigned char *entry;
+  int number;
+  uint32_t first;
+  uint32_t count;
+
+  if(name == NULL || !pack_open(pack)) return(NULL);
+  number = pack_find(name);
+  if(number < 0 || number >= m->count) return(NULL);
+  entry = &m->offsets[number * 8];
+  first = load_le32(&entry[0]);
+  count = load_le32(&entry[4]);
+  if(count == 0 || ((size_t)first + count) * SECTOR_SIZE > m->size)
+    return(NULL);
+  *size = count * SECTOR_SIZE;
+  return(&m->data[(size_t)first * SECTOR_SIZE]);
+}
+
+
+/*===========================================================================
+ *                           read_pack_image
+ *===========================================================================
+ * Desription: Load an image from inside a pack
+ *
+ * Parameters: address - Image address, {pack}:{image}
+ *
+ * Return:     Was disk image loaded correctly?
+ */
+int read_pack_image(char *address)
+{
+  unsigned char *data;
+  struct vib_block *vib;
+  int size;
+
+  container_release();
+  data = pack_image(address, &size);
+  if(data == NULL)
+  {
+    printf("Cannot open disk image \"%s\"\n", address);
+    return(0);
+  }
+  disk_size = size;
+  disk_buffer = image_buffer(disk_size, 0);
+  memcpy(disk_buffer, data, disk_size);
+  disk_format = format_dkp;
+  stats.sectors_read += disk_size / SECTOR_SIZE;
+
+  vib = (struct vib_block*)disk_buffer;
+  if(disk_size < 2 * SECTOR_SIZE || memcmp(vib->id, "DSK", 3) != 0)
+  {
+    printf("%s is not a V9T9 disk image\n", address);
+    return(0);
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             image_exists
+ *===========================================================================
+ * Desription: Check whether an image file, or an image inside a pack,
+ *             exists
+ *
+ * Parameters: filename - Image file or image address
+ *
+ * Return:     Does the image exist?
+ */
+int image_exists(char *filename)
+{
+  char pack[1024];
+  int size;
+  if(pack_split(filename, pack, sizeof(pack)) != NULL)
+    return(pack_image(filename, &size) != NULL);
+  return(access(filename, F_OK) == 0);
+}
+
+
+/*===========================================================================
+ *                             pack_append
+ *===========================================================================
+ * Desription: Add images to a pack, or replace images of the same name
+ *
+ *             Packs are only ever appended to: the images go after
+ *             everything already there, then a new offset table and name
+ *             index, and last the header is rewritten to point at the
+ *             new tables. Replaced images and old tables are left behind
+ *             as garbage until the pack is compacted. Writers take a lock
+ *             on the pack.
+ *
+ * Parameters: path   - Pack file, created if it does not exist
+ *             names  - Image names
+ *             images - Image sectors, V9T9 layout
+ *             sizes  - Size of each image
+ *             count  - Number of images
+ *
+ * Return:     Were the images added?
+ */
+int pack_append(char *path, char **names, unsigned char **images,
+                int *sizes, int count)
+{
+  unsigned char header[SECTOR_SIZE];
+  unsigned char *offsets = NULL;
+  unsigned char *index = NULL;
+  struct stat info;
+  struct stat current;
+  uint32_t end;
+  uint32_t first_new;
+  uint32_t garbage = 0;
+  int old_count = 0;
+  int new_count;
+  int attempt;
+  int ok = 1;
+  int i;
+  int fd;
+
+  // compact_command() may replace the pack while this waits for the lock,
+  // then the file locked is the old one with its header spoiled. Open the
+  // pack again until the file locked is the one in place.
+  for(attempt = 0; ; attempt++)
+  {
+    int moved;
+    int spoiled;
+
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if(fd < 0 || flock(fd, LOCK_EX) != 0 || fstat(fd, &info) != 0)
+    {
+      printf("Cannot open pack \"%s\"\n", path);
+      if(fd >= 0) close(fd);
+      return(0);
+    }
+    moved = (stat(path, &current) != 0 || current.st_ino != info.st_ino ||
+             current.st_dev != info.st_dev);
+    spoiled = (info.st_size >= 12 && pread(fd, header, 12, 0) == 12 &&
+               load_le32(&header[8]) == 0xFFFFFFFF);
+    if((!moved && !spoiled) || attempt == PACK_RETRIES) break;
+    close(fd);
+  }
+
+  // Start a new pack, or read the current tables of this one
+  memset(header, 0, sizeof(header));
+  if(info.st_size == 0)
+  {
+    memcpy(header, PACK_MAGIC, 4);
+    ok = (pwrite(fd, header, SECTOR_SIZE, 0) == SECTOR_SIZE);
+    end = 1;
+  }
+  else
+  {
+    uint32_t table;
+    ok = (pread(fd, header, SECTOR_SIZE, 0) == SECTOR_SIZE &&
+          memcmp(header, PACK_MAGIC, 4) == 0 &&
+          info.st_size % SECTOR_SIZE == 0);
+    old_count = load_le32(&header[4]);
+    table = load_le32(&header[8]);
+    garbage = load_le32(&header[12]);
+    end = info.st_size / SECTOR_SIZE;
+    if(ok)
+    {
+      size_t offset_bytes = pack_offset_sectors(old_count) * SECTOR_SIZE;
+      size_t index_bytes = pack_table_sectors(old_count) * SECTOR_SIZE -
+                           offset_bytes;
+      offsets = malloc(offset_bytes + (size_t)count * 8 + SECTOR_SIZE);
+      index = malloc(index_bytes + (size_t)count * PACK_ENTRY_SIZE +
+                     SECTOR_SIZE);
+      ok = (pread(fd, offsets, offset_bytes, (off_t)table * SECTOR_SIZE) ==
+            (ssize_t)offset_bytes &&
+            pread(fd, index, index_bytes,
+                  ((off_t)table * SECTOR_SIZE) + offset_bytes) ==
+            (ssize_t)index_bytes);
+      garbage += pack_table_sectors(old_count);
+    }
+
+    // Every name must lead to an image of the pack
+    for(i = 0; ok && i < old_count; i++)
+      ok = (load_le32(&index[i * PACK_ENTRY_SIZE + PACK_NAME_LEN]) <
+            (uint32_t)old_count);
+  }
+  if(!ok)
+  {
+    printf("%s is not a valid pack\n", path);
+    free(offsets);
+    free(index);
+    close(fd);
+    return(0);
+  }
+  if(offsets == NULL)
+  {
+    offsets = malloc((size_t)count * 8 + SECTOR_SIZE);
+    index = malloc((size_t)count * PACK_ENTRY_SIZE + SECTOR_SIZE);
+  }
+
+  // Images go after everything there is, a new one for a name replaces
+  // the old one
+  first_new = end;
+  new_count = old_count;
+  for(i = 0; ok && i < count; i++)
+  {
+    unsigned char *entry = NULL;
+    int sectors = (sizes[i] + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int low = 0;
+    int high = new_count;
+    int number;
+
+    while(low < high)
+    {
+      int mid = (low + high) / 2;
+      int order = strncmp((char*)&index[mid * PACK_ENTRY_SIZE], names[i],
+                          PACK_NAME_LEN);
+      if(order == 0)
+      {
+        entry = &index[mid * PACK_ENTRY_SIZE];
+        break;
+      }
+      if(order < 0) low = mid + 1;
+      else          high = mid;
+    }
+    if(entry != NULL)
+    {
+      number = load_le32(&entry[PACK_NAME_LEN]);
+      garbage += load_le32(&offsets[number * 8 + 4]);
+    }
+    else
+    {
+      number = new_count++;
+      memmove(&index[(low + 1) * PACK_ENTRY_SIZE],
+              &index[low * PACK_ENTRY_SIZE],
+              (size_t)(new_count - 1 - low) * PACK_ENTRY_SIZE);
+      entry = &index[low * PACK_ENTRY_SIZE];
+      memset(entry, 0, PACK_ENTRY_SIZE);
+      strncpy((char*)entry, names[i], PACK_NAME_LEN - 1);
+      store_le32(&entry[PACK_NAME_LEN], number);
+    }
+    store_le32(&offsets[number * 8], end);
+    store_le32(&offsets[number * 8 + 4], sectors);
+
+    ok = (pwrite(fd, images[i], sizes[i], (off_t)end * SECTOR_SIZE) ==
+          sizes[i]);
+    if(ok && sizes[i] % SECTOR_SIZE)
+    {
+      // Keep every image sector aligned
+      unsigned char pad[SECTOR_SIZE];
+      int tail = SECTOR_SIZE - sizes[i] % SECTOR_SIZE;
+      memset(pad, 0, tail);
+      ok = (pwrite(fd, pad, tail, (off_t)end * SECTOR_SIZE + sizes[i]) ==
+            tail);
+    }
+    end += sectors;
+  }
+
+  // New tables, then the header that makes them current
+  if(ok)
+  {
+    size_t offset_bytes = pack_offset_sectors(new_count) * SECTOR_SIZE;
+    size_t index_bytes = pack_table_sectors(new_count) * SECTOR_SIZE -
+                         offset_bytes;
+    memset(&offsets[new_count * 8], 0, offset_bytes - new_count * 8);
+    memset(&index[new_count * PACK_ENTRY_SIZE], 0,
+           index_bytes - (size_t)new_count * PACK_ENTRY_SIZE);
+    ok = (pwrite(fd, offsets, offset_bytes, (off_t)end * SECTOR_SIZE) ==
+          (ssize_t)offset_bytes &&
+          pwrite(fd, index, index_bytes,
+                 (off_t)end * SECTOR_SIZE + offset_bytes) ==
+          (ssize_t)index_bytes &&
+          fdatasync(fd) == 0);
+    store_le32(&header[4], new_count);
+    store_le32(&header[8], end);
+    store_le32(&header[12], garbage);
+    stats.sectors_written += end - first_new + pack_table_sectors(new_count);
+    if(ok) ok = (pwrite(fd, header, 16, 0) == 16);
+  }
+  free(offsets);
+  free(index);
+  if(close(fd) != 0) ok = 0;
+  if(!ok) printf("Cannot write pack \"%s\"\n", path);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                           save_pack_image
+ *===========================================================================
+ * Desription: Save the disk image in memory into a pack
+ *
+ * Parameters: address - Image address, {pack}:{image}
+ *
+ * Return:     Was disk image stored correctly?
+ */
+int save_pack_image(char *address)
+{
+  char pack[1024];
+  char *name = pack_split(address, pack, sizeof(pack));
+  unsigned char *data = disk_buffer;
+
+  if(name == NULL || name[0] == 0 || strlen(name) >= PACK_NAME_LEN)
+  {
+    printf("Cannot save disk file \"%s\"\n", address);
+    return(0);
+  }
+  return(pack_append(pack, &name, &data, &disk_size, 1));
+}
+
+
+/*===========================================================================
+ *                            format_for_path
+ *===========================================================================
+ * Desription: Choose the storage format for a new image file
+ *
+ * Parameters: filename - Path of the image file
+ *
+ * Return:     Format selected by the file extension
+ */
+int format_for_path(char *filename)
+{
+  char pack[1024];
+  char *ext = strrchr(filename, '.');
+  if(pack_split(filename, pack, sizeof(pack)) != NULL) return(format_dkp);
+  if(ext != NULL && strcasecmp(ext, ".dkz") == 0)  return(format_dkz);
+  if(ext != NULL && strcasecmp(ext, ".pc99") == 0) return(format_pc99);
+  return(format_v9t9);
+}
+
+
+/*===========================================================================
+ *                             save_disk_as
+ *===========================================================================
+ * Desription: Save the disk image in memory in the given format
+ *
+ * Parameters: filename - File used to store disk image
+ *             format   - Storage format
+ *
+ * Return:     Was disk image stored correctly?
+ */
+int save_disk_as(char *filename, int format)
+{
+  struct phase_timer timer;
+  int ok;
+
+  // Every sector is written, so decompress whatever is still pending
+  phase_start(&timer, phase_save);
+  container_release();
+  if(format == format_dkp)       ok = save_pack_image(filename);
+  else if(format == format_dkz)  ok = save_container(filename);
+  else if(format == format_pc99) ok = save_pc99(filename);
+  else                           ok = save_v9t9(filename);
+  phase_stop(&timer);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                             save_disk
+ *===========================================================================
+ * Desription: Save the disk image in memory to a file, keeping the format
+ *             it was loaded or created in
+ *
+ * Parameters: filename - File used to store disk image
+ *
+ * Return:     Was disk image stored correctly?
+ */
+int save_disk(char *filename)
+{
+  return(save_disk_as(filename, disk_format));
+}
+
+
+/*===========================================================================
+ *                           read_data_regions
+ *===========================================================================
+ * Desription: Read a file into a buffer, skipping holes. The parts of the
+ *             buffer under holes are zero-filled rather than read.
+ *
+ * Parameters: fd     - Open file to read
+ *             buffer - Destination buffer
+ *             size   - Number of bytes to read
+ *
+ * Return:     Was the file read correctly?
+ */
+int read_data_regions(int fd, unsigned char *buffer, off_t size)
+{
+  off_t pos = 0;
+
+  while(pos < size)
+  {
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    off_t hole;
+    if(data < 0)
+    {
+      // No more data in the file
+      if(errno == ENXIO)
+      {
+        memset(&buffer[pos], 0, size - pos);
+        return(1);
+      }
+
+      // Holes are not reported here, read everything that is left
+      data = pos;
+      hole = size;
+    }
+    else
+    {
+      hole = lseek(fd, data, SEEK_HOLE);
+      if(hole < 0 || hole > size) hole = size;
+    }
+
+    // Read this data region
+    if(data > size) data = size;
+    memset(&buffer[pos], 0, data - pos);
+    stats.sectors_read += (hole - data + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    pos = data;
+    while(pos < hole)
+    {
+      ssize_t got = pread(fd, &buffer[pos], hole - pos, pos);
+      if(got <= 0) return(0);
+      pos += got;
+    }
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             read_disk
+ *===========================================================================
+ * Desription: Read a disk image file of any supported format to memory
+ *
+ * Parameters: filename - File from which to read disk image
+ *
+ * Return:     Was disk image loaded correctly?
+ */
+int read_disk(char *filename)
+{
+  struct stat info;
+  char pack[1024];
+  int fd;
+
+  // Any image still in memory makes way for this one
+  release_disk();
+
+  // Images inside a pack come from the pack's mapping
+  if(pack_split(filename, pack, sizeof(pack)) != NULL)
+    return(read_pack_image(filename));
+
+  // Read disk image
+  fd = open(filename, O_RDONLY);
+  if(fd < 0 || fstat(fd, &info) != 0)
+  {
+    printf("Cannot open disk image \"%s\"\n", filename);
+    if(fd >= 0) close(fd);
+    return(0);
+  }
+
+  // Compressed containers are decompressed on demand
+  disk_format = format_v9t9;
+  if(info.st_size >= CONTAINER_HEADER_SIZE)
+  {
+    char magic[4];
+    if(pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+       memcmp(magic, CONTAINER_MAGIC, sizeof(magic)) == 0)
+    {
+      int ok = load_container(fd, info.st_size, filename);
+      close(fd);
+      return(ok);
+    }
+  }
+
+  // Track images are recognised by size and checked by their CRCs
+  {
+    int heads;
+    const struct track_format *tf = pc99_layout(info.st_size, &heads);
+    if(tf != NULL)
+    {
+      int ok = load_pc99(fd, info.st_size, tf, heads, filename);
+      close(fd);
+      return(ok);
+    }
+  }
+
+  // Load image into memory, holes read back as blank sectors
+  disk_size = info.st_size;
+  if(disk_size < 2 * SECTOR_SIZE)
+  {
+    printf("%s is not a V9T9 disk image\n", filename);
+    close(fd);
+    return(0);
+  }
+  disk_buffer = image_buffer(disk_size, 0);
+  if(disk_buffer == NULL || !read_data_regions(fd, disk_buffer, disk_size))
+  {
+    printf("Cannot read disk image \"%s\"\n", filename);
+    close(fd);
+    return(0);
+  }
+  close(fd);
+ 
+  // Confirm this is a valid image
+  struct vib_block *vib = (struct vib_block*)disk_buffer;
+  if(vib->id[0] != 'D' ||
+     vib->id[1] != 'S' ||
+     vib->id[2] != 'K')
+  {
+    printf("%s is not a V9T9 disk image\n", filename);
+    return(0);
+  }
+
+  // File succcessfully loaded
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             load_disk
+ *===========================================================================
+ * Desription: Load disk image to memory
+ *
+ * Parameters: filename - File from which to read disk image
+ *
+ * Return:     Was disk image loaded correctly?
+ */
+int load_disk(char *filename)
+{
+  struct phase_timer timer;
+  int ok;
+
+  phase_start(&timer, phase_load);
+  ok = read_disk(filename);
+  phase_stop(&timer);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                             check_image
+ *===========================================================================
+ * Desription: Check that the FDR index and every FIB of the disk image
+ *             can be used safely
+ *
+ * Parameters: None
+ *
+ * Return:     Description of the first problem found, NULL if none
+ */
+char* check_image()
+{
+  static __thread char reason[64];
+  uint16_t index[MAX_FILE_COUNT];
+  int i;
+  int j;
+
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct cluster_span spans[MAX_CLUSTERS];
+    struct fib_block *fib;
+    int span_count;
+    int sectors = 0;
+
+    if(index[i] == 0) continue;
+    fib = fib_at(index[i]);
+    if(fib == NULL)
+    {
+      snprintf(reason, sizeof(reason), "FDR entry %d is out of range", i);
+      return(reason);
+    }
+    span_count = fib_spans(fib, spans);
+    for(j = 0; j < span_count; j++) sectors += spans[j].count;
+    if(span_count < 0 || fib_file_size(fib) > sectors * SECTOR_SIZE)
+    {
+      snprintf(reason, sizeof(reason), "FIB in sector %d is corrupt",
+               index[i]);
+      return(reason);
+    }
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                           check_allocation
+ *===========================================================================
+ * Desription: Check that every file of the disk image holds whole AUs of
+ *             its own that are marked used, so no AU of several sectors
+ *             was freed while part of it is still in use
+ *
+ * Parameters: None
+ *
+ * Return:     Description of the first problem found, NULL if none
+ */
+char* check_allocation()
+{
+  static __thread char reason[80];
+  uint16_t owner[1600];
+  uint16_t index[MAX_FILE_COUNT];
+  int au = sectors_per_au();
+  int i;
+  int j;
+  int secno;
+
+  memset(owner, 0, sizeof(owner));
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct cluster_span spans[MAX_CLUSTERS + 1];
+    struct fib_block *fib;
+    int span_count;
+
+    if(index[i] == 0) continue;
+    fib = fib_at(index[i]);
+    if(fib == NULL) continue;
+    span_count = fib_spans(fib, spans);
+    if(span_count < 0) continue;
+
+    // The FIB is checked as a span of its own
+    spans[span_count].first = index[i];
+    spans[span_count].count = 1;
+    for(j = 0; j <= span_count; j++)
+    {
+      if(spans[j].first % au != 0)
+      {
+        snprintf(reason, sizeof(reason),
+                 "file of FIB %d has sector %d inside an AU", index[i],
+                 spans[j].first);
+        return(reason);
+      }
+      for(secno = spans[j].first;
+          secno < spans[j].first + spans[j].count; secno++)
+      {
+        int unit = secno / au;
+        if(sector_free(secno))
+        {
+          snprintf(reason, sizeof(reason),
+                   "sector %d of FIB %d is in a free AU", secno, index[i]);
+          return(reason);
+        }
+        if(owner[unit] != 0 && owner[unit] != index[i])
+        {
+          snprintf(reason, sizeof(reason),
+                   "FIBs %d and %d share AU %d", owner[unit], index[i],
+                   unit);
+          return(reason);
+        }
+        owner[unit] = index[i];
+      }
+    }
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                              host_name
+ *===========================================================================
+ * Desription: Make a host file name from the name of a file on disk
+ *
+ * Parameters: fib    - File information block
+ *             buffer - Receives the name, FILE_NAME_LEN + 1 bytes
+ *
+ * Return:     None
+ */
+void host_name(struct fib_block *fib, char *buffer)
+{
+  // Remove trailng spaces from name on disk
+  char *p;
+  memcpy(buffer, fib->name, FILE_NAME_LEN);
+  buffer[FILE_NAME_LEN] = 0;
+  if((p = strchr(buffer, ' ')) != NULL) *p = 0;
+  while((p = strchr(buffer, '/')) != NULL) *p = '_';
+}
+
+
+/*===========================================================================
+ *                            extract_file
+ *===========================================================================
+ * Desription: Copy a file from the disk image to a seperate file
+ *
+ * Parameters: fib      - File information block for the file to be extracted
+ *             filename - File name to use for extracted file
+ *
+ * Return:     Was the file extracted?
+ */
+int extract_file(struct fib_block *fib, char *filename)
+{
+  int i;
+  unsigned char *data;
+  int file_size;
+  int pos = 0;
+  int ok;
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count;
+  char name_buffer[FILE_NAME_LEN + 1];
+  struct phase_timer timer;
+  size_t mark = arena_mark();
+
+  if(fib == NULL) return(0);
+
+  // Make name for the extracted file
+  if(filename == NULL)
+  {
+    host_name(fib, name_buffer);
+    filename = name_buffer;
+  }
+
+  // Gather file contents in scratch space, then write them in one go
+  phase_start(&timer, phase_extract);
+  file_size = fib_file_size(fib);
+  data = arena_alloc(file_size);
+  span_count = fib_spans(fib, spans);
+  for(i=0; i<span_count; i++)
+  {
+    int j;
+    TRACE_BEGIN(trace_extract_span, spans[i].first);
+    for(j=0; j<spans[i].count && pos < file_size; j++)
+    {
+      int size = 256;
+      if(size > file_size - pos) size = file_size - pos;
+      memcpy(&data[pos], get_sector(spans[i].first + j), size);
+      pos += size;
+    }    
+    TRACE_END(trace_extract_span, j);
+  }
+  ok = write_host_file(filename, data, pos);
+  arena_rewind(mark);
+  phase_stop(&timer);
+  if(!ok)
+  {
+    printf("Cannot open file \"%s\"\n", filename);
+    return(0);
+  }
+  
+  if(all_args.verbose)
+    printf("Extracted disk file \"%s\" to \"%s\"\n",
+           fib->name, filename);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             record_sector
+ *===========================================================================
+ * Desription: Find the disk sector holding a sector of a file
+ *
+ *             The cluster table already holds the running total of file
+ *             sectors, the highest offset in each entry, so the entry
+ *             holding a file sector is found by a binary search of the
+ *             table without decoding the other entries.
+ *
+ * Parameters: fib    - File information block
+ *             offset - Sector offset within the file
+ *
+ * Return:     Disk sector, 0 if the file has no such sector
+ */
+int record_sector(struct fib_block *fib, int offset)
+{
+  int sectors = disk_size / SECTOR_SIZE;
+  int low = 0;
+  int high = MAX_CLUSTERS;
+  int first;
+  int start;
+
+  // First entry whose highest offset reaches the sector, unused entries
+  // at the end of the table count as beyond every offset
+  while(low < high)
+  {
+    int mid = (low + high) / 2;
+    if(cluster_first(fib->cluster[mid]) == 0 ||
+       cluster_count(fib->cluster[mid]) >= offset)
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  if(low == MAX_CLUSTERS || cluster_first(fib->cluster[low]) == 0)
+    return(0);
+
+  first = cluster_first(fib->cluster[low]);
+  start = low ? cluster_count(fib->cluster[low - 1]) + 1 : 0;
+  if(offset < start || first + offset - start >= sectors) return(0);
+  return(first + offset - start);
+}
+
+
+/*===========================================================================
+ *                              read_record
+ *===========================================================================
+ * Desription: Read one record of a fixed record file. Records are numbered
+ *             from 0 and never cross a sector, so only the sector holding
+ *             the record is read.
+ *
+ * Parameters: fib    - File information block
+ *             recno  - Record number
+ *             buffer - Receives the record, 256 bytes at most
+ *
+ * Return:     Record length, -1 if the file has no such record
+ */
+int read_record(struct fib_block *fib, int recno, unsigned char *buffer)
+{
+  int reclen = fib->reclen ? fib->reclen : SECTOR_SIZE;
+  int per_sector = fib->recsperphysrec ? fib->recsperphysrec
+                                       : SECTOR_SIZE / reclen;
+  int secno;
+
+  if(recno < 0 || recno >= fib_fixrecs(fib) ||
+     per_sector * reclen > SECTOR_SIZE)
+    return(-1);
+  secno = record_sector(fib, recno / per_sector);
+  if(secno == 0) return(-1);
+  memcpy(buffer, get_sector(secno)->data + (recno % per_sector) * reclen,
+         reclen);
+  return(reclen);
+}
+
+
+/*===========================================================================
+ *                            extract_records
+ *===========================================================================
+ * Desription: Copy a range of records of a DIS/FIX or INT/FIX file to a
+ *             seperate file, one record after the other
+ *
+ * Parameters: fib      - File information block
+ *             first    - First record to copy
+ *             last     - Last record to copy
+ *             filename - File name to use for extracted records
+ *
+ * Return:     Were the records extracted?
+ */
+int extract_records(struct fib_block *fib, int first, int last,
+                    char *filename)
+{
+  unsigned char record[SECTOR_SIZE];
+  char name[FILE_NAME_LEN + 1];
+  struct phase_timer timer;
+  FILE *file;
+  int recno;
+  int ok = 1;
+
+  host_name(fib, name);
+  if(fib->flags & (fib_program | fib_var))
+  {
+    printf("Cannot read records of \"%s\", not a fixed record file\n",
+           name);
+    return(0);
+  }
+  if(first > last || last >= fib_fixrecs(fib))
+  {
+    printf("Cannot read records %d-%d of \"%s\", it holds %d records\n",
+           first, last, name, fib_fixrecs(fib));
+    return(0);
+  }
+
+  phase_start(&timer, phase_extract);
+  file = fopen(filename, "wb");
+  if(file == NULL)
+  {
+    printf("Cannot open file \"%s\"\n", filename);
+    phase_stop(&timer);
+    return(0);
+  }
+  for(recno = first; ok && recno <= last; recno++)
+  {
+    int length = read_record(fib, recno, record);
+    ok = (length > 0 && fwrite(record, length, 1, file) == 1);
+  }
+  if(fclose(file) != 0) ok = 0;
+  phase_stop(&timer);
+  if(!ok)
+  {
+    printf("Cannot extract records of \"%s\" to \"%s\"\n", name,
+           filename);
+    return(0);
+  }
+
+  if(all_args.verbose)
+    printf("Extracted records %d-%d of \"%s\" to \"%s\"\n", first, last,
+           name, filename);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                               find_fib
+ *===========================================================================
+ * Desription: Find the FIB for a file in the disk image
+ *
+ * Parameters: filename - File name to search for in V9T9 format
+ *
+ * Return:     Pointer to the found FIB, NULL if not found
+ */
+struct fib_block* find_fib(char *filename)
+{
+  int i;
+  uint16_t index[MAX_FILE_COUNT];
+  struct fib_block* found = NULL;
+  struct phase_timer timer;
+
+  // Iterate through files
+  phase_start(&timer, phase_lookup);
+  TRACE_BEGIN(trace_find_fib, 0);
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT && found == NULL; i++)
+  {
+    // Try to match this name
+    struct fib_block* fib = fib_at(index[i]);
+    if(fib == NULL) continue;
+    stats.fib_lookups++;
+    if(strncmp(filename, fib->name, FILE_NAME_LEN) == 0)
+      found = fib;
+  }
+  TRACE_END(trace_find_fib, found ? sector_of(found) : 0);
+  phase_stop(&timer);
+  return(found);
+}
+
+
+/*===========================================================================
+ *                             remove_file
+ *===========================================================================
+ * Desription: Remove a file from the disk image
+ *
+ * Parameters: filename - File name to remove in V9T9 format
+ *
+ * Return:     Was file removed?
+ */
+int remove_file(char *filename)
+{
+  struct fib_block *fib;
+  int i;
+  int secno;
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count;
+  struct disk_sector *sector = disk_buffer;
+
+  fib = find_fib(filename);
+  if(fib == NULL)
+  {
+    printf("Cannot remove file \"%s\"\n", filename);
+    return(0);
+  }
+
+  // Free all sectors used by this file
+  span_count = fib_spans(fib, spans);
+  for(i=0; i<span_count; i++)
+  {
+    for(secno = spans[i].first;
+        secno < spans[i].first + spans[i].count; secno++)
+    {
+      memset(get_sector(secno), 0, sizeof(struct disk_sector));
+      mark_sector(secno, 0);
+    }    
+  }
+
+  // Free the FIB block too
+  memset(fib, 0, sizeof(struct disk_sector));
+  secno = sector_of(fib);
+  mark_sector(secno, 0);
+
+  // Remove this entry in the file list
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    if(fdr_index_get(i) == secno) break;
+  }
+  if(i < MAX_FILE_COUNT)
+  {
+    unsigned char *index = sector[BLOCK_FIB_INDEX].data;
+    memmove(&index[i * 2], &index[(i + 1) * 2],
+            (MAX_FILE_COUNT - i - 1) * 2);
+    fdr_index_set(MAX_FILE_COUNT - 1, 0);
+  }
+
+  if(all_args.verbose)
+    printf("Removing file \"%s\" from disk image\n", filename);
+  return(1);
+}
+
+
+// Text gathered in memory before it is printed
+struct text_buffer
+{
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+
+/*===========================================================================
+ *                             text_reserve
+ *===========================================================================
+ * Desription: Make room at the end of a text buffer
+ *
+ * Parameters: buffer - Text buffer
+ *             length - Characters about to be appended
+ *
+ * Return:     None
+ */
+void text_reserve(struct text_buffer *buffer, size_t length)
+{
+  if(buffer->length + length + 1 > buffer->capacity)
+  {
+    buffer->capacity = 2 * (buffer->length + length + 1);
+    buffer->data = realloc(buffer->data, buffer->capacity);
+  }
+}
+
+
+/*===========================================================================
+ *                             text_append
+ *===========================================================================
+ * Desription: Append characters to a text buffer
+ *
+ * Parameters: buffer - Text buffer
+ *             data   - Characters to append
+ *             length - Number of characters
+ *
+ * Return:     None
+ */
+void text_append(struct text_buffer *buffer, const void *data, size_t length)
+{
+  text_reserve(buffer, length);
+  memcpy(&buffer->data[buffer->length], data, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = 0;
+}
+
+
+/*===========================================================================
+ *                              text_putc
+ *===========================================================================
+ * Desription: Append one character to a text buffer
+ *
+ * Parameters: buffer - Text buffer
+ *             c      - Character
+ *
+ * Return:     None
+ */
+void text_putc(struct text_buffer *buffer, char c)
+{
+  text_reserve(buffer, 1);
+  buffer->data[buffer->length++] = c;
+  buffer->data[buffer->length] = 0;
+}
+
+
+/*===========================================================================
+ *                             text_printf
+ *===========================================================================
+ * Desription: Append formatted text to a text buffer
+ *
+ * Parameters: buffer - Text buffer
+ *             format - printf format, then its arguments
+ *
+ * Return:     None
+ */
+void text_printf(struct text_buffer *buffer, const char *format, ...)
+{
+  va_list args;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  text_reserve(buffer, length);
+  va_start(args, format);
+  vsnprintf(&buffer->data[buffer->length], length + 1, format, args);
+  va_end(args);
+  buffer->length += length;
+}
+
+
+/*===========================================================================
+ *                             detokenize
+ *===========================================================================
+ * Desription: List a TI BASIC or Extended BASIC program image as source
+ *
+ *             The image starts with an 8 byte header: a check word, the
+ *             VDP addresses of the two ends of the line number table and
+ *             the top of the program. The table follows with 4 byte
+ *             entries, line number and VDP address of the line's tokens;
+ *             the byte before the tokens is their length and a zero ends
+ *             them. Each token is looked up in basic_tokens, so a program
+ *             is listed in one pass with no allocation per token.
+ *
+ * Parameters: program - Program image
+ *             size    - Size of the program image
+ *             out     - Receives one line of source per program line
+ *
+ * Return:     Number of lines listed, -1 if this is not a BASIC program
+ */
+int detokenize(const unsigned char *program, int size, struct text_buffer *out)
+{
+  static const char *basic_tokens[128] =
+  {
+    NULL,        "ELSE",      "::",        "!",         // 80
+    "IF",        "GO",        "GOTO",      "GOSUB",
+    "RETURN",    "DEF",       "DIM",       "END",       // 88
+    "FOR",       "LET",       "BREAK",     "UNBREAK",
+    "TRACE",     "UNTRACE",   "INPUT",     "DATA",      // 90
+    "RESTORE",   "RANDOMIZE", "NEXT",      "READ",
+    "STOP",      "DELETE",    "REM",       "ON",        // 98
+    "PRINT",     "CALL",      "OPTION",    "OPEN",
+    "CLOSE",     "SUB",       "DISPLAY",   "IMAGE",     // A0
+    "ACCEPT",    "ERROR",     "WARNING",   "SUBEXIT",
+    "SUBEND",    "RUN",       "LINPUT",    NULL,        // A8
+    NULL,        NULL,        NULL,        NULL,
+    "THEN",      "TO",        "STEP",      ",",         // B0
+    ";",         ":",         ")",         "(",
+    "&",         NULL,        "OR",        "AND",       // B8
+    "XOR",       "NOT",       "=",         "<",
+    ">",         "+",         "-",         "*",         // C0
+    "/",         "^",         NULL,        NULL,
+    NULL,        NULL,        "EOF",       "ABS",       // C8
+    "ATN",       "COS",       "EXP",       "INT",
+    "LOG",       "SGN",       "SIN",       "SQR",       // D0
+    "TAN",       "LEN",       "CHR$",      "RND",
+    "SEG$",      "POS",       "VAL",       "STR$",      // D8
+    "ASC",       "PI",        "REC",       "MAX",
+    "MIN",       "RPT$",      NULL,        NULL,        // E0
+    NULL,        NULL,        NULL,        NULL,
+    "NUMERIC",   "DIGIT",     "UALPHA",    "SIZE",      // E8
+    "ALL",       "USING",     "BEEP",      "ERASE",
+    "AT",        "BASE",      "TEMPORARY", "VARIABLE",  // F0
+    "RELATIVE",  "INTERNAL",  "SEQUENTIAL", "OUTPUT",
+    "UPDATE",    "APPEND",    "FIXED",     "PERMANENT", // F8
+    "TAB",       "#",         "VALIDATE",  NULL
+  };
+  int check;
+  int low;
+  int high;
+  int entries;
+  int previous = 0;
+  int i;
+
+  // Check word is the XOR of the table ends, negated when protected
+  if(size < 12) return(-1);
+  check = load_be16(&program[0]);
+  low = load_be16(&program[4]);
+  high = load_be16(&program[2]);
+  if(low > high)
+  {
+    int swap = low;
+    low = high;
+    high = swap;
+  }
+  if((check != (low ^ high) && check != (-(low ^ high) & 0xFFFF)) ||
+     (high - low + 1) % 4 != 0 || 8 + high - low + 1 > size)
+    return(-1);
+  entries = (high - low + 1) / 4;
+
+  // The table is kept in descending line order, list it backwards
+  for(i = entries - 1; i >= 0; i--)
+  {
+    const unsigned char *entry = &program[8 + i * 4];
+    int number = load_be16(&entry[0]);
+    int start = load_be16(&entry[2]) - low + 8;
+    int end;
+    int pos;
+    int spaced = 1;       // Does the output end with a space?
+    int pending = 0;      // Does the next word need a space first?
+
+    if(start < 1 || start >= size || number <= previous)
+      return(-1);
+    end = start + program[start - 1];
+    if(end > size) return(-1);
+    previous = number;
+    text_printf(out, "%d ", number);
+
+    for(pos = start; pos < end && program[pos] != 0; )
+    {
+      int token = program[pos++];
+      const char *word;
+
+      if(token < 0x80)
+      {
+        // Names and other plain text
+        if(pending && token != ' ') text_putc(out, ' ');
+        text_putc(out, token);
+        pending = 0;
+        spaced = (token == ' ');
+        continue;
+      }
+
+      if(token == 0xC7 || token == 0xC8)
+      {
+        // Quoted string, or unquoted text such as a number
+        int length = (pos < end) ? program[pos++] : 0;
+        const unsigned char *text = &program[pos];
+        const unsigned char *quote;
+        if(pos + length > end) return(-1);
+        pos += length;
+        if(pending) text_putc(out, ' ');
+        if(token == 0xC7)
+        {
+          // Quotes inside the string are doubled
+          text_putc(out, '"');
+          while((quote = memchr(text, '"', length)) != NULL)
+          {
+            text_append(out, text, quote - text + 1);
+            text_putc(out, '"');
+            length -= quote - text + 1;
+            text = quote + 1;
+          }
+        }
+        text_append(out, text, length);
+        if(token == 0xC7) text_putc(out, '"');
+        pending = 0;
+        spaced = 0;
+        continue;
+      }
+
+      if(token == 0xC9)
+      {
+        // Line number operand
+        if(pos + 2 > end) return(-1);
+        if(pending || !spaced) text_putc(out, ' ');
+        text_printf(out, "%d", load_be16(&program[pos]));
+        pos += 2;
+        pending = 0;
+        spaced = 0;
+        continue;
+      }
+
+      word = basic_tokens[token - 0x80];
+      if(word == NULL)
+      {
+        text_printf(out, "[%02X]", token);
+        continue;
+      }
+      if((word[0] >= 'A' && word[0] <= 'Z') || token == 0x82 || token == 0x83)
+      {
+        // Keywords stand apart from whatever is next to them
+        char last = out->length ? out->data[out->length - 1] : ' ';
+        if(!spaced && (pending || isalnum((unsigned char)last) ||
+                       last == '$' || last == '"' || last == ')' ||
+                       token == 0x82 || token == 0x83))
+          text_putc(out, ' ');
+        text_append(out, word, strlen(word));
+        pending = 1;
+        spaced = 0;
+
+        // Remarks keep the rest of the line as it was typed
+        if(token == 0x9A || token == 0x83)
+        {
+          const unsigned char *stop = memchr(&program[pos], 0, end - pos);
+          int length = (stop ? stop - program : end) - pos;
+          if(length > 0 && program[pos] != ' ') text_putc(out, ' ');
+          text_append(out, &program[pos], length);
+          pos += length;
+        }
+        continue;
+      }
+      // Signs after a keyword keep their space, as in STEP -1
+      if(pending && (token == 0xC1 || token == 0xC2)) text_putc(out, ' ');
+      text_append(out, word, strlen(word));
+      pending = 0;
+      spaced = 0;
+    }
+    text_putc(out, '\n');
+  }
+  return(entries);
+}
+
+
+/*===========================================================================
+ *                              extract_all
+ *===========================================================================
+ * Desription: Extract all files from the disk image
+ *
+ * Parameters: None
+ *
+ * Return:     None
+ */
+void extract_all()
+{
+  int i;
+  uint16_t index[MAX_FILE_COUNT];
+
+  // Iterate over all files
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct fib_block* fib = fib_at(index[i]);
+    if(fib != NULL)
+      extract_file(fib, NULL);
+  }
+}
+
+
+/*===========================================================================
+ *                             allocate_from
+ *===========================================================================
+ * Desription: Allocate the first free sector at or after a sector, going
+ *             round to the start of the disk if need be
+ *
+ * Parameters: start - Sector to start searching at
+ *
+ * Return:     Pointer to new sector, NULL if none available
+ */
+struct disk_sector* allocate_from(int start)
+{
+  int au = sectors_per_au();
+  int first = au > 1 ? au : 2;
+  int sectors = disk_size / sizeof(struct disk_sector);
+  int pass;
+  int i;
+
+  if(start < first || start >= sectors) start = first;
+  start -= start % au;
+  for(pass = 0; pass < 2; pass++)
+  {
+    int end = pass ? start : sectors;
+    for(i = pass ? first : start; i < end; i += au)
+    {
+      stats.allocator_probes++;
+      if(sector_free(i))
+      {
+        TRACE_INSTANT(trace_allocate, i);
+        mark_sector(i, 1);
+        next_fit_sector = i + au;
+        return(get_sector(i));
+      }
+    }
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                                allocate
+ *===========================================================================
+ * Desription: Allocate a free sector from the disk
+ *
+ * Parameters: None
+ *
+ * Return:     Pointer to new sector, NULL if none available
+ */
+struct disk_sector* allocate()
+{
+  return(allocate_from(0));
+}
+
+
+/*===========================================================================
+ *                             free_run_start
+ *===========================================================================
+ * Desription: Choose where to allocate file data under the current
+ *             allocation policy
+ *
+ * Parameters: need - Number of sectors still to allocate
+ *
+ * Return:     Sector to start allocating at
+ */
+int free_run_start(int need)
+{
+  int au = sectors_per_au();
+  int first = au > 1 ? au : 2;
+  int sectors = disk_size / sizeof(struct disk_sector);
+  int best = -1;
+  int best_length = 0;
+  int run = -1;
+  int i;
+
+  if(allocation_policy == policy_first_fit) return(first);
+  if(allocation_policy == policy_next_fit)  return(next_fit_sector);
+
+  for(i = first; i <= sectors; i += au)
+  {
+    int length;
+    stats.allocator_probes++;
+    if(i < sectors && sector_free(i))
+    {
+      if(run < 0) run = i;
+      continue;
+    }
+    if(run < 0) continue;
+
+    // Best fit takes the smallest run that holds everything, or else the
+    // largest run there is
+    length = i - run;
+    if(best < 0 ||
+       (allocation_policy == policy_worst_fit && length > best_length) ||
+       (allocation_policy == policy_best_fit &&
+        (best_length < need ? length > best_length
+                            : length >= need && length < best_length)))
+    {
+      best = run;
+      best_length = length;
+    }
+    run = -1;
+  }
+  return(best < 0 ? first : best);
+}
+
+
+/*===========================================================================
+ *                             free_sector_count
+ *===========================================================================
+ * Desription: Determine the number of free sectors on this disk
+ *
+ * Parameters: None
+ *
+ * Return:     Number of free sectors
+ */
+int free_sector_count()
+{
+  int i;
+  int count = 0;
+  int au = sectors_per_au();
+  for(i = au > 1 ? au : 2; i < disk_size / sizeof(struct disk_sector);
+      i += au)
+  {
+    if(sector_free(i))
+    {
+      count += au;
+    }
+  }
+  stats.allocator_probes += i / au;
+  return(count);
+}
+
+
+/*===========================================================================
+ *                              free_spans
+ *===========================================================================
+ * Desription: Clear and release the sectors of a list of spans
+ *
+ * Parameters: spans - Spans to release
+ *             count - Number of spans
+ *
+ * Return:     None
+ */
+void free_spans(struct cluster_span *spans, int count)
+{
+  int i;
+  int secno;
+  for(i = 0; i < count; i++)
+  {
+    for(secno = spans[i].first;
+        secno < spans[i].first + spans[i].count; secno++)
+    {
+      memset(get_sector(secno), 0, sizeof(struct disk_sector));
+      mark_sector(secno, 0);
+    }
+  }
+}
+
+
+/*===========================================================================
+ *                            allocate_spans
+ *===========================================================================
+ * Desription: Allocate sectors and append them to a list of spans,
+ *             merging sectors that follow the last span
+ *
+ * Parameters: spans      - Span list to extend
+ *             span_count - Number of spans in the list, updated
+ *             sectors    - Number of sectors to add
+ *
+ * Return:     Were all sectors allocated? On failure the sectors that
+ *             were added are released again.
+ */
+int allocate_spans(struct cluster_span *spans, int *span_count, int sectors)
+{
+  int start_count = *span_count;
+  int start_last = (start_count > 0) ? spans[start_count-1].count : 0;
+  int i;
+
+  for(i = 0; i < sectors; i++)
+  {
+    int secnum;
+    int n = *span_count;
+    int end = (n > 0) ? spans[n-1].first + spans[n-1].count : 0;
+    struct disk_sector *sector;
+
+    // The rest of the last AU already belongs to this file
+    if(n > 0 && end % sectors_per_au())
+    {
+      spans[n-1].count++;
+      continue;
+    }
+
+    // Other policies than first fit keep a file together where they can
+    if(allocation_policy != policy_first_fit && n > 0 &&
+       end < disk_size / (int)sizeof(struct disk_sector) && sector_free(end))
+      sector = allocate_from(end);
+    else
+      sector = allocate_from(free_run_start(sectors - i));
+    if(sector == NULL) break;
+
+    // Sectors in a cluster must be contiguous, check that here
+    secnum = sector_of(sector);
+    if(n == 0 || secnum != spans[n-1].first + spans[n-1].count)
+    {
+      // No longer contiguous, make a new cluster for this sector
+      if(n == MAX_CLUSTERS)
+      {
+        mark_sector(secnum, 0);
+        break;
+      }
+      spans[n].first = secnum;
+      spans[n].count = 0;
+      (*span_count)++;
+      n++;
+    }
+    spans[n-1].count++;
+  }
+  if(i == sectors) return(1);
+
+  // Give back what was taken
+  if(start_count > 0)
+  {
+    struct cluster_span tail = spans[start_count-1];
+    tail.first += start_last;
+    tail.count -= start_last;
+    free_spans(&tail, 1);
+    spans[start_count-1].count = start_last;
+  }
+  free_spans(&spans[start_count], *span_count - start_count);
+  *span_count = start_count;
+  return(0);
+}
+
+
+/*===========================================================================
+ *                             extend_spans
+ *===========================================================================
+ * Desription: Timed allocation of sectors appended to a list of spans
+ *
+ * Parameters: spans      - Span list to extend
+ *             span_count - Number of spans in the list, updated
+ *             sectors    - Number of sectors to add
+ *
+ * Return:     Were all sectors allocated?
+ */
+int extend_spans(struct cluster_span *spans, int *span_count, int sectors)
+{
+  struct phase_timer timer;
+  int ok;
+
+  phase_start(&timer, phase_allocate);
+  ok = allocate_spans(spans, span_count, sectors);
+  phase_stop(&timer);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                           write_span_data
+ *===========================================================================
+ * Desription: Store file contents in the sectors of a list of spans,
+ *             clearing the unused part of the last sector. Sectors that
+ *             already hold the right bytes are left alone.
+ *
+ * Parameters: spans      - Spans receiving the data
+ *             span_count - Number of spans
+ *             data       - File contents
+ *             size       - Size of file contents
+ *
+ * Return:     Number of sectors changed
+ */
+int write_span_data(struct cluster_span *spans, int span_count,
+                    unsigned char *data, int size)
+{
+  struct disk_sector contents;
+  int changed = 0;
+  int i;
+  int j;
+  int pos = 0;
+
+  for(i = 0; i < span_count; i++)
+  {
+    for(j = 0; j < spans[i].count; j++, pos += SECTOR_SIZE)
+    {
+      struct disk_sector *sector = get_sector(spans[i].first + j);
+      int chunk = size - pos;
+      if(chunk > SECTOR_SIZE) chunk = SECTOR_SIZE;
+      if(chunk < 0) chunk = 0;
+      memcpy(contents.data, &data[pos], chunk);
+      memset(contents.data + chunk, 0, SECTOR_SIZE - chunk);
+      if(sector_equal(sector, &contents)) continue;
+      *sector = contents;
+      changed++;
+    }
+  }
+  return(changed);
+}
+
+
+/*===========================================================================
+ *                          fib_update_records
+ *===========================================================================
+ * Desription: Update the record count of a data file after its size
+ *             changed
+ *
+ * Parameters: fib - File information block
+ *
+ * Return:     None
+ */
+void fib_update_records(struct fib_block *fib)
+{
+  if(fib->flags & fib_program) return;
+  if(fib->flags & fib_var)
+    fib_set_fixrecs(fib, fib_physrec_count(fib));
+  else if(fib->reclen != 0)
+    fib_set_fixrecs(fib, fib_file_size(fib) / fib->reclen);
+}
+
+
+/*===========================================================================
+ *                            add_file_data
+ *===========================================================================
+ * Desription: Add a file held in memory to the disk image
+ *
+ * Parameters: label     - Source name used in messages
+ *             diskname  - Name used for the file in V9T9 format
+ *             data      - File contents
+ *             file_size - Size of file contents
+ *
+ * Return:     Pointer to the new FIB, NULL if the file was not added
+ */
+struct fib_block* add_file_data(char *label, char *diskname,
+                                unsigned char *data, int file_size)
+{
+  struct fib_block *fib;
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count = 0;
+  int physrecs;
+  int i;
+  int j;
+  int sector_size = sizeof(struct disk_sector);
+  uint16_t index[MAX_FILE_COUNT];
+
+  if(all_args.verbose)
+    printf("Attempting to add \"%s\" as \"%.*s\"\n", label,
+           FILE_NAME_LEN, diskname);
+
+  // Search for existing file with matching name
+  if(find_fib(diskname) != NULL)
+  {
+    if(!all_args.quiet)
+      printf("Cannot add \"%s\" as \"%.*s\", file already exists\n",
+             label, FILE_NAME_LEN, diskname);
+    return(NULL);
+  }
+
+  // Make sure there is room in the file index
+  if(fdr_index_decode(index) >= MAX_FILE_COUNT)
+  {
+    if(!all_args.quiet) printf("Cannot add \"%s\", too many files\n", label);
+    return(NULL);
+  }
+
+  // Make sure we can fit this file (file data + FIB)
+  physrecs = (file_size + sector_size - 1) / sector_size;
+  if(free_sector_count() < physrecs + 1)
+  {
+    if(!all_args.quiet) printf("Cannot add \"%s\", disk full\n", label);
+    return(NULL);
+  }  	  
+  
+  // Create FIB for this file
+  fib = (struct fib_block*)allocate();
+  if(fib == NULL)
+  {
+    if(!all_args.quiet) printf("Cannot add \"%s\", disk full\n", label);
+    return(NULL);
+  }
+  memset(fib, 0, sector_size);
+  fib->flags = fib_program;
+  fib_set_physrec_count(fib, physrecs);
+  fib->eof = file_size % sector_size;
+  strncpy(fib->name, diskname, FILE_NAME_LEN);
+
+  // Save file contents
+  if(!extend_spans(spans, &span_count, physrecs))
+  {
+    if(!all_args.quiet)
+      printf("Cannot add \"%s\", disk is too fragmented\n", label);
+    memset(fib, 0, sector_size);
+    mark_sector(sector_of(fib), 0);
+    return(NULL);
+  }
+  write_span_data(spans, span_count, data, file_size);
+  fib_set_spans(fib, spans, span_count);
+
+  // Add file to listing
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct fib_block *entry = fib_at(index[i]);
+    if(entry == NULL ||
+       strncmp(entry->name, fib->name, FILE_NAME_LEN) > 0)
+      break;
+  }
+  for(j = MAX_FILE_COUNT - 1; j > i ; j--)
+    index[j] = index[j-1];
+  index[i] = sector_of(fib);
+  for(; i < MAX_FILE_COUNT; i++)
+    fdr_index_set(i, index[i]);
+
+  return(fib);
+}
+
+
+/*===========================================================================
+ *                              grow_file
+ *===========================================================================
+ * Desription: Add one sector to the end of a file, taking the sector right
+ *             after its last cluster when that one is free
+ *
+ * Parameters: fib - File information block
+ *
+ * Return:     New disk sector, 0 if the disk is full
+ */
+int grow_file(struct fib_block *fib)
+{
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count = fib_spans(fib, spans);
+  int physrecs = fib_physrec_count(fib);
+  int sectors = disk_size / SECTOR_SIZE;
+  int have = 0;
+  int secno;
+  int end;
+  int i;
+
+  if(span_count < 0) return(0);
+  for(i = 0; i < span_count; i++) have += spans[i].count;
+
+  // Sectors already allocated past the end of the file come first
+  if(have <= physrecs)
+  {
+    end = span_count ? spans[span_count-1].first +
+                       spans[span_count-1].count : 0;
+    if(span_count > 0 && end < sectors && end % sectors_per_au() == 0 &&
+       sector_free(end))
+    {
+      allocate_from(end);
+      spans[span_count-1].count++;
+    }
+    else if(!extend_spans(spans, &span_count, 1 + physrecs - have))
+    {
+      return(0);
+    }
+    fib_set_spans(fib, spans, span_count);
+  }
+
+  secno = record_sector(fib, physrecs);
+  if(secno == 0) return(0);
+  memset(get_sector(secno), 0, SECTOR_SIZE);
+  fib_set_physrec_count(fib, physrecs + 1);
+  return(secno);
+}
+
+
+/*===========================================================================
+ *                             append_record
+ *===========================================================================
+ * Desription: Add a record to the end of a data file in place
+ *
+ *             A variable record goes after the last record of the last
+ *             sector when it fits there; a fixed record goes in the next
+ *             free slot. A sector is only added when the last one is full.
+ *             Short fixed records are padded with spaces for display files
+ *             and zeros for internal files.
+ *
+ * Parameters: fib    - File information block
+ *             data   - Record contents
+ *             length - Record length
+ *
+ * Return:     Was the record added?
+ */
+int append_record(struct fib_block *fib, unsigned char *data, int length)
+{
+  int reclen = fib->reclen ? fib->reclen : SECTOR_SIZE;
+  int physrecs = fib_physrec_count(fib);
+  unsigned char *sector;
+  int secno;
+
+  if(fib->flags & fib_program) return(0);
+  if(length > reclen || (fib->flags & fib_var && length > SECTOR_SIZE - 2))
+    return(0);
+
+  if(fib->flags & fib_var)
+  {
+    // Each sector is a run of length prefixed records ended by 0xFF, the
+    // end is found by walking them as not every writer sets eof to it
+    int used = SECTOR_SIZE;
+    secno = physrecs > 0 ? record_sector(fib, physrecs - 1) : 0;
+    if(secno != 0)
+    {
+      sector = get_sector(secno)->data;
+      for(used = 0; used < SECTOR_SIZE && sector[used] != 0xFF; )
+        used += 1 + sector[used];
+    }
+    if(used + 1 + length + 1 > SECTOR_SIZE)
+    {
+      secno = grow_file(fib);
+      used = 0;
+    }
+    if(secno == 0) return(0);
+    sector = get_sector(secno)->data;
+    sector[used] = length;
+    memcpy(&sector[used + 1], data, length);
+    sector[used + 1 + length] = 0xFF;
+    fib->eof = used + 1 + length;
+    fib_set_fixrecs(fib, fib_physrec_count(fib));
+  }
+  else
+  {
+    int per_sector = fib->recsperphysrec ? fib->recsperphysrec
+                                         : SECTOR_SIZE / reclen;
+    int recno = fib_fixrecs(fib);
+    if(per_sector * reclen > SECTOR_SIZE) return(0);
+    if(recno / per_sector < physrecs)
+    {
+      secno = record_sector(fib, recno / per_sector);
+    }
+    else
+    {
+      secno = grow_file(fib);
+      fib->eof = 0;
+    }
+    if(secno == 0) return(0);
+    sector = &get_sector(secno)->data[(recno % per_sector) * reclen];
+    memset(sector, (fib->flags & fib_binary) ? 0 : ' ', reclen);
+    memcpy(sector, data, length);
+    fib_set_fixrecs(fib, recno + 1);
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             write_record
+ *===========================================================================
+ * Desription: Replace one record of a fixed record file in place, padded
+ *             as by append_record()
+ *
+ * Parameters: fib    - File information block
+ *             recno  - Record number
+ *             data   - Record contents
+ *             length - Record length
+ *
+ * Return:     Was the record written?
+ */
+int write_record(struct fib_block *fib, int recno, unsigned char *data,
+                 int length)
+{
+  int reclen = fib->reclen ? fib->reclen : SECTOR_SIZE;
+  int per_sector = fib->recsperphysrec ? fib->recsperphysrec
+                                       : SECTOR_SIZE / reclen;
+  unsigned char *record;
+  int secno;
+
+  if(fib->flags & (fib_program | fib_var)) return(0);
+  if(length > reclen || recno < 0 || recno >= fib_fixrecs(fib) ||
+     per_sector * reclen > SECTOR_SIZE)
+    return(0);
+  secno = record_sector(fib, recno / per_sector);
+  if(secno == 0) return(0);
+  record = &get_sector(secno)->data[(recno % per_sector) * reclen];
+  memset(record, (fib->flags & fib_binary) ? 0 : ' ', reclen);
+  memcpy(record, data, length);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                            read_host_file
+ *===========================================================================
+ * Desription: Read a whole host file into memory
+ *
+ * Parameters: filename - File to read
+ *             size     - Receives the file size
+ *
+ * Return:     Allocated file contents, NULL if the file cannot be read
+ */
+unsigned char* read_host_file(char *filename, int *size)
+{
+  FILE *file;
+  unsigned char *data;
+  long file_size;
+
+  file = fopen(filename, "rb");
+  if(file == NULL) return(NULL);
+  fseek(file, 0, SEEK_END);
+  file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data = malloc(file_size > 0 ? file_size : 1);
+  if(data == NULL || fread(data, 1, file_size, file) != (size_t)file_size)
+  {
+    free(data);
+    fclose(file);
+    return(NULL);
+  }
+  fclose(file);
+  *size = file_size;
+  return(data);
+}
+
+
+/*===========================================================================
+ *                                add_file
+ *===========================================================================
+ * Desription: Add a file to the disk image
+ *
+ * Parameters: filename - File name to add
+ *             diskname - Name used for the file in V9T9 format
+ *
+ * Return:     Was file added?
+ */
+int add_file(char *filename, char *diskname)
+{
+  unsigned char *data;
+  int file_size;
+  struct fib_block *fib;
+
+  // Make sure the Source file exists
+  data = read_host_file(filename, &file_size);
+  if(data == NULL)
+  {
+    printf("Cannot add \"%s\", file does not exist\n", filename);
+    return(0);
+  }
+
+  fib = add_file_data(filename, diskname, data, file_size);
+  free(data);
+  return(fib != NULL);
+}
+
+
+/*===========================================================================
+ *                            copy_file_data
+ *===========================================================================
+ * Desription: Copy the contents of a file in the disk image to memory
+ *
+ * Parameters: fib  - File information block
+ *             data - Receives the contents, fib_file_size() bytes
+ *
+ * Return:     Were all the contents copied? Not if the cluster table is
+ *             bad or shorter than the file claims.
+ */
+int copy_file_data(struct fib_block *fib, unsigned char *data)
+{
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count = fib_spans(fib, spans);
+  int file_size = fib_file_size(fib);
+  int pos = 0;
+  int i;
+  int j;
+
+  if(span_count < 0) return(0);
+  for(i = 0; i < span_count && pos < file_size; i++)
+  {
+    for(j = 0; j < spans[i].count && pos < file_size; j++)
+    {
+      int chunk = file_size - pos;
+      if(chunk > SECTOR_SIZE) chunk = SECTOR_SIZE;
+      memcpy(&data[pos], get_sector(spans[i].first + j), chunk);
+      pos += chunk;
+    }
+  }
+  return(pos == file_size);
+}
+
+
+/*===========================================================================
+ *                            load_file_data
+ *===========================================================================
+ * Desription: Read the contents of a file in the disk image into memory
+ *
+ * Parameters: fib  - File information block
+ *             size - Receives the file size
+ *
+ * Return:     Allocated file contents, NULL if the cluster table is bad
+ */
+unsigned char* load_file_data(struct fib_block *fib, int *size)
+{
+  int file_size = fib_file_size(fib);
+  unsigned char *data = malloc(file_size > 0 ? file_size : 1);
+
+  if(data == NULL || !copy_file_data(fib, data))
+  {
+    free(data);
+    return(NULL);
+  }
+  *size = file_size;
+  return(data);
+}
+
+
+/*===========================================================================
+ *                            list_program
+ *===========================================================================
+ * Desription: Write the source of a BASIC program file to a host file
+ *
+ * Parameters: fib      - File information block
+ *             filename - File name to use for the listing
+ *
+ * Return:     Was the program listed?
+ */
+int list_program(struct fib_block *fib, char *filename)
+{
+  struct text_buffer listing;
+  char name[FILE_NAME_LEN + 1];
+  unsigned char *data = NULL;
+  int lines = -1;
+  int size;
+  int ok;
+
+  host_name(fib, name);
+  memset(&listing, 0, sizeof(listing));
+  if(fib->flags & fib_program) data = load_file_data(fib, &size);
+  if(data != NULL) lines = detokenize(data, size, &listing);
+  free(data);
+  if(lines < 0)
+  {
+    printf("Cannot list \"%s\", not a BASIC program\n", name);
+    free(listing.data);
+    return(0);
+  }
+
+  ok = write_host_file(filename, (unsigned char*)listing.data,
+                       listing.length);
+  free(listing.data);
+  if(!ok)
+  {
+    printf("Cannot open file \"%s\"\n", filename);
+    return(0);
+  }
+  if(all_args.verbose)
+    printf("Listed %d lines of \"%s\" to \"%s\"\n", lines, name, filename);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             rewrite_file
+ *===========================================================================
+ * Desription: Replace the contents of a file in the disk image, keeping
+ *             its FIB, its index slot and as much of its current
+ *             allocation as the new size needs. Only sectors whose
+ *             contents differ are written.
+ *
+ * Parameters: fib       - File information block
+ *             data      - New file contents
+ *             file_size - Size of new contents
+ *
+ * Return:     Was the file rewritten?
+ */
+int rewrite_file(struct fib_block *fib, unsigned char *data, int file_size)
+{
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count = fib_spans(fib, spans);
+  int physrecs = (file_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  int have = 0;
+  int i;
+
+  if(span_count < 0) return(0);
+  for(i = 0; i < span_count; i++) have += spans[i].count;
+
+  if(physrecs > have)
+  {
+    // Grow at the tail of the file
+    if(!extend_spans(spans, &span_count, physrecs - have)) return(0);
+  }
+  else
+  {
+    // Release whatever the new contents no longer need
+    int keep = physrecs;
+    for(i = 0; i < span_count && keep >= spans[i].count; i++)
+      keep -= spans[i].count;
+    if(i < span_count)
+    {
+      struct cluster_span tail = spans[i];
+      tail.first += keep;
+      tail.count -= keep;
+      free_spans(&tail, 1);
+      free_spans(&spans[i + 1], span_count - i - 1);
+      spans[i].count = keep;
+      span_count = (keep > 0) ? i + 1 : i;
+    }
+  }
+
+  write_span_data(spans, span_count, data, file_size);
+  fib_set_spans(fib, spans, span_count);
+  fib_set_physrec_count(fib, physrecs);
+  fib->eof = file_size % SECTOR_SIZE;
+  fib_update_records(fib);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             replace_file
+ *===========================================================================
+ * Desription: Replace the contents of a file on disk with a host file,
+ *             adding it if it is not there yet
+ *
+ * Parameters: filename - Host file
+ *             diskname - Name of the file on disk
+ *
+ * Return:     Was the disk image changed?
+ */
+int replace_file(char *filename, char *diskname)
+{
+  struct fib_block *fib = find_fib(diskname);
+  unsigned char *data;
+  int file_size;
+  int ok;
+
+  if(fib == NULL) return(add_file(filename, diskname));
+
+  data = read_host_file(filename, &file_size);
+  if(data == NULL)
+  {
+    printf("Cannot replace \"%.*s\", \"%s\" does not exist\n",
+           FILE_NAME_LEN, diskname, filename);
+    return(0);
+  }
+  if(all_args.verbose)
+    printf("Replacing \"%.*s\" with \"%s\"\n", FILE_NAME_LEN, diskname,
+           filename);
+  ok = rewrite_file(fib, data, file_size);
+  if(!ok)
+    printf("Cannot replace \"%.*s\", disk full\n", FILE_NAME_LEN, diskname);
+  free(data);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                          set_file_attributes
+ *===========================================================================
+ * Desription: Apply the type and protection options of a file argument
+ *             to a file in the disk image
+ *
+ * Parameters: fib   - File information block
+ *             file  - File options to apply
+ *             label - File name used in messages
+ *
+ * Return:     None
+ */
+void set_file_attributes(struct fib_block *fib, struct file_arg *file,
+                         char *label)
+{
+  if(file->protect)   fib->flags |=  fib_wp;
+  if(file->unprotect) fib->flags &= ~fib_wp;
+  if(file->binary)    fib->flags |=  fib_binary;
+  if(file->ascii)     fib->flags &= ~fib_binary;
+  if(file->variable)  fib->flags |=  fib_var;
+  if(file->fixed)     fib->flags &= ~fib_var;
+  if(file->program)   
+  {
+    fib->flags |= fib_program;
+    fib->flags &= ~(fib_binary | fib_var);
+    fib->reclen = 0;
+  }
+  if(file->binary   || file->ascii ||
+     file->variable || file->fixed)
+  {
+    fib->flags &= ~fib_program;
+
+    int j;
+    int sector_count = 0;
+    struct cluster_span spans[MAX_CLUSTERS];
+    int span_count = fib_spans(fib, spans);
+    for(j=0; j<span_count; j++)
+      sector_count += spans[j].count;
+
+    if(file->variable)
+    {
+      // Variable files count level 2 records actually used
+      fib->reclen = 254;
+      fib->recsperphysrec = 254 / fib->reclen;
+      fib_set_fixrecs(fib, sector_count);
+    }
+    else if(file->fixed)
+    {
+      fib->reclen = file->record_size;
+      fib->recsperphysrec = SECTOR_SIZE / fib->reclen;
+      fib_set_fixrecs(fib, (sector_count * SECTOR_SIZE) / fib->reclen);
+    }
+  }
+  if(all_args.verbose)
+  {
+    printf("Setting file \"%s\" as ", label);
+    if(fib->flags & fib_program)
+      printf("program\n");
+    else
+      printf("%s/%s %d\n", 
+             (fib->flags & fib_binary) ? "internal" : "display",
+             (fib->flags & fib_var)    ? "variable" : "fixed",
+             fib->reclen);
+  }
+}
+
+
+/*===========================================================================
+ *                            apply_file_arg
+ *===========================================================================
+ * Desription: Carry out the operations requested for one file
+ *
+ * Parameters: file - File operations
+ *
+ * Return:     Was the disk image modified?
+ */
+int apply_file_arg(struct file_arg *file)
+{
+  struct fib_block *fib;
+  char name[FILE_NAME_LEN + 1];
+  char *range;
+  int modified = 0;
+  name[FILE_NAME_LEN] = 0;
+
+  // Extract a range of records, "name#first[-last]"
+  if(file->extract && (range = strchr(file->file_name, '#')) != NULL)
+  {
+    char *end;
+    int first = strtol(range + 1, &end, 10);
+    int last = first;
+    if(*end == '-') last = strtol(end + 1, &end, 10);
+    if(end == range + 1 || *end != 0)
+    {
+      printf("Invalid record range \"%s\"\n", range);
+      return(0);
+    }
+    *range = 0;
+    if(file->output_name[0] == 0)
+      strcpy(file->output_name, file->file_name);
+    make_name(name, file->file_name, FILE_NAME_LEN);
+    fib = find_fib(name);
+    if(fib == NULL)
+      printf("Cannot find file \"%s\"\n", file->file_name);
+    else
+      extract_records(fib, first, last, file->output_name);
+    *range = '#';
+    return(0);
+  }
+
+  if(file->output_name[0] == 0)
+    strcpy(file->output_name, file->file_name);
+
+  // Make disk name    
+  make_name(name, file->file_name, FILE_NAME_LEN);
+
+  // Extract file from disk
+  if(file->extract )
+  {
+    fib = find_fib(name);
+    if(fib == NULL)
+      printf("Cannot find file \"%s\"\n", file->file_name);
+    else if(file->basic)
+      list_program(fib, file->output_name);
+    else
+      extract_file(fib, file->output_name);
+  }
+
+  // Remove file from disk
+  if(file->remove)
+    modified = remove_file(name);
+
+  // Add file to disk
+  if(file->add)
+  {
+    make_name(name, file->output_name, FILE_NAME_LEN);
+    modified = add_file(file->file_name, name);
+  }
+
+  // Replace file contents, keeping its FIB and place in the index
+  if(file->replace)
+  {
+    make_name(name, file->output_name, FILE_NAME_LEN);
+    modified = replace_file(file->file_name, name);
+  }
+
+  // Set file attributes
+  if(file->protect  || file->unprotect ||
+     file->binary   || file->ascii     ||
+     file->variable || file->fixed     ||
+     file->program  || file->add)   
+  {
+    fib = find_fib(name);
+    if(fib == NULL)
+    {
+      printf("Cannot find file \"%s\"\n", file->file_name);
+    }
+    else
+    {
+      set_file_attributes(fib, file, file->file_name);
+      modified = 1;
+    }
+  }
+  return(modified);
+}
+
+
+/*===========================================================================
+ *                            open_image_view
+ *===========================================================================
+ * Desription: Get read-only access to a whole disk image
+ *
+ *             Sector dumps are mapped directly, other formats and images
+ *             inside packs are loaded and decoded into memory.
+ *
+ * Parameters: view     - View to fill
+ *             filename - Disk image file
+ *
+ * Return:     Was the image opened?
+ */
+int open_image_view(struct image_view *view, char *filename)
+{
+  struct stat info;
+  char pack[1024];
+  char magic[4];
+  int fd;
+
+  memset(view, 0, sizeof(struct image_view));
+
+  // Images in a pack go through the loader below
+  if(pack_split(filename, pack, sizeof(pack)) == NULL)
+  {
+    fd = open(filename, O_RDONLY);
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+      printf("Cannot open disk image \"%s\"\n", filename);
+      if(fd >= 0) close(fd);
+      return(0);
+    }
+
+    if(info.st_size >= 2 * SECTOR_SIZE && info.st_size % SECTOR_SIZE == 0 &&
+       pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+       memcmp(magic, CONTAINER_MAGIC, sizeof(magic)) != 0)
+    {
+      view->data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if(view->data == MAP_FAILED)
+      {
+        printf("Cannot read disk image \"%s\"\n", filename);
+        return(0);
+      }
+      view->size = info.st_size;
+      view->map_size = info.st_size;
+      return(1);
+    }
+    close(fd);
+  }
+
+  // Decode through the normal loader and take over its buffer
+  if(load_disk(filename) == 0) return(0);
+  container_release();
+  view->data = disk_buffer;
+  view->size = disk_size;
+  disk_buffer = NULL;
+  disk_size = 0;
+  return(1);
+}
+
+
+/*===========================================================================
+ *                           close_image_view
+ *===========================================================================
+ * Desription: Release a view opened by open_image_view
+ *
+ * Parameters: view - View to release
+ *
+ * Return:     None
+ */
+void close_image_view(struct image_view *view)
+{
+  if(view->map_size != 0)
+    munmap(view->data, view->map_size);
+  else
+    free(view->data);
+  memset(view, 0, sizeof(struct image_view));
+}
+
+
+/*===========================================================================
+ *                            changed_sector
+ *===========================================================================
+ * Desription: Check whether a sector differs between two images, treating
+ *             sectors past the end of the old image as blank
+ *
+ * Parameters: old_view - Old image
+ *             new_view - New image
+ *             secno    - Sector number in the new image
+ *
+ * Return:     Does the sector differ?
+ */
+int changed_sector(struct image_view *old_view, struct image_view *new_view,
+                   int secno)
+{
+  unsigned char *data = &new_view->data[secno * SECTOR_SIZE];
+  if((secno + 1) * SECTOR_SIZE > old_view->size)
+    return(!sector_is_zero(data));
+  return(!sector_equal(&old_view->data[secno * SECTOR_SIZE], data));
+}
+
+
+/*===========================================================================
+ *                            summarize_delta
+ *===========================================================================
+ * Desription: Build the file-level summary of the changes between images
+ *
+ * Parameters: old_view - Old image
+ *             new_view - New image
+ *             changed  - Per-sector change flags of the new image
+ *             summary  - Output buffer of 2 * MAX_FILE_COUNT entries
+ *
+ * Return:     Number of summary entries
+ */
+int summarize_delta(struct image_view *old_view, struct image_view *new_view,
+                    unsigned char *changed, unsigned char *summary)
+{
+  uint16_t old_index[MAX_FILE_COUNT];
+  uint16_t new_index[MAX_FILE_COUNT];
+  struct fib_block *old_fib[MAX_FILE_COUNT];
+  struct fib_block *new_fib[MAX_FILE_COUNT];
+  int count = 0;
+  int i;
+  int j;
+
+  // Collect the FIBs of both images through the usual accessors
+  disk_buffer = old_view->data;
+  disk_size = old_view->size;
+  fdr_index_decode(old_index);
+  for(i = 0; i < MAX_FILE_COUNT; i++) old_fib[i] = fib_at(old_index[i]);
+  disk_buffer = new_view->data;
+  disk_size = new_view->size;
+  fdr_index_decode(new_index);
+  for(i = 0; i < MAX_FILE_COUNT; i++) new_fib[i] = fib_at(new_index[i]);
+
+  // Added and modified files
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct cluster_span spans[MAX_CLUSTERS];
+    int span_count;
+    int op = 'A';
+
+    if(new_fib[i] == NULL) continue;
+    for(j = 0; j < MAX_FILE_COUNT; j++)
+    {
+      if(old_fib[j] != NULL &&
+         memcmp(old_fib[j]->name, new_fib[i]->name, FILE_NAME_LEN) == 0)
+        break;
+    }
+    if(j < MAX_FILE_COUNT)
+    {
+      op = 0;
+      if(memcmp(old_fib[j], new_fib[i], SECTOR_SIZE) != 0) op = 'M';
+      span_count = fib_spans(new_fib[i], spans);
+      for(j = 0; op == 0 && j < span_count; j++)
+      {
+        int secno;
+        for(secno = spans[j].first;
+            secno < spans[j].first + spans[j].count; secno++)
+        {
+          if(changed[secno]) op = 'M';
+        }
+      }
+      if(op == 0) continue;
+    }
+    summary[count * DELTA_SUMMARY_SIZE] = op;
+    summary[count * DELTA_SUMMARY_SIZE + 1] = new_fib[i]->flags;
+    memcpy(&summary[count * DELTA_SUMMARY_SIZE + 2], new_fib[i]->name,
+           FILE_NAME_LEN);
+    count++;
+  }
+
+  // Deleted files
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    if(old_fib[i] == NULL) continue;
+    for(j = 0; j < MAX_FILE_COUNT; j++)
+    {
+      if(new_fib[j] != NULL &&
+         memcmp(old_fib[i]->name, new_fib[j]->name, FILE_NAME_LEN) == 0)
+        break;
+    }
+    if(j < MAX_FILE_COUNT) continue;
+    summary[count * DELTA_SUMMARY_SIZE] = 'D';
+    summary[count * DELTA_SUMMARY_SIZE + 1] = old_fib[i]->flags;
+    memcpy(&summary[count * DELTA_SUMMARY_SIZE + 2], old_fib[i]->name,
+           FILE_NAME_LEN);
+    count++;
+  }
+
+  disk_buffer = NULL;
+  disk_size = 0;
+  return(count);
+}
+
+
+/*===========================================================================
+ *                             diff_command
+ *===========================================================================
+ * Desription: Write the sector-level delta between two disk images
+ *
+ *             The delta holds a header with the sizes and hashes of both
+ *             images, a file-level summary taken from the FIBs, then each
+ *             run of changed sectors with its contents.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: diff {old image} {new image} {delta}
+ *
+ * Return:     Exit status
+ */
+int diff_command(int argc, char **argv)
+{
+  struct image_view old_view;
+  struct image_view new_view;
+  unsigned char header[DELTA_HEADER_SIZE];
+  unsigned char summary[2 * MAX_FILE_COUNT * DELTA_SUMMARY_SIZE];
+  unsigned char *changed;
+  uint64_t old_hash;
+  uint64_t new_hash;
+  int summary_count;
+  int sectors;
+  int run_count = 0;
+  int changed_count = 0;
+  int secno;
+  int i;
+  FILE *file;
+
+  if(argc != 4)
+  {
+    printf("Usage: dsk99 diff {old image} {new image} {delta file}\n");
+    return(1);
+  }
+  if(!open_image_view(&old_view, argv[1])) return(1);
+  if(!open_image_view(&new_view, argv[2]))
+  {
+    close_image_view(&old_view);
+    return(1);
+  }
+
+  // Single pass over the new image marking changed sectors
+  sectors = new_view.size / SECTOR_SIZE;
+  changed = malloc(sectors);
+  for(secno = 0; secno < sectors; secno++)
+  {
+    changed[secno] = changed_sector(&old_view, &new_view, secno);
+    if(changed[secno])
+    {
+      if(secno == 0 || !changed[secno - 1]) run_count++;
+      changed_count++;
+    }
+  }
+  summary_count = summarize_delta(&old_view, &new_view, changed, summary);
+
+  file = fopen(argv[3], "wb");
+  if(file == NULL)
+  {
+    printf("Cannot open file \"%s\"\n", argv[3]);
+    free(changed);
+    close_image_view(&old_view);
+    close_image_view(&new_view);
+    return(1);
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(&header[0], DELTA_MAGIC, 4);
+  store_le32(&header[4], old_view.size);
+  store_le32(&header[8], new_view.size);
+  store_le32(&header[12], run_count);
+  store_le32(&header[16], summary_count);
+  old_hash = hash_bytes(old_view.data, old_view.size, 0);
+  new_hash = hash_bytes(new_view.data, new_view.size, 0);
+  store_le32(&header[24], old_hash);
+  store_le32(&header[28], old_hash >> 32);
+  store_le32(&header[32], new_hash);
+  store_le32(&header[36], new_hash >> 32);
+  fwrite(header, sizeof(header), 1, file);
+  fwrite(summary, DELTA_SUMMARY_SIZE, summary_count, file);
+
+  // Runs of changed sectors
+  for(secno = 0; secno < sectors; )
+  {
+    unsigned char run[8];
+    int first;
+    if(!changed[secno])
+    {
+      secno++;
+      continue;
+    }
+    for(first = secno; secno < sectors && changed[secno]; secno++);
+    store_le32(&run[0], first);
+    store_le32(&run[4], secno - first);
+    fwrite(run, sizeof(run), 1, file);
+    fwrite(&new_view.data[first * SECTOR_SIZE], SECTOR_SIZE,
+           secno - first, file);
+  }
+
+  // Report the file-level summary
+  for(i = 0; i < summary_count; i++)
+  {
+    printf("%c %.*s\n", summary[i * DELTA_SUMMARY_SIZE], FILE_NAME_LEN,
+           &summary[i * DELTA_SUMMARY_SIZE + 2]);
+  }
+  printf("%d sectors changed in %d runs, delta is %ld bytes\n",
+         changed_count, run_count, ftell(file));
+
+  fclose(file);
+  free(changed);
+  close_image_view(&old_view);
+  close_image_view(&new_view);
+  return(0);
+}
+
+
+/*===========================================================================
+ *                            patch_command
+ *===========================================================================
+ * Desription: Apply a delta written by diff_command to a disk image
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: patch {image} {delta} [{output image}]
+ *
+ * Return:     Exit status
+ */
+int patch_command(int argc, char **argv)
+{
+  struct image_view delta;
+  char *output;
+  unsigned char *p;
+  unsigned char *end;
+  uint64_t old_hash;
+  uint64_t new_hash;
+  uint64_t runs;
+  uint32_t new_size;
+  uint32_t run_count;
+  uint32_t i;
+  int fd;
+  struct stat info;
+
+  if(argc != 3 && argc != 4)
+  {
+    printf("Usage: dsk99 patch {image} {delta file} [{output image}]\n");
+    return(1);
+  }
+  output = (argc == 4) ? argv[3] : argv[1];
+
+  // Map the delta
+  memset(&delta, 0, sizeof(delta));
+  fd = open(argv[2], O_RDONLY);
+  if(fd < 0 || fstat(fd, &info) != 0 || info.st_size < DELTA_HEADER_SIZE ||
+     (delta.data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+                        fd, 0)) == MAP_FAILED)
+  {
+    printf("Cannot read delta file \"%s\"\n", argv[2]);
+    if(fd >= 0) close(fd);
+    return(1);
+  }
+  close(fd);
+  delta.size = info.st_size;
+  delta.map_size = info.st_size;
+  p = delta.data;
+  end = p + delta.size;
+  if(memcmp(p, DELTA_MAGIC, 4) != 0)
+  {
+    printf("%s is not a disk image delta\n", argv[2]);
+    close_image_view(&delta);
+    return(1);
+  }
+  new_size = load_le32(&p[8]);
+  run_count = load_le32(&p[12]);
+  runs = DELTA_HEADER_SIZE + (uint64_t)load_le32(&p[16]) * DELTA_SUMMARY_SIZE;
+
+  // Sector numbers are 16 bits, so no image is larger than 64K sectors
+  if(new_size < 2 * SECTOR_SIZE || new_size % SECTOR_SIZE != 0 ||
+     new_size > 0x10000 * SECTOR_SIZE || runs > delta.size)
+  {
+    printf("Delta \"%s\" is corrupt\n", argv[2]);
+    close_image_view(&delta);
+    return(1);
+  }
+  old_hash = load_le32(&p[24]) | ((uint64_t)load_le32(&p[28]) << 32);
+  new_hash = load_le32(&p[32]) | ((uint64_t)load_le32(&p[36]) << 32);
+
+  // The delta only applies to the exact image it was made from
+  if(load_disk(argv[1]) == 0)
+  {
+    close_image_view(&delta);
+    return(1);
+  }
+  container_release();
+  if(disk_size != (int)load_le32(&p[4]) ||
+     hash_bytes(disk_buffer, disk_size, 0) != old_hash)
+  {
+    printf("Delta \"%s\" does not apply to \"%s\"\n", argv[2], argv[1]);
+    close_image_view(&delta);
+    return(1);
+  }
+  if((int)new_size != disk_size)
+  {
+    void *resized = realloc(disk_buffer, new_size);
+    if(resized == NULL)
+    {
+      printf("Cannot allocate %u bytes for \"%s\"\n", new_size, output);
+      close_image_view(&delta);
+      return(1);
+    }
+    disk_buffer = resized;
+    if((int)new_size > disk_size)
+      memset((unsigned char*)disk_buffer + disk_size, 0,
+             new_size - disk_size);
+    disk_size = new_size;
+  }
+
+  // Copy each run of sectors into place
+  p += runs;
+  for(i = 0; i < run_count; i++)
+  {
+    uint32_t first;
+    uint32_t count;
+    if(end - p < 8) break;
+    first = load_le32(&p[0]);
+    count = load_le32(&p[4]);
+    p += 8;
+    if((uint64_t)(end - p) < (uint64_t)count * SECTOR_SIZE ||
+       ((uint64_t)first + count) * SECTOR_SIZE > (uint64_t)disk_size)
+      break;
+    memcpy((unsigned char*)disk_buffer + (size_t)first * SECTOR_SIZE, p,
+           (size_t)count * SECTOR_SIZE);
+    p += (size_t)count * SECTOR_SIZE;
+  }
+  close_image_view(&delta);
+
+  if(i < run_count || hash_bytes(disk_buffer, disk_size, 0) != new_hash)
+  {
+    printf("Delta \"%s\" is corrupt, image not saved\n", argv[2]);
+    return(1);
+  }
+  if(save_disk(output) == 0) return(1);
+  if(all_args.verbose)
+    printf("Patched disk image \"%s\" into \"%s\"\n", argv[1], output);
+  return(0);
+}
+
+
+// Result of comparing a host directory with a disk image
+struct sync_totals
+{
+  int added;
+  int replaced;
+  int removed;
+  int unchanged;
+  int failed;
+  int stamped;     // FIB timestamps brought up to date
+};
+
+
+/*===========================================================================
+ *                             sync_host_file
+ *===========================================================================
+ * Desription: Bring one file in the disk image up to date with its host
+ *             copy
+ *
+ * Parameters: path       - Host file
+ *             info       - Status of the host file
+ *             diskname   - Name of the file in V9T9 format
+ *             timestamps - Use FIB timestamps to skip unchanged files?
+ *             totals     - Counters to update
+ *
+ * Return:     None
+ */
+void sync_host_file(char *path, struct stat *info, char *diskname,
+                    int timestamps, struct sync_totals *totals)
+{
+  struct fib_block *fib = find_fib(diskname);
+  unsigned char *data;
+  unsigned char *old_data;
+  int size;
+  int old_size;
+
+  // A matching size and update time is trusted without reading the file
+  if(fib != NULL && timestamps && fib_file_size(fib) == info->st_size &&
+     fib_timestamp(fib) == pack_timestamp(info->st_mtime))
+  {
+    totals->unchanged++;
+    return;
+  }
+
+  data = read_host_file(path, &size);
+  if(data == NULL)
+  {
+    printf("Cannot read \"%s\"\n", path);
+    totals->failed++;
+    return;
+  }
+
+  if(fib == NULL)
+  {
+    fib = add_file_data(path, diskname, data, size);
+    if(fib == NULL) totals->failed++;
+    else            totals->added++;
+  }
+  else
+  {
+    // Compare sizes first, then content hashes
+    old_data = load_file_data(fib, &old_size);
+    if(old_data != NULL && old_size == size &&
+       hash_bytes(old_data, old_size, 0) == hash_bytes(data, size, 0))
+    {
+      totals->unchanged++;
+    }
+    else if(rewrite_file(fib, data, size))
+    {
+      if(all_args.verbose)
+        printf("Replacing \"%.*s\" with \"%s\"\n", FILE_NAME_LEN,
+               diskname, path);
+      totals->replaced++;
+    }
+    else
+    {
+      printf("Cannot replace \"%.*s\", disk full\n", FILE_NAME_LEN,
+             diskname);
+      totals->failed++;
+    }
+    free(old_data);
+  }
+
+  // A new time on unchanged contents still has to be saved
+  if(fib != NULL && timestamps &&
+     fib_timestamp(fib) != pack_timestamp(info->st_mtime))
+  {
+    fib_set_timestamp(fib, info->st_mtime);
+    totals->stamped++;
+  }
+  free(data);
+}
+
+
+/*===========================================================================
+ *                            sync_directory
+ *===========================================================================
+ * Desription: Add, replace or remove files so the disk image holds the
+ *             regular files of a host directory
+ *
+ * Parameters: directory  - Host directory
+ *             timestamps - Keep and use FIB timestamps?
+ *             totals     - Counters to fill
+ *
+ * Return:     Was the directory read?
+ */
+int sync_directory(char *directory, int timestamps,
+                   struct sync_totals *totals)
+{
+  uint16_t present[MAX_FILE_COUNT];   // FIBs of files found on the host
+  int present_count = 0;
+  uint16_t index[MAX_FILE_COUNT];
+  struct dirent *entry;
+  DIR *dir;
+  int i;
+  int j;
+
+  memset(totals, 0, sizeof(struct sync_totals));
+  dir = opendir(directory);
+  if(dir == NULL)
+  {
+    printf("Cannot open directory \"%s\"\n", directory);
+    return(0);
+  }
+
+  while((entry = readdir(dir)) != NULL)
+  {
+    char path[1024];
+    char name[FILE_NAME_LEN];
+    struct fib_block *fib;
+    struct stat info;
+
+    if(entry->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    if(stat(path, &info) != 0 || !S_ISREG(info.st_mode)) continue;
+
+    // Two host names may map to the same disk name
+    make_name(name, entry->d_name, FILE_NAME_LEN);
+    fib = find_fib(name);
+    for(i = 0; fib != NULL && i < present_count; i++)
+    {
+      if(present[i] == sector_of(fib)) break;
+    }
+    if(fib != NULL && i < present_count)
+    {
+      printf("Skipping \"%s\", name \"%.*s\" is already used\n", path,
+             FILE_NAME_LEN, name);
+      continue;
+    }
+
+    // Whatever happens to the contents, a file on the host is kept. There
+    // is one FIB per disk file, so the list cannot overflow.
+    sync_host_file(path, &info, name, timestamps, totals);
+    fib = find_fib(name);
+    if(fib != NULL) present[present_count++] = sector_of(fib);
+  }
+  closedir(dir);
+
+  // Remove files that no longer exist on the host
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct fib_block *fib = fib_at(index[i]);
+    char name[FILE_NAME_LEN + 1];
+    if(fib == NULL) continue;
+    for(j = 0; j < present_count; j++)
+    {
+      if(present[j] == index[i]) break;
+    }
+    if(j < present_count) continue;
+    memcpy(name, fib->name, FILE_NAME_LEN);
+    name[FILE_NAME_LEN] = 0;
+    if(remove_file(name)) totals->removed++;
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             sync_command
+ *===========================================================================
+ * Desription: Keep a disk image in step with a host directory
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: sync [-t] [-w] [-V] {image} {directory}
+ *
+ * Return:     Exit status
+ */
+int sync_command(int argc, char **argv)
+{
+  struct sync_totals totals;
+  int timestamps = 0;
+  int watch = 0;
+  char *image;
+  char *directory;
+  int i;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if(strcmp(argv[i], "-t") == 0)      timestamps = 1;
+    else if(strcmp(argv[i], "-w") == 0) watch = 1;
+    else if(strcmp(argv[i], "-V") == 0) all_args.verbose++;
+    else break;
+  }
+  if(argc - i != 2)
+  {
+    printf("Usage: dsk99 sync [-t] [-w] [-V] {image} {directory}\n");
+    return(1);
+  }
+  image = argv[i];
+  directory = argv[i + 1];
+
+  // Start from the existing image, or a blank one
+  if(image_exists(image))
+  {
+    if(load_disk(image) == 0) return(1);
+  }
+  else
+  {
+    create_disk(geometry_sssd);
+    disk_format = format_for_path(image);
+  }
+
+  for(;;)
+  {
+    if(!sync_directory(directory, timestamps, &totals)) return(1);
+    if(totals.added || totals.replaced || totals.removed || totals.stamped ||
+       !image_exists(image))
+    {
+      if(save_disk(image) == 0) return(1);
+    }
+    printf("%d added, %d replaced, %d removed, %d unchanged",
+           totals.added, totals.replaced, totals.removed, totals.unchanged);
+    if(totals.failed) printf(", %d failed", totals.failed);
+    printf("\n");
+    fflush(stdout);
+    if(!watch) break;
+
+#ifdef __linux__
+    {
+      // Wait for changes, then let a burst of edits settle before syncing
+      static int notify = -1;
+      char events[4096];
+      struct pollfd poller;
+
+      if(notify < 0)
+      {
+        notify = inotify_init1(IN_CLOEXEC);
+        if(notify < 0 ||
+           inotify_add_watch(notify, directory,
+                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                             IN_DELETE | IN_CREATE) < 0)
+        {
+          printf("Cannot watch directory \"%s\"\n", directory);
+          return(1);
+        }
+      }
+      if(read(notify, events, sizeof(events)) <= 0) return(1);
+      poller.fd = notify;
+      poller.events = POLLIN;
+      while(poll(&poller, 1, 200) > 0)
+      {
+        if(read(notify, events, sizeof(events)) <= 0) return(1);
+      }
+    }
+#else
+    printf("Watching directories is not supported on this system\n");
+    return(1);
+#endif
+  }
+  return(totals.failed ? 1 : 0);
+}
+
+
+// One file of a manifest driven build
+struct build_entry
+{
+  char source[1024];            // Host file holding the contents
+  char name[FILE_NAME_LEN];     // Name of the file on disk
+  struct file_arg options;      // Type and protection options
+  struct stat info;             // Status of the host file
+  uint64_t hash;                // Content hash of the host file
+  unsigned char *data;          // Contents, NULL until needed
+  int size;                     // Size of contents
+};
+
+
+/*===========================================================================
+ *                           parse_file_flags
+ *===========================================================================
+ * Desription: Parse a word of file type and protection flags, such as
+ *             "-df80" or "-pw", the same way as on the command line
+ *
+ * Parameters: word - Word to parse
+ *             file - File options to update
+ *
+ * Return:     Was the word valid?
+ */
+int parse_file_flags(char *word, struct file_arg *file)
+{
+  char *op = &word[1];
+  if(word[0] != '-' || *op == 0) return(0);
+  while(*op)
+  {
+    // Handle mutually exclusive options
+    if(strchr("di", *op))
+    {
+      file->ascii     = 0;
+      file->binary    = 0;
+    }
+    if(strchr("fpv", *op))
+    {
+      file->fixed     = 0;
+      file->program   = 0;
+      file->variable  = 0;
+    }
+    if(strchr("uw", *op))
+    {
+      file->unprotect = 0;
+      file->protect   = 0;
+    }
+
+    switch(*op++)
+    {
+      case 'd':  file->ascii     = 1; break;
+      case 'i':  file->binary    = 1; break;
+      case 'p':  file->program   = 1; break;
+      case 'u':  file->unprotect = 1; break;
+      case 'w':  file->protect   = 1; break;
+      case 'f':  file->fixed     = 1; break;
+      case 'v':  file->variable  = 1; break;
+      default:   return(0);
+    }
+
+    // Process record length
+    if(op[-1] == 'f' || op[-1] == 'v')
+    {
+      if(*op < '0' || *op > '9') return(0);
+      file->record_size = strtol(op, &op, 10);
+      if(file->record_size < 1 || file->record_size > 254) return(0);
+    }
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                            read_manifest
+ *===========================================================================
+ * Desription: Read a build manifest
+ *
+ *             Each line names a host file, the name it gets on disk and
+ *             optional type and protection flags:
+ *               {host file} {disk name} [-p|-d|-i] [-f{n}|-v{n}] [-w|-u]
+ *             "name {disk name}" and "protect" set the volume name and
+ *             protection. Blank lines and lines starting with # are
+ *             ignored. Host files are relative to the manifest.
+ *
+ * Parameters: filename - Manifest file
+ *             entries  - Array of MAX_FILE_COUNT entries to fill
+ *             count    - Receives the number of entries
+ *             hash     - Receives a hash of the manifest text
+ *
+ * Return:     Was the manifest valid?
+ */
+int read_manifest(char *filename, struct build_entry *entries, int *count,
+                  uint64_t *hash)
+{
+  char base[1024];
+  char line[2048];
+  char *slash;
+  int line_no = 0;
+  FILE *file;
+  int i;
+
+  file = fopen(filename, "r");
+  if(file == NULL)
+  {
+    printf("Cannot open manifest \"%s\"\n", filename);
+    return(0);
+  }
+  strncpy(base, filename, sizeof(base) - 1);
+  base[sizeof(base) - 1] = 0;
+  slash = strrchr(base, '/');
+  if(slash != NULL) slash[1] = 0;
+  else              base[0] = 0;
+
+  *count = 0;
+  *hash = 0;
+  while(fgets(line, sizeof(line), file) != NULL)
+  {
+    char *word[8];
+    int words = 0;
+    char *save;
+    char *p;
+
+    line_no++;
+    *hash = hash_bytes(line, strlen(line), *hash);
+    for(p = strtok_r(line, " \t\r\n", &save); p != NULL && words < 8;
+        p = strtok_r(NULL, " \t\r\n", &save))
+      word[words++] = p;
+    if(words == 0 || word[0][0] == '#') continue;
+
+    if(strcmp(word[0], "name") == 0 && words == 2)
+    {
+      strncpy(all_args.disk_name, word[1], DISK_NAME_LEN);
+      continue;
+    }
+    if(strcmp(word[0], "protect") == 0 && words == 1)
+    {
+      all_args.protect = 1;
+      continue;
+    }
+
+    if(words < 2 || *count >= MAX_FILE_COUNT)
+    {
+      printf("%s:%d: invalid entry\n", filename, line_no);
+      fclose(file);
+      return(0);
+    }
+    struct build_entry *entry = &entries[*count];
+    memset(entry, 0, sizeof(struct build_entry));
+    if(word[0][0] == '/')
+      snprintf(entry->source, sizeof(entry->source), "%s", word[0]);
+    else
+      snprintf(entry->source, sizeof(entry->source), "%s%s", base, word[0]);
+    make_name(entry->name, word[1], FILE_NAME_LEN);
+    for(i = 2; i < words; i++)
+    {
+      if(!parse_file_flags(word[i], &entry->options))
+      {
+        printf("%s:%d: invalid option \"%s\"\n", filename, line_no, word[i]);
+        fclose(file);
+        return(0);
+      }
+    }
+    for(i = 0; i < *count; i++)
+    {
+      if(memcmp(entries[i].name, entry->name, FILE_NAME_LEN) == 0)
+      {
+        printf("%s:%d: duplicate disk name \"%s\"\n", filename, line_no,
+               word[1]);
+        fclose(file);
+        return(0);
+      }
+    }
+    (*count)++;
+  }
+  fclose(file);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                           compare_entries
+ *===========================================================================
+ * Desription: Order build entries by disk name
+ *
+ * Parameters: a, b - Entries to compare
+ *
+ * Return:     Sort order
+ */
+int compare_entries(const void *a, const void *b)
+{
+  return(memcmp(((struct build_entry*)a)->name,
+                ((struct build_entry*)b)->name, FILE_NAME_LEN));
+}
+
+
+/*===========================================================================
+ *                             build_command
+ *===========================================================================
+ * Desription: Build a disk image from a manifest
+ *
+ *             The image is laid out from a blank disk in disk name order,
+ *             so the same inputs always give the same bytes. A cache file
+ *             next to the image records each source's size, time and
+ *             content hash plus a key for the whole build. Sources whose
+ *             size and time are unchanged are not read again, unchanged
+ *             contents are copied from the previous image, and a build
+ *             whose key and output are unchanged does nothing.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: build [-V] {manifest} {image}
+ *
+ * Return:     Exit status
+ */
+int build_command(int argc, char **argv)
+{
+  static struct build_entry entries[MAX_FILE_COUNT];
+  struct image_view previous;
+  struct stat out_info;
+  struct phase_timer timer;
+  char cache_path[1024];
+  char line[1400];
+  uint64_t manifest_hash;
+  uint64_t key;
+  uint64_t cached_key = 0;
+  long cached_out_size = -1;
+  long cached_out_mtime = -1;
+  int have_previous = 0;
+  int reused = 0;
+  int count;
+  int i;
+  char *manifest;
+  char *image;
+  FILE *cache;
+
+  for(i = 1; i < argc && strcmp(argv[i], "-V") == 0; i++)
+    all_args.verbose++;
+  if(argc - i != 2)
+  {
+    printf("Usage: dsk99 build [-V] {manifest} {image}\n");
+    return(1);
+  }
+  manifest = argv[i];
+  image = argv[i + 1];
+  phase_start(&timer, phase_parse);
+  i = read_manifest(manifest, entries, &count, &manifest_hash);
+  phase_stop(&timer);
+  if(!i) return(1);
+  qsort(entries, count, sizeof(struct build_entry), compare_entries);
+  for(i = 0; i < count; i++)
+  {
+    if(stat(entries[i].source, &entries[i].info) != 0)
+    {
+      printf("Cannot add \"%s\", file does not exist\n", entries[i].source);
+      return(1);
+    }
+  }
+
+  // Pick up content hashes of sources that have not changed
+  snprintf(cache_path, sizeof(cache_path), "%s.cache", image);
+  cache = fopen(cache_path, "r");
+  if(cache != NULL)
+  {
+    while(fgets(line, sizeof(line), cache) != NULL)
+    {
+      unsigned long long hash;
+      long mtime;
+      long size;
+      int used;
+      if(sscanf(line, "key %llx out %ld %ld", &hash, &size, &mtime) == 3)
+      {
+        cached_key = hash;
+        cached_out_size = size;
+        cached_out_mtime = mtime;
+      }
+      else if(sscanf(line, "src %llx %ld %ld %n", &hash, &size, &mtime,
+                     &used) == 3)
+      {
+        line[strcspn(line, "\n")] = 0;
+        for(i = 0; i < count; i++)
+        {
+          if(strcmp(entries[i].source, &line[used]) == 0 &&
+             entries[i].info.st_size == size &&
+             entries[i].info.st_mtime == mtime)
+            entries[i].hash = hash;
+        }
+      }
+    }
+    fclose(cache);
+  }
+
+  // Hash whatever sources could not be matched
+  key = hash_bytes(&manifest_hash, sizeof(manifest_hash),
+                   format_for_path(image));
+  for(i = 0; i < count; i++)
+  {
+    if(entries[i].hash == 0)
+    {
+      entries[i].data = read_host_file(entries[i].source, &entries[i].size);
+      if(entries[i].data == NULL)
+      {
+        printf("Cannot read \"%s\"\n", entries[i].source);
+        return(1);
+      }
+      entries[i].hash = hash_bytes(entries[i].data, entries[i].size, 0) | 1;
+    }
+    key = hash_bytes(&entries[i].hash, sizeof(entries[i].hash), key);
+  }
+
+  // Nothing to do when neither the inputs nor the output changed
+  if(key == cached_key && stat(image, &out_info) == 0 &&
+     out_info.st_size == cached_out_size &&
+     out_info.st_mtime == cached_out_mtime)
+  {
+    if(all_args.verbose) printf("Disk image \"%s\" is up to date\n", image);
+    return(0);
+  }
+
+  // Contents that are unchanged come out of the previous image
+  if(stat(image, &out_info) == 0 && open_image_view(&previous, image))
+  {
+    have_previous = 1;
+    disk_buffer = previous.data;
+    disk_size = previous.size;
+    for(i = 0; i < count; i++)
+    {
+      struct fib_block *fib;
+      char name[FILE_NAME_LEN + 1];
+      if(entries[i].data != NULL) continue;
+      memcpy(name, entries[i].name, FILE_NAME_LEN);
+      name[FILE_NAME_LEN] = 0;
+      fib = find_fib(name);
+      if(fib == NULL) continue;
+      entries[i].data = load_file_data(fib, &entries[i].size);
+      if(entries[i].data != NULL &&
+         (hash_bytes(entries[i].data, entries[i].size, 0) | 1) !=
+         entries[i].hash)
+      {
+        free(entries[i].data);
+        entries[i].data = NULL;
+      }
+      if(entries[i].data != NULL) reused++;
+    }
+    disk_buffer = NULL;
+    disk_size = 0;
+    close_image_view(&previous);
+  }
+
+  // Lay out a fresh disk
+  create_disk(geometry_sssd);
+  disk_format = format_for_path(image);
+  make_name(((struct vib_block*)disk_buffer)->name, all_args.disk_name,
+            DISK_NAME_LEN);
+  if(all_args.protect) ((struct vib_block*)disk_buffer)->protection = 'P';
+  for(i = 0; i < count; i++)
+  {
+    struct fib_block *fib;
+    if(entries[i].data == NULL)
+    {
+      entries[i].data = read_host_file(entries[i].source, &entries[i].size);
+      if(entries[i].data == NULL ||
+         (hash_bytes(entries[i].data, entries[i].size, 0) | 1) !=
+         entries[i].hash)
+      {
+        printf("Source \"%s\" changed during the build\n", entries[i].source);
+        return(1);
+      }
+    }
+    fib = add_file_data(entries[i].source, entries[i].name,
+                        entries[i].data, entries[i].size);
+    if(fib == NULL) return(1);
+    set_file_attributes(fib, &entries[i].options, entries[i].source);
+    free(entries[i].data);
+    entries[i].data = NULL;
+  }
+  if(save_disk(image) == 0) return(1);
+
+  // Record what this output was built from
+  cache = fopen(cache_path, "w");
+  if(cache != NULL && stat(image, &out_info) == 0)
+  {
+    for(i = 0; i < count; i++)
+    {
+      fprintf(cache, "src %016llx %ld %ld %s\n",
+              (unsigned long long)entries[i].hash,
+              (long)entries[i].info.st_size, (long)entries[i].info.st_mtime,
+              entries[i].source);
+    }
+    fprintf(cache, "key %016llx out %ld %ld\n", (unsigned long long)key,
+            (long)out_info.st_size, (long)out_info.st_mtime);
+  }
+  if(cache != NULL) fclose(cache);
+
+  if(all_args.verbose)
+    printf("Built \"%s\" with %d files, %d reused from previous image\n",
+           image, count, have_previous ? reused : 0);
+  return(0);
+}
+
+
+// Completed images read from a batch journal, keyed by path and content
+struct journal_set
+{
+  uint64_t *keys;   // Open addressed table, 0 marks a free slot
+  int capacity;     // Number of slots, a power of two
+  int count;        // Number of keys held
+};
+
+
+/*===========================================================================
+ *                             journal_add
+ *===========================================================================
+ * Desription: Remember a completed image
+ *
+ * Parameters: set - Set of completed images
+ *             key - Key of the image
+ *
+ * Return:     None
+ */
+void journal_add(struct journal_set *set, uint64_t key)
+{
+  int i;
+  key |= 1;
+  if(2 * (set->count + 1) > set->capacity)
+  {
+    // Grow and rehash
+    struct journal_set bigger;
+    bigger.capacity = set->capacity ? 2 * set->capacity : 1024;
+    bigger.keys = calloc(bigger.capacity, sizeof(uint64_t));
+    bigger.count = 0;
+    for(i = 0; i < set->capacity; i++)
+    {
+      if(set->keys[i] != 0) journal_add(&bigger, set->keys[i]);
+    }
+    free(set->keys);
+    *set = bigger;
+  }
+  for(i = key & (set->capacity - 1); set->keys[i] != 0;
+      i = (i + 1) & (set->capacity - 1))
+  {
+    if(set->keys[i] == key) return;
+  }
+  set->keys[i] = key;
+  set->count++;
+}
+
+
+/*===========================================================================
+ *                            journal_contains
+ *===========================================================================
+ * Desription: Check whether an image was already completed
+ *
+ * Parameters: set - Set of completed images
+ *             key - Key of the image
+ *
+ * Return:     Was the image completed?
+ */
+int journal_contains(struct journal_set *set, uint64_t key)
+{
+  int i;
+  key |= 1;
+  if(set->capacity == 0) return(0);
+  for(i = key & (set->capacity - 1); set->keys[i] != 0;
+      i = (i + 1) & (set->capacity - 1))
+  {
+    if(set->keys[i] == key) return(1);
+  }
+  return(0);
+}
+
+
+/*===========================================================================
+ *                              hash_file
+ *===========================================================================
+ * Desription: Compute the content hash of a host file
+ *
+ * Parameters: filename - File to hash
+ *             hash     - Receives the hash
+ *
+ * Return:     Could the file be read?
+ */
+int hash_file(char *filename, uint64_t *hash)
+{
+  struct stat info;
+  char pack[1024];
+  void *data;
+  int size;
+  int fd;
+
+  // Images inside a pack are hashed straight from the pack's mapping
+  if(pack_split(filename, pack, sizeof(pack)) != NULL)
+  {
+    data = pack_image(filename, &size);
+    if(data == NULL) return(0);
+    *hash = hash_bytes(data, size, 0);
+    return(1);
+  }
+
+  fd = open(filename, O_RDONLY);
+  if(fd < 0) return(0);
+  if(fstat(fd, &info) != 0)
+  {
+    close(fd);
+    return(0);
+  }
+  if(info.st_size == 0)
+  {
+    close(fd);
+    *hash = hash_bytes("", 0, 0);
+    return(1);
+  }
+  data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return(0);
+  *hash = hash_bytes(data, info.st_size, 0);
+  munmap(data, info.st_size);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             batch_image
+ *===========================================================================
+ * Desription: Run a batch operation on one disk image
+ *
+ * Parameters: path      - Disk image
+ *             operation - 'l' list, 'X' extract all, 'C' convert
+ *             basic     - List BASIC programs as source when extracting
+ *             out_dir   - Directory receiving outputs
+ *             extension - Extension of converted images
+ *             output    - Receives the name of the output
+ *             size      - Size of output buffer
+ *
+ * Return:     Description of the failure, NULL on success
+ */
+char* batch_image(char *path, int operation, int basic, char *out_dir,
+                  char *extension, char *output, int size)
+{
+  static char reason[80];
+  static struct text_buffer listing;   // Kept from image to image
+  char base[256];
+  char pack[1024];
+  char *p;
+  char *problem;
+
+  // Name outputs after the image, without directory or extension
+  p = pack_split(path, pack, sizeof(pack));
+  if(p == NULL) p = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  snprintf(base, sizeof(base), "%s", p);
+  if((p = strrchr(base, '.')) != NULL && p != base) *p = 0;
+
+  release_disk();
+  if(load_disk(path) == 0) return("cannot load image");
+  if((problem = check_image()) != NULL) return(problem);
+
+  switch(operation)
+  {
+    case 'l':
+      snprintf(output, size, "-");
+      printf("\n%s\n", path);
+      list_disk();
+      break;
+
+    case 'X':
+    {
+      uint16_t index[MAX_FILE_COUNT];
+      int i;
+      snprintf(output, size, "%s/%s", out_dir, base);
+      if(mkdir(output, 0777) != 0 && errno != EEXIST)
+        return("cannot create output directory");
+      fdr_index_decode(index);
+      for(i = 0; i < MAX_FILE_COUNT; i++)
+      {
+        char name[FILE_NAME_LEN + 1];
+        char file_path[1024];
+        struct fib_block *fib = fib_at(index[i]);
+        if(fib == NULL) continue;
+        host_name(fib, name);
+        snprintf(file_path, sizeof(file_path), "%s/%s", output, name);
+        if(basic && (fib->flags & fib_program))
+        {
+          // Programs that are not BASIC are extracted as they are
+          unsigned char *data = arena_alloc(fib_file_size(fib));
+          int lines = -1;
+          listing.length = 0;
+          if(copy_file_data(fib, data))
+            lines = detokenize(data, fib_file_size(fib), &listing);
+          if(lines >= 0)
+          {
+            strcat(file_path, ".bas");
+            if(!write_host_file(file_path, (unsigned char*)listing.data,
+                                listing.length))
+            {
+              snprintf(reason, sizeof(reason), "cannot list \"%s\"", name);
+              return(reason);
+            }
+            continue;
+          }
+        }
+        if(!extract_file(fib, file_path))
+        {
+          snprintf(reason, sizeof(reason), "cannot extract \"%s\"", name);
+          return(reason);
+        }
+      }
+      break;
+    }
+
+    case 'C':
+      snprintf(output, size, "%s/%s.%s", out_dir, base, extension);
+      if(!save_disk_as(output, format_for_path(output)))
+        return("cannot save converted image");
+      break;
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                             batch_command
+ *===========================================================================
+ * Desription: Run an operation over many disk images, keeping a journal
+ *             so an interrupted run can be resumed
+ *
+ *             Each image gets one journal line, "ok" or "fail", with the
+ *             content hash of the image, its path and its output or the
+ *             reason it failed. Images already journaled as "ok" with an
+ *             unchanged hash are skipped; failures are retried. A failing
+ *             image is recorded and the run carries on.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: batch [-j {journal}] [-o {directory}]
+ *                               [-V] (-l | -X [-b] | -C {ext}) {image} ...
+ *
+ * Return:     Exit status, 1 if any image failed
+ */
+int batch_command(int argc, char **argv)
+{
+  struct journal_set done;
+  char *journal_path = NULL;
+  char *out_dir = ".";
+  char *extension = NULL;
+  int operation = 0;
+  int basic = 0;
+  int journal = -1;
+  int skipped = 0;
+  int failed = 0;
+  int completed = 0;
+  int i;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)      journal_path = argv[++i];
+    else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_dir = argv[++i];
+    else if(strcmp(argv[i], "-C") == 0 && i + 1 < argc)
+    {
+      operation = 'C';
+      extension = argv[++i];
+    }
+    else if(strcmp(argv[i], "-l") == 0) operation = 'l';
+    else if(strcmp(argv[i], "-X") == 0) operation = 'X';
+    else if(strcmp(argv[i], "-b") == 0) basic = 1;
+    else if(strcmp(argv[i], "-V") == 0) all_args.verbose++;
+    else break;
+  }
+  if(operation == 0 || i >= argc)
+  {
+    printf("Usage: dsk99 batch [-j {journal}] [-o {directory}] "
+           "(-l | -X [-b] | -C {ext}) {image} ...\n");
+    return(1);
+  }
+
+  // Load the images completed by earlier runs
+  memset(&done, 0, sizeof(done));
+  if(journal_path != NULL)
+  {
+    char *line = NULL;
+    size_t capacity = 0;
+    FILE *file = fopen(journal_path, "r");
+    if(file != NULL)
+    {
+      while(getline(&line, &capacity, file) > 0)
+      {
+        unsigned long long hash;
+        int used;
+        if(sscanf(line, "ok %llx %n", &hash, &used) == 1)
+        {
+          char *end = strstr(&line[used], " -> ");
+          if(end == NULL) continue;
+          journal_add(&done, hash_bytes(&line[used], end - &line[used],
+                                        hash));
+        }
+      }
+      fclose(file);
+    }
+    free(line);
+    journal = open(journal_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if(journal < 0)
+    {
+      printf("Cannot open journal \"%s\"\n", journal_path);
+      return(1);
+    }
+  }
+
+  for(; i < argc; i++)
+  {
+    char output[1024];
+    char line[2400];
+    uint64_t hash;
+    char *problem;
+    int length;
+
+    if(!hash_file(argv[i], &hash))
+    {
+      problem = "cannot read image";
+      hash = 0;
+    }
+    else if(journal_contains(&done, hash_bytes(argv[i], strlen(argv[i]),
+                                               hash)))
+    {
+      skipped++;
+      continue;
+    }
+    else
+    {
+      uint64_t start = clock_ns(CLOCK_MONOTONIC);
+      output[0] = 0;
+      problem = batch_image(argv[i], operation, basic, out_dir, extension,
+                            output, sizeof(output));
+      stats_image_done((clock_ns(CLOCK_MONOTONIC) - start) / 1e6);
+    }
+
+    if(problem == NULL)
+      completed++;
+    else
+    {
+      failed++;
+      printf("Skipping \"%s\": %s\n", argv[i], problem);
+    }
+
+    // One append per image; sync now and then so a crash loses little.
+    // An entry too long for line is built on the heap instead.
+    if(journal >= 0)
+    {
+      const char *format = problem == NULL ? "ok %016llx %s -> %s\n"
+                                           : "fail %016llx %s : %s\n";
+      char *detail = problem == NULL ? output : problem;
+      char *entry = line;
+      length = snprintf(line, sizeof(line), format, (unsigned long long)hash,
+                        argv[i], detail);
+      if(length >= (int)sizeof(line) && (entry = malloc(length + 1)) != NULL)
+        snprintf(entry, length + 1, format, (unsigned long long)hash,
+                 argv[i], detail);
+      if(entry == NULL || write(journal, entry, length) != length)
+        printf("Cannot write journal \"%s\"\n", journal_path);
+      if(entry != line) free(entry);
+      if((completed + failed) % 64 == 0) fdatasync(journal);
+    }
+  }
+  release_disk();
+
+  if(journal >= 0)
+  {
+    fdatasync(journal);
+    close(journal);
+  }
+  free(done.keys);
+  if(all_args.verbose || failed)
+    printf("%d completed, %d failed, %d already done\n",
+           completed, failed, skipped);
+  return(failed ? 1 : 0);
+}
+
+
+// A host file held in memory
+struct host_blob
+{
+  char name[256];            // File name within a FIAD directory
+  unsigned char *data;       // File contents
+  int size;                  // Size of file contents
+};
+
+// One image passing through the convert pipeline
+struct convert_item
+{
+  int seq;                   // Position among the inputs
+  char *path;                // Input image or FIAD directory
+  int input_dir;             // Is the input a FIAD directory?
+  struct host_blob *input;   // Input file, or each file of a FIAD directory
+  int input_count;
+  struct host_blob *output;  // Output file, or each file of a FIAD directory
+  int output_count;
+  char output_path[1024];    // Output image or FIAD directory
+  char *problem;             // Why the image is skipped, NULL if fine
+  char reason[80];           // Text of the problem
+  uint64_t start;            // When reading the image began
+};
+
+// Output name of an input, for finding inputs that share one
+struct convert_name
+{
+  char base[256];            // Output name without directory or extension
+  int seq;                   // Position among the inputs
+};
+
+// Bounded queue handing images from one pipeline stage to the next
+struct convert_queue
+{
+  struct convert_item **items;
+  int capacity;
+  int head;                  // Oldest item
+  int count;                 // Number of items queued
+  int closed;                // No more items will be pushed
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+// State shared by the stages of the convert pipeline
+struct convert_job
+{
+  char **paths;              // Inputs
+  int path_count;
+  int next_path;             // Next input to be claimed by a reader
+  int written;               // Inputs the writer is finished with
+  int window;                // Most images in flight at once
+  int readers;               // Readers still running
+  int workers;               // Workers still running
+  int format;                // Format of the outputs
+  char *extension;           // Extension of the outputs
+  char *out_dir;             // Directory receiving the outputs
+  char **clash;              // Earlier input with the same output, by input
+  struct convert_queue decode;   // Inputs read, waiting for a worker
+  struct convert_queue encoded;  // Outputs made, waiting for the writer
+  pthread_mutex_t lock;
+  pthread_cond_t window_open;
+};
+
+
+/*===========================================================================
+ *                         convert_queue_init
+ *===========================================================================
+ * Desription: Set up an empty queue
+ *
+ * Parameters: q        - Queue
+ *             capacity - Most items held before pushes wait
+ *
+ * Return:     None
+ */
+void convert_queue_init(struct convert_queue *q, int capacity)
+{
+  memset(q, 0, sizeof(struct convert_queue));
+  q->items = calloc(capacity, sizeof(struct convert_item*));
+  q->capacity = capacity;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+}
+
+
+/*===========================================================================
+ *                         convert_queue_push
+ *===========================================================================
+ * Desription: Add an item to a queue, waiting while it is full
+ *
+ * Parameters: q    - Queue
+ *             item - Item to add
+ *
+ * Return:     None
+ */
+void convert_queue_push(struct convert_queue *q, struct convert_item *item)
+{
+  pthread_mutex_lock(&q->lock);
+  while(q->count == q->capacity)
+    pthread_cond_wait(&q->not_full, &q->lock);
+  q->items[(q->head + q->count++) % q->capacity] = item;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+
+/*===========================================================================
+ *                          convert_queue_pop
+ *===========================================================================
+ * Desription: Take the oldest item from a queue, waiting while it is empty
+ *
+ * Parameters: q - Queue
+ *
+ * Return:     Item, NULL once the queue is closed and empty
+ */
+struct convert_item* convert_queue_pop(struct convert_queue *q)
+{
+  struct convert_item *item = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  while(q->count == 0 && !q->closed)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  if(q->count > 0)
+  {
+    item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return(item);
+}
+
+
+/*===========================================================================
+ *                         convert_queue_close
+ *===========================================================================
+ * Desription: Mark a queue as having no more items coming
+ *
+ * Parameters: q - Queue
+ *
+ * Return:     None
+ */
+void convert_queue_close(struct convert_queue *q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+
+/*===========================================================================
+ *                         compare_host_blobs
+ *===========================================================================
+ * Desription: Order host files by name
+ *
+ * Parameters: a, b - Files to compare
+ *
+ * Return:     Sort order
+ */
+int compare_host_blobs(const void *a, const void *b)
+{
+  return(strcmp(((struct host_blob*)a)->name, ((struct host_blob*)b)->name));
+}
+
+
+/*===========================================================================
+ *                            convert_read
+ *===========================================================================
+ * Desription: Read an input image, or every file of a FIAD directory,
+ *             into memory
+ *
+ * Parameters: item - Image being converted
+ *
+ * Return:     None, problems are recorded in the item
+ */
+void convert_read(struct convert_item *item)
+{
+  struct stat info;
+  struct dirent *entry;
+  char pack[1024];
+  DIR *dir;
+
+  // Images inside a pack are copied out of the pack's mapping
+  if(pack_split(item->path, pack, sizeof(pack)) != NULL)
+  {
+    unsigned char *data;
+    int size;
+    item->input = calloc(1, sizeof(struct host_blob));
+    item->input_count = 1;
+    data = pack_image(item->path, &size);
+    if(data == NULL)
+    {
+      item->problem = "cannot read image";
+      return;
+    }
+    item->input[0].data = malloc(size);
+    memcpy(item->input[0].data, data, size);
+    item->input[0].size = size;
+    return;
+  }
+
+  if(stat(item->path, &info) != 0)
+  {
+    item->problem = "cannot read image";
+    return;
+  }
+  if(!S_ISDIR(info.st_mode))
+  {
+    item->input = calloc(1, sizeof(struct host_blob));
+    item->input_count = 1;
+    item->input[0].data = read_host_file(item->path, &item->input[0].size);
+    if(item->input[0].data == NULL) item->problem = "cannot read image";
+    return;
+  }
+
+  // Files of a FIAD directory, in name order so layouts repeat
+  item->input_dir = 1;
+  item->input = calloc(MAX_FILE_COUNT, sizeof(struct host_blob));
+  dir = opendir(item->path);
+  if(dir == NULL)
+  {
+    item->problem = "cannot read directory";
+    return;
+  }
+  while(item->problem == NULL && (entry = readdir(dir)) != NULL)
+  {
+    struct host_blob *blob = &item->input[item->input_count];
+    char file_path[1024];
+    snprintf(file_path, sizeof(file_path), "%s/%s", item->path,
+             entry->d_name);
+    if(stat(file_path, &info) != 0 || !S_ISREG(info.st_mode)) continue;
+    if(item->input_count == MAX_FILE_COUNT)
+    {
+      item->problem = "too many files";
+      break;
+    }
+    snprintf(blob->name, sizeof(blob->name), "%s", entry->d_name);
+    blob->data = read_host_file(file_path, &blob->size);
+    if(blob->data == NULL)
+    {
+      snprintf(item->reason, sizeof(item->reason), "cannot read \"%.*s\"",
+               64, entry->d_name);
+      item->problem = item->reason;
+    }
+    item->input_count++;
+  }
+  closedir(dir);
+  qsort(item->input, item->input_count, sizeof(struct host_blob),
+        compare_host_blobs);
+}
+
+
+/*===========================================================================
+ *                           convert_reader
+ *===========================================================================
+ * Desription: Thread body reading inputs in order until none remain
+ *
+ *             A reader does not start an input until the writer is within
+ *             the job window of it, so the images held in memory stay
+ *             bounded however many inputs there are.
+ *
+ * Parameters: arg - Shared convert job
+ *
+ * Return:     None
+ */
+void* convert_reader(void *arg)
+{
+  struct convert_job *job = arg;
+
+  for(;;)
+  {
+    struct convert_item *item;
+    int seq;
+
+    pthread_mutex_lock(&job->lock);
+    while(job->next_path < job->path_count &&
+          job->next_path - job->written >= job->window)
+      pthread_cond_wait(&job->window_open, &job->lock);
+    if(job->next_path >= job->path_count)
+    {
+      if(--job->readers == 0) convert_queue_close(&job->decode);
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+    seq = job->next_path++;
+    pthread_mutex_unlock(&job->lock);
+
+    item = calloc(1, sizeof(struct convert_item));
+    item->seq = seq;
+    item->path = job->paths[seq];
+    item->start = clock_ns(CLOCK_MONOTONIC);
+    if(job->clash[seq] != NULL)
+    {
+      snprintf(item->reason, sizeof(item->reason),
+               "same output name as \"%.*s\"", 48, job->clash[seq]);
+      item->problem = item->reason;
+    }
+    else
+      convert_read(item);
+    convert_queue_push(&job->decode, item);
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                           is_tifiles
+ *===========================================================================
+ * Desription: Does a host file start with a TIFILES header?
+ *
+ * Parameters: blob - Host file
+ *
+ * Return:     Is there a TIFILES header?
+ */
+int is_tifiles(struct host_blob *blob)
+{
+  return(blob->size >= TIFILES_HEADER_SIZE && blob->data[0] == 0x07 &&
+         memcmp(&blob->data[1], "TIFILES", 7) == 0);
+}
+
+
+/*===========================================================================
+ *                           convert_from_fiad
+ *===========================================================================
+ * Desription: Build the disk image for a FIAD directory on the smallest
+ *             disk that holds all of its files
+ *
+ *             Files with a TIFILES header keep their type and record
+ *             layout, other files are added as programs.
+ *
+ * Parameters: item - Image being converted
+ *
+ * Return:     Description of the failure, NULL on success
+ */
+char* convert_from_fiad(struct convert_item *item)
+{
+  char volume[256];
+  char *p;
+  int layout;
+  int i;
+
+  // Smallest disk with room, counting whole allocation units
+  for(layout = 0; layout < geometry_count; layout++)
+  {
+    int sectors = geometries[layout].sectors;
+    int au = sectors > 1600 ? (sectors + 1599) / 1600 : 1;
+    int units = (2 + au - 1) / au;
+    for(i = 0; i < item->input_count; i++)
+    {
+      struct host_blob *blob = &item->input[i];
+      int data = is_tifiles(blob) ? load_be16(&blob->data[8])
+                                  : (blob->size + SECTOR_SIZE - 1) /
+                                    SECTOR_SIZE;
+      units += 1 + (data + au - 1) / au;
+    }
+    if(units <= sectors / au) break;
+  }
+  if(layout == geometry_count) return("files do not fit on any disk");
+
+  create_disk(layout);
+  disk_format = format_v9t9;
+  snprintf(volume, sizeof(volume), "%s", item->path);
+  while((p = strrchr(volume, '/')) != NULL && p[1] == 0 && p != volume)
+    *p = 0;
+  p = strrchr(volume, '/');
+  make_name(((struct vib_block*)disk_buffer)->name, p ? p + 1 : volume,
+            DISK_NAME_LEN);
+
+  for(i = 0; i < item->input_count; i++)
+  {
+    struct host_blob *blob = &item->input[i];
+    unsigned char *header = blob->data;
+    unsigned char *data = blob->data;
+    int size = blob->size;
+    char name[FILE_NAME_LEN];
+    struct fib_block *fib;
+
+    if(is_tifiles(blob))
+    {
+      data += TIFILES_HEADER_SIZE;
+      size = load_be16(&header[8]) * SECTOR_SIZE;
+      if(size > blob->size - TIFILES_HEADER_SIZE)
+        size = blob->size - TIFILES_HEADER_SIZE;
+    }
+    make_name(name, blob->name, FILE_NAME_LEN);
+    fib = add_file_data(blob->name, name, data, size);
+    if(fib == NULL)
+    {
+      snprintf(item->reason, sizeof(item->reason), "cannot add \"%.*s\"",
+               64, blob->name);
+      return(item->reason);
+    }
+    if(is_tifiles(blob))
+    {
+      fib->flags = header[10];
+      fib->recsperphysrec = header[11];
+      fib->eof = header[12];
+      fib->reclen = header[13];
+      fib_set_fixrecs(fib, load_le16(&header[14]));
+    }
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                           convert_decode
+ *===========================================================================
+ * Desription: Make the input of a convert item the current disk image,
+ *             recognising its format from the contents
+ *
+ * Parameters: item - Image being converted
+ *
+ * Return:     Description of the failure, NULL on success
+ */
+char* convert_decode(struct convert_item *item)
+{
+  struct host_blob *in = &item->input[0];
+  const struct track_format *tf;
+  unsigned char *data;
+  int heads;
+
+  if(item->input_dir) return(convert_from_fiad(item));
+
+  // Compressed containers are decompressed in full
+  if(in->size >= CONTAINER_HEADER_SIZE &&
+     memcmp(in->data, CONTAINER_MAGIC, 4) == 0)
+  {
+    data = in->data;
+    in->data = NULL;
+    if(!attach_container(data, in->size, 0, item->path))
+      return("not a valid compressed disk image");
+    container_release();
+    return(NULL);
+  }
+
+  // Track images are recognised by size and checked by their CRCs
+  tf = pc99_layout(in->size, &heads);
+  if(tf != NULL)
+  {
+    if(!decode_pc99(in->data, tf, heads, item->path))
+      return("cannot decode track image");
+    return(NULL);
+  }
+
+  // Sector dumps are used as they are
+  disk_buffer = in->data;
+  disk_size = in->size;
+  disk_format = format_v9t9;
+  in->data = NULL;
+  if(disk_size < 2 * SECTOR_SIZE ||
+     memcmp(((struct vib_block*)disk_buffer)->id, "DSK", 3) != 0)
+    return("not a V9T9 disk image");
+  stats.sectors_read += disk_size / SECTOR_SIZE;
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                            convert_base
+ *===========================================================================
+ * Desription: Name the output of an input after the input, without
+ *             directory or extension
+ *
+ * Parameters: path - Input image, pack address or FIAD directory
+ *             base - Receives the name
+ *             size - Size of base
+ *
+ * Return:     None
+ */
+void convert_base(char *path, char *base, int size)
+{
+  char pack[1024];
+  char *p;
+
+  snprintf(base, size, "%s", path);
+  while((p = strrchr(base, '/')) != NULL && p[1] == 0 && p != base) *p = 0;
+  p = strrchr(base, '/');
+  if(p != NULL) memmove(base, p + 1, strlen(p));
+  if((p = pack_split(base, pack, sizeof(pack))) != NULL)
+    memmove(base, p, strlen(p) + 1);
+  if((p = strrchr(base, '.')) != NULL && p != base) *p = 0;
+}
+
+
+/*===========================================================================
+ *                         compare_convert_names
+ *===========================================================================
+ * Desription: Order inputs by output name, then by position
+ *
+ * Parameters: a - First convert_name
+ *             b - Second convert_name
+ *
+ * Return:     Sort order
+ */
+int compare_convert_names(const void *a, const void *b)
+{
+  const struct convert_name *na = a;
+  const struct convert_name *nb = b;
+  int order = strcmp(na->base, nb->base);
+  return(order != 0 ? order : na->seq - nb->seq);
+}
+
+
+/*===========================================================================
+ *                           convert_encode
+ *===========================================================================
+ * Desription: Encode the current disk image in the job's output format
+ *
+ * Parameters: job  - Convert job
+ *             item - Image being converted
+ *
+ * Return:     Description of the failure, NULL on success
+ */
+char* convert_encode(struct convert_job *job, struct convert_item *item)
+{
+  char base[256];
+
+  convert_base(item->path, base, sizeof(base));
+
+  if(job->format == format_fiad)
+  {
+    uint16_t index[MAX_FILE_COUNT];
+    int i;
+
+    snprintf(item->output_path, sizeof(item->output_path), "%s/%s",
+             job->out_dir, base);
+    fdr_index_decode(index);
+    item->output = calloc(MAX_FILE_COUNT, sizeof(struct host_blob));
+    for(i = 0; i < MAX_FILE_COUNT; i++)
+    {
+      struct fib_block *fib = fib_at(index[i]);
+      struct host_blob *blob = &item->output[item->output_count];
+      struct cluster_span spans[MAX_CLUSTERS];
+      int span_count;
+      int physrecs;
+      int pos = 0;
+      int j;
+      int k;
+
+      if(fib == NULL) continue;
+      item->output_count++;
+      host_name(fib, blob->name);
+      physrecs = fib_physrec_count(fib);
+      blob->size = TIFILES_HEADER_SIZE + physrecs * SECTOR_SIZE;
+      blob->data = calloc(1, blob->size);
+      blob->data[0] = 0x07;
+      memcpy(&blob->data[1], "TIFILES", 7);
+      store_be16(&blob->data[8], physrecs);
+      blob->data[10] = fib->flags;
+      blob->data[11] = fib->recsperphysrec;
+      blob->data[12] = fib->eof;
+      blob->data[13] = fib->reclen;
+      store_le16(&blob->data[14], fib_fixrecs(fib));
+
+      span_count = fib_spans(fib, spans);
+      for(j = 0; j < span_count && pos < physrecs; j++)
+      {
+        for(k = 0; k < spans[j].count && pos < physrecs; k++, pos++)
+          memcpy(&blob->data[TIFILES_HEADER_SIZE + pos * SECTOR_SIZE],
+                 get_sector(spans[j].first + k), SECTOR_SIZE);
+      }
+    }
+    return(NULL);
+  }
+
+  snprintf(item->output_path, sizeof(item->output_path), "%s/%s.%s",
+           job->out_dir, base, job->extension);
+  item->output = calloc(1, sizeof(struct host_blob));
+  item->output_count = 1;
+  if(job->format == format_dkz)
+  {
+    // Images are already spread over the workers, compress on this one
+    item->output[0].data = malloc(container_bound());
+    item->output[0].size = encode_container(item->output[0].data, 1);
+  }
+  else if(job->format == format_pc99)
+  {
+    item->output[0].size = encode_pc99(NULL);
+    if(item->output[0].size == 0)
+      return("PC99 images hold SSSD, DSSD or DSDD disks");
+    item->output[0].data = malloc(item->output[0].size);
+    encode_pc99(item->output[0].data);
+  }
+  else
+  {
+    // The sector dump is the image itself
+    item->output[0].data = disk_buffer;
+    item->output[0].size = disk_size;
+    disk_buffer = NULL;
+    disk_size = 0;
+  }
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                           convert_worker
+ *===========================================================================
+ * Desription: Thread body decoding inputs and encoding outputs until the
+ *             readers are done. Each worker has its own current image.
+ *
+ * Parameters: arg - Shared convert job
+ *
+ * Return:     None
+ */
+void* convert_worker(void *arg)
+{
+  struct convert_job *job = arg;
+  struct convert_item *item;
+
+  while((item = convert_queue_pop(&job->decode)) != NULL)
+  {
+    struct phase_timer timer;
+    char *problem = NULL;
+    int i;
+
+    if(item->problem == NULL)
+    {
+      release_disk();
+      phase_start(&timer, phase_load);
+      problem = convert_decode(item);
+      phase_stop(&timer);
+      if(problem == NULL) problem = check_image();
+      if(problem == NULL)
+      {
+        phase_start(&timer, phase_save);
+        problem = convert_encode(job, item);
+        phase_stop(&timer);
+      }
+    }
+
+    // Keep the problem with the item, it outlives this image
+    if(problem != NULL && problem != item->reason)
+    {
+      snprintf(item->reason, sizeof(item->reason), "%s", problem);
+      problem = item->reason;
+    }
+    if(problem != NULL) item->problem = problem;
+    for(i = 0; i < item->input_count; i++)
+      free(item->input[i].data);
+    free(item->input);
+    item->input = NULL;
+    item->input_count = 0;
+    convert_queue_push(&job->encoded, item);
+  }
+  release_disk();
+  stats_merge();
+
+  pthread_mutex_lock(&job->lock);
+  if(--job->workers == 0) convert_queue_close(&job->encoded);
+  pthread_mutex_unlock(&job->lock);
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                           convert_write
+ *===========================================================================
+ * Desription: Write the outputs of a converted image
+ *
+ * Parameters: job  - Convert job
+ *             item - Converted image
+ *
+ * Return:     Were the outputs written?
+ */
+int convert_write(struct convert_job *job, struct convert_item *item)
+{
+  int i;
+
+  if(job->format == format_v9t9)
+    return(write_sectors(item->output_path, item->output[0].data,
+                         item->output[0].size));
+  if(job->format != format_fiad)
+  {
+    stats.sectors_written += item->output[0].size / SECTOR_SIZE;
+    return(write_host_file(item->output_path, item->output[0].data,
+                           item->output[0].size));
+  }
+
+  if(mkdir(item->output_path, 0777) != 0 && errno != EEXIST) return(0);
+  for(i = 0; i < item->output_count; i++)
+  {
+    char file_path[1400];
+    snprintf(file_path, sizeof(file_path), "%s/%s", item->output_path,
+             item->output[i].name);
+    if(!write_host_file(file_path, item->output[i].data,
+                        item->output[i].size))
+      return(0);
+    stats.sectors_written += item->output[i].size / SECTOR_SIZE;
+  }
+  return(1);
+}
+
+
+/*===========================================================================
+ *                           convert_command
+ *===========================================================================
+ * Desription: Convert many images to one format as a pipeline
+ *
+ *             Reader threads load inputs whole, a pool of workers
+ *             decodes each one and encodes it in the output format, and
+ *             this thread writes the outputs in input order. The stages
+ *             are joined by bounded queues and a window on the number of
+ *             images in flight, so memory stays bounded and a slow stage
+ *             holds the others back. An input that cannot be converted is
+ *             reported and skipped without stopping the rest.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: convert [-j {workers}] [-o {directory}]
+ *                               [-V] {dsk|dkz|pc99|fiad} {input} ...
+ *
+ * Return:     Exit status, 1 if any input failed
+ */
+int convert_command(int argc, char **argv)
+{
+  static char *format_names[] = {"dsk", "dkz", "pc99", "fiad"};
+  struct convert_job job;
+  struct convert_item **pending;
+  struct convert_item *item;
+  struct convert_name *names;
+  pthread_t *threads;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count;
+  int completed = 0;
+  int failed = 0;
+  int i;
+
+  memset(&job, 0, sizeof(job));
+  job.out_dir = ".";
+  job.format = -1;
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)      workers = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) job.out_dir = argv[++i];
+    else if(strcmp(argv[i], "-V") == 0) all_args.verbose++;
+    else break;
+  }
+  if(i < argc)
+  {
+    for(job.format = 0; job.format <= format_fiad; job.format++)
+    {
+      if(strcasecmp(argv[i], format_names[job.format]) == 0) break;
+    }
+    job.extension = argv[i++];
+  }
+  if(job.format < 0 || job.format > format_fiad || workers < 1 || i >= argc)
+  {
+    printf("Usage: dsk99 convert [-j {workers}] [-o {directory}] "
+           "{dsk|dkz|pc99|fiad} {input} ...\n");
+    return(1);
+  }
+
+  // A couple of images per worker keeps every stage busy
+  job.paths = &argv[i];
+  job.path_count = argc - i;
+  job.window = 2 * workers + CONVERT_READERS;
+
+  // Inputs that would overwrite the output of an earlier one are skipped
+  names = malloc(job.path_count * sizeof(struct convert_name));
+  job.clash = calloc(job.path_count, sizeof(char*));
+  for(i = 0; i < job.path_count; i++)
+  {
+    convert_base(job.paths[i], names[i].base, sizeof(names[i].base));
+    names[i].seq = i;
+  }
+  qsort(names, job.path_count, sizeof(struct convert_name),
+        compare_convert_names);
+  for(i = 1; i < job.path_count; i++)
+  {
+    if(strcmp(names[i].base, names[i - 1].base) == 0)
+    {
+      job.clash[names[i].seq] = job.clash[names[i - 1].seq] != NULL
+                                ? job.clash[names[i - 1].seq]
+                                : job.paths[names[i - 1].seq];
+    }
+  }
+  free(names);
+
+  convert_queue_init(&job.decode, workers);
+  convert_queue_init(&job.encoded, job.window);
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.window_open, NULL);
+  pending = calloc(job.window, sizeof(struct convert_item*));
+  threads = malloc((CONVERT_READERS + workers) * sizeof(pthread_t));
+
+  // Go on with the threads that could be started. Holding the lock keeps
+  // the readers from claiming inputs, and so the workers from finishing,
+  // until the counts are known.
+  pthread_mutex_lock(&job.lock);
+  for(job.workers = 0; job.workers < workers; job.workers++)
+  {
+    if(pthread_create(&threads[job.workers], NULL, convert_worker,
+                      &job) != 0) break;
+  }
+  thread_count = job.workers;
+  if(job.workers > 0)
+  {
+    for(job.readers = 0; job.readers < CONVERT_READERS; job.readers++)
+    {
+      if(pthread_create(&threads[thread_count], NULL, convert_reader,
+                        &job) != 0) break;
+      thread_count++;
+    }
+    if(job.readers == 0) convert_queue_close(&job.decode);
+  }
+  pthread_mutex_unlock(&job.lock);
+  if(job.workers == 0 || job.readers == 0)
+  {
+    printf("Cannot start conversion threads\n");
+    for(i = 0; i < thread_count; i++)
+      pthread_join(threads[i], NULL);
+    free(threads);
+    free(pending);
+    free(job.clash);
+    free(job.decode.items);
+    free(job.encoded.items);
+    return(1);
+  }
+
+  // Write outputs in input order as they come in
+  while((item = convert_queue_pop(&job.encoded)) != NULL)
+  {
+    pending[item->seq % job.window] = item;
+    while((item = pending[job.written % job.window]) != NULL)
+    {
+      pending[job.written % job.window] = NULL;
+      if(item->problem == NULL && !convert_write(&job, item))
+        item->problem = "cannot write output";
+      if(item->problem == NULL)
+      {
+        completed++;
+        if(all_args.verbose)
+          printf("%s -> %s\n", item->path, item->output_path);
+      }
+      else
+      {
+        failed++;
+        printf("Skipping \"%s\": %s\n", item->path, item->problem);
+      }
+      stats_image_done((clock_ns(CLOCK_MONOTONIC) - item->start) / 1e6);
+
+      for(i = 0; i < item->output_count; i++)
+        free(item->output[i].data);
+      free(item->output);
+      free(item);
+
+      pthread_mutex_lock(&job.lock);
+      job.written++;
+      pthread_cond_broadcast(&job.window_open);
+      pthread_mutex_unlock(&job.lock);
+    }
+  }
+  for(i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(pending);
+  free(job.clash);
+  free(job.decode.items);
+  free(job.encoded.items);
+  if(all_args.verbose || failed)
+    printf("%d converted, %d failed\n", completed, failed);
+  return(failed ? 1 : 0);
+}
+
+
+/*===========================================================================
+ *                          save_changed_sectors
+ *===========================================================================
+ * Desription: Write back the sectors of a V9T9 image that differ from a
+ *             copy taken when it was loaded. Other formats are saved whole.
+ *
+ * Parameters: filename - Image file
+ *             before   - Image contents as loaded
+ *
+ * Return:     Was the image saved?
+ */
+int save_changed_sectors(char *filename, unsigned char *before)
+{
+  struct phase_timer timer;
+  unsigned char *data = disk_buffer;
+  int sectors = disk_size / SECTOR_SIZE;
+  int ok = 1;
+  int secno;
+  int fd;
+
+  if(disk_format != format_v9t9) return(save_disk(filename));
+
+  phase_start(&timer, phase_save);
+  fd = open(filename, O_WRONLY);
+  if(fd < 0) ok = 0;
+  for(secno = 0; ok && secno < sectors; secno++)
+  {
+    off_t offset = (off_t)secno * SECTOR_SIZE;
+    if(sector_equal(&data[offset], &before[offset])) continue;
+    TRACE_BEGIN(trace_save_write, secno);
+    ok = (pwrite(fd, &data[offset], SECTOR_SIZE, offset) == SECTOR_SIZE);
+    TRACE_END(trace_save_write, 1);
+    stats.sectors_written++;
+  }
+  if(fd >= 0 && close(fd) != 0) ok = 0;
+  phase_stop(&timer);
+  if(!ok) printf("Cannot save disk file \"%s\"\n", filename);
+  return(ok);
+}
+
+
+/*===========================================================================
+ *                           record_command
+ *===========================================================================
+ * Desription: Append records to a data file, or replace one record of a
+ *             fixed record file, in place
+ *
+ *             Display files take one record per line of the host file,
+ *             internal files take records of the file's record length.
+ *             Only the sectors that change are written back to a V9T9
+ *             image.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: append {image} {file} {host file}
+ *                          or   update {image} {file}#{record} {host file}
+ *
+ * Return:     Exit status
+ */
+int record_command(int argc, char **argv)
+{
+  int update = (strcmp(argv[0], "update") == 0);
+  char name[FILE_NAME_LEN + 1];
+  struct fib_block *fib;
+  unsigned char *before;
+  unsigned char *data;
+  char *range = NULL;
+  int recno = 0;
+  int records = 0;
+  int size;
+  int pos;
+  int i;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if(strcmp(argv[i], "-V") == 0) all_args.verbose++;
+    else break;
+  }
+  if(argc - i == 3 && update && (range = strchr(argv[i + 1], '#')) != NULL)
+  {
+    char *end;
+    recno = strtol(range + 1, &end, 10);
+    if(end == range + 1 || *end != 0) range = NULL;
+  }
+  if(argc - i != 3 || (update && range == NULL))
+  {
+    printf("Usage: dsk99 append {image} {file} {host file}\n"
+           "       dsk99 update {image} {file}#{record} {host file}\n");
+    return(1);
+  }
+
+  data = read_host_file(argv[i + 2], &size);
+  if(data == NULL)
+  {
+    printf("Cannot read \"%s\"\n", argv[i + 2]);
+    return(1);
+  }
+  if(load_disk(argv[i]) == 0) return(1);
+  container_release();
+  before = malloc(disk_size);
+  memcpy(before, disk_buffer, disk_size);
+
+  if(range != NULL) *range = 0;
+  make_name(name, argv[i + 1], FILE_NAME_LEN);
+  if(range != NULL) *range = '#';
+  fib = find_fib(name);
+  if(fib == NULL || (fib->flags & fib_program))
+  {
+    printf("Cannot find data file \"%s\"\n", argv[i + 1]);
+    return(1);
+  }
+
+  for(pos = 0; pos < size; records++)
+  {
+    int length;
+    int next;
+    int ok;
+
+    // One line of a display file, or one record length of an internal file
+    if(fib->flags & fib_binary)
+    {
+      length = fib->reclen ? fib->reclen : SECTOR_SIZE;
+      if(length > size - pos) length = size - pos;
+      next = pos + length;
+    }
+    else
+    {
+      unsigned char *eol = memchr(&data[pos], '\n', size - pos);
+      length = eol ? eol - &data[pos] : size - pos;
+      next = pos + length + (eol != NULL);
+      if(length > 0 && data[pos + length - 1] == '\r') length--;
+    }
+
+    if(update)
+      ok = (records == 0 && write_record(fib, recno, &data[pos], length));
+    else
+      ok = append_record(fib, &data[pos], length);
+    if(!ok)
+    {
+      printf("Cannot %s record %d of \"%s\"\n", update ? "write" : "append",
+             update ? recno : records, argv[i + 1]);
+      return(1);
+    }
+    pos = next;
+  }
+  free(data);
+
+  if(save_changed_sectors(argv[i], before) == 0) return(1);
+  free(before);
+  if(all_args.verbose)
+    printf("%s %d record%s of \"%s\"\n", update ? "Wrote" : "Appended",
+           records, records == 1 ? "" : "s", argv[i + 1]);
+  return(0);
+}
+
+
+/*===========================================================================
+ *                             match_files
+ *===========================================================================
+ * Desription: Find the files in the disk image whose names match a glob
+ *
+ * Parameters: pattern - Glob pattern, compared in upper case
+ *             names   - Receives matching names, MAX_FILE_COUNT entries
+ *
+ * Return:     Number of matching files
+ */
+int match_files(char *pattern, char names[][FILE_NAME_LEN + 1])
+{
+  uint16_t index[MAX_FILE_COUNT];
+  char upper[256];
+  int count = 0;
+  int i;
+
+  for(i = 0; pattern[i] && i < (int)sizeof(upper) - 1; i++)
+  {
+    upper[i] = pattern[i];
+    if(upper[i] >= 'a' && upper[i] <= 'z') upper[i] += 'A' - 'a';
+    if(upper[i] == '.') upper[i] = '_';
+  }
+  upper[i] = 0;
+
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct fib_block *fib = fib_at(index[i]);
+    char name[FILE_NAME_LEN + 1];
+    char *p;
+    if(fib == NULL) continue;
+    memcpy(name, fib->name, FILE_NAME_LEN);
+    name[FILE_NAME_LEN] = 0;
+    if((p = strchr(name, ' ')) != NULL) *p = 0;
+    if(fnmatch(upper, name, 0) == 0)
+    {
+      memcpy(names[count], fib->name, FILE_NAME_LEN);
+      names[count][FILE_NAME_LEN] = 0;
+      count++;
+    }
+  }
+  return(count);
+}
+
+
+// File taken from a source image by copy
+struct copy_item
+{
+  struct fib_block fib;         // FIB as it was on the source image
+  unsigned char *data;          // Contents of every sector of the file
+  int sectors;                  // Number of sectors of contents
+};
+
+
+/*===========================================================================
+ *                          compare_copy_items
+ *===========================================================================
+ * Desription: Order files to copy by size, largest first
+ *
+ * Parameters: a - First copy_item
+ *             b - Second copy_item
+ *
+ * Return:     Sort order
+ */
+int compare_copy_items(const void *a, const void *b)
+{
+  return(((const struct copy_item*)b)->sectors -
+         ((const struct copy_item*)a)->sectors);
+}
+
+
+/*===========================================================================
+ *                          compare_fdr_names
+ *===========================================================================
+ * Desription: Order FIB sector numbers by the names of their files
+ *
+ * Parameters: a - First sector number
+ *             b - Second sector number
+ *
+ * Return:     Sort order
+ */
+int compare_fdr_names(const void *a, const void *b)
+{
+  return(strncmp(fib_at(*(const uint16_t*)a)->name,
+                 fib_at(*(const uint16_t*)b)->name, FILE_NAME_LEN));
+}
+
+
+/*===========================================================================
+ *                              take_file
+ *===========================================================================
+ * Desription: Take a copy of a file of the loaded image, FIB and all
+ *
+ * Parameters: item - Receives the FIB and the contents of every sector
+ *             fib  - File information block
+ *
+ * Return:     Was the file taken? It is not if the cluster table is bad.
+ */
+int take_file(struct copy_item *item, struct fib_block *fib)
+{
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count = fib_spans(fib, spans);
+  int pos = 0;
+  int i;
+  int j;
+
+  if(span_count < 0) return(0);
+  item->fib = *fib;
+  item->sectors = fib_physrec_count(fib);
+  item->data = malloc(item->sectors > 0 ? item->sectors * SECTOR_SIZE : 1);
+
+  // A span need not be contiguous in memory, a .dkz image decompresses
+  // its blocks separately
+  for(i = 0; i < span_count && pos < item->sectors; i++)
+  {
+    for(j = 0; j < spans[i].count && pos < item->sectors; j++, pos++)
+      memcpy(&item->data[pos * SECTOR_SIZE], get_sector(spans[i].first + j),
+             SECTOR_SIZE);
+  }
+  memset(&item->data[pos * SECTOR_SIZE], 0,
+         (item->sectors - pos) * SECTOR_SIZE);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             place_files
+ *===========================================================================
+ * Desription: Add a set of taken files to the loaded image as a whole
+ *
+ *             The image is checked for names, index slots and space for
+ *             the whole set before anything is allocated: FIBs first,
+ *             then the file contents largest first so the big files get
+ *             the long free runs. The FDR index is rebuilt once at the
+ *             end. The contents of the items are released.
+ *
+ * Parameters: items      - Files to add, sorted by size here
+ *             item_count - Number of files
+ *             target     - Image name used in messages
+ *
+ * Return:     Were all files added? If not, the image is left part way
+ *             and must not be saved.
+ */
+int place_files(struct copy_item *items, int item_count, char *target)
+{
+  uint16_t index[MAX_FILE_COUNT * 2];
+  int index_count;
+  int need = 0;
+  int au = sectors_per_au();
+  int ok = 1;
+  int i;
+
+  fdr_index_decode(index);
+  for(i = index_count = 0; i < MAX_FILE_COUNT; i++)
+  {
+    if(fib_at(index[i]) != NULL) index[index_count++] = index[i];
+  }
+  for(i = 0; i < item_count; i++)
+  {
+    char name[FILE_NAME_LEN + 1];
+    char *space;
+    memcpy(name, items[i].fib.name, FILE_NAME_LEN);
+    name[FILE_NAME_LEN] = 0;
+    if(find_fib(name) != NULL)
+    {
+      if((space = strchr(name, ' ')) != NULL) *space = 0;
+      printf("Cannot copy \"%s\", file already exists in \"%s\"\n",
+             name, target);
+      ok = 0;
+    }
+    need += (items[i].sectors + au - 1) / au + 1;
+  }
+  if(ok && index_count + item_count > MAX_FILE_COUNT)
+  {
+    printf("Cannot copy %d files, too many files in \"%s\"\n",
+           item_count, target);
+    ok = 0;
+  }
+  if(ok && free_sector_count() / au < need)
+  {
+    printf("Cannot copy %d files, \"%s\" is full\n", item_count, target);
+    ok = 0;
+  }
+
+  // FIBs first, then contents largest first
+  qsort(items, item_count, sizeof(struct copy_item), compare_copy_items);
+  for(i = 0; ok && i < item_count; i++)
+  {
+    struct fib_block *fib = (struct fib_block*)allocate();
+    *fib = items[i].fib;
+    memset(fib->cluster, 0, sizeof(fib->cluster));
+    index[index_count + i] = sector_of(fib);
+  }
+  for(i = 0; i < item_count; i++)
+  {
+    struct fib_block *fib;
+    struct cluster_span spans[MAX_CLUSTERS];
+    int span_count = 0;
+
+    if(ok)
+    {
+      fib = fib_at(index[index_count + i]);
+      if(!extend_spans(spans, &span_count, items[i].sectors))
+      {
+        printf("Cannot copy \"%.*s\", \"%s\" is too fragmented\n",
+               FILE_NAME_LEN, fib->name, target);
+        ok = 0;
+      }
+      else
+      {
+        write_span_data(spans, span_count, items[i].data,
+                        items[i].sectors * SECTOR_SIZE);
+        fib_set_spans(fib, spans, span_count);
+        if(all_args.verbose)
+          printf("Copied \"%.*s\", %d sectors in %d clusters\n",
+                 FILE_NAME_LEN, fib->name, items[i].sectors, span_count);
+      }
+    }
+    free(items[i].data);
+  }
+  if(!ok) return(0);
+
+  // Rebuild the FDR index in name order
+  index_count += item_count;
+  qsort(index, index_count, sizeof(uint16_t), compare_fdr_names);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+    fdr_index_set(i, i < index_count ? index[i] : 0);
+  return(1);
+}
+
+
+/*===========================================================================
+ *                             file_split
+ *===========================================================================
+ * Desription: Find the colon before the file name in an {image}:{file}
+ *             address. The image may itself be in a pack, as in
+ *             "archive.dkp:GAMES1:CHESS", so the search starts after the
+ *             pack.
+ *
+ * Parameters: address - Image address, optionally followed by a file name
+ *
+ * Return:     Colon before the file name, NULL if there is none
+ */
+char* file_split(char *address)
+{
+  char pack[1024];
+  char *image = pack_split(address, pack, sizeof(pack));
+  char *colon = strrchr(image != NULL ? image : address, ':');
+
+  if(colon == address) return(NULL);
+  return(colon);
+}
+
+
+/*===========================================================================
+ *                             copy_command
+ *===========================================================================
+ * Desription: Copy files straight from one disk image to another
+ *
+ *             Each file keeps its FIB, so type, record layout and
+ *             timestamps come across unchanged, and its sectors are
+ *             copied as they are. All files are taken from the sources
+ *             first and then placed in the destination together, see
+ *             place_files(). Nothing is saved unless every file was
+ *             copied.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: copy [-V] {image}:{file} ...
+ *                               {image}[:{file}]
+ *
+ * Return:     Exit status
+ */
+int copy_command(int argc, char **argv)
+{
+  struct copy_item *items = NULL;
+  char names[MAX_FILE_COUNT][FILE_NAME_LEN + 1];
+  char new_name[FILE_NAME_LEN];
+  unsigned char *before = NULL;
+  char *loaded = NULL;
+  char *target;
+  char *colon;
+  int item_count = 0;
+  int first;
+  int ok;
+  int i;
+  int j;
+  int k;
+
+  for(first = 1; first < argc && argv[first][0] == '-'; first++)
+  {
+    if(strcmp(argv[first], "-V") == 0) all_args.verbose++;
+    else break;
+  }
+  if(argc - first < 2)
+  {
+    printf("Usage: dsk99 copy [-V] {image}:{file} ... {image}[:{file}]\n");
+    return(1);
+  }
+
+  // Take every matching file from the sources
+  for(i = first; i < argc - 1; i++)
+  {
+    int count;
+    colon = file_split(argv[i]);
+    if(colon == NULL || colon[1] == 0)
+    {
+      printf("Cannot copy \"%s\", expected {image}:{file}\n", argv[i]);
+      return(1);
+    }
+    *colon = 0;
+    if(loaded == NULL || strcmp(loaded, argv[i]) != 0)
+    {
+      if(load_disk(argv[i]) == 0) return(1);
+      loaded = argv[i];
+    }
+    count = match_files(colon + 1, names);
+    if(count == 0)
+    {
+      printf("No files in \"%s\" match \"%s\"\n", argv[i], colon + 1);
+      return(1);
+    }
+    items = realloc(items, (item_count + count) * sizeof(struct copy_item));
+    for(j = 0; j < count; j++)
+    {
+      struct fib_block *fib = find_fib(names[j]);
+      for(k = 0; k < item_count; k++)
+      {
+        if(memcmp(items[k].fib.name, fib->name, FILE_NAME_LEN) == 0) break;
+      }
+      if(k < item_count)
+      {
+        printf("Cannot copy \"%s\" twice\n", names[j]);
+        return(1);
+      }
+      if(!take_file(&items[item_count], fib))
+      {
+        printf("Cannot copy \"%s\", bad cluster table\n", names[j]);
+        return(1);
+      }
+      item_count++;
+    }
+  }
+  release_disk();
+
+  // A single file may be given a new name
+  target = argv[argc - 1];
+  colon = file_split(target);
+  if(colon != NULL)
+  {
+    *colon = 0;
+    if(item_count != 1)
+    {
+      printf("Cannot rename %d files to \"%s\"\n", item_count, colon + 1);
+      return(1);
+    }
+    make_name(new_name, colon + 1, FILE_NAME_LEN);
+    memcpy(items[0].fib.name, new_name, FILE_NAME_LEN);
+  }
+
+  // Start from the existing image, or a blank one
+  if(image_exists(target))
+  {
+    if(load_disk(target) == 0) return(1);
+    container_release();
+    before = malloc(disk_size);
+    memcpy(before, disk_buffer, disk_size);
+  }
+  else
+  {
+    create_disk(geometry_sssd);
+    disk_format = format_for_path(target);
+  }
+
+  ok = place_files(items, item_count, target);
+  free(items);
+  if(!ok) return(1);
+  if(before != NULL)
+  {
+    if(save_changed_sectors(target, before) == 0) return(1);
+    free(before);
+  }
+  else if(save_disk(target) == 0) return(1);
+  return(0);
+}
+
+
+// File found by repack and the output image it is packed into
+struct repack_file
+{
+  char name[FILE_NAME_LEN];     // Name of the file on its source
+  char new_name[FILE_NAME_LEN]; // Name of the file on the output
+  int image;                    // Source image holding the file
+  int cost;                     // Allocation units needed, FIB included
+  int bin;                      // Output image receiving the file
+};
+
+// Output image being filled by the packing plan
+struct repack_bin
+{
+  int free;                     // Allocation units still free
+  int count;                    // Number of files packed
+  int files[MAX_FILE_COUNT];    // Files packed, as repack_file indexes
+  int failed;                   // Could the output image not be made?
+};
+
+// Source images, the files found in them and the packing plan
+struct repack_job
+{
+  char **paths;                 // Source images
+  int path_count;
+  char **problems;              // Why each unusable source was skipped
+  struct repack_file *files;    // Files found in every source
+  int file_count;
+  struct repack_bin *bins;      // Output images
+  int bin_count;
+  int bin_capacity;
+  int layout;                   // Geometry of the output images
+  int au;                       // Sectors per allocation unit on output
+  int rename;                   // Rename files rather than open an image?
+  int renamed;                  // Files given a new name
+  char *out_dir;                // Directory receiving output images
+  int next;                     // Next image or bin to be claimed
+  int failed;                   // Output images that could not be made
+  pthread_mutex_t lock;
+};
+
+
+/*===========================================================================
+ *                            repack_output
+ *===========================================================================
+ * Desription: Make the path of an output image of repack
+ *
+ * Parameters: job    - Repack job
+ *             bin    - Output image number
+ *             buffer - Receives the path
+ *             size   - Size of buffer
+ *
+ * Return:     None
+ */
+void repack_output(struct repack_job *job, int bin, char *buffer, int size)
+{
+  snprintf(buffer, size, "%s/pack%04d.dsk", job->out_dir, bin + 1);
+}
+
+
+/*===========================================================================
+ *                             repack_scan
+ *===========================================================================
+ * Desription: Worker that lists the files of source images and the space
+ *             each needs on the output geometry
+ *
+ * Parameters: arg - Repack job
+ *
+ * Return:     NULL
+ */
+void* repack_scan(void *arg)
+{
+  struct repack_job *job = arg;
+
+  for(;;)
+  {
+    struct repack_file found[MAX_FILE_COUNT];
+    uint16_t index[MAX_FILE_COUNT];
+    char *problem = NULL;
+    int count = 0;
+    int number;
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    number = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if(number >= job->path_count) break;
+
+    release_disk();
+    if(!read_disk(job->paths[number]))
+      problem = "cannot load image";
+    else if((problem = check_image()) == NULL)
+    {
+      fdr_index_decode(index);
+      for(i = 0; i < MAX_FILE_COUNT; i++)
+      {
+        struct fib_block *fib = fib_at(index[i]);
+        if(fib == NULL) continue;
+        memcpy(found[count].name, fib->name, FILE_NAME_LEN);
+        found[count].image = number;
+        found[count].cost = (fib_physrec_count(fib) + job->au - 1) / job->au
+                            + 1;
+        found[count].bin = -1;
+        count++;
+      }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if(problem != NULL)
+      job->problems[number] = strdup(problem);
+    else if(count > 0)
+    {
+      job->files = realloc(job->files, (job->file_count + count) *
+                           sizeof(struct repack_file));
+      memcpy(&job->files[job->file_count], found,
+             count * sizeof(struct repack_file));
+      job->file_count += count;
+    }
+    pthread_mutex_unlock(&job->lock);
+  }
+  release_disk();
+  stats_merge();
+  return(NULL);
+}
+
+
+/*===========================================================================
+ *                         compare_repack_files
+ *===========================================================================
+ * Desription: Order files for packing, largest first, then by source
+ *             image and name so the plan does not depend on which worker
+ *             scanned what
+ *
+ * Parameters: a - First repack_file
+ *             b - Second repack_file
+ *
+ * Return:     Sort order
+ */
+int compare_repack_files(const void *a, const void *b)
+{
+  const struct repack_file *fa = a;
+  const struct repack_file *fb = b;
+  if(fa->cost != fb->cost) return(fb->cost - fa->cost);
+  if(fa->image != fb->image) return(fa->image - fb->image);
+  return(memcmp(fa->name, fb->name, FILE_NAME_LEN));
+}
+
+
+/*===========================================================================
+ *                           repack_has_name
+ *===========================================================================
+ * Desription: Check whether an output image already holds a file name
+ *
+ * Parameters: job  - Repack job
+ *             bin  - Output image
+ *             name - File name, padded with spaces
+ *
+ * Return:     Is the name taken?
+ */
+int repack_has_name(struct repack_job *job, struct repack_bin *bin,
+                    char *name)
+{
+  int i;
+  for(i = 0; i < bin->count; i++)
+  {
+    if(memcmp(job->files[bin->files[i]].new_name, name, FILE_NAME_LEN) == 0)
+      return(1);
+  }
+  return(0);
+}
+
+
+/*===========================================================================
+ *                             repack_skip
+ *===========================================================================
+ * Desription: Follow the links past files that are already packed
+ *
+ *             Each link points at the next file to try in one direction,
+ *             links of packed files are shortened as they are followed.
+ *
+ * Parameters: link - Links for one direction, one per file plus an end
+ *             i    - File to start at
+ *
+ * Return:     First file not yet packed, or the end of the list
+ */
+int repack_skip(int *link, int i)
+{
+  int end = i;
+  while(link[end] != end) end = link[end];
+  while(link[i] != end)
+  {
+    int next = link[i];
+    link[i] = end;
+    i = next;
+  }
+  return(end);
+}
+
+
+/*===========================================================================
+ *                             repack_plan
+ *===========================================================================
+ * Desription: Pack every file into output images
+ *
+ *             Output images are filled one at a time. Each file taken is
+ *             the one whose size is closest to the space left divided
+ *             by the index slots left, so an image runs out of space and
+ *             slots together rather than filling with large files and
+ *             leaving the many small ones for images of their own. A file
+ *             whose name is already on the image is passed over, or with
+ *             rename takes a suffixed name when nothing else fits.
+ *
+ * Parameters: job      - Repack job, files sorted by compare_repack_files
+ *             capacity - Allocation units free on a blank output image
+ *
+ * Return:     Was there room for every file?
+ */
+int repack_plan(struct repack_job *job, int capacity)
+{
+  int count = job->file_count;
+  int *right = malloc((count + 1) * sizeof(int));
+  int *left = malloc((count + 1) * sizeof(int));
+  int placed = 0;
+  int i;
+
+  // right[] runs towards smaller files and ends at count, left[] runs
+  // towards larger files and ends at the extra entry
+  for(i = 0; i <= count; i++)
+  {
+    right[i] = i;
+    left[i] = i;
+  }
+  if(count > 0 && job->files[0].cost > capacity) placed = -1;
+
+  while(placed >= 0 && placed < count)
+  {
+    struct repack_bin *bin;
+    int b = job->bin_count;
+
+    if(b == job->bin_capacity)
+    {
+      job->bin_capacity = b ? 2 * b : 16;
+      job->bins = realloc(job->bins,
+                          job->bin_capacity * sizeof(struct repack_bin));
+    }
+    bin = &job->bins[b];
+    bin->free = capacity;
+    bin->failed = 0;
+    bin->count = 0;
+    job->bin_count++;
+
+    while(bin->count < MAX_FILE_COUNT && placed < count)
+    {
+      struct repack_file *file;
+      int want = bin->free / (MAX_FILE_COUNT - bin->count);
+      int low = 0;
+      int high = count;
+      int small;
+      int large;
+      int pick;
+      int clash = -1;
+
+      // First file no larger than the wanted size
+      while(low < high)
+      {
+        int mid = (low + high) / 2;
+        if(job->files[mid].cost > want) low = mid + 1;
+        else                            high = mid;
+      }
+
+      // Nearest unclashing file on each side
+      small = repack_skip(right, low);
+      while(small < count &&
+            repack_has_name(job, bin, job->files[small].name))
+      {
+        if(clash < 0) clash = small;
+        small = repack_skip(right, small + 1);
+      }
+      large = (low > 0) ? repack_skip(left, low - 1) : count;
+      while(large < count && job->files[large].cost <= bin->free &&
+            repack_has_name(job, bin, job->files[large].name))
+      {
+        if(clash < 0) clash = large;
+        large = (large > 0) ? repack_skip(left, large - 1) : count;
+      }
+      if(large < count && job->files[large].cost > bin->free) large = count;
+
+      if(small < count && large < count)
+        pick = (job->files[large].cost - want <=
+                want - job->files[small].cost) ? large : small;
+      else
+        pick = (small < count) ? small : large;
+      if(pick == count && job->rename) pick = clash;
+      if(pick < 0 || pick == count) break;
+
+      file = &job->files[pick];
+      memcpy(file->new_name, file->name, FILE_NAME_LEN);
+      if(repack_has_name(job, bin, file->name))
+      {
+        // NAME_2, NAME_3 ... cut short to fit
+        char suffix[FILE_NAME_LEN + 1];
+        int length = FILE_NAME_LEN;
+        int n;
+        while(length > 0 && file->name[length - 1] == ' ') length--;
+        for(n = 2; ; n++)
+        {
+          int size = snprintf(suffix, sizeof(suffix), "_%d", n);
+          int keep = (length + size > FILE_NAME_LEN) ? FILE_NAME_LEN - size
+                                                     : length;
+          memset(file->new_name, ' ', FILE_NAME_LEN);
+          memcpy(file->new_name, file->name, keep);
+          memcpy(&file->new_name[keep], suffix, size);
+          if(!repack_has_name(job, bin, file->new_name)) break;
+        }
+        job->renamed++;
+      }
+      bin->free -= file->cost;
+      bin->files[bin->count++] = pick;
+      file->bin = b;
+      right[pick] = pick + 1;
+      left[pick] = (pick > 0) ? pick - 1 : count;
+      placed++;
+    }
+
+    // A file that fits nowhere would open images forever
+    if(bin->count == 0) placed = -1;
+  }
+  free(right);
+  free(left);
+  return(placed >= 0);
+}
+
+
+/*===========================================================================
+ *                        compare_repack_sources
+ *===========================================================================
+ * Desription: Order files by source image, then by name, for the mapping
+ *
+ * Parameters: a - First repack_file
+ *             b - Second repack_file
+ *
+ * Return:     Sort order
+ */
+int compare_repack_sources(const void *a, const void *b)
+{
+  const struct repack_file *fa = a;
+  const struct repack_file *fb = b;
+  if(fa->image != fb->image) return(fa->image - fb->image);
+  return(memcmp(fa->name, fb->name, FILE_NAME_LEN));
+}
+
+
+/*===========================================================================
+ *                             repack_build
+ *===========================================================================
+ * Desription: Worker that writes output images of the packing plan
+ *
+ * Parameters: arg - Repack job
+ *
+ * Return:     NULL
+ */
+void* repack_build(void *arg)
+{
+  struct repack_job *job = arg;
+  struct copy_item items[MAX_FILE_COUNT];
+
+  for(;;)
   {
-    {"Vh",                  cNONE},
-    {"oV",                  cOUTNAME},
-    {"rV",                  cFILENAME},
-    {"xV",                  cFILENAME},
-    {"nV",                  cDISKNAME},
-    {"cWUlV",               cDISKPATH},
-    {"eWUlXV",              cDISKPATH},
-    {"pdifwuvV0123456789",  cFILENAME},
-    {"apdifwuvV0123456789", cFILENAME},
-    {NULL,    cNONE}
-  };
+    struct repack_bin *bin;
+    char path[1024];
+    char label[16];            // Room for any number, cut by make_name
+    int loaded = -1;
+    int ok = 1;
+    int number;
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    number = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if(number >= job->bin_count) break;
+    bin = &job->bins[number];
+    repack_output(job, number, path, sizeof(path));
+
+    // Take the files from their sources, one source at a time
+    for(i = 0; i < bin->count; i++)
+    {
+      struct repack_file *file = &job->files[bin->files[i]];
+      char name[FILE_NAME_LEN + 1];
+      struct fib_block *fib;
+
+      memcpy(name, file->name, FILE_NAME_LEN);
+      name[FILE_NAME_LEN] = 0;
+      if(file->image != loaded)
+      {
+        release_disk();
+        loaded = file->image;
+        if(!read_disk(job->paths[loaded])) ok = 0;
+      }
+      fib = ok ? find_fib(name) : NULL;
+      if(fib == NULL || !take_file(&items[i], fib))
+      {
+        printf("Cannot copy \"%s\" from \"%s\"\n", name, job->paths[loaded]);
+        while(--i >= 0) free(items[i].data);
+        ok = 0;
+        break;
+      }
+      memcpy(items[i].fib.name, file->new_name, FILE_NAME_LEN);
+    }
+    release_disk();
+
+    if(ok)
+    {
+      create_disk(job->layout);
+      disk_format = format_v9t9;
+      snprintf(label, sizeof(label), "PACK%04d", number + 1);
+      make_name(((struct vib_block*)disk_buffer)->name, label,
+                DISK_NAME_LEN);
+      ok = place_files(items, bin->count, path) && save_disk(path);
+      release_disk();
+    }
+    if(!ok)
+    {
+      pthread_mutex_lock(&job->lock);
+      bin->failed = 1;
+      job->failed++;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+  stats_merge();
+  return(NULL);
+}
+
 
+/*===========================================================================
+ *                            repack_command
+ *===========================================================================
+ * Desription: Pack the files of many small images into as few large
+ *             images as possible
+ *
+ *             Sources are scanned in parallel for the size of every file
+ *             on the output geometry, a packing plan for all files is
+ *             made up front, then the output images are written in
+ *             parallel, one worker per output image. Files keep their
+ *             FIB and name. Where each file went is written to the
+ *             mapping file, or to standard output, one line per file:
+ *             {image}:{file} -> {image}:{file}. Files of an output image
+ *             that could not be made are left out.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: repack [-g {geometry}] [-j {workers}]
+ *                               [-o {directory}] [-m {mapping}] [-r]
+ *                               [-V] {image} ...
+ *
+ * Return:     Exit status
+ */
+int repack_command(int argc, char **argv)
+{
+  struct repack_job job;
+  pthread_t *threads;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  char *mapping_path = NULL;
+  FILE *mapping = stdout;
+  int thread_count;
+  int capacity;
+  int total = 0;
+  int least;
+  int phase;
   int i;
-  int expect = cNONE;
-  struct file_arg curr_file;
-  int last_file = -1;
-  int last_arg = 0;
+  int j;
 
-  // Display help if no arguments given
-  if(argc == 1)
+  memset(&job, 0, sizeof(job));
+  job.layout = geometry_dshd;
+  job.out_dir = ".";
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
   {
-    show_help();
+    if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)      workers = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) job.out_dir = argv[++i];
+    else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc) mapping_path = argv[++i];
+    else if(strcmp(argv[i], "-r") == 0) job.rename = 1;
+    else if(strcmp(argv[i], "-V") == 0) all_args.verbose++;
+    else if(strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+    {
+      i++;
+      for(job.layout = 0; job.layout < geometry_count; job.layout++)
+        if(strcasecmp(argv[i], geometries[job.layout].name) == 0) break;
+      if(job.layout == geometry_count) break;
+    }
+    else break;
+  }
+  if(i >= argc || workers < 1 || job.layout == geometry_count)
+  {
+    printf("Usage: dsk99 repack [-g {geometry}] [-j {workers}] "
+           "[-o {directory}] [-m {mapping}] [-r]\n"
+           "                    {image} ...\n");
+    return(1);
+  }
+  if(mkdir(job.out_dir, 0777) != 0 && errno != EEXIST)
+  {
+    printf("Cannot create directory \"%s\"\n", job.out_dir);
+    return(1);
+  }
+  if(mapping_path != NULL && (mapping = fopen(mapping_path, "w")) == NULL)
+  {
+    printf("Cannot create \"%s\"\n", mapping_path);
+    return(1);
+  }
+
+  // Space on a blank output image
+  create_disk(job.layout);
+  job.au = sectors_per_au();
+  capacity = free_sector_count() / job.au;
+  release_disk();
+
+  job.paths = &argv[i];
+  job.path_count = argc - i;
+  job.problems = calloc(job.path_count, sizeof(char*));
+  pthread_mutex_init(&job.lock, NULL);
+  threads = malloc(workers * sizeof(pthread_t));
+
+  // Scan the sources, plan, then build the outputs
+  for(phase = 0; phase < 2; phase++)
+  {
+    void* (*worker)(void*) = phase ? repack_build : repack_scan;
+    int jobs = phase ? job.bin_count : job.path_count;
+
+    job.next = 0;
+    for(thread_count = 0; thread_count < workers && thread_count < jobs;
+        thread_count++)
+    {
+      if(pthread_create(&threads[thread_count], NULL, worker, &job) != 0)
+        break;
+    }
+    if(thread_count == 0) worker(&job);
+    for(j = 0; j < thread_count; j++)
+      pthread_join(threads[j], NULL);
+    if(phase) break;
+
+    for(j = 0; j < job.path_count; j++)
+    {
+      if(job.problems[j] != NULL)
+        printf("Skipping \"%s\": %s\n", job.paths[j], job.problems[j]);
+    }
+    qsort(job.files, job.file_count, sizeof(struct repack_file),
+          compare_repack_files);
+    if(!repack_plan(&job, capacity))
+    {
+      printf("Cannot repack, a file does not fit on a %s disk\n",
+             geometries[job.layout].name);
+      return(1);
+    }
+
+    // Put the files in source order and list them that way in their
+    // output images, so each source is loaded once per output
+    qsort(job.files, job.file_count, sizeof(struct repack_file),
+          compare_repack_sources);
+    for(j = 0; j < job.bin_count; j++) job.bins[j].count = 0;
+    for(j = 0; j < job.file_count; j++)
+    {
+      struct repack_bin *bin = &job.bins[job.files[j].bin];
+      bin->files[bin->count++] = j;
+    }
+  }
+  free(threads);
+
+  // Old location to new location, for the output images that were made
+  for(j = 0; j < job.file_count; j++)
+  {
+    struct repack_file *file = &job.files[j];
+    char path[1024];
+    char name[FILE_NAME_LEN + 1];
+    char new_name[FILE_NAME_LEN + 1];
+    char *space;
+    if(job.bins[file->bin].failed) continue;
+    memcpy(name, file->name, FILE_NAME_LEN);
+    name[FILE_NAME_LEN] = 0;
+    if((space = strchr(name, ' ')) != NULL) *space = 0;
+    memcpy(new_name, file->new_name, FILE_NAME_LEN);
+    new_name[FILE_NAME_LEN] = 0;
+    if((space = strchr(new_name, ' ')) != NULL) *space = 0;
+    repack_output(&job, file->bin, path, sizeof(path));
+    fprintf(mapping, "%s:%s -> %s:%s\n", job.paths[file->image], name,
+            path, new_name);
+  }
+  if(mapping != stdout) fclose(mapping);
+
+  // No plan can use fewer images than the space or index slots allow
+  for(j = 0; j < job.file_count; j++) total += job.files[j].cost;
+  least = (total + capacity - 1) / capacity;
+  if(least < (job.file_count + MAX_FILE_COUNT - 1) / MAX_FILE_COUNT)
+    least = (job.file_count + MAX_FILE_COUNT - 1) / MAX_FILE_COUNT;
+  printf("Packed %d files from %d images into %d %s images "
+         "(at least %d needed)", job.file_count, job.path_count,
+         job.bin_count, geometries[job.layout].name, least);
+  if(job.renamed) printf(", %d files renamed", job.renamed);
+  printf("\n");
+  for(j = 0; j < job.path_count; j++) free(job.problems[j]);
+  free(job.problems);
+  free(job.files);
+  free(job.bins);
+  return(job.failed ? 1 : 0);
+}
+
+
+/*===========================================================================
+ *                             pack_command
+ *===========================================================================
+ * Desription: Add images to a pack, or list the images of a pack
+ *
+ *             Images may be in any format, including inside another
+ *             pack, and are stored as sector dumps named after the image
+ *             file. They are added a batch at a time, each batch one
+ *             append to the pack. The listing gives the address of each
+ *             image, ready to pass to other commands.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: pack [-l] [-V] {pack} [{image} ...]
+ *
+ * Return:     Exit status
+ */
+int pack_command(int argc, char **argv)
+{
+  char *names[PACK_BATCH];
+  unsigned char *images[PACK_BATCH];
+  int sizes[PACK_BATCH];
+  int list = 0;
+  int count = 0;
+  int added = 0;
+  int failed = 0;
+  size_t bytes = 0;
+  char pack_name[1024];
+  char *pack;
+  int i;
+  int j;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if(strcmp(argv[i], "-l") == 0)      list = 1;
+    else if(strcmp(argv[i], "-V") == 0) all_args.verbose++;
+    else break;
+  }
+  if(i >= argc || (list && argc - i != 1) || (!list && argc - i < 2))
+  {
+    printf("Usage: dsk99 pack {pack} {image} ...\n"
+           "       dsk99 pack -l {pack}\n");
+    return(1);
+  }
+  pack = argv[i++];
+
+  if(list)
+  {
+    struct pack_map *m = &pack_map;
+    if(!pack_open(pack))
+    {
+      printf("Cannot open pack \"%s\"\n", pack);
+      return(1);
+    }
+    for(j = 0; j < m->count; j++)
+    {
+      unsigned char *entry = &m->names[j * PACK_ENTRY_SIZE];
+      int number = load_le32(&entry[PACK_NAME_LEN]);
+      printf("%s:%.*s", pack, PACK_NAME_LEN, (char*)entry);
+      if(all_args.verbose)
+        printf("  %d sectors", load_le32(&m->offsets[number * 8 + 4]));
+      printf("\n");
+    }
+    if(all_args.verbose)
+      printf("%d images, %d sectors of garbage\n", m->count,
+             load_le32(&m->data[12]));
     return(0);
   }
 
-  for(i = 1; i < argc; i++)
+  for(; i <= argc; i++)
   {
-    char *arg = argv[i];
-    if(arg[0] == '-')
+    // Write a batch once it is full or everything has been read
+    if(count > 0 &&
+       (i == argc || count == PACK_BATCH || bytes >= PACK_BATCH_BYTES))
     {
-      // This is an option
-      
-      // Find the set to use
-      struct optionset *set = valid_set;
-      while(set->set != NULL)
-      {
-        // If all option flags are contained in this set, use it
-        if(strspn(&arg[1], set->set) == strlen(arg)-1) break;
+      if(pack_append(pack, names, images, sizes, count)) added += count;
+      else                                              failed += count;
+      for(j = 0; j < count; j++)
+        free(images[j]);
+      count = 0;
+      bytes = 0;
+    }
+    if(i == argc) break;
 
-        // Check next set
-        set++;
-      }
+    names[count] = pack_split(argv[i], pack_name, sizeof(pack_name));
+    if(names[count] == NULL)
+    {
+      names[count] = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1
+                                           : argv[i];
+    }
+    if(names[count][0] == 0 || strlen(names[count]) >= PACK_NAME_LEN)
+    {
+      printf("Skipping \"%s\": name is too long for a pack\n", argv[i]);
+      failed++;
+      continue;
+    }
+    release_disk();
+    if(!read_disk(argv[i]))
+    {
+      printf("Skipping \"%s\": cannot load image\n", argv[i]);
+      failed++;
+      continue;
+    }
+    container_release();
+    images[count] = disk_buffer;
+    sizes[count] = disk_size;
+    bytes += disk_size;
+    disk_buffer = NULL;
+    disk_size = 0;
+    if(all_args.verbose) printf("Adding \"%s\"\n", argv[i]);
+    count++;
+  }
+  printf("%d images added to \"%s\"", added, pack);
+  if(failed) printf(", %d failed", failed);
+  printf("\n");
+  return(failed ? 1 : 0);
+}
 
-      // Check for option validity
-      if(set->set == NULL ||
-         (last_arg != 0 && 
-          expect != cNONE && 
-          set->expect != cNONE && 
-          set->expect != expect))
-      {
-        printf("Invalid option \"%s\"\n", arg);
-        if(all_args.verbose)
-        {
-          if(set->set == NULL)      printf("This option does not exist\n");
-          if(set->expect != expect) printf("This option can't be used with other options it's with\n");
-        }
-        return(0);
-      }
 
-      if(last_arg == 0)
-      {
-        memset(&curr_file, 0, sizeof(struct file_arg));
-        last_arg = 1;
-      }
+/*===========================================================================
+ *                           compact_command
+ *===========================================================================
+ * Desription: Rewrite a pack without replaced images and old tables
+ *
+ *             The live images are copied in name order to a new file
+ *             which then takes the place of the pack. The old pack's
+ *             header is spoiled afterwards, so anything still mapping it
+ *             maps the new pack on its next use, and a writer that was
+ *             waiting for the lock opens the new pack, see pack_append().
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: compact {pack}
+ *
+ * Return:     Exit status
+ */
+int compact_command(int argc, char **argv)
+{
+  struct pack_map *m = &pack_map;
+  unsigned char header[SECTOR_SIZE];
+  unsigned char *offsets;
+  unsigned char *index;
+  char temp[1100];
+  uint32_t end = 1;
+  uint32_t garbage;
+  size_t offset_bytes;
+  size_t index_bytes;
+  int valid = 1;
+  int ok = 1;
+  int lock;
+  int fd;
+  int i;
 
-      // Process flags
-      char *op = &arg[1];
-      while(*op)
-      {
-        switch(*op)
-        {
-          case 'a':  curr_file.add          = 1; break;
-          case 'c':  all_args.create_new    = 1; break;
-          case 'd':  curr_file.ascii        = 1; break;
-          case 'e':  all_args.use_existing  = 1; break;
-          case 'f':  curr_file.fixed        = 1; break;
-          case 'h':  all_args.show_help     = 1; break;
-          case 'i':  curr_file.binary       = 1; break;
-          case 'l':  all_args.list_contents = 1; break;
-          case 'n':  break;
-          case 'o':  break;
-          case 'p':  curr_file.program      = 1; break;
-          case 'r':  curr_file.remove       = 1; break;
-          case 'u':  curr_file.unprotect    = 1; break;
-          case 'U':  all_args.unprotect     = 1; break;
-          case 'v':  curr_file.variable     = 1; break;
-          case 'V':  all_args.verbose++;         break;
-          case 'W':  all_args.protect       = 1; break;
-          case 'w':  curr_file.protect      = 1; break;
-          case 'x':  curr_file.extract      = 1; break;
-          case 'X':  all_args.extract_all   = 1; break;
+  if(argc != 2)
+  {
+    printf("Usage: dsk99 compact {pack}\n");
+    return(1);
+  }
 
-          default:   printf("Unknown option \"%c\"\n", *op); return(0);
+  // Hold off writers while the pack is copied
+  lock = open(argv[1], O_RDWR);
+  if(lock < 0 || flock(lock, LOCK_EX) != 0 || !pack_open(argv[1]))
+  {
+    printf("Cannot open pack \"%s\"\n", argv[1]);
+    if(lock >= 0) close(lock);
+    return(1);
+  }
+  garbage = load_le32(&m->data[12]);
+  snprintf(temp, sizeof(temp), "%s.tmp", argv[1]);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+  {
+    printf("Cannot create \"%s\"\n", temp);
+    close(lock);
+    return(1);
+  }
+
+  offset_bytes = pack_offset_sectors(m->count) * SECTOR_SIZE;
+  index_bytes = pack_table_sectors(m->count) * SECTOR_SIZE - offset_bytes;
+  offsets = calloc(1, offset_bytes + 1);
+  index = calloc(1, index_bytes + 1);
+  for(i = 0; ok && i < m->count; i++)
+  {
+    unsigned char *entry = &m->names[i * PACK_ENTRY_SIZE];
+    uint32_t number = load_le32(&entry[PACK_NAME_LEN]);
+    uint32_t first;
+    uint32_t sectors;
+    size_t size;
+
+    if(number >= (uint32_t)m->count)
+    {
+      valid = 0;
+      ok = 0;
+      break;
+    }
+    first = load_le32(&m->offsets[number * 8]);
+    sectors = load_le32(&m->offsets[number * 8 + 4]);
+    size = (size_t)sectors * SECTOR_SIZE;
+
+    // Images are renumbered in name order
+    memcpy(&index[i * PACK_ENTRY_SIZE], entry, PACK_NAME_LEN);
+    store_le32(&index[i * PACK_ENTRY_SIZE + PACK_NAME_LEN], i);
+    store_le32(&offsets[i * 8], end);
+    store_le32(&offsets[i * 8 + 4], sectors);
+    ok = ((size_t)first * SECTOR_SIZE + size <= m->size &&
+          pwrite(fd, &m->data[(size_t)first * SECTOR_SIZE], size,
+                 (off_t)end * SECTOR_SIZE) == (ssize_t)size);
+    end += sectors;
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, PACK_MAGIC, 4);
+  store_le32(&header[4], m->count);
+  store_le32(&header[8], end);
+  if(ok)
+    ok = (pwrite(fd, header, SECTOR_SIZE, 0) == SECTOR_SIZE &&
+          pwrite(fd, offsets, offset_bytes, (off_t)end * SECTOR_SIZE) ==
+          (ssize_t)offset_bytes &&
+          pwrite(fd, index, index_bytes,
+                 (off_t)end * SECTOR_SIZE + offset_bytes) ==
+          (ssize_t)index_bytes &&
+          fdatasync(fd) == 0);
+  free(offsets);
+  free(index);
+  if(close(fd) != 0) ok = 0;
+  if(ok) ok = (rename(temp, argv[1]) == 0);
+  if(!ok)
+  {
+    if(valid) printf("Cannot write pack \"%s\"\n", temp);
+    else      printf("%s is not a valid pack\n", argv[1]);
+    unlink(temp);
+    close(lock);
+    return(1);
+  }
+
+  // Send readers of the old file to the new one
+  memset(header, 0xFF, 8);
+  if(pwrite(lock, &header[4], 4, 8) != 4) ok = 0;
+  close(lock);
+  printf("Compacted \"%s\", %d images, %u sectors freed\n", argv[1],
+         m->count, garbage);
+  return(0);
+}
+
+
+// Images searched by recover and the report for each
+struct recover_job
+{
+  char **paths;                 // Images to search
+  int path_count;
+  int next_path;                // Next image to be claimed by a worker
+  int restore;                  // Restore the files that can be?
+  struct text_buffer *reports;  // Report of each image
+  int *done;                    // Has each image been searched?
+  int found;                    // Orphaned FIBs over all images
+  int recoverable;              // Of those, files that can be restored
+  int restored;                 // Files restored
+  int failed;                   // Images that could not be read or saved
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+
+/*===========================================================================
+ *                             fib_plausible
+ *===========================================================================
+ * Desription: Quick check of whether a sector could hold a FIB
+ *
+ *             The name must be printable with no periods and spaces only
+ *             at its end, tested 16 bytes at a time, and the flags and
+ *             record layout must be ones a FIB can have. Most sectors
+ *             fail on the first load.
+ *
+ * Parameters: data - Sector contents
+ *
+ * Return:     Could the sector be a FIB?
+ */
+int fib_plausible(const unsigned char *data)
+{
+  const struct fib_block *fib = (const struct fib_block*)data;
+  unsigned all = (1 << FILE_NAME_LEN) - 1;
+  unsigned valid;
+  unsigned spaces;
+  int length;
+
+#ifdef __SSE2__
+  __m128i v = _mm_loadu_si128((const __m128i*)data);
+  valid = _mm_movemask_epi8(_mm_andnot_si128(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+            _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)),
+                          _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)))));
+  spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+#else
+  int i;
+  valid = 0;
+  spaces = 0;
+  for(i = 0; i < FILE_NAME_LEN; i++)
+  {
+    valid |= (data[i] > 0x1F && data[i] < 0x7F && data[i] != '.') << i;
+    spaces |= (data[i] == ' ') << i;
+  }
+#endif
+  valid &= all;
+  spaces &= all;
+
+  // A run of spaces must reach the end of the name
+  if(valid != all || (spaces & 1) ||
+     (spaces != 0 && spaces + (spaces & -spaces) != all + 1))
+    return(0);
+
+  if(fib->flags & ~(fib_program | fib_binary | fib_wp | fib_var)) return(0);
+  if(fib->flags & fib_program)
+    return(!(fib->flags & fib_var) && fib->reclen == 0 &&
+           fib->recsperphysrec == 0);
+  length = fib->reclen ? fib->reclen : SECTOR_SIZE;
+  return(fib->recsperphysrec != 0 &&
+         fib->recsperphysrec * length <= SECTOR_SIZE);
+}
+
+
+/*===========================================================================
+ *                            recover_image
+ *===========================================================================
+ * Desription: Look for orphaned FIBs in the free sectors of an image,
+ *             and restore the files that can be
+ *
+ *             A candidate must pass fib_plausible() and have a cluster
+ *             table that covers exactly its sector count, inside the disk
+ *             and clear of the VIB and FDR index. Its file can be
+ *             restored if the FIB and every sector of its clusters are
+ *             still free, no earlier candidate claimed them, and no file
+ *             on the disk has its name.
+ *
+ * Parameters: job    - Recover job
+ *             report - Receives a line for each candidate
+ *             path   - Disk image
+ *
+ * Return:     None
+ */
+void recover_image(struct recover_job *job, struct text_buffer *report,
+                   char *path)
+{
+  uint16_t index[MAX_FILE_COUNT * 2];
+  unsigned char *claimed;
+  unsigned char *before = NULL;
+  char *problem;
+  int sectors;
+  int index_count = 0;
+  int existing;
+  int restored = 0;
+  int found = 0;
+  int recoverable = 0;
+  int secno;
+  int i;
+  int j;
+
+  release_disk();
+  if(!read_disk(path))
+  {
+    text_printf(report, "Skipping \"%s\": cannot load image\n", path);
+    pthread_mutex_lock(&job->lock);
+    job->failed++;
+    pthread_mutex_unlock(&job->lock);
+    return;
+  }
+  if((problem = check_image()) != NULL)
+  {
+    text_printf(report, "Skipping \"%s\": %s\n", path, problem);
+    pthread_mutex_lock(&job->lock);
+    job->failed++;
+    pthread_mutex_unlock(&job->lock);
+    return;
+  }
+  if(job->restore)
+  {
+    container_release();
+    if(disk_format == format_v9t9)
+    {
+      before = malloc(disk_size);
+      memcpy(before, disk_buffer, disk_size);
+    }
+  }
+
+  sectors = disk_size / SECTOR_SIZE;
+  claimed = calloc(1, sectors);
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    if(fib_at(index[i]) != NULL) index[index_count++] = index[i];
+  }
+  existing = index_count;
+
+  for(secno = BLOCK_FIB_INDEX + 1; secno < sectors; secno++)
+  {
+    struct cluster_span spans[MAX_CLUSTERS];
+    struct fib_block *fib;
+    char name[FILE_NAME_LEN + 1];
+    char type[16];
+    char *status = NULL;
+    int span_count;
+    int total = 0;
+
+    if(claimed[secno] || !sector_free(secno)) continue;
+    fib = (struct fib_block*)get_sector(secno);
+    if(!fib_plausible((unsigned char*)fib)) continue;
+
+    // The cluster table must describe exactly the file's sectors
+    span_count = fib_spans(fib, spans);
+    if(span_count < 0) continue;
+    for(i = span_count; i < MAX_CLUSTERS; i++)
+    {
+      if(fib->cluster[i][0] | fib->cluster[i][1] | fib->cluster[i][2]) break;
+    }
+    if(i < MAX_CLUSTERS) continue;
+    for(i = 0; i < span_count && spans[i].first > BLOCK_FIB_INDEX; i++)
+      total += spans[i].count;
+    if(i < span_count || total != fib_physrec_count(fib) ||
+       fib_file_size(fib) > total * SECTOR_SIZE)
+      continue;
+
+    // Can it be restored as it is?
+    found++;
+    memcpy(name, fib->name, FILE_NAME_LEN);
+    name[FILE_NAME_LEN] = 0;
+    for(i = 0; i < span_count && status == NULL; i++)
+    {
+      for(j = spans[i].first; j < spans[i].first + spans[i].count; j++)
+      {
+        if(j == secno || claimed[j])
+        {
+          status = "overlaps another deleted file";
+          break;
         }
-
-        op++;
-        // Process record length
-        if((*(op-1) == 'f' || *(op-1) == 'v') && set->expect == cFILENAME)
+        if(!sector_free(j))
         {
-          if(*op < '0' || *op > '9' ||
-             (curr_file.record_size = strtol(op, &op, 10)) == 0)
-          {
-            printf("Unknown option \"%s\"\n", (op-1)); return(0);
-          }
-          if(curr_file.record_size > 254)
-          {
-            printf("Invalid record length %d\n", curr_file.record_size);
-            return(0);
-          }
-
-          struct file_arg *file = &all_args.file[all_args.file_count];
-          file->ascii = curr_file.ascii;
-          file->binary = curr_file.binary;
-          file->fixed = curr_file.fixed;
-          file->variable = curr_file.variable;
-          file->record_size = curr_file.record_size;
+          status = "sectors are in use";
+          break;
         }
       }
-      expect = set->expect;
     }
+    if(status == NULL && find_fib(name) != NULL) status = "name is in use";
+    if(status == NULL && job->restore && index_count == MAX_FILE_COUNT)
+      status = "file index is full";
+    if(status == NULL)
+    {
+      recoverable++;
+      claimed[secno] = 1;
+      for(i = 0; i < span_count; i++)
+        memset(&claimed[spans[i].first], 1, spans[i].count);
+      status = job->restore ? "restored" : "recoverable";
+      if(job->restore) index[index_count++] = secno;
+    }
+
+    if(fib->flags & fib_program)
+      snprintf(type, sizeof(type), "program");
     else
+      snprintf(type, sizeof(type), "%s/%s %d",
+               (fib->flags & fib_binary) ? "int" : "dis",
+               (fib->flags & fib_var) ? "var" : "fix", fib->reclen);
+    if(strchr(name, ' ') != NULL) *strchr(name, ' ') = 0;
+    text_printf(report, "%s: sector %d: %s, %s, %d bytes: %s\n", path, secno,
+                name, type, fib_file_size(fib), status);
+  }
+
+  // Allocate the restored files and put them back in the index
+  for(i = existing; i < index_count; i++)
+  {
+    struct cluster_span spans[MAX_CLUSTERS];
+    int span_count = fib_spans(fib_at(index[i]), spans);
+    mark_sector(index[i], 1);
+    for(j = 0; j < span_count; j++)
     {
-      // This is a name
-      int i;
-      if(expect == cNONE)
-      {
-        printf("Invalid argument \"%s\"\n", arg);
-        return(0);
-      }
-      last_arg = 0;
-      switch(expect)
-      {
-        case cFILENAME:
-          for(i = 0; i < all_args.file_count; i++)
-          {
-            if(strcmp(all_args.file[i].file_name, arg) == 0) break;
-          }          
-          if(i >= MAX_FILE_COUNT)
-          {
-            printf("Disk full, cannot add \"%s\"\n", arg);
-            return(0);
-          }
-          if(i == all_args.file_count)
-            all_args.file_count++;
-          if(curr_file.add != 0 || curr_file.extract != 0) last_file = i;
-//          memcpy(&all_args.file[i], &curr_file, sizeof(struct file_arg));
-          strcpy(all_args.file[i].file_name, arg);
-          break;
-          
-        case cOUTNAME:
-          if(last_file == -1)
-          {
-            printf("No file to use for output name \"%s\"\n", arg);
-            return(0);
-          }
-          strcpy(all_args.file[i].output_name, arg);
-          last_file = -1;
-          break;
+      for(secno = spans[j].first;
+          secno < spans[j].first + spans[j].count; secno++)
+        mark_sector(secno, 1);
+    }
+    restored++;
+  }
+  if(restored > 0)
+  {
+    qsort(index, index_count, sizeof(uint16_t), compare_fdr_names);
+    for(i = 0; i < MAX_FILE_COUNT; i++)
+      fdr_index_set(i, i < index_count ? index[i] : 0);
+    if(!(before != NULL ? save_changed_sectors(path, before)
+                        : save_disk(path)))
+    {
+      text_printf(report, "Cannot save \"%s\"\n", path);
+      restored = 0;
+      pthread_mutex_lock(&job->lock);
+      job->failed++;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+  free(before);
+  free(claimed);
+
+  pthread_mutex_lock(&job->lock);
+  job->found += found;
+  job->recoverable += recoverable;
+  job->restored += restored;
+  pthread_mutex_unlock(&job->lock);
+}
 
-        case cDISKPATH:
-          strcpy(all_args.image_path, arg);
-          expect = cNONE;
-          break;
 
-        case cDISKNAME:
-          strncpy(all_args.disk_name, arg, DISK_NAME_LEN);
-          expect = cNONE;
-          break;
+/*===========================================================================
+ *                            recover_worker
+ *===========================================================================
+ * Desription: Thread body recovering images until none remain
+ *
+ * Parameters: arg - Recover job
+ *
+ * Return:     NULL
+ */
+void* recover_worker(void *arg)
+{
+  struct recover_job *job = arg;
 
-        default:
-          printf("Internal error, unknown name type %d for \"%s\"\n", 
-                 expect, arg);
-          return(0);
-      }
-    }
+  for(;;)
+  {
+    int number;
+
+    pthread_mutex_lock(&job->lock);
+    number = job->next_path++;
+    pthread_mutex_unlock(&job->lock);
+    if(number >= job->path_count) break;
+
+    recover_image(job, &job->reports[number], job->paths[number]);
+
+    pthread_mutex_lock(&job->lock);
+    job->done[number] = 1;
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&job->lock);
   }
-  return(1);
+  release_disk();
+  stats_merge();
+  return(NULL);
 }
-#endif
-int parse_arguments(int argc, char **argv)
+
+
+/*===========================================================================
+ *                            recover_command
+ *===========================================================================
+ * Desription: Find files that were deleted by dropping their FDR index
+ *             entry and freeing their sectors, and restore them with -r
+ *
+ *             Images are searched on a pool of workers and reported in
+ *             the order given, one line per orphaned FIB.
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: recover [-r] [-j {workers}] {image} ...
+ *
+ * Return:     Exit status
+ */
+int recover_command(int argc, char **argv)
 {
-  enum
+  struct recover_job job;
+  pthread_t *threads;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count;
+  int i;
+
+  memset(&job, 0, sizeof(job));
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
   {
-    cNONE = 0,
-    cFILENAME,
-    cOUTNAME,
-    cDISKPATH,
-    cDISKNAME
-  };
+    if(strcmp(argv[i], "-r") == 0) job.restore = 1;
+    else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      workers = atoi(argv[++i]);
+    else break;
+  }
+  if(i >= argc || workers < 1)
+  {
+    printf("Usage: dsk99 recover [-r] [-j {workers}] {image} ...\n");
+    return(1);
+  }
 
-  struct optionset
+  job.paths = &argv[i];
+  job.path_count = argc - i;
+  job.reports = calloc(job.path_count, sizeof(struct text_buffer));
+  job.done = calloc(job.path_count, sizeof(int));
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.finished, NULL);
+  if(workers > job.path_count) workers = job.path_count;
+  threads = malloc(workers * sizeof(pthread_t));
+  for(thread_count = 0; thread_count < workers; thread_count++)
   {
-    char *set;     // Set of all valid flags in this option
-    int   expect;  // Type of parameter we expect to get next
-  };  
+    if(pthread_create(&threads[thread_count], NULL, recover_worker,
+                      &job) != 0)
+      break;
+  }
+  if(thread_count == 0) recover_worker(&job);
 
-  // valid sets of flags for options
-  struct optionset valid_set[] =
+  // Print reports in the order the images were given
+  for(i = 0; i < job.path_count; i++)
   {
-    {"Vh",                  cNONE},
-    {"oV",                  cOUTNAME},
-    {"rV",                  cFILENAME},
-    {"xV",                  cFILENAME},
-    {"nV",                  cDISKNAME},
-    {"cWUlV",               cDISKPATH},
-    {"eWUlXV",              cDISKPATH},
-    {"pdifwuvV0123456789",  cFILENAME},
-    {"apdifwuvV0123456789", cFILENAME},
-    {NULL,    cNONE}
-  };
+    pthread_mutex_lock(&job.lock);
+    while(!job.done[i]) pthread_cond_wait(&job.finished, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+    if(job.reports[i].length > 0)
+      fwrite(job.reports[i].data, job.reports[i].length, 1, stdout);
+    free(job.reports[i].data);
+  }
+  for(i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  printf("%d deleted files found in %d images, %d recoverable",
+         job.found, job.path_count, job.recoverable);
+  if(job.restore) printf(", %d restored", job.restored);
+  if(job.failed) printf(", %d images failed", job.failed);
+  printf("\n");
+  free(threads);
+  free(job.reports);
+  free(job.done);
+  return(job.failed ? 1 : 0);
+}
+
+
+// Pattern searched for by grep
+struct grep_pattern
+{
+  unsigned char text[SECTOR_SIZE];  // Literal text, upper case with -i
+  int length;                       // Length of the literal text
+  int ignore_case;                  // Match either case?
+  int use_regex;                    // Is the pattern an extended regex?
+  int basic;                        // Search BASIC programs as source?
+  regex_t regex;                    // Compiled pattern for -E
+};
+
+// Images searched by grep and the report for each
+struct grep_job
+{
+  char **paths;                 // Images to search
+  int path_count;
+  int next_path;                // Next image to be claimed by a worker
+  struct grep_pattern *pattern;
+  struct text_buffer *reports;  // Report of each image
+  int *done;                    // Has each image been searched?
+  int matches;                  // Matching lines over all images
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
 
+
+/*===========================================================================
+ *                              find_bytes
+ *===========================================================================
+ * Desription: Find the first occurrence of a byte string
+ *
+ *             16 positions are tested at a time for both the first and
+ *             the last byte of the needle, and only positions where both
+ *             match are compared in full.
+ *
+ * Parameters: haystack - Bytes to search
+ *             size     - Number of bytes to search
+ *             needle   - Bytes to find
+ *             length   - Number of bytes to find, at least 1
+ *
+ * Return:     Offset of the match, -1 if there is none
+ */
+int find_bytes(const unsigned char *haystack, int size,
+               const unsigned char *needle, int length)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[length - 1]);
+  for(; i + length + 15 <= size; i += 16)
+  {
+    __m128i head = _mm_loadu_si128((const __m128i*)&haystack[i]);
+    __m128i tail = _mm_loadu_si128((const __m128i*)&haystack[i + length - 1]);
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                      _mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+    while(mask != 0)
+    {
+      int at = i + __builtin_ctz(mask);
+      if(length <= 2 ||
+         memcmp(&haystack[at + 1], &needle[1], length - 2) == 0)
+        return(at);
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for(; i + length <= size; i++)
+  {
+    if(haystack[i] == needle[0] &&
+       memcmp(&haystack[i], needle, length) == 0)
+      return(i);
+  }
+  return(-1);
+}
+
+
+/*===========================================================================
+ *                             grep_report
+ *===========================================================================
+ * Desription: Add a matching line to the report of an image, showing
+ *             unprintable bytes as dots
+ *
+ * Parameters: report - Report of the image
+ *             image  - Image name
+ *             file   - File name
+ *             label  - Record number or offset of the line
+ *             data   - Line of text
+ *             length - Length of the line, at most 256
+ *
+ * Return:     None
+ */
+void grep_report(struct text_buffer *report, char *image, char *file,
+                 char *label, const unsigned char *data, int length)
+{
+  char line[SECTOR_SIZE + 1];
   int i;
-  int expect = cNONE;
-  struct file_arg curr_file;
-  int last_file = -1;
 
-  // Display help if no arguments given
-  if(argc == 1)
+  for(i = 0; i < length; i++)
+    line[i] = (data[i] >= 0x20 && data[i] < 0x7F) ? data[i] : '.';
+  line[length] = 0;
+  text_printf(report, "%s:%s:%s:%s\n", image, file, label, line);
+}
+
+
+/*===========================================================================
+ *                              grep_line
+ *===========================================================================
+ * Desription: Report a line of text if it matches the pattern
+ *
+ * Parameters: job    - Grep job
+ *             report - Report of the image
+ *             image  - Image name
+ *             file   - File name
+ *             label  - Record number or offset of the line
+ *             data   - Line of text
+ *             length - Length of the line
+ *
+ * Return:     Did the line match?
+ */
+int grep_line(struct grep_job *job, struct text_buffer *report, char *image,
+              char *file, char *label, const unsigned char *data,
+              int length)
+{
+  struct grep_pattern *pattern = job->pattern;
+  char line[SECTOR_SIZE + 1];
+  int i;
+
+  if(length > SECTOR_SIZE) length = SECTOR_SIZE;
+  if(pattern->use_regex)
+  {
+    for(i = 0; i < length; i++)
+      line[i] = (data[i] >= 0x20 && data[i] < 0x7F) ? data[i] : '.';
+    line[length] = 0;
+    if(regexec(&pattern->regex, line, 0, NULL, 0) != 0) return(0);
+  }
+  else if(pattern->ignore_case)
+  {
+    for(i = 0; i < length; i++)
+      line[i] = (data[i] >= 'a' && data[i] <= 'z') ? data[i] - 'a' + 'A'
+                                                   : data[i];
+    if(find_bytes((unsigned char*)line, length, pattern->text,
+                  pattern->length) < 0)
+      return(0);
+  }
+  else if(find_bytes(data, length, pattern->text, pattern->length) < 0)
   {
-    show_help();
     return(0);
   }
 
-  memset(&curr_file, 0, sizeof(struct file_arg));
-  for(i = 1; i < argc; i++)
-  {
-    char *arg = argv[i];
-    if(arg[0] == '-')
-    {
-      // This is an option
-      
-      // Find the set to use
-      struct optionset *set = valid_set;
-      while(set->set != NULL)
-      {
-        // If all option flags are contained in this set, use it
-        if(strspn(&arg[1], set->set) == strlen(arg)-1) break;
+  grep_report(report, image, file, label, data, length);
+  return(1);
+}
 
-        // Check next set
-        set++;
-      }
 
-      // Check for option validity
-      if(expect != cFILENAME ||
-         set->expect != cOUTNAME)
-      {
-        if((set->set == NULL)
-           ||
-           (expect != cNONE && 
-            set->expect != cNONE && 
-            set->expect != expect))
-        {
-          printf("Invalid option \"%s\"\n", arg);
-          if(all_args.verbose)
-          {
-            if(set->set == NULL)      printf("This option does not exist\n");
-            if(set->expect != expect) printf("This option can't be used with other options it's with\n");
-          }
-          return(0);
-        }
-      }
+/*===========================================================================
+ *                             grep_records
+ *===========================================================================
+ * Desription: Search each record of a data file, straight from its sectors
+ *
+ * Parameters: job    - Grep job
+ *             report - Report of the image
+ *             image  - Image name
+ *             file   - File name
+ *             fib    - File information block
+ *
+ * Return:     Number of matching records
+ */
+int grep_records(struct grep_job *job, struct text_buffer *report,
+                 char *image, char *file, struct fib_block *fib)
+{
+  struct cluster_span spans[MAX_CLUSTERS];
+  int span_count = fib_spans(fib, spans);
+  int physrecs = fib_physrec_count(fib);
+  int reclen = fib->reclen ? fib->reclen : SECTOR_SIZE;
+  int per_sector = fib->recsperphysrec ? fib->recsperphysrec
+                                       : SECTOR_SIZE / reclen;
+  int records = fib_fixrecs(fib);
+  int recno = 0;
+  int found = 0;
+  int offset = 0;
+  int i;
+  int j;
+
+  if(!(fib->flags & fib_var) && per_sector * reclen > SECTOR_SIZE) return(0);
+  for(i = 0; i < span_count; i++)
+  {
+    for(j = 0; j < spans[i].count && offset < physrecs; j++, offset++)
+    {
+      unsigned char *sector = get_sector(spans[i].first + j)->data;
+      char label[16];
+      int pos = 0;
+      int k;
 
-      // Process flags
-      char *op = &arg[1];
-      while(*op)
+      if(fib->flags & fib_var)
       {
-        // Handle mutually exclusive options
-        if(strchr("arx", *op))
-        {
-          curr_file.add       = 0;
-          curr_file.remove    = 0;
-          curr_file.extract   = 0;
-        }
-        if(strchr("di", *op))
-        {
-          curr_file.ascii     = 0;
-          curr_file.binary    = 0;
-        }
-        if(strchr("fpv", *op))
+        // Length prefixed records up to the 0xFF end marker
+        while(pos < SECTOR_SIZE && sector[pos] != 0xFF &&
+              pos + 1 + sector[pos] <= SECTOR_SIZE)
         {
-          curr_file.fixed     = 0;
-          curr_file.program   = 0;
-          curr_file.variable  = 0;
-        }
-        if(strchr("uw", *op))
-        {
-          curr_file.unprotect = 0;
-          curr_file.protect   = 0;
+          snprintf(label, sizeof(label), "%d", recno++);
+          found += grep_line(job, report, image, file, label,
+                             &sector[pos + 1], sector[pos]);
+          pos += 1 + sector[pos];
         }
+        continue;
+      }
 
-        switch(*op)
-        {
-          case 'a':  curr_file.add          = 1; break;
-          case 'c':  all_args.create_new    = 1; break;
-          case 'd':  curr_file.ascii        = 1; break;
-          case 'e':  all_args.use_existing  = 1; break;
-          case 'f':  curr_file.fixed        = 1; break;
-          case 'h':  all_args.show_help     = 1; break;
-          case 'i':  curr_file.binary       = 1; break;
-          case 'l':  all_args.list_contents = 1; break;
-          case 'n':  break;
-          case 'o':  break;
-          case 'p':  curr_file.program      = 1; break;
-          case 'r':  curr_file.remove       = 1; break;
-          case 'u':  curr_file.unprotect    = 1; break;
-          case 'U':  all_args.unprotect     = 1; break;
-          case 'v':  curr_file.variable     = 1; break;
-          case 'V':  all_args.verbose++;         break;
-          case 'W':  all_args.protect       = 1; break;
-          case 'w':  curr_file.protect      = 1; break;
-          case 'x':  curr_file.extract      = 1; break;
-          case 'X':  all_args.extract_all   = 1; break;
+      for(k = 0; k < per_sector && recno < records; k++)
+      {
+        snprintf(label, sizeof(label), "%d", recno++);
+        found += grep_line(job, report, image, file, label,
+                           &sector[k * reclen], reclen);
+      }
+    }
+  }
+  return(found);
+}
 
-          default:   printf("Unknown option \"%c\"\n", *op); return(0);
-        }
 
-        op++;
-        // Process record length
-        if(set->expect == cFILENAME)
-        {
-          if((*(op-1) == 'f' || *(op-1) == 'v') && set->expect == cFILENAME)
-          {
-            if(*op < '0' || *op > '9' ||
-               (curr_file.record_size = strtol(op, &op, 10)) == 0)
-            {
-              printf("Unknown option \"%s\"\n", (op-1)); return(0);
-            }
-            if(curr_file.record_size > 254)
-            {
-              printf("Invalid record length %d\n", curr_file.record_size);
-              return(0);
-            }
-          }
-        }
+/*===========================================================================
+ *                             grep_program
+ *===========================================================================
+ * Desription: Search the runs of printable text in a program file, as
+ *             strings(1) would find them. Lines are labelled with their
+ *             byte offset.
+ *
+ *             A literal pattern is searched for over the whole file, and
+ *             only a match is widened to the run around it; a regular
+ *             expression is tried on every run.
+ *
+ * Parameters: job    - Grep job
+ *             report - Report of the image
+ *             image  - Image name
+ *             file   - File name
+ *             fib    - File information block
+ *
+ * Return:     Number of matching runs
+ */
+int grep_program(struct grep_job *job, struct text_buffer *report,
+                 char *image, char *file, struct fib_block *fib)
+{
+  struct grep_pattern *pattern = job->pattern;
+  unsigned char *data;
+  unsigned char *text;
+  char label[16];
+  int found = 0;
+  int size;
+  int pos = 0;
+  int i;
+
+  data = load_file_data(fib, &size);
+  if(data == NULL) return(0);
+
+  // BASIC programs are searched line by line of their source
+  if(pattern->basic)
+  {
+    struct text_buffer listing;
+    memset(&listing, 0, sizeof(listing));
+    if(detokenize(data, size, &listing) >= 0)
+    {
+      char *line = listing.data;
+      while(line != NULL && line < listing.data + listing.length)
+      {
+        char *end = strchr(line, '\n');
+        snprintf(label, sizeof(label), "%d", atoi(line));
+        found += grep_line(job, report, image, file, label,
+                           (unsigned char*)line, end - line);
+        line = end + 1;
       }
-      expect = set->expect;
+      free(listing.data);
+      free(data);
+      return(found);
     }
-    else
+    free(listing.data);
+  }
+
+  if(!pattern->use_regex)
+  {
+    int at;
+
+    text = data;
+    if(pattern->ignore_case)
     {
-      // This is a name
-      int i;
-      if(expect == cNONE)
+      text = malloc(size > 0 ? size : 1);
+      for(i = 0; i < size; i++)
+        text[i] = (data[i] >= 'a' && data[i] <= 'z') ? data[i] - 'a' + 'A'
+                                                     : data[i];
+    }
+    while((at = find_bytes(&text[pos], size - pos, pattern->text,
+                           pattern->length)) >= 0)
+    {
+      int start = pos + at;
+      int end = pos + at + pattern->length;
+
+      // Widen to the printable run, keeping the line to a sector
+      while(start > pos && start > end - SECTOR_SIZE / 2 &&
+            data[start - 1] >= 0x20 && data[start - 1] < 0x7F)
+        start--;
+      while(end < size && end < start + SECTOR_SIZE &&
+            data[end] >= 0x20 && data[end] < 0x7F)
+        end++;
+      if(end - start >= 4)
       {
-        printf("Invalid argument \"%s\"\n", arg);
-        return(0);
+        snprintf(label, sizeof(label), "@%d", start);
+        grep_report(report, image, file, label, &data[start], end - start);
+        found++;
       }
+      pos = end;
+    }
+    if(text != data) free(text);
+    free(data);
+    return(found);
+  }
 
-      switch(expect)
-      {
-        case cFILENAME:
-          for(i = 0; i < all_args.file_count; i++)
-          {
-            if(strcmp(all_args.file[i].file_name, arg) == 0) break;
-          }          
-          if(i >= MAX_FILE_COUNT)
-          {
-            printf("Disk full, cannot add \"%s\"\n", arg);
-            return(0);
-          }
-          if(i == all_args.file_count)
-            all_args.file_count++;
-          if(curr_file.add != 0 || curr_file.extract != 0) last_file = i;
-          memcpy(&all_args.file[i], &curr_file, sizeof(struct file_arg));
-          strcpy(all_args.file[i].file_name, arg);
-          break;
-          
-        case cOUTNAME:
-          if(last_file == -1)
-          {
-            printf("No file to use for output name \"%s\"\n", arg);
-            return(0);
-          }
-          strcpy(all_args.file[i].output_name, arg);
-          last_file = -1;
-          expect = cNONE;
-          memset(&curr_file, 0, sizeof(struct file_arg));
-          break;
+  while(pos < size)
+  {
+    int start;
+    while(pos < size && (data[pos] < 0x20 || data[pos] >= 0x7F)) pos++;
+    start = pos;
+    while(pos < size && data[pos] >= 0x20 && data[pos] < 0x7F) pos++;
+    if(pos - start >= 4)
+    {
+      snprintf(label, sizeof(label), "@%d", start);
+      found += grep_line(job, report, image, file, label, &data[start],
+                         pos - start);
+    }
+  }
+  free(data);
+  return(found);
+}
 
-        case cDISKPATH:
-          strcpy(all_args.image_path, arg);
-          expect = cNONE;
-          memset(&curr_file, 0, sizeof(struct file_arg));
-          break;
 
-        case cDISKNAME:
-          strncpy(all_args.disk_name, arg, DISK_NAME_LEN);
-          expect = cNONE;
-          memset(&curr_file, 0, sizeof(struct file_arg));
-          break;
+/*===========================================================================
+ *                             grep_worker
+ *===========================================================================
+ * Desription: Thread body searching images until none remain. Each
+ *             worker has its own current image.
+ *
+ * Parameters: arg - Shared grep job
+ *
+ * Return:     None
+ */
+void* grep_worker(void *arg)
+{
+  struct grep_job *job = arg;
 
-        default:
-          printf("Internal error, unknown name type %d for \"%s\"\n", 
-                 expect, arg);
-          return(0);
+  for(;;)
+  {
+    uint16_t index[MAX_FILE_COUNT];
+    struct text_buffer *report;
+    char *problem;
+    char *image;
+    int found = 0;
+    int number;
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    number = job->next_path++;
+    pthread_mutex_unlock(&job->lock);
+    if(number >= job->path_count) break;
+    image = job->paths[number];
+    report = &job->reports[number];
+
+    release_disk();
+    if(!read_disk(image))
+      text_printf(report, "Skipping \"%s\": cannot load image\n", image);
+    else if((problem = check_image()) != NULL)
+      text_printf(report, "Skipping \"%s\": %s\n", image, problem);
+    else
+    {
+      fdr_index_decode(index);
+      for(i = 0; i < MAX_FILE_COUNT; i++)
+      {
+        struct fib_block *fib = fib_at(index[i]);
+        char file[FILE_NAME_LEN + 1];
+        if(fib == NULL) continue;
+        host_name(fib, file);
+        if(fib->flags & fib_program)
+          found += grep_program(job, report, image, file, fib);
+        else
+          found += grep_records(job, report, image, file, fib);
       }
     }
+
+    pthread_mutex_lock(&job->lock);
+    job->matches += found;
+    job->done[number] = 1;
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&job->lock);
   }
-  return(1);
+  release_disk();
+  stats_merge();
+  return(NULL);
 }
 
 
 /*===========================================================================
- *                              list_disk
+ *                             grep_command
  *===========================================================================
- * Desription: List the contents of the disk
+ * Desription: Search the files inside many images without extracting them
  *
- * Parameters: None
+ *             Records of data files are searched as they sit in their
+ *             sectors; program files are searched by their runs of
+ *             printable text, or with -b as BASIC source where they are
+ *             BASIC programs. Each match is printed as image, file,
+ *             record number (@offset or line number in a program) and the
+ *             text. The
+ *             images are searched on a pool of workers and reported in
+ *             the order given.
  *
- * Return:     None
+ * Parameters: argc - Number of command arguments
+ *             argv - Arguments: grep [-i] [-E] [-b] [-j {workers}]
+ *                               {pattern} {image} ...
+ *
+ * Return:     Exit status, 0 if anything matched
  */
-void list_disk()
+int grep_command(int argc, char **argv)
 {
+  struct grep_pattern pattern;
+  struct grep_job job;
+  pthread_t *threads;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count;
   int i;
-  struct disk_sector *sector = disk_buffer;
-  struct vib_block *vib = disk_buffer;
-
-  // Dump header
-  short physrecs = vib->physrecs;
-  vib->physrecs = 0;  // Terminate name
-  printf("Disk Name : %s\n",vib->name);
-  printf("Disk Size : %d\n",swap(physrecs) * 256);
-  printf("Protected?: %s\n",(vib->protection == 'P' ? "Yes": "No"));
-  printf("Cylinders : %d\n",vib->cylinders);
-  printf("Heads     : %d\n",vib->heads);
-  printf("Density   : %s\n",(vib->density == 1 ? "FM SD":
-                            (vib->density == 2 ? "MFM DD":
-                            (vib->density == 3 ? "MFM HD": 
-                                                 "Unknown"))));
 
-  printf("\n");
-  printf("Name        Type         WP  Size   Sectors\n");
-  printf("----------  -----------  --  -----  ------\n");
-  // List files
-  for(i = 0; i < MAX_FILE_COUNT; i++)
+  memset(&pattern, 0, sizeof(pattern));
+  for(i = 1; i < argc && argv[i][0] == '-'; i++)
   {
-    short fib_idx = swap(sector[BLOCK_FIB_INDEX].data[i]);
-    if(fib_idx != 0)
+    if(strcmp(argv[i], "-i") == 0)      pattern.ignore_case = 1;
+    else if(strcmp(argv[i], "-E") == 0) pattern.use_regex = 1;
+    else if(strcmp(argv[i], "-b") == 0) pattern.basic = 1;
+    else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      workers = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--") == 0)
     {
-      struct fib_block* fib = (struct fib_block*)(&sector[fib_idx]);
-      int first = cluster_first(&fib->cluster[0][0]);
-      int i;
+      i++;
+      break;
+    }
+    else break;
+  }
+  if(argc - i < 2 || workers < 1 || argv[i][0] == 0 ||
+     strlen(argv[i]) > SECTOR_SIZE)
+  {
+    printf("Usage: dsk99 grep [-i] [-E] [-b] [-j {workers}] {pattern} "
+           "{image} ...\n");
+    return(2);
+  }
+  if(pattern.use_regex)
+  {
+    int flags = REG_EXTENDED | REG_NOSUB;
+    if(pattern.ignore_case) flags |= REG_ICASE;
+    if(regcomp(&pattern.regex, argv[i], flags) != 0)
+    {
+      printf("Invalid regular expression \"%s\"\n", argv[i]);
+      return(2);
+    }
+  }
+  pattern.length = strlen(argv[i]);
+  memcpy(pattern.text, argv[i], pattern.length);
+  if(pattern.ignore_case)
+  {
+    int j;
+    for(j = 0; j < pattern.length; j++)
+    {
+      if(pattern.text[j] >= 'a' && pattern.text[j] <= 'z')
+        pattern.text[j] += 'A' - 'a';
+    }
+  }
+  i++;
+
+  memset(&job, 0, sizeof(job));
+  job.paths = &argv[i];
+  job.path_count = argc - i;
+  job.pattern = &pattern;
+  job.reports = calloc(job.path_count, sizeof(struct text_buffer));
+  job.done = calloc(job.path_count, sizeof(int));
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.finished, NULL);
+  if(workers > job.path_count) workers = job.path_count;
+  threads = malloc(workers * sizeof(pthread_t));
+  for(thread_count = 0; thread_count < workers; thread_count++)
+  {
+    if(pthread_create(&threads[thread_count], NULL, grep_worker, &job) != 0)
+      break;
+  }
+  if(thread_count == 0) grep_worker(&job);
 
-      // File type
-      fib->reserved[0] = 0;  // Terminate file name
-      printf("%s  ", fib->name);
-      if(fib->flags & fib_program)
-      {
-        printf("program      ");
-      }
-      else
+  // Print reports in the order the images were given
+  for(i = 0; i < job.path_count; i++)
+  {
+    pthread_mutex_lock(&job.lock);
+    while(!job.done[i]) pthread_cond_wait(&job.finished, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+    if(job.reports[i].length > 0)
+      fwrite(job.reports[i].data, job.reports[i].length, 1, stdout);
+    free(job.reports[i].data);
+  }
+  for(i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(job.reports);
+  free(job.done);
+  if(pattern.use_regex) regfree(&pattern.regex);
+  return(job.matches ? 0 : 1);
+}
+
+
+/*===========================================================================
+ *                           run_script_op
+ *===========================================================================
+ * Desription: Carry out one command file operation on the loaded image
+ *
+ * Parameters: op - Operation
+ *
+ * Return:     Was the disk image modified?
+ */
+int run_script_op(struct script_op *op)
+{
+  static char names[MAX_FILE_COUNT][FILE_NAME_LEN + 1];
+  struct vib_block *vib = disk_buffer;
+  struct file_arg *file = &op->file;
+  char name[FILE_NAME_LEN + 1];
+  int modified = 0;
+  int count;
+  int i;
+
+  switch(op->type)
+  {
+    case op_add:
+      name[FILE_NAME_LEN] = 0;
+      make_name(name, file->output_name, FILE_NAME_LEN);
+      if(add_file(file->file_name, name))
       {
-        if(fib->flags & fib_binary) printf("int/");
-          else printf("dis/");
-        if(fib->flags & fib_var) printf("var");
-          else printf("fix");
-        printf(" %-3d  ", fib->reclen);
+        set_file_attributes(find_fib(name), file, file->file_name);
+        modified = 1;
       }
-      
-      // Write protect
-      if(fib->flags & fib_wp) printf("wp  ");
-        else                  printf("    ");
-        
-      // File size
-      printf("%5d  ", (swap(fib->physrec_count)-1) * 256 + fib->eof);
+      break;
 
-      // Sector usage
-      for(i=0; i<76; i++)
+    case op_name:
+      make_name(vib->name, file->file_name, DISK_NAME_LEN);
+      modified = 1;
+      break;
+
+    case op_protect:
+      vib->protection = 'P';
+      modified = 1;
+      break;
+
+    case op_unprotect:
+      vib->protection = 0;
+      modified = 1;
+      break;
+
+    case op_list:
+      list_disk();
+      break;
+
+    case op_copy:
+      save_disk_as(file->file_name, format_for_path(file->file_name));
+      break;
+
+    default:
+      // Operations on every file matching a glob
+      count = match_files(file->file_name, names);
+      if(count == 0)
+        printf("Cannot find file \"%s\"\n", file->file_name);
+      for(i = 0; i < count; i++)
       {
-        int first = cluster_first(&fib->cluster[i][0]);
-        int count = cluster_count(&fib->cluster[i][0]);
+        struct stat info;
+        char path[1024];
+        char host[FILE_NAME_LEN + 1];
+        struct fib_block *fib = find_fib(names[i]);
 
-        if(count == 0) break;
-        if(count > 2)
+        if(op->type == op_remove)
+        {
+          if(remove_file(names[i])) modified = 1;
+        }
+        else if(op->type == op_attr)
+        {
+          set_file_attributes(fib, file, names[i]);
+          modified = 1;
+        }
+        else if(file->output_name[0] == 0)
+        {
+          extract_file(fib, NULL);
+        }
+        else if(count > 1 || (stat(file->output_name, &info) == 0 &&
+                              S_ISDIR(info.st_mode)))
         {
-          printf("%d-%d  ", first, first + count);
+          // Several files, or a directory, take the names from the disk
+          host_name(fib, host);
+          snprintf(path, sizeof(path), "%s/%s", file->output_name, host);
+          extract_file(fib, path);
         }
         else
         {
-          printf("%d", first);
+          extract_file(fib, file->output_name);
         }
       }
-      printf("\n");
+      break;
+  }
+  return(modified);
+}
+
+
+/*===========================================================================
+ *                           script_image_for
+ *===========================================================================
+ * Desription: Find the entry for a disk image path in a command file,
+ *             adding one if the path has not been seen
+ *
+ * Parameters: images - Image list, grown as needed
+ *             count  - Number of images, updated
+ *             slots  - Hash of paths to images, grown as needed
+ *             size   - Size of the hash, updated
+ *             path   - Path to disk image
+ *
+ * Return:     Index of the image
+ */
+int script_image_for(struct script_image **images, int *count, int **slots,
+                     int *size, char *path)
+{
+  int i;
+  int slot;
+
+  if(2 * (*count + 1) > *size)
+  {
+    free(*slots);
+    *size = *size ? 2 * *size : 64;
+    *slots = malloc(*size * sizeof(int));
+    memset(*slots, 0xFF, *size * sizeof(int));
+    for(i = 0; i < *count; i++)
+    {
+      char *key = (*images)[i].path;
+      slot = hash_bytes(key, strlen(key), 0) & (*size - 1);
+      while((*slots)[slot] >= 0) slot = (slot + 1) & (*size - 1);
+      (*slots)[slot] = i;
     }
+    *images = realloc(*images, *size / 2 * sizeof(struct script_image));
+  }
+
+  slot = hash_bytes(path, strlen(path), 0) & (*size - 1);
+  while((i = (*slots)[slot]) >= 0)
+  {
+    if(strcmp((*images)[i].path, path) == 0) return(i);
+    slot = (slot + 1) & (*size - 1);
   }
+  i = (*count)++;
+  memset(&(*images)[i], 0, sizeof(struct script_image));
+  strncpy((*images)[i].path, path, sizeof((*images)[i].path) - 1);
+  (*images)[i].first_op = -1;
+  (*images)[i].last_op = -1;
+  (*slots)[slot] = i;
+  return(i);
 }
 
 
-/*
-0: Program/data file indicator 0 = Data file 1 = Program file
+/*===========================================================================
+ *                              run_script
+ *===========================================================================
+ * Desription: Run the operations of a command file
+ *
+ *             "image {path}" or "create {path}" starts a block of
+ *             operations on a disk image. Blocks for the same image are
+ *             merged, and every image is loaded and saved exactly once.
+ *             Operations in a block are
+ *               add [{flags}] {host file} [{disk name}]
+ *               extract {glob} [{host file or directory}]
+ *               remove {glob}
+ *               attr {flags} {glob}
+ *               name {disk name} | protect | unprotect | list
+ *               copy {path}
+ *             where flags are the file type and protection options used
+ *             on the command line.
+ *
+ * Parameters: filename - Command file
+ *
+ * Return:     Were all operations carried out?
+ */
+int run_script(char *filename)
+{
+  struct script_image *images = NULL;
+  struct script_op *ops = NULL;
+  int *slots = NULL;
+  int slot_count = 0;
+  int image_count = 0;
+  int op_count = 0;
+  int op_capacity = 0;
+  int current = -1;
+  int line_no = 0;
+  int ok = 1;
+  char line[2048];
+  FILE *file;
+  struct phase_timer timer;
+  int i;
 
-1: Binary/ASCII data 0 = ASCII data (DISPLAY file) 1 = Binary data (INTERNAL 
-or program file)
+  file = fopen(filename, "r");
+  if(file == NULL)
+  {
+    printf("Cannot open command file \"%s\"\n", filename);
+    return(0);
+  }
+  phase_start(&timer, phase_parse);
 
-2: Reserved for future data type expansion
+  // Read every operation before touching any image
+  while(ok && fgets(line, sizeof(line), file) != NULL)
+  {
+    char *word[8];
+    int words = 0;
+    char *save;
+    char *p;
+    struct script_op *op;
+    int first;
 
-3: Protect flag 0 = Not protected 1 = Protected
+    line_no++;
+    for(p = strtok_r(line, " \t\r\n", &save); p != NULL && words < 8;
+        p = strtok_r(NULL, " \t\r\n", &save))
+      word[words++] = p;
+    if(words == 0 || word[0][0] == '#') continue;
 
-4-6: Reserved for future expansion
+    if((strcmp(word[0], "image") == 0 || strcmp(word[0], "create") == 0) &&
+       words == 2)
+    {
+      current = script_image_for(&images, &image_count, &slots, &slot_count,
+                                 word[1]);
+      if(word[0][0] == 'c') images[current].create = 1;
+      continue;
+    }
+    if(current < 0)
+    {
+      printf("%s:%d: no image for \"%s\"\n", filename, line_no, word[0]);
+      ok = 0;
+      break;
+    }
 
-7: FIXED/VARIABLE flag 0 = Fixed length records 1 = Variable length records
+    if(op_count == op_capacity)
+    {
+      op_capacity = op_capacity ? 2 * op_capacity : 256;
+      ops = realloc(ops, op_capacity * sizeof(struct script_op));
+    }
+    op = &ops[op_count];
+    memset(op, 0, sizeof(struct script_op));
+    op->next = -1;
 
-Byte 13 contains the number of logical records per AU.
+    // Leading file flags
+    for(first = 1; first < words && word[first][0] == '-'; first++)
+    {
+      if(!parse_file_flags(word[first], &op->file))
+      {
+        printf("%s:%d: invalid option \"%s\"\n", filename, line_no,
+               word[first]);
+        ok = 0;
+      }
+    }
+    if(first < words)
+      strncpy(op->file.file_name, word[first], sizeof(op->file.file_name) - 1);
+    if(first + 1 < words)
+      strncpy(op->file.output_name, word[first + 1],
+              sizeof(op->file.output_name) - 1);
 
-Bytes 14-15 contain the number of logical records allocated on Level 2
-(256 byte records}.
+    if(strcmp(word[0], "add") == 0 && words - first >= 1)
+    {
+      op->type = op_add;
+      if(op->file.output_name[0] == 0)
+      {
+        p = strrchr(op->file.file_name, '/');
+        strcpy(op->file.output_name, p ? p + 1 : op->file.file_name);
+      }
+    }
+    else if(strcmp(word[0], "extract") == 0 && words - first >= 1)
+      op->type = op_extract;
+    else if(strcmp(word[0], "remove") == 0 && words - first == 1)
+      op->type = op_remove;
+    else if(strcmp(word[0], "attr") == 0 && words - first == 1 && first > 1)
+      op->type = op_attr;
+    else if(strcmp(word[0], "name") == 0 && words == 2)
+      op->type = op_name;
+    else if(strcmp(word[0], "protect") == 0 && words == 1)
+      op->type = op_protect;
+    else if(strcmp(word[0], "unprotect") == 0 && words == 1)
+      op->type = op_unprotect;
+    else if(strcmp(word[0], "list") == 0 && words == 1)
+      op->type = op_list;
+    else if(strcmp(word[0], "copy") == 0 && words == 2)
+      op->type = op_copy;
+    else
+    {
+      printf("%s:%d: invalid command \"%s\"\n", filename, line_no, word[0]);
+      ok = 0;
+      break;
+    }
 
-Byte 16 contains the EOF offset within the highest physical AU for variable
-length record files and program files.
+    // Chain the operation to its image
+    if(images[current].first_op < 0)
+      images[current].first_op = op_count;
+    else
+      ops[images[current].last_op].next = op_count;
+    images[current].last_op = op_count;
+    op_count++;
+  }
+  fclose(file);
+  phase_stop(&timer);
 
-Byte 17 contains the logical record size in bytes. In case of variable length
-records, this entry will indicate the maximum allowable record size.
+  // One load and one save per image
+  for(i = 0; ok && i < image_count; i++)
+  {
+    int modified = 0;
+    int j;
 
-Bytes 18-19 contain the number of records allocated on Level 3, For variable
-length records, this entry is replaced with the number of Level 2 records
-actually used. (NOTE: The bytes in this entry are in reverse order.)
+    if(images[i].first_op < 0 && !images[i].create) continue;
+    release_disk();
+    if(images[i].create)
+    {
+      create_disk(geometry_sssd);
+      disk_format = format_for_path(images[i].path);
+      modified = 1;
+    }
+    else if(load_disk(images[i].path) == 0)
+    {
+      ok = 0;
+      continue;
+    }
+    if(all_args.verbose)
+      printf("Using disk image \"%s\"\n", images[i].path);
 
-Bytes 20-27 have been reserved for future expansion. They will be fixed to 0
-in this implementation of disk peripheral software.
+    for(j = images[i].first_op; j >= 0; j = ops[j].next)
+    {
+      if(run_script_op(&ops[j])) modified = 1;
+    }
+    if(modified && save_disk(images[i].path) == 0) ok = 0;
+  }
+  release_disk();
 
-Bytes 23-255 contain three byte blocks indicating the clusters that have been
-allocated for the file. The first 12 bits in each entry indicate the address of
-the first AU in the cluster . The second 12 bits indicate the highest logical
-record offset in the cluster of contiguous records. This indication has been 
-chosen, rather than the number of data-records in the chain, since it reduces
-the amount of computation required for relative record file access.
-*/
+  free(images);
+  free(ops);
+  free(slots);
+  return(ok);
+}
 
 
 /*===========================================================================
- *                             mark_sector
+ *                            trace_command
  *===========================================================================
- * Desription: Set sector usage in the allocation bitmap
+ * Desription: Decode a trace file into a summary per event or into the
+ *             Chrome trace event format
  *
- * Parameters: sector - Sector number to mark
- *             used   - Is this sector used?
+ * Parameters: argc - Number of command arguments
+ *             argv - Argument list, starting with the command name
  *
- * Return:     None
+ * Return:     Exit status
  */
-void mark_sector(int sector, int used)
+int trace_command(int argc, char **argv)
 {
-  struct vib_block *vib = disk_buffer;
-  if(used)
+  static char *event_names[trace_event_count] =
   {
-    vib->abm[sector/8] |= 1 <<(sector%8);
+    "allocate", "find_fib", "extract_span", "save_write", "compress_block"
+  };
+  uint64_t count[trace_event_count];
+  uint64_t total[trace_event_count];
+  uint64_t longest[trace_event_count];
+  uint64_t (*open_time)[32] = NULL;
+  int *depth = NULL;
+  int threads = 0;
+  int seen = 0;
+  int chrome = 0;
+  unsigned char header[16];
+  struct trace_record record;
+  uint32_t records;
+  uint32_t n;
+  FILE *file;
+  int i = 1;
+
+  if(argc > 1 && strcmp(argv[1], "-j") == 0)
+  {
+    chrome = 1;
+    i++;
   }
-  else
+  if(argc - i != 1)
   {
-    vib->abm[sector/8] &= ~(1 <<(sector%8));
+    printf("Usage: dsk99 trace [-j] {trace file}\n");
+    return(1);
   }
-}
 
+  file = fopen(argv[i], "rb");
+  if(file == NULL || fread(header, sizeof(header), 1, file) != 1 ||
+     memcmp(header, TRACE_MAGIC, 4) != 0 ||
+     load_le32(&header[4]) != sizeof(struct trace_record))
+  {
+    printf("Cannot read trace file \"%s\"\n", argv[i]);
+    if(file != NULL) fclose(file);
+    return(1);
+  }
+  records = load_le32(&header[8]);
+  memset(count, 0, sizeof(count));
+  memset(total, 0, sizeof(total));
+  memset(longest, 0, sizeof(longest));
 
-/*===========================================================================
- *                             create_disk
- *===========================================================================
- * Desription: Create a new disk image in memory
- *
- * Parameters: None
- *
- * Return:     None
- */
-void create_disk()
-{
-  int i;
-  struct vib_block *vib;
-  disk_size = 92160;
-  disk_buffer = malloc(disk_size);
-  memset(disk_buffer, 0, disk_size);
-  
-  // Format disk as SSSD image
-  vib = (struct vib_block*)disk_buffer;
-  make_name(vib->name, "", DISK_NAME_LEN);
-  vib->physrecs = swap(360);
-  vib->secspertrack = 9;
-  strcpy(vib->id, "DSK");
-  vib->cylinders    = 40;
-  vib->heads        = 1;
-  vib->density      = 1;
+  if(chrome) printf("{\"traceEvents\": [\n");
+  for(n = 0; n < records; n++)
+  {
+    if(fread(&record, sizeof(record), 1, file) != 1) break;
+    if(record.event >= trace_event_count) continue;
+    if(record.thread >= seen) seen = record.thread + 1;
 
-  // Set allocation bitmap
-  memset(&vib->abm[0], 0xFF, sizeof(vib->abm));
-  for(i = 2; i < disk_size / sizeof(struct disk_sector); i++)
+    if(chrome)
+    {
+      printf("%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+             "\"pid\": 1, \"tid\": %d%s, \"args\": {\"arg\": %u}}",
+             n ? ",\n" : "", event_names[record.event], record.kind,
+             record.time_ns / 1e3, record.thread,
+             record.kind == 'I' ? ", \"s\": \"t\"" : "", record.arg);
+      continue;
+    }
+
+    // Pair begin and end records on a stack per thread
+    if(record.thread >= threads)
+    {
+      int grown = record.thread + 16;
+      open_time = realloc(open_time, grown * sizeof(*open_time));
+      depth = realloc(depth, grown * sizeof(int));
+      for(; threads < grown; threads++) depth[threads] = 0;
+    }
+    if(record.kind == 'B')
+    {
+      if(depth[record.thread] < 32)
+        open_time[record.thread][depth[record.thread]] = record.time_ns;
+      depth[record.thread]++;
+    }
+    else if(record.kind == 'E')
+    {
+      uint64_t took;
+      // An end whose begin was overwritten in the ring is dropped
+      if(depth[record.thread] == 0) continue;
+      depth[record.thread]--;
+      if(depth[record.thread] >= 32) continue;
+      took = record.time_ns - open_time[record.thread][depth[record.thread]];
+      count[record.event]++;
+      total[record.event] += took;
+      if(took > longest[record.event]) longest[record.event] = took;
+    }
+    else
+    {
+      count[record.event]++;
+    }
+  }
+  fclose(file);
+
+  if(chrome)
   {
-    mark_sector(i, 0);
+    printf("\n]}\n");
+  }
+  else
+  {
+    printf("Event             Count    Total us     Mean us      Max us\n");
+    printf("--------------  -------  ----------  ----------  ----------\n");
+    for(i = 0; i < trace_event_count; i++)
+    {
+      if(count[i] == 0) continue;
+      printf("%-14s  %7llu  %10.3f  %10.3f  %10.3f\n", event_names[i],
+             (unsigned long long)count[i], total[i] / 1e3,
+             total[i] / 1e3 / count[i], longest[i] / 1e3);
+    }
+    printf("\n%u records from %d threads\n", n, seen);
   }
+  free(open_time);
+  free(depth);
+  return(0);
 }
 
 
 /*===========================================================================
- *                             save_disk
+ *                            corpus_random
  *===========================================================================
- * Desription: Save the disk image in memory to a file
+ * Desription: Next value of a seeded random sequence (splitmix64), so a
+ *             generated corpus depends only on its seed
  *
- * Parameters: filename - File used to store disk image
+ * Parameters: state - Sequence state, updated
+ *             limit - Values are below this limit
  *
- * Return:     Was disk image stored correctly?
+ * Return:     Random value
  */
-int save_disk(char *filename)
+int corpus_random(uint64_t *state, int limit)
 {
-  FILE *file;
-  file = fopen(filename, "wb");
-  if(file == NULL)
-  {
-    printf("Cannot dave disk file \"%s\"\n", filename);
-    return(0);
-  }
-  fwrite(disk_buffer, disk_size, 1, file);
-  fclose(file);
-
-  return(1);
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  z ^= z >> 31;
+  return((int)(z % (uint64_t)limit));
 }
 
 
 /*===========================================================================
- *                             load_disk
+ *                             corpus_line
  *===========================================================================
- * Desription: Load disk image to memory
+ * Desription: Make a line of text from common words
  *
- * Parameters: filename - File from which to read disk image
+ * Parameters: state  - Random sequence state
+ *             line   - Receives the text, not terminated
+ *             length - Length of the line
  *
- * Return:     Was disk image loaded correctly?
+ * Return:     None
  */
-int load_disk(char *filename)
+void corpus_line(uint64_t *state, unsigned char *line, int length)
 {
-  // Read disk image
-  FILE *file = fopen(filename, "rb");      
-  if(file == NULL)
+  static char *words[] =
   {
-    printf("Cannot open disk image \"%s\"\n", all_args.image_path);
-    return(0);
-  }
+    "CALL", "PRINT", "SCORE", "GOTO", "DATA", "THE", "SPRITE", "COLOR",
+    "DISK", "RECORD", "NAME", "10", "200", "LEVEL", "HCHAR", "END"
+  };
+  int i = 0;
 
-  // Load image into memory
-  fseek(file, 0, SEEK_END);
-  disk_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-  disk_buffer = malloc(disk_size);
-  fread(disk_buffer, disk_size, 1, file);
- 
-  // Confirm this is a valid image
-  struct vib_block *vib = (struct vib_block*)disk_buffer;
-  if(vib->id[0] != 'D' ||
-     vib->id[1] != 'S' ||
-     vib->id[2] != 'K')
+  while(i < length)
   {
-    printf("%s is not a V9T9 disk image\n", all_args.image_path);
-    return(0);
+    char *word = words[corpus_random(state, 16)];
+    while(*word && i < length) line[i++] = *word++;
+    if(i < length) line[i++] = ' ';
   }
-
-  // File succcessfully loaded
-  return(1);
 }
 
 
 /*===========================================================================
- *                            extract_file
+ *                            corpus_file
  *===========================================================================
- * Desription: Copy a file from the disk image to a seperate file
+ * Desription: Add one generated file to the disk image. Programs hold
+ *             random bytes, DIS/VAR 80 files hold text lines packed as on
+ *             a real disk and DIS/FIX files hold fixed length records.
  *
- * Parameters: fib      - File information block for the file to be extracted
- *             filename - File name to use for extracted file
+ * Parameters: state   - Random sequence state
+ *             name    - Name of the file in V9T9 format
+ *             sectors - Approximate size of the file in sectors
  *
- * Return:     None
+ * Return:     Size of the file contents, 0 if the file was not added
  */
-void extract_file(struct fib_block *fib, char *filename)
+int corpus_file(uint64_t *state, char *name, int sectors)
 {
+  static unsigned char data[2880 * SECTOR_SIZE];
+  static int fixed_sizes[4] = {80, 128, 40, 64};
+  struct fib_block *fib;
+  int kind = corpus_random(state, 10);
+  int reclen = 80;
+  int records = 0;
+  int size;
+  int eof = 0;
   int i;
-  struct disk_sector *sector = disk_buffer;
-  FILE *file;
-  int file_size;
-  char name_buffer[FILE_NAME_LEN + 1];
-
-  if(fib == NULL) return;
 
-  // Make name for the extracted file
-  if(filename == NULL)
+  memset(data, 0, sectors * SECTOR_SIZE);
+  if(kind < 5)
   {
-    // Remove trailng spaces from name on disk
-    char *p;
-    strncpy(name_buffer, fib->name, FILE_NAME_LEN);
-    if((p = strchr(name_buffer, ' ')) != NULL) *p = 0;
-    if((p = strchr(name_buffer, '/')) != NULL) *p = '_';
-    filename = name_buffer;
+    // Program image
+    size = (sectors - 1) * SECTOR_SIZE + 1 + corpus_random(state, 255);
+    for(i = 0; i < size; i++)
+      data[i] = (i & 3) ? corpus_random(state, 256) : 0x20 + (i % 64);
   }
-
-  // Open extraction destination
-  file = fopen(filename, "wb");
-  if(file == NULL)
+  else if(kind < 8)
   {
-    printf("Cannot open file \"%s\"\n", filename);
+    // DIS/VAR 80, records do not cross sectors and 0xFF ends each sector
+    for(i = 0; i < sectors; i++)
+    {
+      unsigned char *sector = &data[i * SECTOR_SIZE];
+      int used = 0;
+      for(;;)
+      {
+        int length = corpus_random(state, reclen + 1);
+        if(used + 1 + length + 1 > SECTOR_SIZE) break;
+        sector[used] = length;
+        corpus_line(state, &sector[used + 1], length);
+        used += 1 + length;
+        records++;
+      }
+      sector[used] = 0xFF;
+      eof = used;
+    }
+    size = sectors * SECTOR_SIZE;
   }
-
-  // Copy file contents to destination
-  file_size = (swap(fib->physrec_count)-1) * 256 + fib->eof;
-  for(i=0; i<76; i++)
+  else
   {
-    int first = cluster_first(&fib->cluster[i][0]);
-    int count = cluster_count(&fib->cluster[i][0]);
-    int j;
-
-    if(count == 0) break;
-    for(j=0; j<=count; j++)
+    // DIS/FIX, whole records per sector
+    reclen = fixed_sizes[corpus_random(state, 4)];
+    records = sectors * (SECTOR_SIZE / reclen) -
+              corpus_random(state, SECTOR_SIZE / reclen);
+    for(i = 0; i < records; i++)
     {
-      int size = 256;
-      if(size > file_size) size = file_size;
-      fwrite(&sector[first + j], size, 1, file);
-      file_size -= size;
-    }    
+      int per = SECTOR_SIZE / reclen;
+      corpus_line(state, &data[(i / per) * SECTOR_SIZE + (i % per) * reclen],
+                  reclen);
+    }
+    size = sectors * SECTOR_SIZE;
   }
-  fclose(file);
-  
-  if(all_args.verbose)
-    printf("Extracted disk file \"%s\" to \"%s\"\n",
-           fib->name, filename);
+
+  fib = add_file_data(name, name, data, size);
+  if(fib == NULL) return(0);
+  if(kind >= 5)
+  {
+    fib->flags = (kind < 8) ? fib_var : 0;
+    fib->reclen = reclen;
+    fib->recsperphysrec = (kind < 8) ? (SECTOR_SIZE - 1) / (reclen + 1)
+                                     : SECTOR_SIZE / reclen;
+    fib->eof = eof;
+    fib_set_fixrecs(fib, (kind < 8) ? sectors : records);
+  }
+  if(corpus_random(state, 8) == 0) fib->flags |= fib_wp;
+  return(size);
 }
 
 
 /*===========================================================================
- *                               find_fib
+ *                            corpus_image
  *===========================================================================
- * Desription: Find the FIB for a file in the disk image
+ * Desription: Generate one disk image of the corpus. Fragmented images are
+ *             made by adding spacer files, removing every other one before
+ *             the real files are added and removing the rest afterwards.
  *
- * Parameters: filename - File name to search for in V9T9 format
+ * Parameters: seed   - Seed of the corpus
+ *             number - Number of the image
+ *             path   - File to save the image to
+ *             bytes  - Receives the size of the file contents added
  *
- * Return:     Pointer to the found FIB, NULL if not found
+ * Return:     Number of files on the image, -1 if it cannot be saved
  */
-struct fib_block* find_fib(char *filename)
+int corpus_image(uint64_t seed, int number, char *path, uint64_t *bytes)
 {
+  static int layouts[10] =
+  {
+    geometry_sssd, geometry_sssd, geometry_sssd, geometry_sssd,
+    geometry_dssd, geometry_dssd, geometry_dssd,
+    geometry_dsdd, geometry_dsdd, geometry_dshd
+  };
+  static char *stems[8] =
+  {
+    "GAME", "DATA", "LOAD", "NOTES", "SCORE", "MUSIC", "CHARS", "UTIL"
+  };
+  uint64_t state = hash_bytes(&number, sizeof(number), seed);
+  int layout = layouts[corpus_random(&state, 10)];
+  int fragmentation = corpus_random(&state, 4);
+  int spacers = fragmentation * 10;
+  int total;
+  int target;
+  int files = 0;
+  char name[FILE_NAME_LEN + 1];
+  char label[32];
   int i;
-  struct disk_sector *sector = disk_buffer;
 
-  // Iterate through files
-  for(i = 0; i < MAX_FILE_COUNT; i++)
+  create_disk(layout);
+  total = geometries[layout].sectors;
+  target = total * (30 + corpus_random(&state, 66)) / 100;
+  snprintf(label, sizeof(label), "ARC%05d", number);
+  make_name(((struct vib_block*)disk_buffer)->name, label, DISK_NAME_LEN);
+  name[FILE_NAME_LEN] = 0;
+
+  // Spacers, every other one is removed again to leave holes
+  for(i = 0; i < spacers; i++)
   {
-    short fib_idx = swap(sector[BLOCK_FIB_INDEX].data[i]);
-    if(fib_idx != 0)
-    {
-      // Try to match this name
-      struct fib_block* fib = (struct fib_block*)(&sector[fib_idx]);
-      if(strncmp(filename, fib->name, FILE_NAME_LEN) == 0)
-        return(fib);
-    }
+    snprintf(label, sizeof(label), "~SPACE%03d", i);
+    make_name(name, label, FILE_NAME_LEN);
+    corpus_file(&state, name, 1 + corpus_random(&state, 2 * fragmentation));
   }
-  return(NULL);
+  for(i = 0; i < spacers; i += 2)
+  {
+    snprintf(label, sizeof(label), "~SPACE%03d", i);
+    make_name(name, label, FILE_NAME_LEN);
+    remove_file(name);
+  }
+
+  *bytes = 0;
+  while(files < MAX_FILE_COUNT - spacers - 1 &&
+        total - free_sector_count() < target)
+  {
+    int room = free_sector_count() - 4 * sectors_per_au();
+    int sectors = 1 + corpus_random(&state, total / 16);
+    int size;
+
+    if(sectors > room) sectors = room;
+    if(sectors <= 0) break;
+    snprintf(label, sizeof(label), "%s%d", stems[corpus_random(&state, 8)],
+             files);
+    make_name(name, label, FILE_NAME_LEN);
+    size = corpus_file(&state, name, sectors);
+    if(size == 0) break;
+    *bytes += size;
+    files++;
+  }
+
+  for(i = 1; i < spacers; i += 2)
+  {
+    snprintf(label, sizeof(label), "~SPACE%03d", i);
+    make_name(name, label, FILE_NAME_LEN);
+    remove_file(name);
+  }
+
+  i = save_disk_as(path, format_v9t9);
+  release_disk();
+  return(i ? files : -1);
 }
 
 
 /*===========================================================================
- *                             remove_file
+ *                           generate_command
  *===========================================================================
- * Desription: Remove a file from the disk image
+ * Desription: Write a synthetic archive of disk images. The same seed
+ *             always gives the same images.
  *
- * Parameters: filename - File name to remove in V9T9 format
+ * Parameters: argc - Number of command arguments
+ *             argv - Argument list, starting with the command name
  *
- * Return:     Was file removed?
+ * Return:     Exit status
  */
-int remove_file(char *filename)
+int generate_command(int argc, char **argv)
 {
-  struct fib_block *fib;
+  unsigned long long seed = 1;
+  uint64_t bytes = 0;
+  long long files = 0;
+  int count = 1000;
+  int n;
   int i;
-  int secno;
-  struct disk_sector *sector = disk_buffer;
 
-  fib = find_fib(filename);
-  if(fib == NULL)
+  for(i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2)
   {
-    printf("Cannot remove file \"%s\"\n", filename);
-    return(0);
+    if(strcmp(argv[i], "-s") == 0)      seed = strtoull(argv[i + 1], NULL, 0);
+    else if(strcmp(argv[i], "-n") == 0) count = atoi(argv[i + 1]);
+    else break;
   }
-
-  // Free all sectors used by this file
-  for(i=0; i<76; i++)
+  if(argc - i != 1 || count <= 0)
   {
-    int first = cluster_first(&fib->cluster[i][0]);
-    int count = cluster_count(&fib->cluster[i][0]);
-    if(count == 0) break;
-    for(secno = first; secno<=first+count; secno++)
-    {
-      memset(&sector[secno], 0, sizeof(struct disk_sector));
-      mark_sector(secno, 0);
-    }    
+    printf("Usage: dsk99 generate [-s {seed}] [-n {images}] {directory}\n");
+    return(1);
   }
-
-  // Free the FIB block too
-  memset(fib, 0, sizeof(struct disk_sector));
-  secno = ((intptr_t)fib - (intptr_t)disk_buffer) / sizeof(struct disk_sector);
-  mark_sector(secno, 0);
-
-  // Remove this entry in the file list
-  for(i = 0; i < MAX_FILE_COUNT; i++)
+  if(mkdir(argv[i], 0777) != 0 && errno != EEXIST)
   {
-    short fib_idx = swap(sector[BLOCK_FIB_INDEX].data[i]);
-    if(fib_idx == secno) break;
+    printf("Cannot create directory \"%s\"\n", argv[i]);
+    return(1);
   }
-  for(i = i; i < MAX_FILE_COUNT; i++)
+
+  for(n = 0; n < count; n++)
   {
-    sector[BLOCK_FIB_INDEX].data[i] = sector[BLOCK_FIB_INDEX].data[i + 1];
+    char path[1024];
+    uint64_t image_bytes;
+    int image_files;
+
+    snprintf(path, sizeof(path), "%s/img%05d.dsk", argv[i], n);
+    image_files = corpus_image(seed, n, path, &image_bytes);
+    if(image_files < 0) return(1);
+    files += image_files;
+    bytes += image_bytes;
+    if(all_args.verbose)
+      printf("%s: %d files, %llu bytes\n", path, image_files,
+             (unsigned long long)image_bytes);
   }
-
-  if(all_args.verbose)
-    printf("Removing file \"%s\" from disk image\n", filename);
-  return(1);
+  printf("Generated %d images with %lld files, %llu bytes of file data\n",
+         count, files, (unsigned long long)bytes);
+  return(0);
 }
 
 
 /*===========================================================================
- *                              extract_all
+ *                           sim_workload
  *===========================================================================
- * Desription: Extract all files from the disk image
+ * Desription: Make a random workload of adds, removes and resizes. The
+ *             workload keeps its own account of file sizes, so it is the
+ *             same whatever the allocation policy does with it. Adds are
+ *             favoured while the disk is under half full and removes once
+ *             it is over 85% full.
  *
- * Parameters: None
+ * Parameters: seed    - Seed of the workload
+ *             count   - Number of operations
+ *             sectors - Size of the disk
  *
- * Return:     None
+ * Return:     Allocated list of count operations
  */
-void extract_all()
+struct sim_op* sim_workload(uint64_t seed, int count, int sectors)
 {
+  struct sim_op *ops = calloc(count, sizeof(struct sim_op));
+  int size[MAX_FILE_COUNT];
+  int live[MAX_FILE_COUNT];
+  int live_count = 0;
+  int next_file = 0;
+  int used = 0;
   int i;
-  struct disk_sector *sector = disk_buffer;
 
-  // Iterate over all files
-  for(i = 0; i < MAX_FILE_COUNT; i++)
+  if(ops == NULL)
   {
-    short fib_idx = swap(sector[BLOCK_FIB_INDEX].data[i]);
-    if(fib_idx != 0)
+    printf("Cannot allocate a workload of %d operations\n", count);
+    return(NULL);
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    int roll = corpus_random(&seed, 100);
+    int add_chance = used < sectors / 2 ? 60 :
+                     used > sectors * 85 / 100 ? 15 : 35;
+    int remove_chance = used > sectors * 85 / 100 ? 60 : 30;
+    int pick = live_count ? corpus_random(&seed, live_count) : 0;
+    int new_size = 1 + corpus_random(&seed, sectors / 24);
+    char label[16];
+
+    if(live_count == 0 ||
+       (roll < add_chance && live_count < MAX_FILE_COUNT - 1 &&
+        used + new_size + 1 < sectors))
     {
-      struct fib_block* fib = (struct fib_block*)(&sector[fib_idx]);
-      extract_file(fib, NULL);
+      // Add a new file
+      snprintf(label, sizeof(label), "F%05d", next_file++);
+      ops[i].type = 'a';
+      ops[i].sectors = new_size;
+      size[live_count] = new_size;
+      live[live_count] = next_file - 1;
+      live_count++;
+      used += new_size + 1;
     }
+    else if(roll < add_chance + remove_chance)
+    {
+      // Remove a file
+      snprintf(label, sizeof(label), "F%05d", live[pick]);
+      ops[i].type = 'r';
+      used -= size[pick] + 1;
+      live_count--;
+      size[pick] = size[live_count];
+      live[pick] = live[live_count];
+    }
+    else
+    {
+      // Resize a file, more often growing than shrinking
+      snprintf(label, sizeof(label), "F%05d", live[pick]);
+      new_size = size[pick] + corpus_random(&seed, size[pick] + 8) -
+                 size[pick] / 2;
+      if(new_size < 1) new_size = 1;
+      if(used - size[pick] + new_size >= sectors) new_size = size[pick];
+      ops[i].type = 'z';
+      ops[i].sectors = new_size;
+      used += new_size - size[pick];
+      size[pick] = new_size;
+    }
+    make_name(ops[i].name, label, FILE_NAME_LEN);
   }
+  return(ops);
 }
 
 
 /*===========================================================================
- *                                allocate
+ *                          sim_read_workload
  *===========================================================================
- * Desription: Allocate a free sector from the disk
+ * Desription: Read a recorded workload, one operation per line:
+ *             "add {name} {sectors}", "remove {name}" or
+ *             "resize {name} {sectors}". Lines starting with # are comments.
  *
- * Parameters: None
+ * Parameters: filename - Workload file
+ *             count    - Receives the number of operations
  *
- * Return:     Pointer to new sector, NULL if none available
+ * Return:     Allocated list of operations, NULL if the file is unusable
  */
-struct disk_sector* allocate()
+struct sim_op* sim_read_workload(char *filename, int *count)
 {
-  int i;
-  struct vib_block *vib = (struct vib_block*)disk_buffer;
-  struct disk_sector *sector = (struct disk_sector*)disk_buffer;
-  for(i = 2; i < disk_size / sizeof(struct disk_sector); i++)
+  struct sim_op *ops = NULL;
+  int capacity = 0;
+  char line[256];
+  int line_no = 0;
+  FILE *file;
+
+  file = fopen(filename, "r");
+  if(file == NULL)
   {
-    if((vib->abm[i/8] & (1 << (i % 8))) == 0)
+    printf("Cannot open workload \"%s\"\n", filename);
+    return(NULL);
+  }
+  *count = 0;
+  while(fgets(line, sizeof(line), file) != NULL)
+  {
+    char type[16];
+    char name[64];
+    int sectors = 0;
+    int words;
+
+    line_no++;
+    words = sscanf(line, "%15s %63s %d", type, name, &sectors);
+    if(words <= 0 || type[0] == '#') continue;
+    if(*count == capacity)
+    {
+      struct sim_op *grown;
+      capacity = capacity ? 2 * capacity : 1024;
+      grown = realloc(ops, capacity * sizeof(struct sim_op));
+      if(grown == NULL)
+      {
+        printf("%s:%d: too many operations\n", filename, line_no);
+        free(ops);
+        fclose(file);
+        return(NULL);
+      }
+      ops = grown;
+    }
+    if(strcmp(type, "add") == 0 && words == 3 && sectors > 0)
+      ops[*count].type = 'a';
+    else if(strcmp(type, "remove") == 0 && words == 2)
+      ops[*count].type = 'r';
+    else if(strcmp(type, "resize") == 0 && words == 3 && sectors > 0)
+      ops[*count].type = 'z';
+    else
     {
-      mark_sector(i, 1);
-      return(&sector[i]);
+      printf("%s:%d: invalid operation\n", filename, line_no);
+      free(ops);
+      fclose(file);
+      return(NULL);
     }
+    make_name(ops[*count].name, name, FILE_NAME_LEN);
+    ops[*count].name[FILE_NAME_LEN] = 0;
+    ops[*count].sectors = sectors;
+    (*count)++;
   }
-  return(NULL);
+  fclose(file);
+  return(ops);
 }
 
 
 /*===========================================================================
- *                             free_sector_count
+ *                             sim_measure
  *===========================================================================
- * Desription: Determine the number of free sectors on this disk
+ * Desription: Measure the fragmentation of the current disk image
  *
- * Parameters: None
+ * Parameters: sample - Receives the measurements
  *
- * Return:     Number of free sectors
+ * Return:     None
  */
-int free_sector_count()
+void sim_measure(struct sim_sample *sample)
 {
+  uint16_t index[MAX_FILE_COUNT];
+  int sectors = disk_size / (int)sizeof(struct disk_sector);
+  int au = sectors_per_au();
+  int clusters = 0;
+  int run = 0;
   int i;
-  int count = 0;
-  struct vib_block *vib = (struct vib_block*)disk_buffer;
-  struct disk_sector *sector = (struct disk_sector*)disk_buffer;
-  for(i = 2; i < disk_size / sizeof(struct disk_sector); i++)
+
+  memset(sample, 0, sizeof(struct sim_sample));
+  fdr_index_decode(index);
+  for(i = 0; i < MAX_FILE_COUNT; i++)
+  {
+    struct cluster_span spans[MAX_CLUSTERS];
+    struct fib_block *fib = fib_at(index[i]);
+    int count;
+    if(fib == NULL || (count = fib_spans(fib, spans)) < 0) continue;
+    sample->files++;
+    clusters += count;
+    if(count > sample->max_clusters) sample->max_clusters = count;
+  }
+  sample->fragments = sample->files ? (double)clusters / sample->files : 0;
+
+  for(i = au > 1 ? au : 2; i < sectors; i += au)
   {
-    if((vib->abm[i/8] & (1 << (i % 8))) == 0)
+    if(sector_free(i))
     {
-      count++;
+      run += au;
+      sample->free_sectors += au;
+      if(run > sample->largest_run) sample->largest_run = run;
+    }
+    else
+    {
+      run = 0;
     }
   }
-  return(count);
 }
 
 
 /*===========================================================================
- *                                add_file
+ *                          simulate_command
  *===========================================================================
- * Desription: Add a file to the disk image
+ * Desription: Replay an add/remove/resize workload against an in-memory
+ *             image once per allocation policy, and compare how the image
+ *             ages under each
  *
- * Parameters: filename - File name to add
- *             diskname - Name used for the file in V9T9 format
+ * Parameters: argc - Number of command arguments
+ *             argv - Argument list, starting with the command name
  *
- * Return:     Was file removed?
+ * Return:     Exit status
  */
-int add_file(char *filename, char *diskname)
+int simulate_command(int argc, char **argv)
 {
-  struct fib_block *fib;
-  int first = 0;
-  int count = 0;
-  FILE *file;
-  int file_size;
-  char *cluster;
+  static unsigned char data[2880 * SECTOR_SIZE];
+  struct sim_sample final[policy_count];
+  double mean_ns[policy_count];
+  double mean_probes[policy_count];
+  int failures[policy_count];
+  int run_policy[policy_count];
+  struct sim_op *ops = NULL;
+  char *series_path = NULL;
+  char *workload = NULL;
+  char *policies = "first,next,best,worst";
+  char list[64];
+  char *name;
+  int chosen = 0;
+  char *problem = NULL;
+  unsigned long long seed = 1;
+  FILE *series = NULL;
+  int layout = geometry_dssd;
+  int count = 20000;
+  int interval;
+  int policy;
   int i;
-  int j;
-  int sector_size = sizeof(struct disk_sector);
-  struct disk_sector *sector = (struct disk_sector*)disk_buffer;
-
-  if(all_args.verbose)
-    printf("Attempting to add \"%s\" as \"%s\"\n", filename, diskname);
 
-  // Search for existing file with matching name
-  if(find_fib(diskname) != NULL)
+  for(i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2)
   {
-    printf("Cannot add \"%s\" as \"%s\", file already exists\n",
-           filename, diskname);
-    return(0);
+    if(strcmp(argv[i], "-s") == 0)      seed = strtoull(argv[i + 1], NULL, 0);
+    else if(strcmp(argv[i], "-n") == 0) count = atoi(argv[i + 1]);
+    else if(strcmp(argv[i], "-r") == 0) workload = argv[i + 1];
+    else if(strcmp(argv[i], "-o") == 0) series_path = argv[i + 1];
+    else if(strcmp(argv[i], "-p") == 0) policies = argv[i + 1];
+    else if(strcmp(argv[i], "-g") == 0)
+    {
+      for(layout = 0; layout < geometry_count; layout++)
+        if(strcasecmp(argv[i + 1], geometries[layout].name) == 0) break;
+      if(layout == geometry_count) break;
+    }
+    else break;
   }
-
-  // Make sure the Source file exists
-  file = fopen(filename, "rb");
-  if(file == NULL)
+  if(i != argc || count <= 0 || layout == geometry_count)
   {
-    printf("Cannot add \"%s\", file does not exist\n", filename);
-    return(0);
+    printf("Usage: dsk99 simulate [-g {geometry}] [-s {seed}] [-n {ops}] "
+           "[-r {workload}]\n"
+           "                      [-p {policy},...] [-o {series.csv}]\n");
+    return(1);
   }
 
-  // Find file size
-  fseek(file, 0, SEEK_END);
-  file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  // Make sure we can fit this file (file data + FIB)
-  if(free_sector_count() < (file_size/sector_size)+1)
+  // Policies to compare, as a comma separated list of names
+  memset(run_policy, 0, sizeof(run_policy));
+  if(snprintf(list, sizeof(list), "%s", policies) >= (int)sizeof(list))
   {
-    printf("Cannot add \"%s\", disk full\n", filename);
-    fclose(file);
-    return(0);
-  }  	  
-  
-  // Create FIB for this file
-  fib = (struct fib_block*)allocate();
-  if(fib == NULL)
+    printf("Too many allocation policies \"%s\"\n", policies);
+    return(1);
+  }
+  for(name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
   {
-    printf("Cannot add \"%s\", disk full\n", filename);
-    fclose(file);
-    return(0);
+    for(policy = 0; policy < policy_count; policy++)
+      if(strcmp(name, policy_names[policy]) == 0) break;
+    if(policy == policy_count)
+    {
+      printf("Unknown allocation policy \"%s\"\n", name);
+      return(1);
+    }
+    run_policy[policy] = 1;
+    chosen++;
+  }
+  if(chosen == 0)
+  {
+    printf("No allocation policy given\n");
+    return(1);
   }
-  memset(fib, 0, sector_size);
-  fib->flags = fib_program;
-  fib->physrec_count = swap((file_size / sector_size) + 1);
-  fib->eof = file_size % sector_size;
-  strncpy(fib->name, diskname, FILE_NAME_LEN);
 
-  // Save file contents
-  cluster = &fib->cluster[0][0]; 
-  while(file_size > 0)
+  if(workload != NULL)
+    ops = sim_read_workload(workload, &count);
+  else
+    ops = sim_workload(seed, count, geometries[layout].sectors);
+  if(ops == NULL || count == 0) return(1);
+  if(series_path != NULL)
   {
-    int secnum;
-    struct disk_sector *sector = allocate();
-    if(sector == NULL)
+    series = fopen(series_path, "w");
+    if(series == NULL)
     {
-      printf("Cannot add \"%s\", disk is full\n", filename);
-      fclose(file);
-      return(0);
+      printf("Cannot write \"%s\"\n", series_path);
+      return(1);
     }
-    fread(sector, sector_size, 1, file);
+    fprintf(series, "policy,op,files,free_sectors,largest_free_run,"
+            "mean_clusters,max_clusters,failures,ns_per_op,probes_per_op\n");
+  }
+  interval = count / 100 > 0 ? count / 100 : 1;
+  for(i = 0; i < (int)sizeof(data); i++) data[i] = i;
 
-    // Sectors in a cluster must be contiguous, check that here
-    secnum = ((intptr_t)sector - (intptr_t)disk_buffer) / sector_size;
-    if(secnum != first + count)
+  for(policy = 0; policy < policy_count; policy++)
+  {
+    uint64_t window_ns = 0;
+    uint64_t total_ns = 0;
+    uint64_t window_probes = stats.allocator_probes;
+    uint64_t first_probes = stats.allocator_probes;
+
+    if(!run_policy[policy]) continue;
+    allocation_policy = policy;
+    next_fit_sector = 0;
+    failures[policy] = 0;
+    release_disk();
+    create_disk(layout);
+
+    // Failed operations are counted, not shown
+    all_args.quiet = 1;
+    for(i = 0; i < count; i++)
     {
-      if(first != 0)
+      uint64_t start = clock_ns(CLOCK_MONOTONIC);
+      struct fib_block *fib;
+      int ok = 1;
+
+      switch(ops[i].type)
+      {
+        case 'a':
+          ok = add_file_data(ops[i].name, ops[i].name, data,
+                             ops[i].sectors * SECTOR_SIZE) != NULL;
+          break;
+        case 'r':
+          ok = find_fib(ops[i].name) != NULL && remove_file(ops[i].name);
+          break;
+        case 'z':
+          fib = find_fib(ops[i].name);
+          ok = fib != NULL &&
+               rewrite_file(fib, data, ops[i].sectors * SECTOR_SIZE);
+          break;
+      }
+      if(!ok) failures[policy]++;
+      window_ns += clock_ns(CLOCK_MONOTONIC) - start;
+
+      // Every hundredth of the run, and at its end, check that no AU was
+      // left part free
+      if((i + 1) % interval == 0 || i + 1 == count)
+        problem = check_allocation();
+      if(problem != NULL) break;
+
+      if(series != NULL && ((i + 1) % interval == 0 || i + 1 == count))
       {
-        // No longer contiguous, make a new cluster for this sector
-        make_cluster(cluster, first, count);
-        cluster += 3;
+        struct sim_sample sample;
+        int ops_done = (i % interval) + 1;
+        sim_measure(&sample);
+        fprintf(series, "%s,%d,%d,%d,%d,%.3f,%d,%d,%.1f,%.1f\n",
+                policy_names[policy], i + 1, sample.files,
+                sample.free_sectors, sample.largest_run, sample.fragments,
+                sample.max_clusters, failures[policy],
+                (double)window_ns / ops_done,
+                (double)(stats.allocator_probes - window_probes) / ops_done);
+        total_ns += window_ns;
+        window_ns = 0;
+        window_probes = stats.allocator_probes;
       }
-      first = secnum;
-      count = 0;
     }
-    count++;
-    file_size -= sector_size;
-  }
-  make_cluster(cluster, first, count);
+    all_args.quiet = 0;
+    if(problem != NULL)
+    {
+      printf("%s policy, operation %d: %s\n", policy_names[policy], i + 1,
+             problem);
+      return(1);
+    }
 
-  // Add file to listing
-  for(i = 0; i < MAX_FILE_COUNT; i++)
-  {
-    short fib_idx = swap(sector[BLOCK_FIB_INDEX].data[i]);
-    if(fib_idx == 0 ||
-       strncmp(((struct fib_block*)&sector[fib_idx])->name,
-               fib->name, FILE_NAME_LEN) > 0)
-      break;
-  }
-  for(j = MAX_FILE_COUNT - 1; j > i ; j--)
-  {
-    sector[BLOCK_FIB_INDEX].data[j] = sector[BLOCK_FIB_INDEX].data[j-1];
+    sim_measure(&final[policy]);
+    mean_ns[policy] = (double)(total_ns + window_ns) / count;
+    mean_probes[policy] = (double)(stats.allocator_probes - first_probes) /
+                          count;
   }
-  sector[BLOCK_FIB_INDEX].data[i] = 
-    swap(((intptr_t)fib - (intptr_t)disk_buffer) / sector_size);
-
-  fclose(file);
-  return(1);
+  if(series != NULL) fclose(series);
+  release_disk();
+  allocation_policy = policy_first_fit;
+
+  // Side by side summary
+  printf("%d operations on %s\n\n%-22s", count, geometries[layout].name,
+         "Policy");
+  for(policy = 0; policy < policy_count; policy++)
+    if(run_policy[policy]) printf("  %10s", policy_names[policy]);
+#define SIM_ROW(label, format, value) \
+  printf("\n%-22s", label); \
+  for(policy = 0; policy < policy_count; policy++) \
+    if(run_policy[policy]) printf(format, value);
+  SIM_ROW("Failed operations", "  %10d", failures[policy]);
+  SIM_ROW("Files", "  %10d", final[policy].files);
+  SIM_ROW("Free sectors", "  %10d", final[policy].free_sectors);
+  SIM_ROW("Largest free run", "  %10d", final[policy].largest_run);
+  SIM_ROW("Mean clusters/file", "  %10.2f", final[policy].fragments);
+  SIM_ROW("Max clusters (of 76)", "  %10d", final[policy].max_clusters);
+  SIM_ROW("Mean ns/op", "  %10.0f", mean_ns[policy]);
+  SIM_ROW("Bitmap probes/op", "  %10.1f", mean_probes[policy]);
+#undef SIM_ROW
+  printf("\n");
+  free(ops);
+  return(0);
 }
 
 
+// Commands selected by the first argument
+struct command commands[] =
+{
+  {"diff",     diff_command},
+  {"patch",    patch_command},
+  {"sync",     sync_command},
+  {"build",    build_command},
+  {"batch",    batch_command},
+  {"trace",    trace_command},
+  {"generate", generate_command},
+  {"simulate", simulate_command},
+  {"convert",  convert_command},
+  {"append",   record_command},
+  {"update",   record_command},
+  {"grep",     grep_command},
+  {"copy",     copy_command},
+  {"repack",   repack_command},
+  {"pack",     pack_command},
+  {"compact",  compact_command},
+  {"recover",  recover_command},
+  {NULL,       NULL}
+};
+
+
 /*===========================================================================
- *                                  main
+ *                                  run
  *===========================================================================
- * Desription: Entry point for the program
+ * Desription: Carry out the command or disk operations given as arguments
  *
  * Parameters: argc - Number of command arguments
  *             argv - Argument list
  *
- * Return:     None
+ * Return:     Exit status
  */
-int main(int argc, char **argv)
+int run(int argc, char **argv)
 {
   int i;
   int modified = 0;
+  unsigned char *loaded = NULL;
   struct vib_block* vib;
+  struct phase_timer timer;
 
-  memset(&all_args, 0, sizeof(all_args));
-  if(parse_arguments(argc, argv) == 0) return(1);
+  // Run a command if one is named
+  if(argc > 1)
+  {
+    struct command *command;
+    for(command = commands; command->name != NULL; command++)
+    {
+      if(strcmp(argv[1], command->name) == 0)
+        return(command->run(argc - 1, &argv[1]));
+    }
+  }
+
+  phase_start(&timer, phase_parse);
+  i = parse_arguments(argc, argv);
+  phase_stop(&timer);
+  if(i == 0) return(1);
   if(all_args.verbose > 1)
   {
     printf("\n");
@@ -1363,6 +11792,7 @@ int main(int argc, char **argv)
     printf("use existing  =%d\n", all_args.use_existing);
     printf("list disk     =%d\n", all_args.list_contents);
     printf("extract all   =%d\n", all_args.extract_all);
+    printf("copy path     =%s\n", all_args.copy_path);
     printf("verbose       =%d\n", all_args.verbose);
     printf("show help     =%d\n", all_args.show_help);
 
@@ -1392,10 +11822,15 @@ int main(int argc, char **argv)
     return(0);
   }
 
+  // Run a command file
+  if(all_args.script_path[0] != 0)
+    return(run_script(all_args.script_path) ? 0 : 1);
+
   // Get disk image
   if(all_args.create_new)
   {
-    create_disk();
+    create_disk(geometry_sssd);
+    disk_format = format_for_path(all_args.image_path);
     if(all_args.verbose)
       printf("Creating new disk image \"%s\"\n",all_args.image_path);
     modified = 1;
@@ -1403,9 +11838,16 @@ int main(int argc, char **argv)
   else
   {
     if(load_disk(all_args.image_path) == 0)
-      return(0);
+      return(1);
     if(all_args.verbose)
       printf("Using disk image \"%s\"\n",all_args.image_path);
+
+    // Sector dumps are updated by writing back just the changed sectors
+    if(disk_format == format_v9t9)
+    {
+      loaded = malloc(disk_size);
+      memcpy(loaded, disk_buffer, disk_size);
+    }
   }
   vib = (struct vib_block*)disk_buffer;
 
@@ -1444,120 +11886,77 @@ int main(int argc, char **argv)
   // Act on individual files
   for(i = 0; i < all_args.file_count; i++)
   {
-    struct fib_block *fib;
-    char name[FILE_NAME_LEN + 1];
-    name[FILE_NAME_LEN] = 0;
-
-    if(all_args.file[i].output_name[0] == 0)
-      strcpy(all_args.file[i].output_name, all_args.file[i].file_name);
-
-    // Make disk name    
-    make_name(name, all_args.file[i].file_name, FILE_NAME_LEN);
-
-    // Extract file from disk
-    if(all_args.file[i].extract )
-    {
-      fib = find_fib(name);
-      if(fib == NULL)
-        printf("Cannot find file \"%s\"\n", all_args.file[i].file_name);
-      else
-        extract_file(fib, all_args.file[i].output_name);
-    }
-
-    // Remove file from disk
-    if(all_args.file[i].remove)
-      modified = remove_file(name);
-
-    // Add file to disk
-    if(all_args.file[i].add)
-    {
-      make_name(name, all_args.file[i].output_name, FILE_NAME_LEN);
-      modified = add_file(all_args.file[i].file_name, name);
-    }
-
-    // Set file attributes
-    if(all_args.file[i].protect  || all_args.file[i].unprotect ||
-       all_args.file[i].binary   || all_args.file[i].ascii     ||
-       all_args.file[i].variable || all_args.file[i].fixed     ||
-       all_args.file[i].program  || all_args.file[i].add)   
-    {
-      fib = find_fib(name);
-      if(fib == NULL)
-      {
-        printf("Cannot find file \"%s\"\n", all_args.file[i].file_name);
-      }
-      else
-      {
-        if(all_args.file[i].protect)   fib->flags |=  fib_wp;
-        if(all_args.file[i].unprotect) fib->flags &= ~fib_wp;
-        if(all_args.file[i].binary)    fib->flags |=  fib_binary;
-        if(all_args.file[i].ascii)     fib->flags &= ~fib_binary;
-        if(all_args.file[i].variable)  fib->flags |=  fib_var;
-        if(all_args.file[i].fixed)     fib->flags &= ~fib_var;
-        if(all_args.file[i].program)   
-        {
-          fib->flags |= fib_program;
-          fib->flags &= ~(fib_binary | fib_var);
-          fib->reclen = 0;
-        }
-        if(all_args.file[i].binary   || all_args.file[i].ascii ||
-           all_args.file[i].variable || all_args.file[i].fixed)
-        {
-          fib->flags &= ~fib_program;
-
-          int j;
-          int sector_count = 0;
-          int sector_max = 0;
-          for(j=0; j<76; j++)
-          {
-            int first = cluster_first(&fib->cluster[j][0]);
-            int count = cluster_count(&fib->cluster[j][0]);
-            if(count == 0) break;
-
-            sector_count += count;
-            sector_max = first + count;
-          }
-
-          if(all_args.file[i].variable)
-          {
-            fib->reclen = 254;
-            fib->recsperphysrec = 254 / fib->reclen;
-            fib->fixrecs = sector_max;
-          }
-          else if(all_args.file[i].fixed)
-          {
-            fib->reclen = all_args.file[i].record_size;
-            fib->recsperphysrec = SECTOR_SIZE / fib->reclen;
-            fib->fixrecs = (sector_count * SECTOR_SIZE) / fib->reclen;
-          }
-        }
-        if(all_args.verbose)
-        {
-          printf("Setting file \"%s\" as ", all_args.file[i].file_name);
-          if(fib->flags & fib_program)
-            printf("program\n");
-          else
-            printf("%s/%s %d\n", 
-                   (fib->flags & fib_binary) ? "internal" : "display",
-                   (fib->flags & fib_var)    ? "variable" : "fixed",
-                   fib->reclen);
-        }
-        modified = 1;
-      }
-    }
+    if(apply_file_arg(&all_args.file[i])) modified = 1;
   }
 
   // Save the modified disk image
   if(modified)
   {
-    save_disk(all_args.image_path); 
+    if(loaded != NULL) save_changed_sectors(all_args.image_path, loaded);
+    else               save_disk(all_args.image_path);
     if(all_args.verbose)
       printf("Saving modified disk image as \"%s\"\n", all_args.image_path);
   }
 
+  // Save a copy of the image, converting its format if needed
+  if(all_args.copy_path[0] != 0)
+  {
+    if(save_disk_as(all_args.copy_path, format_for_path(all_args.copy_path)) &&
+       all_args.verbose)
+      printf("Saving copy of disk image as \"%s\"\n", all_args.copy_path);
+  }
+
   // List disk contents
   if(all_args.list_contents)
     list_disk(); 
 
   return(0);
 }
+
+
+/*===========================================================================
+ *                                  main
+ *===========================================================================
+ * Desription: Entry point for the program
+ *
+ * Parameters: argc - Number of command arguments
+ *             argv - Argument list
+ *
+ * Return:     None
+ */
+int main(int argc, char **argv)
+{
+  int i;
+  int j;
+  int status;
+  uint64_t start = clock_ns(CLOCK_MONOTONIC);
+
+  memset(&all_args, 0, sizeof(all_args));
+
+  // Statistics and the allocation policy may be given with any command
+  for(i = j = 1; i < argc; i++)
+  {
+    int policy;
+    if(strcmp(argv[i], "--stats") == 0)           stats_report = 1;
+    else if(strcmp(argv[i], "--stats=json") == 0) stats_report = 2;
+    else if(strncmp(argv[i], "--alloc=", 8) == 0)
+    {
+      for(policy = 0; policy < policy_count; policy++)
+        if(strcmp(&argv[i][8], policy_names[policy]) == 0) break;
+      if(policy == policy_count)
+      {
+        printf("Invalid allocation policy \"%s\"\n", &argv[i][8]);
+        return(1);
+      }
+      allocation_policy = policy;
+    }
+    else argv[j++] = argv[i];
+  }
+  argc = j;
+  argv[argc] = NULL;
+
+  status = run(argc, argv);
+  TRACE_DUMP();
+  if(stats_report) report_stats(clock_ns(CLOCK_MONOTONIC) - start);
+  return(status);
+}